@@ -33,6 +33,7 @@
 #endif /* S_SPLINT_S */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
@@ -70,12 +71,17 @@ struct msg_buf {
 	size_t			 rmsgoff;
 
 	/**
-	 * An offset into the message that is currently written to the pipe.
-	 * The first woff bytes of the message have been written the rest must
-	 * still be written.
+	 * An offset into the first message that is currently written to
+	 * the pipe. The first woff bytes of the message have been written
+	 * the rest must still be written.
 	 */
 	size_t			 woff;
 
+	/**
+	 * The number of messages in the wmsgs array.
+	 */
+	int			 wcnt;
+
 	/**
 	 * Points to a buffer used for reading data. This is where input
 	 * data is first stored. It is only transfered to rmsg if the current
@@ -106,11 +112,12 @@ struct msg_buf {
 	struct anoubisd_msg	*rmsg;
 
 	/**
-	 * This is the message that is currently being written to the pipe.
-	 * The message will be freed after it is written, i.e. the caller
-	 * can forget about it.
+	 * These are the messages that are currently being written to the
+	 * pipe. All of them are written with a single system call if
+	 * possible. The messages will be freed after they are written,
+	 * i.e. the caller can forget about them.
 	 */
-	struct anoubisd_msg	*wmsg;
+	struct anoubisd_msg	*wmsgs[MSG_WBATCH];
 
 	/**
 	 * True if a previous call to read returned zero. This is used to
@@ -127,6 +134,13 @@ struct msg_buf {
  */
 static struct msg_buf fds[MSG_BUFS];
 
+/**
+ * Statistics about the number of system calls and messages. This
+ * is updated by the functions in this file and by the event handlers
+ * of the master process.
+ */
+struct amsg_stats	 amsg_stats;
+
 /**
  * Associate a message buffer with a file descriptor and initialize it.
  * The file descriptor is set no non-blocking.
@@ -180,7 +194,7 @@ msg_init(int fd)
 	fds[idx].rmsg = NULL;
 	fds[idx].rmsgoff = 0;
 
-	fds[idx].wmsg = NULL;
+	fds[idx].wcnt = 0;
 	fds[idx].woff = 0;
 
 	fds[idx].fd = fd;
@@ -230,16 +244,18 @@ void
 msg_release(int fd)
 {
 	struct msg_buf	*buf = _get_mbp(fd);
+	int		 i;
+
 	if (!buf)
 		return;
 	free(buf->rbufp);
-	if (buf->wmsg)
-		free(buf->wmsg);
+	for (i=0; i<buf->wcnt; ++i)
+		free(buf->wmsgs[i]);
 	if (buf->rmsg)
 		free(buf->rmsg);
 	buf->rmsg = NULL;
 	buf->rmsgoff = 0;
-	buf->wmsg = NULL;
+	buf->wcnt = 0;
 	buf->woff = 0;
 	buf->rbufp = NULL;
 	buf->fd = -1;
@@ -364,26 +380,46 @@ int msg_eof(int fd)
 }
 
 /**
- * Write pending data from current outgoing message to the file
- * descriptor. This function tries to write data at most once.
+ * Remove the first cnt messages from the output buffer and free them.
+ *
+ * @param mbp The message buffer.
+ * @param cnt The number of messages to remove.
+ */
+static void
+_drop_wmsgs(struct msg_buf *mbp, int cnt)
+{
+	int	i;
+
+	for (i=0; i<cnt; ++i)
+		free(mbp->wmsgs[i]);
+	mbp->wcnt -= cnt;
+	memmove(mbp->wmsgs, mbp->wmsgs + cnt,
+	    mbp->wcnt * sizeof(struct anoubisd_msg *));
+	mbp->woff = 0;
+}
+
+/**
+ * Write pending data from the current outgoing messages to the file
+ * descriptor. All pending messages are written with a single call
+ * to writev. This function tries to write data at most once.
  *
  * @param mbp The message buffer.
  */
 static void
 _flush_buf(struct msg_buf *mbp)
 {
-	int size;
+	struct iovec	iov[MSG_WBATCH];
+	int		i, done, size;
 
-	if (mbp->wmsg == NULL)
-		return;
-	if ((int)mbp->woff == mbp->wmsg->size) {
-		free(mbp->wmsg);
-		mbp->wmsg = NULL;
-		mbp->woff = 0;
+	if (mbp->wcnt == 0)
 		return;
+	for (i=0; i<mbp->wcnt; ++i) {
+		iov[i].iov_base = mbp->wmsgs[i];
+		iov[i].iov_len = mbp->wmsgs[i]->size;
 	}
-	size = write(mbp->fd, ((void*)mbp->wmsg)+mbp->woff,
-	    mbp->wmsg->size - mbp->woff);
+	iov[0].iov_base += mbp->woff;
+	iov[0].iov_len -= mbp->woff;
+	size = writev(mbp->fd, iov, mbp->wcnt);
 	if (size < 0) {
 		switch(errno) {
 		case EAGAIN: case EINTR:
@@ -397,21 +433,29 @@ _flush_buf(struct msg_buf *mbp)
 			 */
 			log_warn("write error dropping %sdata",
 			    (mbp->woff ? "incomplete " : ""));
-			free(mbp->wmsg);
-			mbp->wmsg = NULL;
-			mbp->woff = 0;
+			_drop_wmsgs(mbp, mbp->wcnt);
 			return;
 		}
 		log_warn("write error");
 		return;
 	}
-	mbp->woff += size;
-	DEBUG(DBG_MSG_SEND, "_flush_buf: fd:%d size:%d", mbp->fd, size);
+	amsg_stats.msgwrites++;
+	DEBUG(DBG_MSG_SEND, "_flush_buf: fd:%d size:%d msgs:%d", mbp->fd,
+	    size, mbp->wcnt);
 
-	if ((int)mbp->woff == mbp->wmsg->size) {
-		free(mbp->wmsg);
-		mbp->woff = 0;
-		mbp->wmsg = NULL;
+	/* Free all messages that were written completely. */
+	for (done=0; done<mbp->wcnt; ++done) {
+		if ((size_t)size < iov[done].iov_len)
+			break;
+		size -= iov[done].iov_len;
+	}
+	amsg_stats.msgs += done;
+	amsg_histogram_add(amsg_stats.msgbatch, done);
+	if (done) {
+		_drop_wmsgs(mbp, done);
+		mbp->woff = size;
+	} else {
+		mbp->woff += size;
 	}
 }
 
@@ -495,7 +539,9 @@ eof:
  * payload data) from the file descriptor (or from data in its associated
  * buffer). This is similar to get_msg but takes into account that
  * the kernel will not let us read partial messages from the eventdev
- * device.
+ * device. A single read can return more than one event. These events
+ * are kept in the buffer and returned by subsequent calls without
+ * another read.
  *
  * @param fd The file descriptor to read from.
  * @return A kernel event encapsulated in a malloced struct anoubis_msg
@@ -521,28 +567,41 @@ get_event(int fd)
 		master_terminate();
 	}
 
-	/*
-	 * If we can call get_event on this fd, it cannot have
-	 * a pending message because get_event only returns a single
-	 * complete message.
-	 */
-	if (mbp->rheadp != mbp->rtailp || mbp->rmsg != NULL) {
+	if (mbp->rmsg != NULL) {
 		log_warnx(" get_event: Invalid buffer state");
 		return NULL;
 	}
-	size = read(fd, mbp->rbufp, 2*MSG_BUF_SIZE);
-	if (size <= 0) {
-		if (size == 0)
-			mbp->iseof = 1;
-		if (size < 0 && errno != EAGAIN && errno != EINTR)
-			log_warn(" get_event: read error");
-		return NULL;
+	/*
+	 * Read as many events as the kernel is willing to return if
+	 * all events from the previous read have been processed.
+	 */
+	if (mbp->rheadp == mbp->rtailp) {
+		size = read(fd, mbp->rbufp, 2*MSG_BUF_SIZE);
+		if (size <= 0) {
+			if (size == 0)
+				mbp->iseof = 1;
+			if (size < 0 && errno != EAGAIN && errno != EINTR)
+				log_warn(" get_event: read error");
+			return NULL;
+		}
+		amsg_stats.evreads++;
+		mbp->rheadp = mbp->rbufp;
+		mbp->rtailp = mbp->rbufp + size;
 	}
-	evt = (struct eventdev_hdr *)mbp->rbufp;
-	if (size < (int)sizeof(struct eventdev_hdr) || evt->msg_size != size) {
+	/*
+	 * The kernel never returns partial events. Drop the rest of the
+	 * buffer if the event at its start is incomplete.
+	 */
+	evt = (struct eventdev_hdr *)mbp->rheadp;
+	size = mbp->rtailp - mbp->rheadp;
+	if (size < (int)sizeof(struct eventdev_hdr) || evt->msg_size > size
+	    || evt->msg_size < sizeof(struct eventdev_hdr)) {
 		log_warnx(" Bad eventdev message length %d", size);
+		mbp->rheadp = mbp->rtailp = mbp->rbufp;
 		return NULL;
 	}
+	mbp->rheadp += evt->msg_size;
+	amsg_stats.events++;
 	msg_r = msg_factory(ANOUBISD_MSG_EVENTDEV, evt->msg_size);
 	if (msg_r == NULL) {
 		log_warn("get_event: can't allocate memory");
@@ -581,25 +640,27 @@ get_event(int fd)
  * end of the message.
  *
  * @param fd The file descriptor to read from.
- * @param msgp A complete message (if any) is stored here. This value
- *     must never be NULL. The pointer pointed to by msgp is either set
- *     to NULL or is set to point to the result message. The result message
- *     is allocated using anoubis_msg_new and must be freed by the caller
- *     with anoubis_msg_free.
+ * @param bufp The start of a complete message (if any) is stored here.
+ *     The pointer is either set to NULL or to the message data in the
+ *     receive buffer of the file descriptor. The message data is not
+ *     copied and is only valid until the next call to this function
+ *     for the same file descriptor.
+ * @param lenp The length of the message data (including the checksum)
+ *     is stored here.
  * @return Zero if EOF is encountered. A negative error code if an error
  *     occured or a positive value in case of success.
  *     NOTE: Success does not mean that there is a complete message
  *     available. The message may still be incomplete. In this case
- *     NULL is stored in *msgp.
+ *     NULL is stored in *bufp.
  */
 int
-get_client_msg(int fd, struct anoubis_msg **msgp)
+get_client_msg(int fd, void **bufp, size_t *lenp)
 {
 	struct msg_buf		*mbp;
 	u_int32_t		 len;
-	struct anoubis_msg	*m;
 
-	*msgp = NULL;
+	*bufp = NULL;
+	*lenp = 0;
 	if ((mbp = _get_mbp(fd)) == NULL)
 		return 0;
 	if (mbp->rmsg) {
@@ -612,78 +673,102 @@ get_client_msg(int fd, struct anoubis_msg **msgp)
 	if ((unsigned int)(mbp->rtailp - mbp->rheadp) < sizeof(len))
 		return 1;
 	len = ntohl(*(u_int32_t*)mbp->rheadp);
+	if (len < sizeof(len) + CSUM_LEN)
+		return -EFAULT;
 	if ((unsigned int)(mbp->rtailp - mbp->rheadp) < len)
 		if (!_fill_buf(mbp))
 			return 0;
 	if ((unsigned int)(mbp->rtailp - mbp->rheadp) < len)
 		return 1;
 	/*
-	 * anoubis_msg_new expects the size of the message without
-	 * the message length and without the trainling checksum (i.e.
-	 * payload data only). However, m->length of the resulting
-	 * message includes the checksum but not the message length.
-	 * This is the reason for the somewhat surprising length calculations.
+	 * The length on the wire includes the length itself. The
+	 * message data is left in place: _fill_buf only moves data
+	 * in the buffer during the next call.
 	 */
-	m = anoubis_msg_new(len - sizeof(len) - CSUM_LEN);
-	if (!m)
-		return -ENOMEM;
-	memcpy(m->u.buf, mbp->rheadp+sizeof(len), m->length);
+	*bufp = mbp->rheadp + sizeof(len);
+	*lenp = len - sizeof(len);
 	mbp->rheadp += len;
-	*msgp = m;
 	return 1;
 }
 
 /**
- * Write a message to the file descriptor. The message is buffered
- * if it cannot be written immediately. At most one message can be
- * buffered at a time. If the function accepts the message it makes
+ * Write several messages to the file descriptor with a single system
+ * call. The messages are buffered if they cannot be written immediately.
+ * Messages are only accepted if the output buffer is empty (after
+ * an attempt to flush it). If the function accepts a message it makes
  * sure that the message is freed. Otherwise the caller is responsible
- * for the message. Note that is quite possible that the function rejects
- * a message. This happens in particular, if another message is still in
- * the output buffer. The message is checked using amsg_verify before it
- * is sent.
+ * for the message. The messages are checked using amsg_verify before
+ * they are sent.
  *
  * @param fd The file descriptor.
- * @param msg The message to send. Use NULL to just flush the message
- *     buffer.
- * @return Positive if the message was accepted, zero if the message
- *     was not accepted due to a write buffer and negative if the
- *     message cannot be sent permanently (e.g. because it exceeds the
- *     message size limit or the buffer is not initialized). If the
- *     message to send is NULL a positive return value implies that the
+ * @param msgs The messages to send in this order.
+ * @param cnt The number of messages. Use zero to just flush the message
+ *     buffer. At most MSG_WBATCH messages are accepted.
+ * @return The number of messages accepted from the start of the array,
+ *     zero if no message was accepted due to a write buffer and negative
+ *     if the first message cannot be sent permanently (e.g. because it
+ *     exceeds the message size limit or the buffer is not initialized).
+ *     If cnt is zero a positive return value implies that the
  *     buffer was flushed completely.
  *
- * @note This function adds the message to the output buffer and tries
+ * @note This function adds the messages to the output buffer and tries
  *     to flush the output buffer. However, if the output buffer is
  *     not empty after the function returns, it is the responsibility of
  *     the caller to flush the output buffer at a later point in time.
  */
 int
-send_msg(int fd, struct anoubisd_msg *msg)
+send_msgv(int fd, struct anoubisd_msg **msgs, int cnt)
 {
-	struct msg_buf *mbp;
+	struct msg_buf	*mbp;
+	int		 i;
 
 	if ((mbp = _get_mbp(fd)) == NULL) {
 		log_warnx("msg_buf not initialized");
 		return -1;
 	}
-	if (mbp->wmsg) {
+	if (mbp->wcnt) {
 		_flush_buf(mbp);
-		if (mbp->wmsg)
+		if (mbp->wcnt)
 			return 0;
 	}
-	if (!msg)
+	if (cnt == 0)
 		return 1;
-	if (msg->size > MSG_SIZE_LIMIT) {
-		log_warnx("send_msg: message %p to large %d", msg, msg->size);
-		return -1;
+	if (cnt > MSG_WBATCH)
+		cnt = MSG_WBATCH;
+	for (i=0; i<cnt; ++i) {
+		if (msgs[i]->size > MSG_SIZE_LIMIT) {
+			log_warnx("send_msg: message %p to large %d", msgs[i],
+			    msgs[i]->size);
+			break;
+		}
+		amsg_verify(msgs[i]);
+		mbp->wmsgs[i] = msgs[i];
+		DEBUG(DBG_MSG_RECV, "send_msg: fd:%d size:%d", mbp->fd,
+		    msgs[i]->size);
 	}
-	amsg_verify(msg);
-	mbp->wmsg = msg;
+	if (i == 0)
+		return -1;
+	mbp->wcnt = i;
 	mbp->woff = 0;
-	DEBUG(DBG_MSG_RECV, "send_msg: fd:%d size:%d", mbp->fd, msg->size);
 	_flush_buf(mbp);
-	return 1;
+	return i;
+}
+
+/**
+ * Write a message to the file descriptor. This is the same as send_msgv
+ * with a single message.
+ *
+ * @param fd The file descriptor.
+ * @param msg The message to send. Use NULL to just flush the message
+ *     buffer.
+ * @return Positive if the message was accepted, zero if the message
+ *     was not accepted due to a write buffer and negative if the
+ *     message cannot be sent permanently. See send_msgv for details.
+ */
+int
+send_msg(int fd, struct anoubisd_msg *msg)
+{
+	return send_msgv(fd, &msg, msg ? 1 : 0);
 }
 
 /**
@@ -702,7 +787,7 @@ msg_pending(int fd)
 		log_warnx("msg_buf not initialized");
 		return 0;
 	}
-	return mbp->wmsg != NULL;
+	return mbp->wcnt != 0;
 }
 
 /**
@@ -736,6 +821,41 @@ msg_factory(int mtype, int size)
 	return msg;
 }
 
+/**
+ * Append statistics values to a statistics message of the kernel
+ * (an ANOUBISD_MSG_EVENTDEV message with source ANOUBIS_SOURCE_STAT).
+ * The kernel message header is adjusted accordingly.
+ *
+ * @param msg The statistics message. This message is freed.
+ * @param vals The values to append.
+ * @param cnt The number of values.
+ * @return A new message that contains the values of the original
+ *     message followed by the new values or NULL if the message
+ *     would become too large.
+ */
+struct anoubisd_msg *
+msg_append_stats(struct anoubisd_msg *msg,
+    const struct anoubis_stat_value *vals, int cnt)
+{
+	struct anoubisd_msg	*nmsg;
+	struct eventdev_hdr	*hdr;
+	int			 oldsize, extra;
+
+	oldsize = msg->size - sizeof(struct anoubisd_msg);
+	extra = cnt * sizeof(struct anoubis_stat_value);
+	nmsg = msg_factory(ANOUBISD_MSG_EVENTDEV, oldsize + extra);
+	if (nmsg == NULL) {
+		free(msg);
+		return NULL;
+	}
+	memcpy(nmsg->msg, msg->msg, oldsize);
+	memcpy(nmsg->msg + oldsize, vals, extra);
+	free(msg);
+	hdr = (struct eventdev_hdr *)nmsg->msg;
+	hdr->msg_size += extra;
+	return nmsg;
+}
+
 /**
  * Reduce the message payload size of a message. This function does not
  * actually free memory and it never increases the message size. However,
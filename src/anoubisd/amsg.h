@@ -57,6 +57,67 @@
  */
 #define MSG_SIZE_LIMIT	100000
 
+/**
+ * Maximum number of messages that are written to a file descriptor
+ * with a single system call.
+ */
+#define MSG_WBATCH	32
+
+/**
+ * The number of buckets in a batch size histogram. Bucket i counts
+ * batches with 2^i up to 2^(i+1)-1 entries, the last bucket counts
+ * all larger batches.
+ */
+#define AMSG_HISTSIZE	8
+
+/**
+ * Statistics about the number of system calls used to transfer
+ * messages. Only the master process reports these values.
+ */
+struct amsg_stats {
+	/** Read system calls on the event device that returned events. */
+	u_int64_t	evreads;
+	/** Events read from the event device. */
+	u_int64_t	events;
+	/** Events processed per wakeup of the event handler. */
+	u_int64_t	evbatch[AMSG_HISTSIZE];
+	/** Write system calls with replies to the event device. */
+	u_int64_t	replywrites;
+	/** Replies written to the event device. */
+	u_int64_t	replies;
+	/** Replies per write system call. */
+	u_int64_t	replybatch[AMSG_HISTSIZE];
+	/** Write system calls on pipes to other daemon processes. */
+	u_int64_t	msgwrites;
+	/** Messages written to pipes. */
+	u_int64_t	msgs;
+	/** Messages completed per write system call. */
+	u_int64_t	msgbatch[AMSG_HISTSIZE];
+};
+
+extern struct amsg_stats	 amsg_stats;
+
+/**
+ * Count a batch of the given size in a histogram.
+ *
+ * @param hist The histogram (AMSG_HISTSIZE buckets).
+ * @param n The batch size. Nothing is counted if this is zero.
+ * @return None.
+ */
+static inline void
+amsg_histogram_add(u_int64_t *hist, unsigned int n)
+{
+	int	bucket = 0;
+
+	if (n == 0)
+		return;
+	while (n > 1 && bucket < AMSG_HISTSIZE-1) {
+		n >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
 /* Struct forward declaration to avoid anoubisd.h */
 struct anoubisd_msg;
 
@@ -68,8 +129,9 @@ extern struct anoubisd_msg	*get_msg(int);
 extern struct anoubisd_msg	*get_event(int);
 extern struct anoubisd_msg	*compat_get_event(struct anoubisd_msg *,
 				    unsigned long version);
-extern int			 get_client_msg(int, struct anoubis_msg **);
+extern int			 get_client_msg(int, void **, size_t *);
 extern int			 send_msg(int, struct anoubisd_msg *);
+extern int			 send_msgv(int, struct anoubisd_msg **, int);
 extern int			 msg_pending(int);
 extern int			 msg_eof(int);
 extern void			 amsg_verify(struct anoubisd_msg *);
@@ -81,5 +143,7 @@ extern int			 amsg_sfs_checksumop_size(const char *buf,
 				     int maxlen);
 extern struct anoubisd_msg	*msg_factory(int, int);
 extern void			 msg_shrink(struct anoubisd_msg *, int);
+extern struct anoubisd_msg	*msg_append_stats(struct anoubisd_msg *,
+				     const struct anoubis_stat_value *, int);
 
 #endif /* !_AMSG_H */
@@ -694,7 +694,7 @@ anoubisd_sfscache_invalidate_size(const char *buf, int buflen)
 	SHIFT_CNT(msg->plen, buf, buflen);
 	if (msg->keylen) {
 		CHECK_LEN(msg->keylen, buflen);
-		STRINGS(buf, buflen);
+		SHIFT_CNT(msg->keylen, buf, buflen);
 	}
 	RETURN_SIZE();
 }
@@ -736,12 +736,17 @@ static int
 anoubisd_sfs_update_all_size(const char *buf, int buflen)
 {
 	struct anoubisd_sfs_update_all	*msg;
+	unsigned int			 i;
 	DECLARE_SIZE();
 
 	CAST(msg, buf, buflen);
 	SHIFT_FIELD(msg, payload, buf, buflen);
-	SHIFT_CNT(msg->cslen, buf, buflen);
-	STRINGS(buf, buflen);
+	if (msg->nrec > SIZE_LIMIT)
+		return -1;
+	for (i = 0; i < msg->nrec; ++i) {
+		SHIFT_CNT(msg->cslen, buf, buflen);
+		SHIFT_STRING(buf, buflen);
+	}
 
 	RETURN_SIZE();
 }
@@ -92,6 +92,12 @@
  * of a user can slow down the anoubis daemon.
  */
 #define ANOUBISD_MAX_POLICYSIZE		0x1400000
+#define ANOUBISD_SFSCACHE_SIZE		0x800000
+
+/**
+ * Maximum number of worker threads of the policy engine.
+ */
+#define ANOUBISD_MAX_POLICY_WORKERS	64
 
 /**
  * Maximum number of client connections per user.
@@ -142,6 +148,21 @@
  */
 #define ANOUBISD_DEFAULTNAME		"default"
 
+/**
+ * The file that stores the verdicts of playground scanners.
+ */
+#define ANOUBISD_SCANCACHE		PACKAGE_POLICYDIR "/scancache"
+
+/**
+ * The default number of entries in the scanner cache.
+ */
+#define ANOUBISD_SCANCACHE_SIZE		4096
+
+/**
+ * The default time (in seconds) that a scanner verdict remains valid.
+ */
+#define ANOUBISD_SCANCACHE_TTL		3600
+
 /**
  * The directory where the sfs tree is stored (system global value).
  */
@@ -153,6 +174,17 @@
  */
 #define SFS_CHECKSUMCHROOT		"/sfs"
 
+/**
+ * The directory of the indexed checksum store (system global value).
+ */
+#define SFS_STOREDIR			PACKAGE_POLICYDIR SFS_STOREDIR_CHROOT
+
+/**
+ * The directory of the indexed checksum store relative to the chroot
+ * environment in the policy engine.
+ */
+#define SFS_STOREDIR_CHROOT		"/sfsdb"
+
 /**
  * The directory where the public keys/certificates are stored (system
  * global value).
@@ -251,6 +283,15 @@ typedef enum
 	ANOUBISD_AUTH_MODE_OFF
 } anoubisd_auth_mode;
 
+/**
+ * Constants for the storage backend of checksums and signatures.
+ */
+typedef enum
+{
+	ANOUBISD_SFS_STORE_TREE,
+	ANOUBISD_SFS_STORE_INDEXED
+} anoubisd_sfs_store;
+
 /**
  * Declaration of the upgrade trigger list.
  */
@@ -365,6 +406,37 @@ struct anoubisd_config {
 	 * is granted this amount of time before a scan failure is assumed.
 	 */
 	int					 scanner_timeout;
+
+	/**
+	 * The number of entries in the scanner cache. Zero disables
+	 * the cache.
+	 */
+	int					 scanner_cache_size;
+
+	/**
+	 * The time (in seconds) that a cached scanner verdict remains
+	 * valid. Zero disables the cache.
+	 */
+	int					 scanner_cache_ttl;
+
+	/**
+	 * The maximum amount of memory (in bytes) used by the checksum
+	 * cache of the policy engine.
+	 */
+	int					 sfscache_size;
+
+	/**
+	 * The number of worker threads that the policy engine uses
+	 * to evaluate rules. Zero means that rules are evaluated by
+	 * the main thread.
+	 */
+	int					 policy_workers;
+
+	/**
+	 * The storage backend for checksums and signatures. This is
+	 * only evaluated when the daemon starts.
+	 */
+	anoubisd_sfs_store			 sfs_store;
 };
 
 /**
@@ -665,28 +737,33 @@ struct anoubisd_sfscache_invalidate {
 
 	/**
 	 * Contains the NUL-terminted path name (plen bytes) followed by
-	 * keylen bytes of the key ID.
+	 * keylen bytes of the binary key ID.
 	 */
 	char		payload[0];
 };
 
 /**
  * Message format of ANOUBISD_MSG_SFS_UPDATE_ALL messages. These are
- * send by the upgrade process after calculating the new checksum of
- * an upgraded file. The master process will update all checksums of
- * the file in the SFS tree.
+ * send by the upgrade process after calculating the new checksums of
+ * upgraded files. The master process will update all checksums of
+ * the files in the SFS tree.
  */
 struct anoubisd_sfs_update_all {
 	/**
-	 * The length of the checksum inside the payload. Should be
+	 * The length of each checksum inside the payload. Should be
 	 * ANOUBIS_CS_LEN.
 	 */
 	uint32_t	cslen;
 
 	/**
-	 * The payload data. This consists of cslen bytes of checksum
-	 * data followed by the NUL-terminated path name of the upgraded
-	 * file.
+	 * The number of files in the payload.
+	 */
+	uint32_t	nrec;
+
+	/**
+	 * The payload data. This consists of nrec records. Each record
+	 * consists of cslen bytes of checksum data followed by the
+	 * NUL-terminated path name of the upgraded file.
 	 */
 	char		payload[0];
 };
@@ -958,6 +1035,16 @@ struct anoubisd_msg_config
 	 */
 	uint32_t		policysize;
 
+	/**
+	 * The size limit of the policy engine's checksum cache.
+	 */
+	uint32_t		sfscache_size;
+
+	/**
+	 * The number of worker threads of the policy engine.
+	 */
+	uint32_t		policy_workers;
+
 	/**
 	 * The new upgrade mode.
 	 */
@@ -1106,7 +1193,8 @@ struct anoubisd_msg_pgcommit_reply {
 	 * come in pair. The first string in each pair is the description
 	 * of a scanner from the anoubisd.conf file, the second is its
 	 * output for the given file. Only scanners that rejected the file
-	 * are listed.
+	 * are listed. The strings are followed by a latency report that
+	 * is not NUL-terminated (see ANOUBIS_PGCOMMIT_LATENCY).
 	 */
 	char		payload[0];
 };
@@ -1244,6 +1332,24 @@ extern int	anoubisd_scanproc_exit(pid_t pid, int status, int anoubisfd,
 		    Queue *queue);
 extern void	anoubisd_scanners_detach(void);
 
+/*
+ * Public functions of the scanner cache.
+ *
+ * Implementation and inline documentation can be found in scancache.c.
+ */
+#define SCANCACHE_KEYLEN	32
+
+struct scancache;
+
+extern int	scancache_open(const char *path, unsigned int nslots,
+		    struct scancache **);
+extern void	scancache_close(struct scancache *);
+extern int	scancache_fd(struct scancache *);
+extern int	scancache_lookup(struct scancache *, const u_int8_t *key,
+		    time_t now, time_t ttl);
+extern int	scancache_store(struct scancache *, const u_int8_t *key,
+		    time_t now);
+
 /* External variable declarations. */
 extern struct anoubisd_config		 anoubisd_config;
 extern enum anoubisd_process_type	 anoubisd_process;
@@ -1251,6 +1357,7 @@ extern char				*logname;
 extern uint32_t				 debug_flags;
 extern char				 debug_stderr;
 extern char				 anoubisd_noaction;
+extern char				 anoubisd_migrate;
 extern gid_t				 anoubisd_gid;
 extern unsigned long			 version;
 
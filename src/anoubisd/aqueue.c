@@ -109,6 +109,29 @@ queue_peek(Queue *queue)
 	return entry->data;
 }
 
+/**
+ * Return the data stored in the first entries of the queue without
+ * modifying the queue.
+ *
+ * @param queue The queue.
+ * @param data The data pointers are stored in this array.
+ * @param max The size of the array.
+ * @return The number of data pointers stored in the array.
+ */
+int
+queue_peek_many(Queue *queue, void **data, int max)
+{
+	struct queue_entry	*entry;
+	int			 cnt = 0;
+
+	TAILQ_FOREACH(entry, &queue->list, next) {
+		if (cnt == max)
+			break;
+		data[cnt++] = entry->data;
+	}
+	return cnt;
+}
+
 /**
  * Remove a particular data item from the queue. The data item
  * is first searched in the queue and then removed.
@@ -135,7 +158,9 @@ queue_delete(Queue *queue, void *data)
 /**
  * Assume that the given queue contains anoubid_msg structures that
  * must be written to the given file descriptor in order. This function
- * tries to use send_msg to send messages until the queue write blocks.
+ * tries to use send_msgv to send messages until the queue write blocks.
+ * Up to MSG_WBATCH messages from the head of the queue are handed to
+ * send_msgv at once, i.e. they are written with a single system call.
  * Before returning this function adds the libevent event associated
  * with the queue if the queue is not empty or the file descriptors
  * buffer still has pending data.
@@ -150,20 +175,21 @@ queue_delete(Queue *queue, void *data)
 int
 dispatch_write_queue(Queue *q, int fd)
 {
-	struct anoubisd_msg	*msg;
-	int			 ret = 0;
+	struct anoubisd_msg	*msgs[MSG_WBATCH];
+	int			 i, cnt, ret = 0;
 
 	DEBUG(DBG_TRACE, ">dispatch_write_queue: %p", q);
 
 	while (queue_peek(q) || msg_pending(fd)) {
-		msg = queue_peek(q);
+		cnt = queue_peek_many(q, (void **)msgs, MSG_WBATCH);
 		/*
-		 * Call send_msg even if msg == NULL (will flush pending
+		 * Call send_msgv even if cnt == 0 (will flush pending
 		 * message data).
 		 */
-		ret = send_msg(fd, msg);
+		ret = send_msgv(fd, msgs, cnt);
 		/*
-		 * ret > 0:  send_msg will take over and free the message.
+		 * ret > 0:  send_msgv will take over and free the first
+		 *           ret messages.
 		 * ret == 0: Buffers flushed but message not sent.
 		 * ret < 0:  Permanent error: Drop message (if any).
 		 */
@@ -172,21 +198,21 @@ dispatch_write_queue(Queue *q, int fd)
 			break;
 		}
 		if (ret < 0) {
-			if (msg) {
+			if (cnt) {
 				/* Permanent error. Dequeue and free. */
 				dequeue(q);
 				DEBUG(DBG_QUEUE,
-				    " Dropping unsent message: %p", msg);
-				free(msg);
+				    " Dropping unsent message: %p", msgs[0]);
+				free(msgs[0]);
 			}
 			event_add(q->ev, NULL);
 			break;
 		}
 		/*
-		 * Message (if any) sent and probably already freed.
-		 * Remove its ptr from the queue, too.
+		 * Messages (if any) sent and probably already freed.
+		 * Remove their ptrs from the queue, too.
 		 */
-		if (msg)
+		for (i=0; cnt && i<ret; ++i)
 			dequeue(q);
 	}
 	DEBUG(DBG_TRACE, "<dispatch_write_queue: %p", q);
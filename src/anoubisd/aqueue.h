@@ -78,6 +78,7 @@ void queue_init(Queue *queue, struct event *ev)
 extern void			 enqueue(Queue *, void *);
 extern void			*dequeue(Queue *);
 extern void			*queue_peek(Queue *);
+extern int			 queue_peek_many(Queue *, void **, int);
 extern void			 queue_delete(Queue *, void *);
 extern int			 dispatch_write_queue(Queue *q, int fd);
 
@@ -74,6 +74,11 @@ typedef enum {
 	key_policysize,
 	key_commit,
 	key_scantimeout,
+	key_scancachesize,
+	key_scancachettl,
+	key_sfscachesize,
+	key_policyworkers,
+	key_sfsstore,
 } cfg_key;
 
 
@@ -108,6 +113,11 @@ static const struct stringkey		keywords[] = {
 	{ "policysize", key_policysize },
 	{ "commit", key_commit },
 	{ "scanner_timeout", key_scantimeout },
+	{ "scanner_cache_size", key_scancachesize },
+	{ "scanner_cache_ttl", key_scancachettl },
+	{ "sfscache_size", key_sfscachesize },
+	{ "policy_workers", key_policyworkers },
+	{ "sfs_store", key_sfsstore },
 	{ NULL, key_bad }
 };
 
@@ -134,6 +144,16 @@ static const struct stringkey		authmodes[] = {
 	{ NULL, -1 },
 };
 
+/**
+ * This array associates string values of checksum storage backends with
+ * their respective numeric values. The value -1 indicates an invalid string.
+ */
+static const struct stringkey		sfsstores[] = {
+	{ "tree", ANOUBISD_SFS_STORE_TREE },
+	{ "indexed", ANOUBISD_SFS_STORE_INDEXED },
+	{ NULL, -1 },
+};
+
 /**
  * This array associates string value for boolean values with their
  * respective numeric values. The value -1 indicates an invalid string.
@@ -188,7 +208,7 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-D <flags>] [-dn] [-f <conffile>]"
+	fprintf(stderr, "usage: %s [-D <flags>] [-dMn] [-f <conffile>]"
 	    " [-s <socket> ]\n", __progname);
 	exit(1);
 }
@@ -685,6 +705,33 @@ cfg_param_process(struct cfg_param *param, int lineno)
 			    &anoubisd_config.scanner_timeout))
 				return 0;
 			break;
+		case key_scancachesize:
+			if (!cfg_parse_int(param->value, lineno, 0, INT_MAX,
+			    &anoubisd_config.scanner_cache_size))
+				return 0;
+			break;
+		case key_scancachettl:
+			if (!cfg_parse_int(param->value, lineno, 0, INT_MAX,
+			    &anoubisd_config.scanner_cache_ttl))
+				return 0;
+			break;
+		case key_sfscachesize:
+			if (!cfg_parse_int(param->value, lineno, 0, INT_MAX,
+			    &anoubisd_config.sfscache_size))
+				return 0;
+			break;
+		case key_policyworkers:
+			if (!cfg_parse_int(param->value, lineno, 0,
+			    ANOUBISD_MAX_POLICY_WORKERS,
+			    &anoubisd_config.policy_workers))
+				return 0;
+			break;
+		case key_sfsstore:
+			tmp = name_to_value(sfsstores, param->value, lineno);
+			if (tmp == -1)
+				return 0;
+			anoubisd_config.sfs_store = tmp;
+			break;
 		default:
 			log_warnx("line %d: Internal error: "
 			    "Bad key value %d", lineno, param->key);
@@ -852,7 +899,7 @@ cfg_read_cmdline(int argc, char * const *argv)
 	endptr = NULL;
 
 	while (ch != -1) {
-		ch = getopt(argc, argv, "dD:ns:f:");
+		ch = getopt(argc, argv, "dD:nMs:f:");
 		switch (ch) {
 		case -1:
 			/* No arguments left. */
@@ -879,6 +926,9 @@ cfg_read_cmdline(int argc, char * const *argv)
 		case 'n':
 			anoubisd_noaction = 1;
 			break;
+		case 'M':
+			anoubisd_migrate = 1;
+			break;
 		case 's':
 			if (!optarg) {
 				/* make statical analyzers happy */
@@ -959,6 +1009,11 @@ cfg_defaults(void)
 	anoubisd_config.auth_mode = ANOUBISD_AUTH_MODE_OPTIONAL;
 	anoubisd_config.policysize = ANOUBISD_MAX_POLICYSIZE;
 	anoubisd_config.scanner_timeout = 5*60; /* Five minutes */
+	anoubisd_config.scanner_cache_size = ANOUBISD_SCANCACHE_SIZE;
+	anoubisd_config.scanner_cache_ttl = ANOUBISD_SCANCACHE_TTL;
+	anoubisd_config.sfscache_size = ANOUBISD_SFSCACHE_SIZE;
+	anoubisd_config.policy_workers = 0;
+	anoubisd_config.sfs_store = ANOUBISD_SFS_STORE_TREE;
 
 	return 1;
 }
@@ -1125,6 +1180,14 @@ cfg_dump(FILE *f)
 	fprintf(f, "auth_mode: %s\n",
 	    value_to_name(authmodes, anoubisd_config.auth_mode));
 	fprintf(f, "policysize: %i\n", anoubisd_config.policysize);
+	fprintf(f, "sfscache_size: %i\n", anoubisd_config.sfscache_size);
+	fprintf(f, "scanner_cache_size: %i\n",
+	    anoubisd_config.scanner_cache_size);
+	fprintf(f, "scanner_cache_ttl: %i\n",
+	    anoubisd_config.scanner_cache_ttl);
+	fprintf(f, "policy_workers: %i\n", anoubisd_config.policy_workers);
+	fprintf(f, "sfs_store: %s\n",
+	    value_to_name(sfsstores, anoubisd_config.sfs_store));
 
 	/* playground scanners */
 	CIRCLEQ_FOREACH(scanner, &anoubisd_config.pg_scanner, link) {
@@ -1184,6 +1247,8 @@ cfg_msg_create(void)
 	confmsg = (struct anoubisd_msg_config *)msg->msg;
 
 	confmsg->policysize = anoubisd_config.policysize;
+	confmsg->sfscache_size = anoubisd_config.sfscache_size;
+	confmsg->policy_workers = anoubisd_config.policy_workers;
 	/* Fill message: upgrade mode. */
 	confmsg->upgrade_mode = anoubisd_config.upgrade_mode;
 
@@ -1244,6 +1309,8 @@ cfg_msg_parse(struct anoubisd_msg *msg)
 	}
 	memcpy(anoubisd_config.unixsocket, confmsg->chunk, offset);
 	anoubisd_config.policysize = confmsg->policysize;
+	anoubisd_config.sfscache_size = confmsg->sfscache_size;
+	anoubisd_config.policy_workers = confmsg->policy_workers;
 
 	/* Extract trigger list. */
 	count = confmsg->triggercount;
@@ -145,6 +145,27 @@ atfd_unlinkat(struct atfd *atfd, const char *path)
 #endif
 }
 
+static inline int
+atfd_renameat(struct atfd *atfd, const char *from, const char *to)
+{
+#ifdef LINUX
+	return renameat(atfd->atfd, from, atfd->atfd, to);
+#endif
+#ifdef OPENBSD
+	char *fullfrom = atfd_openat_path(atfd->prefix, from);
+	char *fullto = atfd_openat_path(atfd->prefix, to);
+	int ret = -1;
+
+	if (fullfrom == NULL || fullto == NULL)
+		errno = ENOMEM;
+	else
+		ret = rename(fullfrom, fullto);
+	free(fullfrom);
+	free(fullto);
+	return ret;
+#endif
+}
+
 static inline DIR *
 atfd_fdopendir(struct atfd *atfd)
 {
@@ -37,6 +37,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 
@@ -158,6 +159,7 @@ pid_t		upgrade_pid = 0;	/** The pid of the upgrade process */
 u_int32_t	debug_flags = 0;	/** Current debug flags */
 char		debug_stderr = 0;	/** True if debugging is on stderr */
 char		anoubisd_noaction = 0;	/** True if -n switch was given */
+char		anoubisd_migrate = 0;	/** True if -M switch was given */
 gid_t		anoubisd_gid;		/** Group ID of the anoubisd user */
 
 /**
@@ -652,7 +654,7 @@ is_sfstree_empty()
 			return -errno;
 	}
 	while ((dirent = readdir(dirh)) != NULL) {
-		if (strcmp(dirent->d_name, ".")  != 0 ||
+		if (strcmp(dirent->d_name, ".")  != 0 &&
 		    strcmp(dirent->d_name, "..") != 0) {
 			empty = 0;
 			break;
@@ -842,6 +844,36 @@ main(int argc, char *argv[])
 		early_errx(msg);
 	}
 
+	if (anoubisd_migrate) {
+		int	cnt;
+
+		if (geteuid() != 0)
+			early_errx("need root privileges");
+		cnt = sfs_migrate_tree();
+		if (cnt < 0) {
+			errno = -cnt;
+			early_err("Migration of " SFS_CHECKSUMROOT " failed");
+		}
+		printf("%d checksum(s) copied to " SFS_STOREDIR "\n", cnt);
+		exit(0);
+	}
+
+	/*
+	 * Refuse to start with an empty indexed store if there are
+	 * checksums in the SFS tree. They would silently disappear.
+	 */
+	if (anoubisd_config.sfs_store == ANOUBISD_SFS_STORE_INDEXED
+	    && !sfs_store_exists(SFS_STOREDIR)) {
+		int empty = is_sfstree_empty();
+		if (empty < 0)
+			early_err("Could not read " SFS_CHECKSUMROOT);
+		if (!empty)
+			early_errx("The indexed checksum store " SFS_STOREDIR
+			    " does not exist but " SFS_CHECKSUMROOT
+			    " is not empty.\nRun " PACKAGE_DAEMON " -M to copy"
+			    " the checksums.");
+	}
+
 	if (anoubisd_noaction) {
 		/* Exit at this point, no further action required.
 		 * Note that there is another exit(0) above in the
@@ -932,6 +964,9 @@ main(int argc, char *argv[])
 	/* Load Public Keys */
 	cert_init(0);
 
+	if (sfs_backend_init(anoubisd_config.sfs_store, 0) < 0)
+		fatal("Cannot open " SFS_STOREDIR);
+
 	if (!CIRCLEQ_EMPTY(&anoubisd_config.pg_scanner)) {
 		int				 cnt = 0;
 		struct anoubisd_pg_scanner	*scanner;
@@ -980,8 +1015,6 @@ main(int argc, char *argv[])
 	anoubisd_defaultsigset(&mask);
 	sigdelset(&mask, SIGCHLD);
 	sigdelset(&mask, SIGHUP);
-	/* Unblock SIGALRM. This is required by the scanner children. */
-	sigdelset(&mask, SIGALRM);
 	sigprocmask(SIG_SETMASK, &mask, NULL);
 
 	/* init msg_bufs */
@@ -1336,25 +1369,19 @@ send_sfscache_invalidate_key(const char *path, const struct abuf_buffer keyid)
 {
 	struct anoubisd_msg			*msg;
 	struct anoubisd_sfscache_invalidate	*invmsg;
-	char					*keyidstr = NULL;
 
-	keyidstr = abuf_convert_tohexstr(keyid);
-	if (keyidstr == NULL)
-		master_terminate();
 	msg = msg_factory(ANOUBISD_MSG_SFSCACHE_INVALIDATE,
 	    sizeof(struct anoubisd_sfscache_invalidate) + strlen(path) + 1
-	    + strlen(keyidstr) + 1);
-	if (!msg) {
-		free(keyidstr);
+	    + abuf_length(keyid));
+	if (!msg)
 		master_terminate();
-	}
 	invmsg = (struct anoubisd_sfscache_invalidate*)msg->msg;
 	invmsg->uid = (uid_t)-1;
 	invmsg->plen = strlen(path)+1;
-	invmsg->keylen = strlen(keyidstr)+1;
+	invmsg->keylen = abuf_length(keyid);
 	memcpy(invmsg->payload, path, invmsg->plen);
-	memcpy(invmsg->payload + invmsg->plen, keyidstr, invmsg->keylen);
-	free(keyidstr);
+	abuf_copy_frombuf(invmsg->payload + invmsg->plen, keyid,
+	    invmsg->keylen);
 	enqueue(&eventq_m2p, msg);
 }
 
@@ -1522,6 +1549,60 @@ create_checksumreply_msg(int type, u_int64_t token, int payloadlen)
 	return msg;
 }
 
+/**
+ * State of a checksum list request while the names are collected into
+ * checksum reply messages.
+ */
+struct sfs_list_reply {
+	/** The token to use for the reply messages. */
+	u_int64_t		 token;
+	/** The current reply message (NULL if none has been created). */
+	struct anoubisd_msg	*msg;
+	/** The number of bytes used in the current reply message. */
+	int			 offset;
+};
+
+/**
+ * Add a name to the reply of a checksum list request. Full reply
+ * messages are sent to the session engine.
+ *
+ * @param name The name.
+ * @param arg The reply state (struct sfs_list_reply).
+ * @return Zero in case of success, a negative error code if the name
+ *     does not fit into a reply message.
+ */
+static int
+sfs_checksumop_list_add(const char *name, void *arg)
+{
+	struct sfs_list_reply		*state = arg;
+	struct anoubisd_msg_csumreply	*reply;
+	int				 len = strlen(name) + 1;
+
+	if (state->msg == NULL) {
+		state->msg = create_checksumreply_msg(
+		    ANOUBISD_MSG_CHECKSUMREPLY, state->token, 8000);
+		reply = (struct anoubisd_msg_csumreply *)state->msg->msg;
+		reply->flags |= POLICY_FLAG_START;
+		state->offset = 0;
+	}
+	reply = (struct anoubisd_msg_csumreply *)state->msg->msg;
+	if (state->offset + len > reply->len) {
+		reply->len = state->offset;
+		msg_shrink(state->msg,
+		    sizeof(struct anoubisd_msg_csumreply) + state->offset);
+		enqueue(&eventq_m2s, state->msg);
+		state->msg = create_checksumreply_msg(
+		    ANOUBISD_MSG_CHECKSUMREPLY, state->token, 8000);
+		reply = (struct anoubisd_msg_csumreply *)state->msg->msg;
+		state->offset = 0;
+	}
+	if (state->offset + len > reply->len)
+		return -ENAMETOOLONG;
+	memcpy(reply->data + state->offset, name, len);
+	state->offset += len;
+	return 0;
+}
+
 /**
  * Process a checksum list request. The details of the request are given
  * by the csop parameter. As a result of this function one or more
@@ -1534,94 +1615,122 @@ create_checksumreply_msg(int type, u_int64_t token, int payloadlen)
 static void
 sfs_checksumop_list(struct sfs_checksumop *csop, u_int64_t token)
 {
-	char				*sfs_path = NULL;
-	int				 error = EINVAL;
-	struct anoubisd_msg		*msg = NULL;
-	struct anoubisd_msg_csumreply	*reply = NULL;
-	DIR				*sfs_dir = NULL;
-	struct dirent			*entry;
-	int				 offset;
-	int				 found = 0, wantids;
-
-	wantids = (csop->listflags & ANOUBIS_CSUM_WANTIDS);
-	if (csop->op != ANOUBIS_CHECKSUM_OP_GENERIC_LIST) {
-		error = EINVAL;
-		goto out;
-	}
-	error = -convert_user_path(csop->path, &sfs_path, !wantids);
+	struct sfs_list_reply		 state;
+	struct anoubisd_msg_csumreply	*reply;
+	int				 error;
+
+	state.token = token;
+	state.msg = NULL;
+	state.offset = 0;
+	error = -sfs_list(csop, sfs_checksumop_list_add, &state);
+	if (state.msg == NULL) {
+		state.msg = create_checksumreply_msg(
+		    ANOUBISD_MSG_CHECKSUMREPLY, token, 0);
+		reply = (struct anoubisd_msg_csumreply *)state.msg->msg;
+		reply->flags = POLICY_FLAG_START;
+	}
+	reply = (struct anoubisd_msg_csumreply *)state.msg->msg;
 	if (error)
-		goto out;
-	sfs_dir = opendir(sfs_path);
-	if (sfs_dir == NULL) {
-		error = errno;
-		if (error == ENOENT || error == ENOTDIR)
-			error = 0;
-		goto out;
-	}
-	msg = create_checksumreply_msg(ANOUBISD_MSG_CHECKSUMREPLY,
-	    token, 8000);
+		state.offset = 0;
+	reply->len = state.offset;
+	reply->flags |= POLICY_FLAG_END;
+	reply->reply = error;
+	msg_shrink(state.msg,
+	    sizeof(struct anoubisd_msg_csumreply) + state.offset);
+	enqueue(&eventq_m2s, state.msg);
+}
+
+/**
+ * The maximum payload size of a single CSMULTI reply message. If the
+ * answers to a CSMULTI request need more space, the reply is split
+ * into several messages.
+ */
+#define CSMULTI_REPLY_MAX	16000
+
+/**
+ * Send the answers to some records of a CSMULTI request to the session
+ * engine in a single reply message. The signature buffers of the records
+ * are freed.
+ *
+ * @param csop The checksum operation.
+ * @param token The token to use for the reply message.
+ * @param first The index of the first record in the message.
+ * @param cnt The number of records in the message.
+ * @param errors The error codes of all records in the request.
+ * @param sigbufs The signature buffers of all records in the request
+ *     (GET requests only, NULL otherwise).
+ * @param totallen The total length of the reply message.
+ * @param flags The policy flags of the message (POLICY_FLAG_START
+ *     and/or POLICY_FLAG_END).
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_send_csmulti_reply(struct sfs_checksumop *csop, u_int64_t token,
+    unsigned int first, unsigned int cnt, int *errors,
+    struct abuf_buffer *sigbufs, unsigned int totallen, int flags)
+{
+	struct anoubisd_msg		*msg;
+	struct anoubisd_msg_csumreply	*reply;
+	Anoubis_CSMultiReplyMessage	*rep;
+	Anoubis_CSMultiReplyRecord	*r;
+	struct abuf_buffer		 rbuf;
+	unsigned int			 i, off;
+
+	msg = create_checksumreply_msg(ANOUBISD_MSG_CSMULTIREPLY, token,
+	    totallen);
 	reply = (struct anoubisd_msg_csumreply *)msg->msg;
-	reply->flags |= POLICY_FLAG_START;
-	offset = 0;
+	reply->flags = flags;
+	reply->reply = 0;
+	rbuf = abuf_open_frommem(reply->data, totallen);
+	rep = abuf_cast(rbuf, Anoubis_CSMultiReplyMessage);
+	if (!rep)
+		goto nomem;
+	set_value(rep->type, ANOUBIS_P_CSMULTIREPLY);
+	set_value(rep->operation, csop->op);
+	set_value(rep->error, 0);
+	off = offsetof(Anoubis_CSMultiReplyMessage, payload);
+	for (i=first; i<first+cnt; ++i) {
+		unsigned int			 length;
 
-	while((entry = readdir(sfs_dir)) != NULL) {
-		char		*tmp;
-		int		 tmplen;
-		if (!sfs_wantentry(csop, sfs_path, entry->d_name))
-			continue;
-		found = 1;
-		if (wantids) {
-			tmp = strdup(entry->d_name);
-		} else {
-			tmp = remove_escape_seq(entry->d_name);
-		}
-		tmplen = strlen(tmp) + 1;
-		if (offset + tmplen > reply->len) {
-			reply->len = offset;
-			msg_shrink(msg,
-			    sizeof(struct anoubisd_msg_csumreply) + offset);
-			enqueue(&eventq_m2s, msg);
-			msg = create_checksumreply_msg(
-			    ANOUBISD_MSG_CHECKSUMREPLY, token, 8000);
-			reply = (struct anoubisd_msg_csumreply *)msg->msg;
-			offset = 0;
-		}
-		if (offset + tmplen > reply->len) {
-			free(tmp);
-			error = ENAMETOOLONG;
-			goto out;
+		length = sizeof(Anoubis_CSMultiReplyRecord);
+		if (sigbufs)
+			length += abuf_length(sigbufs[i]);
+		r = abuf_cast_off(rbuf, off, Anoubis_CSMultiReplyRecord);
+		if (!r)
+			goto nomem;
+		set_value(r->length, length);
+		set_value(r->index, csmultiarr_access(csop->csmulti, i).index);
+		set_value(r->error, errors[i]);
+		if (sigbufs && abuf_length(sigbufs[i])) {
+			unsigned int cp;
+			unsigned int off2;
+
+			off2 = off
+			    + offsetof(Anoubis_CSMultiReplyRecord, payload);
+			cp = abuf_copy_part(rbuf, off2, sigbufs[i], 0,
+			    abuf_length(sigbufs[i]));
+			if (cp != abuf_length(sigbufs[i]))
+				goto nomem;
+			abuf_free(sigbufs[i]);
+			sigbufs[i] = ABUF_EMPTY;
 		}
-		memcpy(reply->data + offset, tmp, tmplen);
-		offset += tmplen;
-		free(tmp);
-	}
-	closedir(sfs_dir);
-	reply->len = offset;
-	reply->flags |= POLICY_FLAG_END;
-	msg_shrink(msg, sizeof(struct anoubisd_msg_csumreply) + offset);
-	enqueue(&eventq_m2s, msg);
-	if (!found) {
-		sfs_remove_index(sfs_path, csop);
-	}
-	free(sfs_path);
-	return;
-out:
-	if (sfs_dir)
-		closedir(sfs_dir);
-	if (sfs_path)
-		free(sfs_path);
-	if (msg) {
-		msg_shrink(msg, sizeof(struct anoubisd_msg_csumreply));
-		reply->len = 0;
-		reply->flags |= POLICY_FLAG_END;
-	} else {
-		msg = create_checksumreply_msg(ANOUBISD_MSG_CHECKSUMREPLY,
-		    token, 0);
-		reply = (struct anoubisd_msg_csumreply *)msg->msg;
-		reply->flags = (POLICY_FLAG_START | POLICY_FLAG_END);
+		off += length;
 	}
-	reply->reply = error;
+	r = abuf_cast_off(rbuf, off, Anoubis_CSMultiReplyRecord);
+	if (!r)
+		goto nomem;
+	set_value(r->length, 0);
+	set_value(r->index, 0);
+	set_value(r->error, 0);
+
 	enqueue(&eventq_m2s, msg);
+	DEBUG(DBG_QUEUE, " >eventq_m2s: %" PRIx64, reply->token);
+	return 0;
+
+nomem:
+	free(msg);
+	return -ENOMEM;
 }
 
 /**
@@ -1629,8 +1738,12 @@ out:
  * CSMULTI request is that it can contain serveral path names in a single
  * request message. This function sends one ore more checksum reply message
  * with the result of the checksum operation to the session engine.
- * Individual checksum operations in the CSMULTI request are handled by
- * sfs_checksumop.
+ * Each reply message is sent as soon as it is full, i.e. the client
+ * can process the first answers while the remaining records are still
+ * handled. Individual checksum operations in the CSMULTI request are
+ * handled by sfs_checksumop. The records are processed in the order of
+ * the request; records for files in the same directory share a cached
+ * directory file descriptor in the SFS tree.
  *
  * @param csop The checksum operation.
  * @param token The token to use for the reply messages.
@@ -1645,31 +1758,26 @@ static int
 sfs_process_csmulti(struct sfs_checksumop *csop, u_int64_t token)
 {
 	int				 get = 0;
-	unsigned int			 totallen = 0;
+	unsigned int			 totallen, reclen;
 	int				*errors = NULL;
 	struct abuf_buffer		*sigbufs = NULL;
-	struct abuf_buffer		 rbuf;
 	unsigned int			 nrec = csop->nrec;
-	unsigned int			 i;
-	struct anoubisd_msg		*msg = NULL;
-	struct anoubisd_msg_csumreply	*reply;
-	Anoubis_CSMultiReplyMessage	*rep;
-	Anoubis_CSMultiReplyRecord	*r;
-	unsigned int			 off;
+	unsigned int			 i, first = 0;
+	int				 flags = POLICY_FLAG_START;
+	int				 ret;
 
 	DEBUG(DBG_TRACE, " >sfs_process_csmulti");
 	if (csop->op == ANOUBIS_CHECKSUM_OP_GET2
 	    || csop->op == ANOUBIS_CHECKSUM_OP_GETSIG2)
 		get = 1;
-	if (nrec > 1000)
-		nrec = 1000;
-	errors = malloc(nrec * sizeof(int));
+	/* Make sure that malloc does not return NULL for empty requests. */
+	errors = malloc((nrec + 1) * sizeof(int));
 	if (!errors) {
 		DEBUG(DBG_TRACE, " <sfs_process_csmulti (ENOMEM)");
 		return -ENOMEM;
 	}
 	if (get) {
-		sigbufs = malloc(nrec * sizeof(struct abuf_buffer));
+		sigbufs = malloc((nrec + 1) * sizeof(struct abuf_buffer));
 		if (sigbufs == NULL) {
 			free(errors);
 			DEBUG(DBG_TRACE, " <sfs_process_csmulti (ENOMEM)");
@@ -1678,7 +1786,9 @@ sfs_process_csmulti(struct sfs_checksumop *csop, u_int64_t token)
 		for (i=0; i<nrec; ++i)
 			sigbufs[i] = ABUF_EMPTY;
 	}
-	totallen = sizeof(Anoubis_CSMultiReplyMessage);
+	/* Message header and sentinel record. */
+	totallen = sizeof(Anoubis_CSMultiReplyMessage)
+	    + sizeof(Anoubis_CSMultiReplyRecord);
 	DEBUG(DBG_CSUM, " sfs_process_csmulti: nrec=%d", nrec);
 	for (i=0; i<nrec; ++i) {
 		struct sfs_csmulti_record	*rec;
@@ -1690,7 +1800,7 @@ sfs_process_csmulti(struct sfs_checksumop *csop, u_int64_t token)
 			errors[i] = -sfs_checksumop(csop, &sigbufs[i]);
 		else
 			errors[i] = -sfs_checksumop(csop, NULL);
-		totallen += sizeof(Anoubis_CSMultiReplyRecord);
+		reclen = sizeof(Anoubis_CSMultiReplyRecord);
 		if (errors[i]) {
 			if (get) {
 				abuf_free(sigbufs[i]);
@@ -1698,78 +1808,35 @@ sfs_process_csmulti(struct sfs_checksumop *csop, u_int64_t token)
 			}
 		} else {
 			if (get)
-				totallen += abuf_length(sigbufs[i]);
+				reclen += abuf_length(sigbufs[i]);
 			else
 				send_sfscache_invalidate(csop);
 		}
-		if (totallen > 16000) {
-			nrec = i+1;
-			break;
-		}
-	}
-	totallen += sizeof(Anoubis_CSMultiReplyRecord);
-	msg = create_checksumreply_msg(ANOUBISD_MSG_CSMULTIREPLY, token,
-	    totallen);
-	if (!msg)
-		goto nomem;
-
-	reply = (struct anoubisd_msg_csumreply *)msg->msg;
-	reply->flags = POLICY_FLAG_START | POLICY_FLAG_END;
-	reply->reply = 0;
-	rbuf = abuf_open_frommem(reply->data, totallen);
-	rep = abuf_cast(rbuf, Anoubis_CSMultiReplyMessage);
-	set_value(rep->type, ANOUBIS_P_CSMULTIREPLY);
-	set_value(rep->operation, csop->op);
-	set_value(rep->error, 0);
-	off = offsetof(Anoubis_CSMultiReplyMessage, payload);
-	for (i=0; i<nrec; ++i) {
-		unsigned int			 length;
-
-		length = sizeof(Anoubis_CSMultiReplyRecord);
-		if (get)
-			length += abuf_length(sigbufs[i]);
-		r = abuf_cast_off(rbuf, off, Anoubis_CSMultiReplyRecord);
-		if (!r)
-			goto nomem;
-		set_value(r->length, length);
-		set_value(r->index, csmultiarr_access(csop->csmulti, i).index);
-		set_value(r->error, errors[i]);
-		if (get && abuf_length(sigbufs[i])) {
-			unsigned int cp;
-			unsigned int off2;
-
-			off2 = off
-			    + offsetof(Anoubis_CSMultiReplyRecord, payload);
-			cp = abuf_copy_part(rbuf, off2, sigbufs[i], 0,
-			    abuf_length(sigbufs[i]));
-			if (cp != abuf_length(sigbufs[i]))
+		if (i > first && totallen + reclen > CSMULTI_REPLY_MAX) {
+			ret = sfs_send_csmulti_reply(csop, token, first,
+			    i - first, errors, sigbufs, totallen, flags);
+			if (ret < 0)
 				goto nomem;
-			abuf_free(sigbufs[i]);
-			sigbufs[i] = ABUF_EMPTY;
+			flags = 0;
+			first = i;
+			totallen = sizeof(Anoubis_CSMultiReplyMessage)
+			    + sizeof(Anoubis_CSMultiReplyRecord);
 		}
-		off += length;
+		totallen += reclen;
 	}
-	r = abuf_cast_off(rbuf, off, Anoubis_CSMultiReplyRecord);
-	if (!r)
+	ret = sfs_send_csmulti_reply(csop, token, first, nrec - first,
+	    errors, sigbufs, totallen, flags | POLICY_FLAG_END);
+	if (ret < 0)
 		goto nomem;
-	set_value(r->length, 0);
-	set_value(r->index, 0);
-	set_value(r->error, 0);
 	free(errors);
 	if (sigbufs)
 		free(sigbufs);
-
-	enqueue(&eventq_m2s, msg);
-	DEBUG(DBG_QUEUE, " >eventq_m2s: %" PRIx64, reply->token);
 	DEBUG(DBG_TRACE, " <sfs_process_csmulti (success)");
 
 	return 0;
 
 nomem:
-	if (msg)
-		free(msg);
-	if (errors)
-		free(errors);
+	free(errors);
 	if (sigbufs) {
 		for (i=0; i<nrec; ++i)
 			abuf_free(sigbufs[i]);
@@ -2291,10 +2358,23 @@ dispatch_p2m(int fd, short event __used, void *arg __used)
 	DEBUG(DBG_TRACE, "<dispatch_p2m");
 }
 
+/**
+ * The maximum number of replies that are written to the kernel device
+ * with a single system call. The OpenBSD implementation of the device
+ * only handles a single reply per write.
+ */
+#ifdef OPENBSD
+#define EVENTDEV_WBATCH		1
+#else
+#define EVENTDEV_WBATCH		MSG_WBATCH
+#endif
+
 /**
  * This is the event handler for messages that are sent from the master to
  * the kernel device. It is called when the master to kernel queue is not
- * empty and the eventdev device is ready for writing. The handler
+ * empty and the eventdev device is ready for writing. Replies from the
+ * head of the queue are written to the device with a single writev
+ * call until the queue is empty or the device would block. The handler
  * must make sure that it re-adds the write event as long as the queue is
  * not empty.
  *
@@ -2305,44 +2385,61 @@ dispatch_p2m(int fd, short event __used, void *arg __used)
 static void
 dispatch_m2dev(int fd, short event __used, void *arg __used)
 {
+	struct anoubisd_msg		*msgs[EVENTDEV_WBATCH];
+	struct iovec			 iov[EVENTDEV_WBATCH];
 	struct anoubisd_msg		*msg;
 	struct eventdev_reply		*ev_rep;
 	ssize_t				 ret;
+	int				 i, cnt;
 
 	DEBUG(DBG_TRACE, ">dispatch_m2dev");
 
-	/* msg was checked for non-nullness just above */
-	/*@-nullderef@*/ /*@-nullpass@*/
-	if ((msg = queue_peek(&eventq_m2dev)) == NULL) {
-		DEBUG(DBG_TRACE, "<dispatch_m2dev (no msg)");
-		return;
-	}
-	/*@=nullderef@*/ /*@=nullpass@*/
-
-	switch(msg->mtype) {
-		case ANOUBISD_MSG_EVENTREPLY:
-			ret = write(fd, msg->msg,
-			    sizeof(struct eventdev_reply));
-
+	for (;;) {
+		cnt = queue_peek_many(&eventq_m2dev, (void **)msgs,
+		    EVENTDEV_WBATCH);
+		if (cnt == 0)
+			break;
+		for (i=0; i<cnt; ++i) {
+			if (msgs[i]->mtype != ANOUBISD_MSG_EVENTREPLY)
+				break;
+			iov[i].iov_base = msgs[i]->msg;
+			iov[i].iov_len = sizeof(struct eventdev_reply);
+		}
+		if (i == 0) {
+			DEBUG(DBG_TRACE, " dispatch_m2dev (bad msg)");
+			msg = dequeue(&eventq_m2dev);
+			free(msg);
+			continue;
+		}
+		ret = writev(fd, iov, i);
+		if (ret < 0) {
 			/*
 			 * ESRCH/EINVAL returns are events which
 			 * have been cancelled before anoubisd replied.
-			 * These should be dequeued.
+			 * The kernel stops at the first such reply.
+			 * It should be dequeued.
 			 */
-			if (ret > 0 ||
-			    (ret < 0 && (errno == EINVAL || errno == ESRCH))) {
-				msg = dequeue(&eventq_m2dev);
-				ev_rep = (struct eventdev_reply *)msg->msg;
-				DEBUG(DBG_QUEUE, " <eventq_m2dev: %x%s",
-				    ev_rep->msg_token,
-				    (ret < 0)? " (bad reply)" : "");
-				free(msg);
-			}
-			break;
-		default:
-			DEBUG(DBG_TRACE, "<dispatch_m2dev (bad msg)");
+			if (errno != EINVAL && errno != ESRCH)
+				break;
+			cnt = 1;
+		} else {
+			cnt = ret / sizeof(struct eventdev_reply);
+			amsg_stats.replywrites++;
+			amsg_stats.replies += cnt;
+			amsg_histogram_add(amsg_stats.replybatch, cnt);
+		}
+		for (i=0; i<cnt; ++i) {
 			msg = dequeue(&eventq_m2dev);
+			ev_rep = (struct eventdev_reply *)msg->msg;
+			DEBUG(DBG_QUEUE, " <eventq_m2dev: %x%s",
+			    ev_rep->msg_token, (ret < 0)? " (bad reply)" : "");
 			free(msg);
+		}
+		/*
+		 * A short write stops at a reply that the kernel did not
+		 * accept. The next write will report the error for it.
+		 */
+		if (cnt == 0)
 			break;
 	}
 
@@ -2352,6 +2449,44 @@ dispatch_m2dev(int fd, short event __used, void *arg __used)
 	DEBUG(DBG_TRACE, "<dispatch_m2dev");
 }
 
+/**
+ * Append the event and message transfer statistics of the master
+ * process to a statistics message from the kernel.
+ *
+ * @param msg The statistics message (source ANOUBIS_SOURCE_STAT). The
+ *     message is freed by this function.
+ * @return The new statistics message or NULL if it cannot be created.
+ */
+static struct anoubisd_msg *
+master_append_stats(struct anoubisd_msg *msg)
+{
+	struct anoubis_stat_value	 vals[6 + 3 * AMSG_HISTSIZE];
+	int				 i, n = 0;
+
+#define ADDSTAT(KEY, VALUE) do {				\
+		vals[n].subsystem = ANOUBIS_STAT_SUBSYS_MASTER;	\
+		vals[n].key = (KEY);				\
+		vals[n].value = (VALUE);			\
+		n++;						\
+	} while (0)
+	ADDSTAT(ANOUBIS_STAT_MASTER_EVREADS, amsg_stats.evreads);
+	ADDSTAT(ANOUBIS_STAT_MASTER_EVENTS, amsg_stats.events);
+	ADDSTAT(ANOUBIS_STAT_MASTER_REPLYWRITES, amsg_stats.replywrites);
+	ADDSTAT(ANOUBIS_STAT_MASTER_REPLIES, amsg_stats.replies);
+	ADDSTAT(ANOUBIS_STAT_MASTER_MSGWRITES, amsg_stats.msgwrites);
+	ADDSTAT(ANOUBIS_STAT_MASTER_MSGS, amsg_stats.msgs);
+	for (i=0; i<AMSG_HISTSIZE; ++i) {
+		ADDSTAT(ANOUBIS_STAT_MASTER_EVBATCH + i,
+		    amsg_stats.evbatch[i]);
+		ADDSTAT(ANOUBIS_STAT_MASTER_REPLYBATCH + i,
+		    amsg_stats.replybatch[i]);
+		ADDSTAT(ANOUBIS_STAT_MASTER_MSGBATCH + i,
+		    amsg_stats.msgbatch[i]);
+	}
+#undef ADDSTAT
+	return msg_append_stats(msg, vals, n);
+}
+
 /**
  * This is the event handler for kernel events. The corresponding libevent
  * event is always active. This function is called as soon as data becomes
@@ -2371,13 +2506,21 @@ dispatch_dev2m(int fd, short event __used, void *arg __used)
 	struct eventdev_reply		*rep;
 	struct anoubisd_msg		*msg;
 	struct anoubisd_msg		*msg_reply;
+	unsigned int			 nevents = 0;
 
 	DEBUG(DBG_TRACE, ">dispatch_dev2m");
 
 	for (;;) {
 		if ((msg = get_event(fd)) == NULL)
 			break;
+		nevents++;
 		hdr = (struct eventdev_hdr *)msg->msg;
+		if (hdr->msg_source == ANOUBIS_SOURCE_STAT) {
+			msg = master_append_stats(msg);
+			if (msg == NULL)
+				continue;
+			hdr = (struct eventdev_hdr *)msg->msg;
+		}
 
 		DEBUG(DBG_QUEUE, " >dev2m: %x %c source=%d", hdr->msg_token,
 		    (hdr->msg_flags & EVENTDEV_NEED_REPLY)  ? 'R' : 'N',
@@ -2414,12 +2557,17 @@ dispatch_dev2m(int fd, short event __used, void *arg __used)
 		    hdr->msg_pid);
 
 		if ((hdr->msg_flags & EVENTDEV_NEED_REPLY) ||
+		    (hdr->msg_source == ANOUBIS_SOURCE_STAT) ||
 		    (hdr->msg_source == ANOUBIS_SOURCE_PROCESS) ||
 		    (hdr->msg_source == ANOUBIS_SOURCE_SFSEXEC) ||
 		    (hdr->msg_source == ANOUBIS_SOURCE_IPC) ||
 		    (hdr->msg_source == ANOUBIS_SOURCE_PLAYGROUNDPROC) ||
 		    (hdr->msg_source == ANOUBIS_SOURCE_PLAYGROUNDFILE)) {
-			/* Send event to policy process for handling. */
+			/*
+			 * Send event to policy process for handling.
+			 * Statistics are forwarded to the session engine
+			 * by the policy process.
+			 */
 			enqueue(&eventq_m2p, msg);
 			DEBUG(DBG_QUEUE, " >eventq_m2p: %x source=%d",
 			    hdr->msg_token, hdr->msg_source);
@@ -2431,6 +2579,10 @@ dispatch_dev2m(int fd, short event __used, void *arg __used)
 
 		DEBUG(DBG_TRACE, "<dispatch_dev2m (loop)");
 	}
+	amsg_histogram_add(amsg_stats.evbatch, nevents);
+	DEBUG(DBG_QUEUE, " dispatch_dev2m: %u events, %llu events in "
+	    "%llu reads", nevents, (unsigned long long)amsg_stats.events,
+	    (unsigned long long)amsg_stats.evreads);
 	if (terminate) {
 		event_del(&ev_dev2m);
 		if (terminate < 2)
@@ -2469,11 +2621,13 @@ dispatch_m2u(int fd, short event __used, void *arg __used)
 }
 
 /**
- * Update everyones checksums and signatures (where possible) on a
- * particular file. This is called after an upgrade completes.
+ * Update everyones checksums and signatures (where possible) on the
+ * files in an update message. This is called after an upgrade completes.
+ * The upgrade process sends the checksums of several files in a single
+ * message, sorted by path name.
  *
  * @param msg The request message received from the upgrade process that
- *     contains the path name.
+ *     contains the path names and checksums.
  *
  * @note This function does not invalidate the sfs tree cache in the
  * policy engine. The entire cache will be dropped at the end of the
@@ -2483,8 +2637,11 @@ static void
 dispatch_sfs_update_all(struct anoubisd_msg *msg)
 {
 	struct anoubisd_sfs_update_all	*umsg;
-	size_t				 plen;
-	char				*path;
+	struct cert			*cert = NULL;
+	struct abuf_buffer		 md;
+	size_t				 len, plen;
+	unsigned int			 i;
+	char				*path, *end;
 	int				 ret;
 
 	if (anoubisd_config.upgrade_mode == ANOUBISD_UPGRADE_MODE_OFF) {
@@ -2492,44 +2649,55 @@ dispatch_sfs_update_all(struct anoubisd_msg *msg)
 		    "Upgrade mode is OFF.");
 		return;
 	}
-	/*
-	 * Validate the message format and extract path/checksum. The
-	 * Pathname must have space for at least one byte.
-	 */
-	if ((size_t)msg->size < sizeof(*msg) + sizeof(*umsg)
-	    + ANOUBIS_CS_LEN + 1)
+	if ((size_t)msg->size < sizeof(*msg) + sizeof(*umsg))
 		goto bad;
 	umsg = (struct anoubisd_sfs_update_all *)msg->msg;
 	if (umsg->cslen != ANOUBIS_CS_LEN)
 		goto bad;
-	plen = msg->size - sizeof(*msg) - sizeof(*umsg) - ANOUBIS_CS_LEN;
-	path = umsg->payload + umsg->cslen;
-	/* Forcefully NUL terminate the path name. */
-	path[plen-1] = 0;
-
-	/*
-	 * Update checksums on disk.
-	 */
-	ret = sfs_update_all(path,
-	    abuf_open_frommem(umsg->payload, ANOUBIS_CS_LEN));
-	if (ret < 0)
-		log_warnx("Cannot update checksums during update");
+	len = msg->size - sizeof(*msg) - sizeof(*umsg);
 	if (anoubisd_config.rootkey) {
-		struct cert	*cert = cert_get_by_uid(0);
+		cert = cert_get_by_uid(0);
+		if (cert == NULL || cert->privkey == NULL) {
+			cert = NULL;
+			if (anoubisd_config.rootkey_required) {
+				log_warnx("ERROR: Upgrade in progress but "
+				    "rootkey is not available");
+				send_upgrade_ok(0);
+			}
+		}
+	}
+	path = umsg->payload;
+	for (i = 0; i < umsg->nrec; ++i) {
+		/*
+		 * Validate the record and extract path/checksum. The
+		 * Pathname must have space for at least one byte.
+		 */
+		if (len < ANOUBIS_CS_LEN + 1)
+			goto bad;
+		md = abuf_open_frommem(path, ANOUBIS_CS_LEN);
+		path += ANOUBIS_CS_LEN;
+		len -= ANOUBIS_CS_LEN;
+		end = memchr(path, 0, len);
+		if (end == NULL)
+			goto bad;
+		plen = end - path;
 
-		DEBUG(DBG_UPGRADE, " signature update for %s, cert %p %p",
-		    path, cert, cert?cert->privkey:NULL);
-		if (cert && cert->privkey) {
-			ret = sfs_update_signature(path, cert,
-			    abuf_open_frommem(umsg->payload, ANOUBIS_CS_LEN));
+		/*
+		 * Update checksums on disk.
+		 */
+		ret = sfs_update_all(path, md);
+		if (ret < 0)
+			log_warnx("Cannot update checksums during update");
+		if (cert) {
+			DEBUG(DBG_UPGRADE, " signature update for %s, cert %p",
+			    path, cert);
+			ret = sfs_update_signature(path, cert, md);
 			if (ret < 0)
 				log_warnx("Cannot update root signature "
 				    "during update");
-		} else if (anoubisd_config.rootkey_required) {
-			log_warnx("ERROR: Upgrade in progress but rootkey "
-			    "is not available");
-			send_upgrade_ok(0);
 		}
+		path += plen + 1;
+		len -= plen + 1;
 	}
 	return;
 bad:
@@ -73,6 +73,7 @@ static struct anoubisd_reply	*pe_dispatch_event(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_process(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_sfsexec(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_alf(struct eventdev_hdr *);
+static struct pe_proc		*pe_alf_get_proc(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_ipc(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_sfs(struct eventdev_hdr *);
 static struct anoubisd_reply	*pe_handle_playgroundask(struct eventdev_hdr *);
@@ -131,6 +132,7 @@ void
 pe_init(void)
 {
 	sfshash_init();
+	sfshash_load_filter();
 	pe_proc_init();
 	cert_init(1);
 	pe_user_init();
@@ -142,6 +144,7 @@ pe_init(void)
 void
 pe_shutdown(void)
 {
+	pe_workers_stop();
 	pe_user_flush_db(NULL);
 	sfshash_flush();
 	pe_proc_shutdown();
@@ -152,7 +155,8 @@ pe_shutdown(void)
 /**
  * Reconfigure the policy engine. This is called in response to a
  * HUP signal. It reloads the policy and certificate database and
- * deletes all entries from the sfs hash.
+ * deletes all entries from the sfs hash. The negative lookup filter of
+ * the sfs hash is kept, it is maintained incrementally.
  */
 void
 pe_reconfigure(void)
@@ -348,7 +352,8 @@ pe_upgrade_finish(void)
 	}
 	/*
 	 * Checksums might have changed and the master does not send checksum
-	 * updates for these files.
+	 * updates for these files. The upgrade only updates existing
+	 * checksums, i.e. the negative lookup filter is still valid.
 	 */
 	sfshash_flush();
 	upgrade_iterator = NULL;
@@ -396,6 +401,41 @@ policy_engine(struct anoubisd_msg *request)
 	return reply;
 }
 
+/**
+ * Process a kernel event asynchronously if possible. This is only
+ * done if the policy engine has worker threads. Currently, this applies
+ * to ALF events: The rule blocks are evaluated by the worker threads
+ * while all other processing happens in the main thread. Processing
+ * is synchronous if ALF debugging is enabled because logging is not
+ * thread safe.
+ *
+ * @param request The request message from the master.
+ * @param cb The callback that receives the reply. It is called from
+ *     the main thread, possibly before this function returns.
+ * @return True if the request was taken over. The request and the
+ *     reply are passed to the callback in this case. If the return
+ *     value is zero, the caller must process the request with
+ *     policy_engine.
+ */
+int
+policy_engine_async(struct anoubisd_msg *request, pe_reply_cb cb)
+{
+	struct eventdev_hdr	*hdr;
+
+	if (pe_workers_active() == 0 || (debug_flags & DBG_PE_DECALF))
+		return 0;
+	if (request->mtype != ANOUBISD_MSG_EVENTDEV)
+		return 0;
+	hdr = (struct eventdev_hdr *)request->msg;
+	if (hdr->msg_source != ANOUBIS_SOURCE_ALF)
+		return 0;
+	if (hdr->msg_size < (sizeof(struct eventdev_hdr) +
+	    sizeof(struct alf_event)))
+		return 0;
+	pe_alf_submit(pe_alf_get_proc(hdr), request, cb);
+	return 1;
+}
+
 /**
  * This is the internal function to handle the different types of kernel
  * events. It is used by policy_engine and dispatches different types
@@ -585,7 +625,6 @@ pe_handle_process(struct eventdev_hdr *hdr)
 static struct anoubisd_reply *
 pe_handle_alf(struct eventdev_hdr *hdr)
 {
-	struct alf_event	*msg;
 	struct anoubisd_reply	*reply = NULL;
 	struct pe_proc		*proc;
 
@@ -598,7 +637,26 @@ pe_handle_alf(struct eventdev_hdr *hdr)
 		log_warnx("pe_handle_alf: short message");
 		return (NULL);
 	}
-	msg = (struct alf_event *)(hdr + 1);
+	proc = pe_alf_get_proc(hdr);
+	reply = pe_decide_alf(proc, hdr);
+	pe_proc_put(proc);
+	DEBUG(DBG_TRACE, "<policy_engine");
+	return (reply);
+}
+
+/**
+ * Return the process that triggered an ALF event. The PID of the
+ * process is updated if it is not yet known.
+ *
+ * @param hdr The event. The caller must make sure that it is long enough.
+ * @return The process or NULL if the process is not tracked. The caller
+ *     must drop the reference to the process with pe_proc_put.
+ */
+static struct pe_proc *
+pe_alf_get_proc(struct eventdev_hdr *hdr)
+{
+	struct alf_event	*msg = (struct alf_event *)(hdr + 1);
+	struct pe_proc		*proc;
 
 	/* get process from tracker list */
 	if ((proc = pe_proc_get(msg->common.task_cookie)) == NULL) {
@@ -612,10 +670,7 @@ pe_handle_alf(struct eventdev_hdr *hdr)
 		if (pe_proc_get_pid(proc) == -1)
 			pe_proc_set_pid(proc, hdr->msg_pid);
 	}
-	reply = pe_decide_alf(proc, hdr);
-	pe_proc_put(proc);
-	DEBUG(DBG_TRACE, "<policy_engine");
-	return (reply);
+	return proc;
 }
 
 /**
@@ -1031,7 +1086,7 @@ pe_handle_playgroundproc(struct eventdev_hdr *hdr)
 		pe_proc_set_playgroundid(proc, extract_pgid(&pg->common));
 		/* Policy might change due to a modified playground ID. */
 		for (i=0; i<PE_PRIO_MAX; ++i)
-			pe_context_refresh(proc, i, NULL);
+			pe_context_refresh(proc, i);
 		pe_proc_put(proc);
 	}
 	return NULL;
@@ -1309,11 +1364,32 @@ err:
 }
 #endif
 
+/**
+ * The data structure that pe_build_prefixhash uses to index the path
+ * prefixes of a rule block (one of PE_PREFIX_HASH or PE_PREFIX_TRIE).
+ */
+static int	pe_prefix_backend = PE_PREFIX_TRIE;
+
+/**
+ * Select the data structure that is used to index the path prefixes
+ * of rule blocks. This only affects rule blocks that are indexed after
+ * the call.
+ *
+ * @param backend The new backend (PE_PREFIX_HASH or PE_PREFIX_TRIE).
+ * @return None.
+ */
+void
+pe_set_prefix_backend(int backend)
+{
+	pe_prefix_backend = backend;
+}
+
 /**
  * Analyse the rules in the given rule block and store all path
- * prefixes in a prefix hash. The prefix hash is saved in the userdata
- * field of the rule and will be freed by the ruleset destructor.
- * It is useful to lookup matching rules for a given path name efficiently.
+ * prefixes in a prefix hash or a prefix trie, depending on the selected
+ * backend. The result is saved in the userdata field of the rule and
+ * will be freed by the ruleset destructor. It is useful to lookup
+ * matching rules for a given path name efficiently.
  *
  * @param block The rule block to analyse.
  * @return Zero in case of success, a negative error code if something
@@ -1322,17 +1398,20 @@ err:
 int
 pe_build_prefixhash(struct apn_rule *block)
 {
-	int			 cnt = 0, idx = 1;
+	int			 cnt = 0, idx = 1, ret;
 	struct apn_rule		*rule;
 
-	TAILQ_FOREACH(rule, &block->rule.chain, entry)
-		cnt++;
-	block->userdata = pe_prefixhash_create(cnt);
+	if (pe_prefix_backend == PE_PREFIX_TRIE) {
+		block->userdata = pe_prefixtrie_create();
+	} else {
+		TAILQ_FOREACH(rule, &block->rule.chain, entry)
+			cnt++;
+		block->userdata = pe_prefixhash_create(cnt);
+	}
 	if (!block->userdata)
 		return -ENOMEM;
 	DEBUG(DBG_TRACE, ">pe_build_prefixhash");
 	TAILQ_FOREACH(rule, &block->rule.chain, entry) {
-		int		 ret;
 		const char	*prefix;
 		switch (rule->apn_type) {
 		case APN_SFS_ACCESS:
@@ -1351,15 +1430,20 @@ pe_build_prefixhash(struct apn_rule *block)
 			log_warnx("pe_build_prefixhash: Invalid rule "
 			    "type %u in SFS rule %lu",
 			    rule->apn_type, rule->apn_id);
-			pe_prefixhash_destroy(block->userdata);
+			pe_userdata_destroy(block->userdata);
 			block->userdata = NULL;
 			DEBUG(DBG_TRACE,
 			    "<pe_build_prefixhash: invalid type");
 			return -EINVAL;
 		}
-		ret = pe_prefixhash_add(block->userdata, prefix, rule, idx);
+		if (pe_prefix_backend == PE_PREFIX_TRIE)
+			ret = pe_prefixtrie_add(block->userdata, prefix,
+			    rule, idx);
+		else
+			ret = pe_prefixhash_add(block->userdata, prefix,
+			    rule, idx);
 		if (ret < 0) {
-			pe_prefixhash_destroy(block->userdata);
+			pe_userdata_destroy(block->userdata);
 			block->userdata = NULL;
 			DEBUG(DBG_TRACE, "<pe_build_prefixhash: "
 			    "add failed with %d", ret);
@@ -1368,10 +1452,110 @@ pe_build_prefixhash(struct apn_rule *block)
 		DEBUG(DBG_TRACE, " pe_build_prefixhash: added %p", rule);
 		idx++;
 	}
+	if (pe_prefix_backend == PE_PREFIX_TRIE) {
+		ret = pe_prefixtrie_finish(block->userdata);
+		if (ret < 0) {
+			pe_userdata_destroy(block->userdata);
+			block->userdata = NULL;
+			DEBUG(DBG_TRACE, "<pe_build_prefixhash: "
+			    "finish failed with %d", ret);
+			return ret;
+		}
+	}
 	DEBUG(DBG_TRACE, "<pe_build_prefixhash");
 	return 0;
 }
 
+/**
+ * Return the rules in a path based rule block (SFS or sandbox) that
+ * might match the given path. The prefix index of the block is built
+ * if it does not exist, yet. The list will contain all rules that match
+ * but additional rules that do not match may be included, too.
+ *
+ * @param block The rule block.
+ * @param path The path name (may be NULL).
+ * @param rulesp The candidate rules are returned here in rule order.
+ *     The result must be released with pe_prefix_putrules.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+int
+pe_prefix_getrules(struct apn_rule *block, const char *path,
+    struct apnarr_array *rulesp)
+{
+	struct pe_userdata	*hdr;
+	int			 error;
+
+	(*rulesp) = apnarr_EMPTY;
+	if (block->userdata == NULL) {
+		error = pe_build_prefixhash(block);
+		if (error < 0)
+			return error;
+	}
+	hdr = block->userdata;
+	switch (hdr->type) {
+	case PE_USERDATA_PREFIXTRIE:
+		return pe_prefixtrie_getrules(block->userdata, path, rulesp);
+	case PE_USERDATA_PREFIXHASH:
+		return pe_prefixhash_getrules(block->userdata, path, rulesp);
+	}
+	log_warnx("pe_prefix_getrules: Invalid userdata type %d", hdr->type);
+	return -EINVAL;
+}
+
+/**
+ * Release a list of candidate rules returned by pe_prefix_getrules.
+ * Lists returned by the prefix trie refer to memory of the trie and
+ * are not freed.
+ *
+ * @param block The rule block that was passed to pe_prefix_getrules.
+ *     May be NULL if the list is empty.
+ * @param rules The list of rules.
+ * @return None.
+ */
+void
+pe_prefix_putrules(struct apn_rule *block, struct apnarr_array rules)
+{
+	struct pe_userdata	*hdr;
+
+	if (apnarr_size(rules) == 0 || block == NULL)
+		return;
+	hdr = block->userdata;
+	if (hdr && hdr->type == PE_USERDATA_PREFIXHASH)
+		apnarr_free(rules);
+}
+
+/**
+ * Free data that the policy engine attached to the userdata field of
+ * an apn_rule. This is the destructor of all rulesets loaded by the
+ * policy engine. The type of the data is determined by its
+ * pe_userdata header.
+ *
+ * @param data The userdata of the rule.
+ * @return None.
+ */
+void
+pe_userdata_destroy(void *data)
+{
+	struct pe_userdata	*hdr = data;
+
+	if (hdr == NULL)
+		return;
+	switch (hdr->type) {
+	case PE_USERDATA_PREFIXHASH:
+		pe_prefixhash_destroy(data);
+		break;
+	case PE_USERDATA_ALF:
+		pe_alf_compiled_destroy(data);
+		break;
+	case PE_USERDATA_PREFIXTRIE:
+		pe_prefixtrie_destroy(data);
+		break;
+	default:
+		log_warnx("pe_userdata_destroy: Invalid type %d", hdr->type);
+	}
+}
+
 /**
  * Look at the path prefixes of all rules in the rulelist. If there is at
  * least one path prefix that applies to exactly one of the two paths in
@@ -1486,14 +1670,15 @@ pe_compare(struct pe_proc *proc, struct pe_path_event *event, time_t now)
 		int			prio = prios[!!(x & 2)];
 		int			pidx = (x & 1);
 		struct apnarr_array	rulelist = apnarr_EMPTY;
+		struct apn_rule		*block = NULL;
 		int			error = 0;
 
 		if (type == APN_SFS_ACCESS) {
 			error = pe_sfs_getrules(event->uid, prio,
-			    event->path[pidx], &rulelist);
+			    event->path[pidx], &block, &rulelist);
 		} else if (type == APN_SB_ACCESS) {
 			error = pe_sb_getrules(proc, event->uid, prio,
-			    event->path[pidx], &rulelist);
+			    event->path[pidx], &block, &rulelist);
 		}
 
 		DEBUG(DBG_PE, " pe_compare: prio %d rules %d for %s",
@@ -1504,7 +1689,7 @@ pe_compare(struct pe_proc *proc, struct pe_path_event *event, time_t now)
 			continue;
 
 		error = pe_compare_path(rulelist, event, now);
-		apnarr_free(rulelist);
+		pe_prefix_putrules(block, rulelist);
 		if (error < 0)
 			return error;
 	}
@@ -53,6 +53,27 @@ struct pe_context;
 struct pe_policy_db;
 struct pe_user;
 struct pe_pubkey_db;
+struct pe_alf_cache;
+
+/**
+ * Types of the data structures that the policy engine attaches to
+ * the userdata field of an apn_rule.
+ */
+#define PE_USERDATA_PREFIXHASH	1
+#define PE_USERDATA_ALF		2
+#define PE_USERDATA_PREFIXTRIE	3
+
+/**
+ * All data structures that are stored in the userdata field of an
+ * apn_rule must start with this header. It tells the ruleset destructor
+ * (pe_userdata_destroy) how to free the data.
+ */
+struct pe_userdata {
+	/**
+	 * The type of the data (one of the PE_USERDATA_* constants).
+	 */
+	int		 type;
+};
 
 /**
  * Description (identification) of a process or context. This consists of a
@@ -145,6 +166,34 @@ struct anoubisd_reply {
 	struct pe_proc_ident *ctxident;
 };
 
+/**
+ * The callback that receives the reply for a kernel event that is
+ * processed asynchronously (see policy_engine_async). The callback
+ * is called from the main thread and takes over ownership of the
+ * message and of the reply. The reply is NULL if no reply is required.
+ */
+typedef void (*pe_reply_cb)(struct anoubisd_msg *, struct anoubisd_reply *);
+
+/**
+ * A job that is processed by the worker threads of the policy engine.
+ * See pe_workers.c for the rules that apply to the callbacks.
+ */
+struct pe_job {
+	/**
+	 * Link to the job lists of the worker pool.
+	 */
+	TAILQ_ENTRY(pe_job)	 next;
+
+	/**
+	 * Called from a worker thread to process the job.
+	 */
+	void			(*run)(struct pe_job *);
+
+	/**
+	 * Called from the main thread after the job was processed.
+	 */
+	void			(*done)(struct pe_job *);
+};
 
 #define PE_UPGRADE_TOUCHED	0x0001
 #define PE_UPGRADE_WRITEOK	0x0002
@@ -240,6 +289,17 @@ struct pe_path_event {
 
 /* Policy Engine main entry point. Documention is in pe.c */
 struct anoubisd_reply	*policy_engine(struct anoubisd_msg *request);
+int			 policy_engine_async(struct anoubisd_msg *request,
+			     pe_reply_cb cb);
+
+/* Worker threads of the policy engine. */
+int			 pe_workers_start(int);
+void			 pe_workers_stop(void);
+int			 pe_workers_active(void);
+int			 pe_workers_fd(void);
+void			 pe_workers_submit(struct pe_job *);
+int			 pe_workers_complete(void);
+void			 pe_workers_drain(void);
 
 /* Proc Ident management functions. */
 void			 pe_proc_ident_set(struct pe_proc_ident *,
@@ -305,10 +365,12 @@ int			 pe_context_uses_rs(struct pe_context *,
 			     struct apn_ruleset *);
 int			 pe_context_is_nosfs(struct pe_context *);
 int			 pe_context_is_pg(struct pe_context *);
+struct pe_alf_cache	*pe_context_get_alfcache(struct pe_context *);
+void			 pe_context_set_alfcache(struct pe_context *,
+			     struct pe_alf_cache *);
 
 /* Context change functions */
-void			 pe_context_refresh(struct pe_proc *, int,
-			     struct pe_policy_db *);
+void			 pe_context_refresh(struct pe_proc *, int);
 void			 pe_context_exec(struct pe_proc *, uid_t,
 			     struct pe_proc_ident *);
 int			 pe_context_will_transition(struct pe_proc *, uid_t,
@@ -325,7 +387,7 @@ char			*pe_context_dump(struct eventdev_hdr *,
 			     struct pe_proc *, int);
 
 /* Rule change/reload functions */
-void			 pe_proc_update_db(struct pe_policy_db *);
+int			 pe_proc_refresh_stale(int);
 void			 pe_proc_update_db_one(struct apn_ruleset *, int,
 			     uid_t);
 
@@ -337,6 +399,10 @@ void			 pe_user_init(void);
 void			 pe_user_flush_db(struct pe_policy_db *);
 void			 pe_user_dump(void);
 void			 pe_user_reconfigure(void);
+unsigned long		 pe_user_generation(void);
+int			 pe_user_retired_dbs(void);
+struct pe_policy_db	*pe_user_db_get(void);
+void			 pe_user_db_put(struct pe_policy_db *);
 
 /* Public Key Management */
 void			 pe_pubkey_init(void);
@@ -359,14 +425,20 @@ struct pe_filetree_node	*pe_upgrade_filelist_get(void);
 
 /* Subsystem entry points for Policy decisions. */
 struct anoubisd_reply	*pe_decide_alf(struct pe_proc *, struct eventdev_hdr *);
+void			 pe_alf_submit(struct pe_proc *, struct anoubisd_msg *,
+			     pe_reply_cb);
+void			 pe_alf_invalidate(void);
+void			 pe_alf_cache_free(struct pe_alf_cache *);
+void			 pe_alf_compiled_destroy(void *);
 struct anoubisd_reply	*pe_decide_sfs(struct pe_proc *,
 			     struct pe_file_event *);
 struct anoubisd_reply	*pe_decide_sandbox(struct pe_proc *proc,
 			     struct pe_file_event *);
 int			 pe_sfs_getrules(uid_t, int, const char *,
-			     struct apnarr_array *);
+			     struct apn_rule **, struct apnarr_array *);
 int			 pe_sb_getrules(struct pe_proc *, uid_t, int,
-			     const char *, struct apnarr_array *);
+			     const char *, struct apn_rule **,
+			     struct apnarr_array *);
 
 
 /* IPC handling */
@@ -381,7 +453,27 @@ int			 pe_prefixhash_add(struct pe_prefixhash *,
 			     const char *str, struct apn_rule *, int idx);
 int			 pe_prefixhash_getrules(struct pe_prefixhash *,
 			     const char *, struct apnarr_array *rulesp);
+
+/* Prefix Trie */
+struct pe_prefixtrie;
+struct pe_prefixtrie	*pe_prefixtrie_create(void);
+void			 pe_prefixtrie_destroy(struct pe_prefixtrie *);
+int			 pe_prefixtrie_add(struct pe_prefixtrie *,
+			     const char *str, struct apn_rule *, int idx);
+int			 pe_prefixtrie_finish(struct pe_prefixtrie *);
+int			 pe_prefixtrie_getrules(struct pe_prefixtrie *,
+			     const char *, struct apnarr_array *rulesp);
+
+/* Path prefix lookup (backend independent) */
+#define PE_PREFIX_HASH		0
+#define PE_PREFIX_TRIE		1
+void			 pe_set_prefix_backend(int);
 int			 pe_build_prefixhash(struct apn_rule *);
+int			 pe_prefix_getrules(struct apn_rule *, const char *,
+			     struct apnarr_array *);
+void			 pe_prefix_putrules(struct apn_rule *,
+			     struct apnarr_array);
+void			 pe_userdata_destroy(void *);
 
 /* Playground management */
 void			 pe_playground_add(anoubis_cookie_t pgid,
@@ -422,11 +514,37 @@ void			 pe_playground_notify_forced(struct pe_proc_ident *,
 void			 pe_playground_save_last_pgid(uint64_t pgid);
 uint64_t		 pe_playground_load_last_pgid();
 
+/* Playground file database */
+struct pe_pgfiles;
+struct pe_pgfiles	*pe_pgfiles_create(void);
+void			 pe_pgfiles_destroy(struct pe_pgfiles *);
+int			 pe_pgfiles_count(struct pe_pgfiles *);
+int			 pe_pgfiles_names(struct pe_pgfiles *);
+int			 pe_pgfiles_add(struct pe_pgfiles *, uint64_t dev,
+			     uint64_t ino, const char *path);
+int			 pe_pgfiles_remove(struct pe_pgfiles *, uint64_t dev,
+			     uint64_t ino);
+int			 pe_pgfiles_rename_dir(struct pe_pgfiles *,
+			     uint64_t dev, uint64_t ino, const char *path,
+			     const char *old_path);
+int			 pe_pgfiles_foreach(struct pe_pgfiles *,
+			     int (*)(uint64_t, uint64_t, const char *, void *),
+			     void *);
+int			 pe_pgfiles_load(struct pe_pgfiles *, int fd);
+int			 pe_pgfiles_save(struct pe_pgfiles *, int fd);
+void			 pe_pgfiles_setjournal(struct pe_pgfiles *, int fd);
+int			 pe_pgfiles_needcompact(struct pe_pgfiles *);
+
 /*
  * Entry points exported for the benefit of unit tests.
  * DO NOT USE THESE FROM NORMAL CODE.
  */
 
+struct alf_event;
+
 struct anoubisd_reply	*test_pe_handle_sfs(struct eventdev_hdr *hdr);
+int			 test_pe_alf_evaluate(struct apn_rule *block,
+			     struct alf_event *msg, int compiled, int *log,
+			     u_int32_t *rule_id);
 
 #endif	/* _PE_H_ */
@@ -72,10 +72,30 @@
 #include "anoubisd.h"
 #include "pe.h"
 
-static int		 pe_alf_evaluate(struct pe_proc *, int, uid_t,
-			     struct alf_event *, int *, u_int32_t *);
+struct pe_alf_job;
+struct pe_alf_prio;
+
+static struct apn_rule	*pe_alf_getrule(struct pe_proc *, int, uid_t,
+			     struct alf_event *, struct pe_context **);
+static void		 pe_alf_prepare(struct pe_alf_job *, struct pe_proc *,
+			     struct eventdev_hdr *);
+static void		 pe_alf_run(struct pe_job *);
+static struct anoubisd_reply
+			*pe_alf_finish(struct pe_alf_job *);
+static void		 pe_alf_done(struct pe_job *);
+static int		 pe_alf_cache_lookup(struct pe_context *,
+			     struct apn_rule *, struct alf_event *,
+			     struct pe_alf_prio *);
+static void		 pe_alf_cache_insert(struct pe_context *,
+			     struct apn_rule *, struct alf_event *,
+			     struct pe_alf_prio *);
 static int		 pe_alf_evaluate_rule(struct apn_rule *,
 			     struct alf_event *, int *, u_int32_t *, time_t);
+static inline int	 pe_alf_always_allow(struct alf_event *);
+static struct pe_alf_compiled
+			*pe_alf_compile(struct apn_rule *);
+static int		 pe_alf_evaluate_compiled(struct pe_alf_compiled *,
+			     struct alf_event *, int *, u_int32_t *, time_t);
 static char		*pe_dump_alfmsg(struct alf_event *);
 static int		 pe_addrmatch_out(struct alf_event *, struct
 			     apn_rule *);
@@ -86,6 +106,252 @@ static int		 pe_addrmatch_host(struct apn_host *, void *,
 static int		 pe_addrmatch_port(struct apn_port *, void *,
 			     unsigned short);
 
+/*
+ * ALF rule blocks are compiled into a pe_alf_compiled structure the
+ * first time they are used to evaluate an event. The compiled version
+ * is stored in the userdata field of the rule block and is freed by the
+ * ruleset destructor. Each host list of a filter rule is converted into
+ * sorted tables of non-overlapping address ranges, port lists are converted
+ * into sorted tables of port ranges. Matching uses a binary search in these
+ * tables instead of walking the host and port lists.
+ *
+ * Additionally, each context keeps a small LRU cache of recent decisions
+ * (struct pe_alf_cache). The cache is only used if none of the rules
+ * in the rule block has a scope, i.e. if the decision only depends on the
+ * event itself. It is invalidated by pe_alf_invalidate if the policy
+ * database changes.
+ */
+
+/**
+ * A range of IP addresses. IPv4 and IPv6 addresses are both stored
+ * as 128-bit numbers in host byte order. Index zero contains the most
+ * significant 64 bits.
+ */
+struct pe_alf_range {
+	u_int64_t		 lo[2];
+	u_int64_t		 hi[2];
+};
+
+/**
+ * Compiled address ranges of a host list for one address family.
+ * pos contains the ranges of non-negated host entries sorted by
+ * their start address and merged if they overlap. neg contains the
+ * ranges of negated host entries.
+ */
+struct pe_alf_addrtab {
+	unsigned int		 npos;
+	unsigned int		 nneg;
+	struct pe_alf_range	*pos;
+	struct pe_alf_range	*neg;
+};
+
+/**
+ * Compiled host list of a filter rule. Index zero of tab is used for
+ * AF_INET, index one for AF_INET6. If any is true, the rule has no
+ * host restriction.
+ */
+struct pe_alf_hostmatch {
+	int			 any;
+	struct pe_alf_addrtab	 tab[2];
+};
+
+/**
+ * A range of ports. The values are compared exactly like the
+ * port values in the original apn_port structures.
+ */
+struct pe_alf_portrange {
+	u_int16_t		 lo;
+	u_int16_t		 hi;
+};
+
+/**
+ * Compiled port list of a filter rule. The ranges are sorted and
+ * non-overlapping. If any is true, the rule has no port restriction.
+ */
+struct pe_alf_portmatch {
+	int			 any;
+	unsigned int		 cnt;
+	struct pe_alf_portrange	*ranges;
+};
+
+#define PE_ALF_DIR_OUT		0x01
+#define PE_ALF_DIR_IN		0x02
+
+/**
+ * A single compiled rule from an ALF rule block.
+ */
+struct pe_alf_crule {
+	struct apn_rule		*rule;
+	int			 dirmask;
+	struct pe_alf_hostmatch	 fromhost;
+	struct pe_alf_hostmatch	 tohost;
+	struct pe_alf_portmatch	 fromport;
+	struct pe_alf_portmatch	 toport;
+};
+
+/**
+ * The compiled version of an ALF rule block. The rules are stored in
+ * the order of the rule block.
+ */
+struct pe_alf_compiled {
+	struct pe_userdata	 hdr;
+	int			 hasscope;
+	unsigned int		 nrules;
+	struct pe_alf_crule	*rules;
+};
+
+#define PE_ALF_CACHE_SIZE	8
+
+/**
+ * The part of an ALF event that is relevant for a decision. This is
+ * used as the key of the ALF decision cache. Addresses and ports are
+ * stored exactly as they appear in the event.
+ */
+struct pe_alf_key {
+	int			 family;
+	int			 type;
+	int			 protocol;
+	int			 op;
+	u_int16_t		 lport;
+	u_int16_t		 pport;
+	u_int32_t		 laddr[4];
+	u_int32_t		 paddr[4];
+};
+
+/**
+ * A single cached ALF decision.
+ */
+struct pe_alf_cache_entry {
+	struct pe_alf_key	 key;
+	int			 decision;
+	int			 log;
+	u_int32_t		 rule_id;
+};
+
+/**
+ * The ALF decision cache of a context. Entries are sorted by the time of
+ * their last use, the most recently used entry comes first.
+ */
+struct pe_alf_cache {
+	unsigned long		 generation;
+	struct apn_rule		*block;
+	int			 cnt;
+	struct pe_alf_cache_entry ent[PE_ALF_CACHE_SIZE];
+};
+
+/**
+ * The generation of the policy database. This is incremented each time
+ * that the policy database changes. Cache contents of a different
+ * generation are invalid.
+ */
+static unsigned long	 pe_alf_generation = 1;
+
+/*
+ * The evaluation of an ALF event is split into three steps. This allows
+ * the policy engine to evaluate the rules in a worker thread (see
+ * pe_workers.c) while all modifications of global data structures
+ * happen in the main thread:
+ * - pe_alf_prepare (main thread) looks up the rule blocks for all
+ *   priorities, compiles them and consults the decision caches.
+ * - pe_alf_run (worker thread) evaluates the compiled rule blocks
+ *   of all priorities that still need a decision. It only reads the
+ *   compiled rule blocks and the event.
+ * - pe_alf_finish (main thread) combines the results of all priorities,
+ *   updates the decision caches, logs the decision and creates the reply.
+ */
+
+/**
+ * Evaluation states of a single priority of an ALF event.
+ * PE_ALF_DONE: The decision is known.
+ * PE_ALF_EVAL: The compiled rule block must be evaluated.
+ * PE_ALF_CACHE: The compiled rule block must be evaluated and the
+ *     result can be stored in the decision cache of the context.
+ */
+#define PE_ALF_DONE	0
+#define PE_ALF_EVAL	1
+#define PE_ALF_CACHE	2
+
+/**
+ * The evaluation of an ALF event for a single priority.
+ */
+struct pe_alf_prio {
+	/**
+	 * The evaluation state (one of the PE_ALF_* constants).
+	 */
+	int			 state;
+
+	/**
+	 * The context that the rule block belongs to. This is only set
+	 * (and referenced) in state PE_ALF_CACHE.
+	 */
+	struct pe_context	*ctx;
+
+	/**
+	 * The rule block and its compiled version.
+	 */
+	struct apn_rule		*rule;
+	struct pe_alf_compiled	*comp;
+
+	/**
+	 * The decision (-1 if no rule matched), the log level and the
+	 * rule ID of the matching rule.
+	 */
+	int			 decision;
+	int			 log;
+	u_int32_t		 rule_id;
+};
+
+/**
+ * An ALF event that is evaluated. The structure is allocated on the
+ * stack for synchronous evaluation and dynamically for evaluation in
+ * a worker thread.
+ */
+struct pe_alf_job {
+	/**
+	 * The worker pool job. Must be the first member.
+	 */
+	struct pe_job		 job;
+
+	/**
+	 * The process that triggered the event (may be NULL).
+	 */
+	struct pe_proc		*proc;
+
+	/**
+	 * The kernel event.
+	 */
+	struct eventdev_hdr	*hdr;
+
+	/**
+	 * The message that contains the kernel event and the callback
+	 * that receives the reply. Only used for asynchronous evaluation.
+	 */
+	struct anoubisd_msg	*msg;
+	pe_reply_cb		 cb;
+
+	/**
+	 * The policy generation at the time the job was prepared.
+	 */
+	unsigned long		 generation;
+
+	/**
+	 * A reference to the policy database that contains the rule
+	 * blocks of the job. This keeps the rules alive if the
+	 * database is replaced while the job is in flight.
+	 */
+	struct pe_policy_db	*pdb;
+
+	/**
+	 * The time used for scope checks.
+	 */
+	time_t			 now;
+
+	/**
+	 * The evaluation state of each priority.
+	 */
+	struct pe_alf_prio	 prio[PE_PRIO_MAX];
+};
+
 /**
  * Evaluate an ALF event and decide if the event should be allow
  * according to the relevant policies. This is the main entry point
@@ -100,13 +366,7 @@ static int		 pe_addrmatch_port(struct apn_port *, void *,
 struct anoubisd_reply *
 pe_decide_alf(struct pe_proc *proc, struct eventdev_hdr *hdr)
 {
-	static char		*verdict[3] = { "allowed", "denied", "asked" };
-	struct alf_event	*msg;
-	struct anoubisd_reply	*reply;
-	int			 i, ret, decision, log, thislog, prio;
-	u_int32_t		 rule_id = 0;
-	char			*dump = NULL;
-	char			*context = NULL;
+	struct pe_alf_job	job;
 
 	if (hdr == NULL) {
 		log_warnx("pe_decide_alf: empty header");
@@ -117,37 +377,270 @@ pe_decide_alf(struct pe_proc *proc, struct eventdev_hdr *hdr)
 		log_warnx("pe_decide_alf: short message");
 		return (NULL);
 	}
-	msg = (struct alf_event *)(hdr + 1);
+	pe_alf_prepare(&job, proc, hdr);
+	pe_alf_run(&job.job);
+	return pe_alf_finish(&job);
+}
+
+/**
+ * Evaluate an ALF event asynchronously. Rule blocks are evaluated by
+ * the worker threads if required. The reply is passed to the callback
+ * function once the evaluation is complete. This might happen before
+ * this function returns.
+ *
+ * @param proc The process that triggered the event (may be NULL). The
+ *     caller's reference to the process is passed to this function.
+ * @param msg The message with the kernel event. It must be of type
+ *     ANOUBISD_MSG_EVENTDEV, the source of the kernel event must
+ *     be ANOUBIS_SOURCE_ALF and the caller must make sure that the
+ *     event is long enough. The message is passed to the callback.
+ * @param cb The callback function.
+ */
+void
+pe_alf_submit(struct pe_proc *proc, struct anoubisd_msg *msg, pe_reply_cb cb)
+{
+	struct eventdev_hdr	*hdr = (struct eventdev_hdr *)msg->msg;
+	struct pe_alf_job	*job;
+	int			 i;
+
+	if ((job = malloc(sizeof(struct pe_alf_job))) == NULL) {
+		log_warn("pe_alf_submit: cannot allocate memory");
+		master_terminate();
+	}
+	pe_alf_prepare(job, proc, hdr);
+	job->msg = msg;
+	job->cb = cb;
+	job->job.run = &pe_alf_run;
+	job->job.done = &pe_alf_done;
+	for (i = 0; i < PE_PRIO_MAX; i++) {
+		if (job->prio[i].state != PE_ALF_DONE)
+			break;
+	}
+	/* Do not bother the worker threads if there is nothing to do. */
+	if (i == PE_PRIO_MAX)
+		pe_alf_done(&job->job);
+	else
+		pe_workers_submit(&job->job);
+}
+
+/**
+ * The done callback of an asynchronous ALF job. It finishes the
+ * evaluation, passes the reply to the callback and frees the job.
+ *
+ * @param pjob The job.
+ */
+static void
+pe_alf_done(struct pe_job *pjob)
+{
+	struct pe_alf_job	*job = (struct pe_alf_job *)pjob;
+	struct anoubisd_reply	*reply;
+
+	reply = pe_alf_finish(job);
+	job->cb(job->msg, reply);
+	pe_proc_put(job->proc);
+	free(job);
+}
+
+/**
+ * Return the ALF rule block that applies to an ALF event at a given
+ * priority. If the user ID of the process is equal to the user ID in
+ * the event, the rules from the processes context are used, otherwise
+ * the rules for the application in the ruleset for the uid of the event
+ * are used.
+ *
+ * @param proc The process that triggered the event.
+ * @param prio The rule set priority.
+ * @param uid The user ID of the event.
+ * @param msg The ALF event.
+ * @param ctxp The context that the rule block was taken from is
+ *     returned here. NULL if the rule block does not belong to a context.
+ * @return The rule block or NULL if there is no rule block.
+ */
+static struct apn_rule *
+pe_alf_getrule(struct pe_proc *proc, int prio, uid_t uid,
+    struct alf_event *msg, struct pe_context **ctxp)
+{
+	struct apn_rule		*rule;
+	int			 ispg = (extract_pgid(&msg->common) != 0);
+
+	*ctxp = NULL;
+	if (proc && pe_proc_get_uid(proc) == uid) {
+		*ctxp = pe_proc_get_context(proc, prio);
+		return pe_context_get_alfrule(*ctxp);
+	} else {
+		struct apn_ruleset *rs = pe_user_get_ruleset(uid, prio, NULL);
+		if (rs == NULL)
+			return NULL;
+		TAILQ_FOREACH(rule, &rs->alf_queue, entry) {
+			if (!ispg && (rule->flags & APN_RULE_PGONLY))
+				continue;
+			if (rule->app == NULL)
+				break;
+		}
+		return rule;
+	}
+}
+
+/**
+ * Prepare the evaluation of an ALF event. This looks up the rule blocks
+ * for all priorities and compiles them. Decisions that can be made
+ * without evaluating a compiled rule block are made immediately. This
+ * includes decisions that are found in the decision cache of a context.
+ * The remaining priorities must be evaluated by pe_alf_run.
+ *
+ * @param job The job structure. All fields except those that are
+ *     used for asynchronous evaluation are initialized.
+ * @param proc The process that triggered the event (may be NULL).
+ * @param hdr The event. The caller must make sure that it is of type
+ *     ANOUBIS_SOURCE_ALF and long enough.
+ */
+static void
+pe_alf_prepare(struct pe_alf_job *job, struct pe_proc *proc,
+    struct eventdev_hdr *hdr)
+{
+	struct alf_event	*msg = (struct alf_event *)(hdr + 1);
+	struct pe_alf_prio	*p;
+	struct pe_context	*ctx;
+	struct apn_rule		*rule;
+	int			 i;
+
+	job->proc = proc;
+	job->hdr = hdr;
+	job->msg = NULL;
+	job->cb = NULL;
+	job->generation = pe_alf_generation;
+	job->pdb = pe_user_db_get();
+	if (time(&job->now) == (time_t)-1) {
+		log_warn("Cannot get current time");
+		master_terminate();
+	}
+	for (i = 0; i < PE_PRIO_MAX; i++) {
+		p = &job->prio[i];
+		p->state = PE_ALF_DONE;
+		p->ctx = NULL;
+		p->comp = NULL;
+		p->decision = -1;
+		p->log = APN_LOG_NONE;
+		p->rule_id = 0;
+		p->rule = rule = pe_alf_getrule(proc, i, hdr->msg_uid,
+		    msg, &ctx);
+		DEBUG(DBG_PE_DECALF, "pe_alf_prepare: prio %d context %p "
+		    "rule %p", i, ctx, rule);
+		if (rule == NULL)
+			continue;
+		/* Trivial decisions do not touch log and rule_id. */
+		if (pe_alf_always_allow(msg)) {
+			p->decision = APN_ACTION_ALLOW;
+			continue;
+		}
+		p->comp = pe_alf_compile(rule);
+		if (p->comp == NULL) {
+			p->decision = pe_alf_evaluate_rule(rule, msg, &p->log,
+			    &p->rule_id, job->now);
+			continue;
+		}
+		if (ctx == NULL || p->comp->hasscope) {
+			p->state = PE_ALF_EVAL;
+			continue;
+		}
+		if (pe_alf_cache_lookup(ctx, rule, msg, p) == 0)
+			continue;
+		pe_context_reference(ctx);
+		p->ctx = ctx;
+		p->state = PE_ALF_CACHE;
+	}
+}
+
+/**
+ * Evaluate the compiled rule blocks of all priorities that are not
+ * yet decided. This function can be called from a worker thread.
+ *
+ * @param pjob The job.
+ */
+static void
+pe_alf_run(struct pe_job *pjob)
+{
+	struct pe_alf_job	*job = (struct pe_alf_job *)pjob;
+	struct alf_event	*msg = (struct alf_event *)(job->hdr + 1);
+	struct pe_alf_prio	*p;
+	int			 i;
+
+	for (i = 0; i < PE_PRIO_MAX; i++) {
+		p = &job->prio[i];
+		if (p->state == PE_ALF_DONE)
+			continue;
+		p->decision = pe_alf_evaluate_compiled(p->comp, msg, &p->log,
+		    &p->rule_id, job->now);
+	}
+}
+
+/**
+ * Finish the evaluation of an ALF event. The results of all priorities
+ * are combined, new decisions are stored in the decision caches and the
+ * decision is logged.
+ *
+ * @param job The job. The context and database references of the job
+ *     are dropped.
+ * @return The reply for the event. The structure is alloated dynamically
+ *     and must be freed by the caller.
+ */
+static struct anoubisd_reply *
+pe_alf_finish(struct pe_alf_job *job)
+{
+	static char		*verdict[3] = { "allowed", "denied", "asked" };
+	struct pe_proc		*proc = job->proc;
+	struct eventdev_hdr	*hdr = job->hdr;
+	struct alf_event	*msg = (struct alf_event *)(hdr + 1);
+	struct anoubisd_reply	*reply;
+	struct pe_alf_prio	*p;
+	int			 i, decision, log, prio, last;
+	u_int32_t		 rule_id = 0;
+	char			*dump = NULL;
+	char			*context = NULL;
 
 	log = APN_LOG_NONE;
 	prio = -1;
 	rule_id = 0;
 	decision = -1;
+	last = PE_PRIO_MAX - 1;
 
 	for (i = 0; i < PE_PRIO_MAX; i++) {
-		DEBUG(DBG_PE_DECALF, "pe_decide_alf: prio %d context %p", i,
-		    pe_proc_get_context(proc, i));
-
-		thislog = APN_LOG_NONE;
-		ret = pe_alf_evaluate(proc, i, hdr->msg_uid, msg,
-		    &thislog, &rule_id);
-		if (ret != -1) {
+		p = &job->prio[i];
+		if (p->decision != -1) {
 			/*
 			 * User rules must not decrease the log level
 			 * of admin rules. This still allows a user to
 			 * change the reported rule ID, though!.
 			 */
-			if (thislog > log)
-				log = thislog;
-			decision = ret;
+			if (p->log > log)
+				log = p->log;
+			rule_id = p->rule_id;
+			decision = p->decision;
 			prio = i;
 		}
-		if (ret == APN_ACTION_DENY) {
+		if (p->decision == APN_ACTION_DENY) {
+			last = i;
 			break;
 		}
 	}
 	DEBUG(DBG_PE_DECALF, "pe_decide_alf: decision %d", decision);
 
+	/*
+	 * Only cache results of priorities that actually contributed to
+	 * the decision and only if the policy did not change in between.
+	 */
+	for (i = 0; i < PE_PRIO_MAX; i++) {
+		p = &job->prio[i];
+		if (p->state != PE_ALF_CACHE)
+			continue;
+		if (i <= last && job->generation == pe_alf_generation)
+			pe_alf_cache_insert(p->ctx, p->rule, msg, p);
+		pe_context_put(p->ctx);
+		p->ctx = NULL;
+	}
+	pe_user_db_put(job->pdb);
+	job->pdb = NULL;
+
 	/* If no default rule matched, decide on deny */
 	if (decision == -1) {
 		decision = APN_ACTION_DENY;
@@ -214,63 +707,144 @@ pe_decide_alf(struct pe_proc *proc, struct eventdev_hdr *hdr)
 }
 
 /**
- * Evaluate an ALF event according to the policy given by prio and uid.
- * If the user ID of the process is equal to the user ID in the event,
- * the rules from the processes context are used, otherwise the rules
- * for the application in the ruleset for the uid of the event is used.
+ * Invalidate the ALF decision caches of all contexts. This must be
+ * called whenever rules in the policy database change.
+ */
+void
+pe_alf_invalidate(void)
+{
+	pe_alf_generation++;
+}
+
+/**
+ * Free an ALF decision cache.
  *
- * ALF rules always apply filter rules first. Capability rules are evaluated
- * only if no filter rule matches. Finally, default rules are evaluated.
- * Within one class of rules the evaluation order depends on the order
- * of the rules in the rule block.
+ * @param cache The cache (may be NULL).
+ */
+void
+pe_alf_cache_free(struct pe_alf_cache *cache)
+{
+	if (cache)
+		free(cache);
+}
+
+/**
+ * Fill the cache key for an ALF event. Unused parts of the key are
+ * zero, i.e. two keys can be compared with memcmp.
  *
- * @param proc The process that triggered the event.
- * @param prio The rule set priority.
- * @param uid The user ID of the event.
- * @param msg The ALF event itself.
- * @param log The log level for the result is returned here. The
- *     caller should initialize this to APN_LOG_NONE.
- * @param rule_id The rule ID of the rule that matched the event is
- *     returned here. The caller should initialize the rule ID to zero.
- * @return The decision of the event. Possible values are the
- *     APN_ACTION_* defines from apn.h. A negative value indicates that
- *     no decision was made.
+ * @param key The key.
+ * @param msg The ALF event.
  */
-static int
-pe_alf_evaluate(struct pe_proc *proc, int prio, uid_t uid,
-    struct alf_event *msg, int *log, u_int32_t *rule_id)
+static void
+pe_alf_key_fill(struct pe_alf_key *key, struct alf_event *msg)
 {
-	struct apn_rule	*rule;
-	int		 decision;
-	time_t		 t;
-	int		 ispg = (extract_pgid(&msg->common) != 0);
+	memset(key, 0, sizeof(*key));
+	key->family = msg->family;
+	key->type = msg->type;
+	key->protocol = msg->protocol;
+	key->op = msg->op;
+	switch (msg->family) {
+	case AF_INET:
+		key->lport = msg->local.in_addr.sin_port;
+		key->pport = msg->peer.in_addr.sin_port;
+		key->laddr[0] = msg->local.in_addr.sin_addr.s_addr;
+		key->paddr[0] = msg->peer.in_addr.sin_addr.s_addr;
+		break;
+	case AF_INET6:
+		key->lport = msg->local.in6_addr.sin6_port;
+		key->pport = msg->peer.in6_addr.sin6_port;
+		memcpy(key->laddr, &msg->local.in6_addr.sin6_addr,
+		    sizeof(key->laddr));
+		memcpy(key->paddr, &msg->peer.in6_addr.sin6_addr,
+		    sizeof(key->paddr));
+		break;
+	}
+}
 
-	if (proc && pe_proc_get_uid(proc) == uid) {
-		rule = pe_context_get_alfrule(pe_proc_get_context(proc, prio));
-	} else {
-		struct apn_ruleset *rs = pe_user_get_ruleset(uid, prio, NULL);
-		if (rs) {
-			TAILQ_FOREACH(rule, &rs->alf_queue, entry) {
-				if (!ispg && (rule->flags & APN_RULE_PGONLY))
-					continue;
-				if (rule->app == NULL)
-					break;
-			}
-		} else {
-			rule = NULL;
-		}
+/**
+ * Look up an ALF event in the decision cache of a context. The cache
+ * is only valid for the rule block that it was created for and only
+ * if the policy generation did not change. A cache hit moves the
+ * entry to the front of the cache.
+ *
+ * @param ctx The context.
+ * @param rule The ALF rule block of the context. The rule block must
+ *     not depend on rule scopes.
+ * @param msg The ALF event.
+ * @param p The decision, log level and rule ID are stored here in case
+ *     of a cache hit.
+ * @return Zero in case of a cache hit, a negative error code otherwise.
+ */
+static int
+pe_alf_cache_lookup(struct pe_context *ctx, struct apn_rule *rule,
+    struct alf_event *msg, struct pe_alf_prio *p)
+{
+	struct pe_alf_cache		*cache;
+	struct pe_alf_cache_entry	 tmp;
+	int				 i;
+
+	cache = pe_context_get_alfcache(ctx);
+	if (cache == NULL)
+		return -ENOENT;
+	if (cache->generation != pe_alf_generation || cache->block != rule) {
+		cache->cnt = 0;
+		return -ENOENT;
 	}
-	if (rule == NULL || msg == NULL)
-		return -1;
-	if (time(&t) == (time_t)-1) {
-		log_warn("Cannot get current time");
-		master_terminate();
+	pe_alf_key_fill(&tmp.key, msg);
+	for (i = 0; i < cache->cnt; ++i) {
+		if (memcmp(&cache->ent[i].key, &tmp.key, sizeof(tmp.key)))
+			continue;
+		tmp = cache->ent[i];
+		memmove(&cache->ent[1], &cache->ent[0],
+		    i * sizeof(struct pe_alf_cache_entry));
+		cache->ent[0] = tmp;
+		p->decision = tmp.decision;
+		if (tmp.decision != -1) {
+			p->log = tmp.log;
+			p->rule_id = tmp.rule_id;
+		}
+		DEBUG(DBG_PE_DECALF, "pe_alf_cache_lookup: cache hit %d",
+		    tmp.decision);
+		return 0;
 	}
-	decision = pe_alf_evaluate_rule(rule, msg, log, rule_id, t);
-	DEBUG(DBG_PE_DECALF, "pe_alf_evaluate: decision %d rule %p", decision,
-	    rule);
+	return -ENOENT;
+}
 
-	return (decision);
+/**
+ * Store the decision for an ALF event in the decision cache of a
+ * context. The least recently used entry is evicted if the cache is full.
+ *
+ * @param ctx The context.
+ * @param rule The ALF rule block of the context.
+ * @param msg The ALF event.
+ * @param p The decision, the log level and the rule ID.
+ */
+static void
+pe_alf_cache_insert(struct pe_context *ctx, struct apn_rule *rule,
+    struct alf_event *msg, struct pe_alf_prio *p)
+{
+	struct pe_alf_cache		*cache;
+
+	cache = pe_context_get_alfcache(ctx);
+	if (cache == NULL) {
+		cache = malloc(sizeof(struct pe_alf_cache));
+		if (cache == NULL)
+			return;
+		cache->cnt = 0;
+		pe_context_set_alfcache(ctx, cache);
+	}
+	if (cache->generation != pe_alf_generation || cache->block != rule)
+		cache->cnt = 0;
+	cache->generation = pe_alf_generation;
+	cache->block = rule;
+	if (cache->cnt < PE_ALF_CACHE_SIZE)
+		cache->cnt++;
+	memmove(&cache->ent[1], &cache->ent[0],
+	    (cache->cnt - 1) * sizeof(struct pe_alf_cache_entry));
+	pe_alf_key_fill(&cache->ent[0].key, msg);
+	cache->ent[0].decision = p->decision;
+	cache->ent[0].log = p->log;
+	cache->ent[0].rule_id = p->rule_id;
 }
 
 /**
@@ -315,6 +889,26 @@ pe_alf_capmatch(struct apn_rule *rule, int type)
 	return 0;
 }
 
+/**
+ * Return true if an ALF event is always allowed without looking at
+ * any rules. For TCP/SCTP we validate ACCEPT/CONNECT and allow
+ * SEND/RECVMSG, for UDP, we always allow CONNECT events as these do
+ * not really generate network traffic.
+ *
+ * @param msg The ALF event.
+ * @return True if the event must be allowed.
+ */
+static inline int
+pe_alf_always_allow(struct alf_event *msg)
+{
+	if ((msg->op == ALF_SENDMSG || msg->op == ALF_RECVMSG) &&
+	    (msg->protocol == IPPROTO_TCP || msg->protocol == IPPROTO_SCTP))
+		return 1;
+	if (msg->protocol == IPPROTO_UDP && msg->op == ALF_CONNECT)
+		return 1;
+	return 0;
+}
+
 /**
  * Evaluate all ALF rules in a rule block and return the decision for
  * the event. This function tries all filter, capability  and default
@@ -346,18 +940,9 @@ pe_alf_evaluate_rule(struct apn_rule *rule, struct alf_event *msg,
 	    msg->protocol == IPPROTO_SCTP)
 		isfilter = 1;
 
-	/*
-	 * For TCP/SCTP we validate ACCEPT/CONNECT and allow SEND/RECVMSG,
-	 * for UDP, we always allow CONNECT events as these do not really
-	 * generate network traffic.
-	 */
-	if ((msg->op == ALF_SENDMSG || msg->op == ALF_RECVMSG) &&
-	    (msg->protocol == IPPROTO_TCP || msg->protocol == IPPROTO_SCTP))
-		return APN_ACTION_ALLOW;
-	if (msg->protocol == IPPROTO_UDP && msg->op == ALF_CONNECT)
+	if (pe_alf_always_allow(msg))
 		return APN_ACTION_ALLOW;
 
-
 	TAILQ_FOREACH(hp, &rule->rule.chain, entry) {
 
 		/* Skip rules that are not in scope. */
@@ -441,6 +1026,540 @@ pe_alf_evaluate_rule(struct apn_rule *rule, struct alf_event *msg,
 	return default_decision;
 }
 
+/**
+ * Compare two 128-bit addresses.
+ *
+ * @param a The first address.
+ * @param b The second address.
+ * @return A value less than, equal to or greater than zero if a is
+ *     less than, equal to or greater than b.
+ */
+static inline int
+pe_alf_addrcmp(const u_int64_t *a, const u_int64_t *b)
+{
+	if (a[0] != b[0])
+		return (a[0] < b[0]) ? -1 : 1;
+	if (a[1] != b[1])
+		return (a[1] < b[1]) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Convert the address in a socket address to a 128-bit number in
+ * host byte order.
+ *
+ * @param addr The socket address.
+ * @param af The address family (AF_INET or AF_INET6).
+ * @param out The result is stored here.
+ */
+static void
+pe_alf_sockaddr_to_u128(void *addr, unsigned short af, u_int64_t *out)
+{
+	const u_int8_t	*p;
+	int		 i;
+
+	out[0] = out[1] = 0;
+	if (af == AF_INET) {
+		out[1] = ntohl(((struct sockaddr_in *)addr)->sin_addr.s_addr);
+		return;
+	}
+	p = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+	for (i = 0; i < 16; ++i)
+		out[i/8] = (out[i/8] << 8) | p[i];
+}
+
+/**
+ * Convert an apn_addr into a range of 128-bit addresses.
+ *
+ * @param addr The address including its netmask.
+ * @param range The result is stored here.
+ */
+static void
+pe_alf_apnaddr_to_range(struct apn_addr *addr, struct pe_alf_range *range)
+{
+	u_int64_t	 mask[2];
+	int		 len = addr->len, i;
+
+	range->lo[0] = range->lo[1] = 0;
+	if (addr->af == AF_INET) {
+		/* The upper 96 bits of an IPv4 address are always zero. */
+		if (len > 32)
+			len = 32;
+		len += 96;
+		range->lo[1] = ntohl(addr->apa.v4.s_addr);
+	} else {
+		for (i = 0; i < 16; ++i)
+			range->lo[i/8] = (range->lo[i/8] << 8)
+			    | addr->apa.addr8[i];
+	}
+	if (len > 128)
+		len = 128;
+	if (len < 0)
+		len = 0;
+	for (i = 0; i < 2; ++i, len -= 64) {
+		if (len >= 64)
+			mask[i] = ~(u_int64_t)0;
+		else if (len <= 0)
+			mask[i] = 0;
+		else
+			mask[i] = ~(u_int64_t)0 << (64 - len);
+	}
+	for (i = 0; i < 2; ++i) {
+		range->lo[i] &= mask[i];
+		range->hi[i] = range->lo[i] | ~mask[i];
+	}
+}
+
+/**
+ * Compare two address ranges by their start address. This is
+ * a callback function for qsort.
+ */
+static int
+pe_alf_rangecmp(const void *a, const void *b)
+{
+	return pe_alf_addrcmp(((const struct pe_alf_range *)a)->lo,
+	    ((const struct pe_alf_range *)b)->lo);
+}
+
+/**
+ * Compare two port ranges by their first port. This is a callback
+ * function for qsort.
+ */
+static int
+pe_alf_portcmp(const void *a, const void *b)
+{
+	const struct pe_alf_portrange	*p1 = a, *p2 = b;
+
+	if (p1->lo != p2->lo)
+		return (p1->lo < p2->lo) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Compile a host list into address range tables.
+ *
+ * A host list matches an address if at least one of the entries with
+ * the same address family matches, where negated entries match if the
+ * address is not in their range. This is exactly what pe_addrmatch_host
+ * does, independent of the order of the entries.
+ *
+ * @param host The host list.
+ * @param hm The compiled host list is stored here.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+pe_alf_compile_host(struct apn_host *host, struct pe_alf_hostmatch *hm)
+{
+	struct apn_host		*hp;
+	struct pe_alf_addrtab	*tab;
+	struct pe_alf_range	*r;
+	unsigned int		 cnt[2] = { 0, 0 }, i, j;
+	int			 idx;
+
+	memset(hm, 0, sizeof(*hm));
+	if (host == NULL) {
+		hm->any = 1;
+		return 0;
+	}
+	for (hp = host; hp; hp = hp->next) {
+		if (hp->addr.af == AF_INET)
+			cnt[0]++;
+		else if (hp->addr.af == AF_INET6)
+			cnt[1]++;
+	}
+	for (idx = 0; idx < 2; ++idx) {
+		if (cnt[idx] == 0)
+			continue;
+		tab = &hm->tab[idx];
+		tab->pos = calloc(cnt[idx], sizeof(struct pe_alf_range));
+		tab->neg = calloc(cnt[idx], sizeof(struct pe_alf_range));
+		if (tab->pos == NULL || tab->neg == NULL)
+			return -ENOMEM;
+	}
+	for (hp = host; hp; hp = hp->next) {
+		if (hp->addr.af == AF_INET)
+			tab = &hm->tab[0];
+		else if (hp->addr.af == AF_INET6)
+			tab = &hm->tab[1];
+		else
+			continue;
+		if (hp->negate)
+			r = &tab->neg[tab->nneg++];
+		else
+			r = &tab->pos[tab->npos++];
+		pe_alf_apnaddr_to_range(&hp->addr, r);
+	}
+	/* Sort positive ranges and merge overlapping ranges. */
+	for (idx = 0; idx < 2; ++idx) {
+		tab = &hm->tab[idx];
+		if (tab->npos < 2)
+			continue;
+		qsort(tab->pos, tab->npos, sizeof(struct pe_alf_range),
+		    pe_alf_rangecmp);
+		for (i = 1, j = 0; i < tab->npos; ++i) {
+			if (pe_alf_addrcmp(tab->pos[i].lo, tab->pos[j].hi) <= 0) {
+				if (pe_alf_addrcmp(tab->pos[i].hi,
+				    tab->pos[j].hi) > 0) {
+					tab->pos[j].hi[0] = tab->pos[i].hi[0];
+					tab->pos[j].hi[1] = tab->pos[i].hi[1];
+				}
+				continue;
+			}
+			tab->pos[++j] = tab->pos[i];
+		}
+		tab->npos = j + 1;
+	}
+	return 0;
+}
+
+/**
+ * Compile a port list into a sorted table of non-overlapping port ranges.
+ *
+ * @param port The port list.
+ * @param pm The compiled port list is stored here.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+pe_alf_compile_port(struct apn_port *port, struct pe_alf_portmatch *pm)
+{
+	struct apn_port		*pp;
+	unsigned int		 cnt = 0, i, j;
+
+	memset(pm, 0, sizeof(*pm));
+	if (port == NULL) {
+		pm->any = 1;
+		return 0;
+	}
+	for (pp = port; pp; pp = pp->next)
+		cnt++;
+	pm->ranges = calloc(cnt, sizeof(struct pe_alf_portrange));
+	if (pm->ranges == NULL)
+		return -ENOMEM;
+	for (pp = port; pp; pp = pp->next) {
+		u_int16_t	hi = pp->port2 ? pp->port2 : pp->port;
+
+		/* Empty range, this can never match. */
+		if (hi < pp->port)
+			continue;
+		pm->ranges[pm->cnt].lo = pp->port;
+		pm->ranges[pm->cnt].hi = hi;
+		pm->cnt++;
+	}
+	if (pm->cnt < 2)
+		return 0;
+	qsort(pm->ranges, pm->cnt, sizeof(struct pe_alf_portrange),
+	    pe_alf_portcmp);
+	for (i = 1, j = 0; i < pm->cnt; ++i) {
+		if (pm->ranges[i].lo <= pm->ranges[j].hi) {
+			if (pm->ranges[i].hi > pm->ranges[j].hi)
+				pm->ranges[j].hi = pm->ranges[i].hi;
+			continue;
+		}
+		pm->ranges[++j] = pm->ranges[i];
+	}
+	pm->cnt = j + 1;
+	return 0;
+}
+
+/**
+ * Free the memory of a compiled host list. The structure itself
+ * is not freed.
+ */
+static void
+pe_alf_free_host(struct pe_alf_hostmatch *hm)
+{
+	int	idx;
+
+	for (idx = 0; idx < 2; ++idx) {
+		if (hm->tab[idx].pos)
+			free(hm->tab[idx].pos);
+		if (hm->tab[idx].neg)
+			free(hm->tab[idx].neg);
+	}
+}
+
+/**
+ * Free a compiled ALF rule block. This is called via pe_userdata_destroy
+ * if the ruleset is freed.
+ *
+ * @param data The compiled rule block (struct pe_alf_compiled).
+ */
+void
+pe_alf_compiled_destroy(void *data)
+{
+	struct pe_alf_compiled	*comp = data;
+	unsigned int		 i;
+
+	if (comp == NULL)
+		return;
+	for (i = 0; comp->rules && i < comp->nrules; ++i) {
+		pe_alf_free_host(&comp->rules[i].fromhost);
+		pe_alf_free_host(&comp->rules[i].tohost);
+		if (comp->rules[i].fromport.ranges)
+			free(comp->rules[i].fromport.ranges);
+		if (comp->rules[i].toport.ranges)
+			free(comp->rules[i].toport.ranges);
+	}
+	if (comp->rules)
+		free(comp->rules);
+	free(comp);
+}
+
+/**
+ * Return the compiled version of an ALF rule block. The rule block
+ * is compiled on first use and the result is stored in the userdata
+ * field of the rule block.
+ *
+ * @param block The ALF rule block.
+ * @return The compiled rule block or NULL if the rule block could not
+ *     be compiled. The caller should fall back to pe_alf_evaluate_rule
+ *     in this case.
+ */
+static struct pe_alf_compiled *
+pe_alf_compile(struct apn_rule *block)
+{
+	struct pe_alf_compiled	*comp;
+	struct pe_alf_crule	*cr;
+	struct apn_rule		*hp;
+	unsigned int		 cnt = 0;
+
+	if (block->userdata) {
+		if (((struct pe_userdata *)block->userdata)->type
+		    != PE_USERDATA_ALF)
+			return NULL;
+		return block->userdata;
+	}
+	comp = calloc(1, sizeof(struct pe_alf_compiled));
+	if (comp == NULL)
+		return NULL;
+	comp->hdr.type = PE_USERDATA_ALF;
+	TAILQ_FOREACH(hp, &block->rule.chain, entry)
+		cnt++;
+	if (cnt) {
+		comp->rules = calloc(cnt, sizeof(struct pe_alf_crule));
+		if (comp->rules == NULL)
+			goto err;
+	}
+	TAILQ_FOREACH(hp, &block->rule.chain, entry) {
+		cr = &comp->rules[comp->nrules++];
+		cr->rule = hp;
+		if (hp->scope)
+			comp->hasscope = 1;
+		if (hp->apn_type != APN_ALF_FILTER)
+			continue;
+		switch (hp->rule.afilt.filtspec.netaccess) {
+		case APN_CONNECT:
+		case APN_SEND:
+			cr->dirmask = PE_ALF_DIR_OUT;
+			break;
+		case APN_ACCEPT:
+		case APN_RECEIVE:
+			cr->dirmask = PE_ALF_DIR_IN;
+			break;
+		case APN_BOTH:
+			cr->dirmask = PE_ALF_DIR_OUT | PE_ALF_DIR_IN;
+			break;
+		}
+		if (pe_alf_compile_host(hp->rule.afilt.filtspec.fromhost,
+		    &cr->fromhost) < 0
+		    || pe_alf_compile_host(hp->rule.afilt.filtspec.tohost,
+		    &cr->tohost) < 0
+		    || pe_alf_compile_port(hp->rule.afilt.filtspec.fromport,
+		    &cr->fromport) < 0
+		    || pe_alf_compile_port(hp->rule.afilt.filtspec.toport,
+		    &cr->toport) < 0)
+			goto err;
+	}
+	block->userdata = comp;
+	DEBUG(DBG_PE_DECALF, "pe_alf_compile: block %p rules %u scope %d",
+	    block, comp->nrules, comp->hasscope);
+	return comp;
+err:
+	log_warnx("pe_alf_compile: Out of memory");
+	pe_alf_compiled_destroy(comp);
+	return NULL;
+}
+
+/**
+ * Match a socket address against a compiled host list.
+ *
+ * @param hm The compiled host list.
+ * @param addr The socket address.
+ * @param af The address family of the socket address.
+ * @return True if the address matches.
+ */
+static int
+pe_alf_match_host(struct pe_alf_hostmatch *hm, void *addr, unsigned short af)
+{
+	struct pe_alf_addrtab	*tab;
+	u_int64_t		 val[2];
+	unsigned int		 lo, hi, mid, i;
+
+	if (hm->any)
+		return 1;
+	if (af == AF_INET)
+		tab = &hm->tab[0];
+	else if (af == AF_INET6)
+		tab = &hm->tab[1];
+	else
+		return 0;
+	if (tab->npos == 0 && tab->nneg == 0)
+		return 0;
+	pe_alf_sockaddr_to_u128(addr, af, val);
+
+	/* Find the last range that starts at or before val. */
+	lo = 0;
+	hi = tab->npos;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pe_alf_addrcmp(tab->pos[mid].lo, val) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && pe_alf_addrcmp(val, tab->pos[lo-1].hi) <= 0)
+		return 1;
+	for (i = 0; i < tab->nneg; ++i) {
+		if (pe_alf_addrcmp(val, tab->neg[i].lo) < 0
+		    || pe_alf_addrcmp(val, tab->neg[i].hi) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Match the port of a socket address against a compiled port list.
+ *
+ * @param pm The compiled port list.
+ * @param addr The socket address.
+ * @param af The address family of the socket address.
+ * @return True if the port matches.
+ */
+static int
+pe_alf_match_port(struct pe_alf_portmatch *pm, void *addr, unsigned short af)
+{
+	u_int16_t	 port;
+	unsigned int	 lo, hi, mid;
+
+	if (pm->any)
+		return 1;
+	if (af == AF_INET)
+		port = ((struct sockaddr_in *)addr)->sin_port;
+	else if (af == AF_INET6)
+		port = ((struct sockaddr_in6 *)addr)->sin6_port;
+	else
+		return 0;
+	lo = 0;
+	hi = pm->cnt;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pm->ranges[mid].lo <= port)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo > 0 && port <= pm->ranges[lo-1].hi);
+}
+
+/**
+ * Evaluate a compiled ALF rule block. This function implements the same
+ * semantics as pe_alf_evaluate_rule.
+ *
+ * @param comp The compiled rule block.
+ * @param msg The ALF event.
+ * @param log The log level for the result is returned here.
+ * @param rule_id The rule ID of the matching rule is returned here.
+ * @param now The current time for scope checks.
+ * @return The decision or -1 if no rule matched.
+ */
+static int
+pe_alf_evaluate_compiled(struct pe_alf_compiled *comp, struct alf_event *msg,
+    int *log, u_int32_t *rule_id, time_t now)
+{
+	struct pe_alf_crule	*cr;
+	struct apn_rule		*hp;
+	void			*src, *dst;
+	unsigned int		 i;
+	int			 default_decision = -1;
+	int			 isfilter = 0, dir;
+
+	if (msg->protocol == IPPROTO_UDP || msg->protocol == IPPROTO_TCP ||
+	    msg->protocol == IPPROTO_SCTP)
+		isfilter = 1;
+
+	if (pe_alf_always_allow(msg))
+		return APN_ACTION_ALLOW;
+
+	switch (msg->op) {
+	case ALF_SENDMSG:
+	case ALF_CONNECT:
+		dir = PE_ALF_DIR_OUT;
+		src = &msg->local;
+		dst = &msg->peer;
+		break;
+	case ALF_RECVMSG:
+	case ALF_ACCEPT:
+		dir = PE_ALF_DIR_IN;
+		src = &msg->peer;
+		dst = &msg->local;
+		break;
+	default:
+		dir = 0;
+		src = dst = NULL;
+	}
+
+	for (i = 0; i < comp->nrules; ++i) {
+		cr = &comp->rules[i];
+		hp = cr->rule;
+
+		if (hp->scope && !pe_in_scope(hp->scope,
+		    msg->common.task_cookie, now))
+			continue;
+
+		if (hp->apn_type == APN_DEFAULT) {
+			if (default_decision == -1) {
+				*rule_id = hp->apn_id;
+				*log = hp->rule.apndefault.log;
+				default_decision = hp->rule.apndefault.action;
+			}
+			continue;
+		}
+
+		if (hp->apn_type == APN_ALF_CAPABILITY) {
+			if (isfilter)
+				continue;
+			if (!pe_alf_capmatch(hp, msg->type))
+				continue;
+			*log = hp->rule.afilt.filtspec.log;
+			*rule_id = hp->apn_id;
+			return hp->rule.afilt.action;
+		}
+
+		if (hp->apn_type != APN_ALF_FILTER || !isfilter)
+			continue;
+		if (msg->type != SOCK_STREAM && msg->type != SOCK_DGRAM)
+			continue;
+		if (msg->protocol != hp->rule.afilt.filtspec.proto)
+			continue;
+		if ((cr->dirmask & dir) == 0)
+			continue;
+		if (!pe_alf_match_host(&cr->fromhost, src, msg->family)
+		    || !pe_alf_match_port(&cr->fromport, src, msg->family)
+		    || !pe_alf_match_host(&cr->tohost, dst, msg->family)
+		    || !pe_alf_match_port(&cr->toport, dst, msg->family))
+			continue;
+
+		*log = hp->rule.afilt.filtspec.log;
+		*rule_id = hp->apn_id;
+		DEBUG(DBG_PE_DECALF, "pe_alf_evaluate_compiled: decision %d",
+		    hp->rule.afilt.action);
+		return hp->rule.afilt.action;
+	}
+	return default_decision;
+}
+
 /**
  * Decode an ALF message into a printable string. The string is
  * allocated dynamically and must to be freed by the caller.
@@ -849,3 +1968,22 @@ pe_addrmatch_port(struct apn_port *port, void *addr, unsigned short af)
 
 	return (match);
 }
+
+/*
+ * Entry Points exported for the benefit of the policy engine unit tests.
+ * DO NOT CALL THESE FUNCTIONS FROM NORMAL CODE.
+ */
+int
+test_pe_alf_evaluate(struct apn_rule *block, struct alf_event *msg,
+    int compiled, int *log, u_int32_t *rule_id)
+{
+	struct pe_alf_compiled	*comp;
+	time_t			 now = time(NULL);
+
+	if (!compiled)
+		return pe_alf_evaluate_rule(block, msg, log, rule_id, now);
+	comp = pe_alf_compile(block);
+	if (comp == NULL)
+		return -ENOMEM;
+	return pe_alf_evaluate_compiled(comp, msg, log, rule_id, now);
+}
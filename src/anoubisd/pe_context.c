@@ -73,7 +73,8 @@
  * - RELOAD: In case of a rule reload, the path and checksum in the each
  *         context of each tracked process is used to search for a new
  *         context in the new rules.  This new context is used for the
- *         process from then on.
+ *         process from then on. The search happens when the process
+ *         triggers its next event, not at the time of the reload.
  *         SPECIAL CASES:
  *         - The process has no context. (A)
  *         - The process has a context but no new context is found in the
@@ -179,11 +180,25 @@ struct pe_context {
 	 */
 	struct apn_ruleset	*ruleset;
 
+	/**
+	 * The policy database that contains the ruleset. The context
+	 * holds a reference to the database. NULL if the context
+	 * has no ruleset.
+	 */
+	struct pe_policy_db	*pdb;
+
 	/**
 	 * The path and checksum of the context. This data is used
 	 * to refresh the context, e.g. in case of a rule reload.
 	 */
 	struct pe_proc_ident	 ident;
+
+	/**
+	 * Recent ALF decisions made with the alf rule block of this
+	 * context. This is allocated by the ALF code on demand and NULL
+	 * if no decision was cached, yet.
+	 */
+	struct pe_alf_cache	*alfcache;
 };
 
 /* Prototypes */
@@ -264,15 +279,13 @@ pe_savedctx_norules(struct pe_proc *proc, int prio)
  *   parameters of that context.
  * - If there are rules but no old context we search for rules based on
  *   the processes identifier.
- * pdb contains the database that should be used to lookup rulesets. If pdb
- * is NULL the currently active policy database is used.
+ * Rulesets are always taken from the active policy database.
  *
  * @param proc The process.
  * @param prio The priority.
- * @param pdb The policy data base to search.
  */
 void
-pe_context_refresh(struct pe_proc *proc, int prio, struct pe_policy_db *pdb)
+pe_context_refresh(struct pe_proc *proc, int prio)
 {
 	struct apn_ruleset	*newrules;
 	struct pe_context	*context, *oldctx;
@@ -288,7 +301,7 @@ pe_context_refresh(struct pe_proc *proc, int prio, struct pe_policy_db *pdb)
 
 	DEBUG(DBG_TRACE, ">pe_context_refresh");
 	context = NULL;
-	newrules = pe_user_get_ruleset(pe_proc_get_uid(proc), prio, pdb);
+	newrules = pe_user_get_ruleset(pe_proc_get_uid(proc), prio, NULL);
 	DEBUG(DBG_TRACE, " pe_context_refresh: newrules = %p", newrules);
 	if (!newrules) {
 		pe_context_norules(proc, prio);
@@ -433,7 +446,7 @@ pe_context_subject_match(const struct apn_app *app,
 {
 	const struct apn_subject	*subject;
 	struct abuf_buffer		 csum = ABUF_EMPTY;
-	char				*keyid;
+	struct cert			*cert;
 	int				 ret;
 
 	if (!app)
@@ -458,17 +471,15 @@ pe_context_subject_match(const struct apn_app *app,
 			return 0;
 		break;
 	case APN_CS_KEY:
+		ret = sfshash_get_key(app->name, subject->value.keyid, &csum);
+		if (ret != 0)
+			return 0;
+		break;
 	case APN_CS_KEY_SELF:
-		if (subject->type == APN_CS_KEY_SELF) {
-			keyid = cert_keyid_for_uid(uid);
-			if (!keyid)
-				return 0;
-		} else {
-			keyid = subject->value.keyid;
-		}
-		ret = sfshash_get_key(app->name, keyid, &csum);
-		if (subject->type == APN_CS_KEY_SELF)
-			free(keyid);
+		cert = cert_get_by_uid(uid);
+		if (!cert)
+			return 0;
+		ret = sfshash_get_keyid(app->name, cert->keyid, &csum);
 		if (ret != 0)
 			return 0;
 		break;
@@ -916,7 +927,8 @@ pe_context_search(struct apn_ruleset *rs, struct pe_proc_ident *pident,
  * the ruleset and the process identification of the context. The reference
  * counter is set to one, everything else is set to NULL.
  *
- * @param rs The ruleset of the context.
+ * @param rs The ruleset of the context. It must belong to the active
+ *     policy database, the context takes a reference to that database.
  * @param pident The process identification.
  * @return The new context.
  */
@@ -933,6 +945,8 @@ pe_context_alloc(struct apn_ruleset *rs, struct pe_proc_ident *pident)
 	ctx->sbrule = NULL;
 	ctx->ctxrule = NULL;
 	ctx->ruleset = rs;
+	ctx->pdb = rs ? pe_user_db_get() : NULL;
+	ctx->alfcache = NULL;
 	ctx->refcount = 1;
 	ctx->ident.csum = ABUF_EMPTY;
 	ctx->ident.pathhint = NULL;
@@ -954,6 +968,8 @@ pe_context_put(struct pe_context *ctx)
 	if (!ctx || --(ctx->refcount))
 		return;
 	pe_proc_ident_put(&ctx->ident);
+	pe_alf_cache_free(ctx->alfcache);
+	pe_user_db_put(ctx->pdb);
 	free(ctx);
 }
 
@@ -1139,3 +1155,36 @@ pe_context_is_pg(struct pe_context *ctx)
 		return 0;
 	return !!(ctx->ctxrule->flags & APN_RULE_PGFORCE);
 }
+
+/**
+ * Return the ALF decision cache of the context.
+ *
+ * @param ctx The context.
+ * @return The ALF decision cache or NULL if the context has none.
+ */
+struct pe_alf_cache *
+pe_context_get_alfcache(struct pe_context *ctx)
+{
+	if (ctx == NULL)
+		return NULL;
+	return ctx->alfcache;
+}
+
+/**
+ * Attach an ALF decision cache to the context. The context takes over
+ * ownership of the cache and frees it together with the context.
+ *
+ * @param ctx The context.
+ * @param cache The new cache. Any previous cache is freed.
+ */
+void
+pe_context_set_alfcache(struct pe_context *ctx, struct pe_alf_cache *cache)
+{
+	if (ctx == NULL) {
+		pe_alf_cache_free(cache);
+		return;
+	}
+	if (ctx->alfcache && ctx->alfcache != cache)
+		pe_alf_cache_free(ctx->alfcache);
+	ctx->alfcache = cache;
+}
@@ -0,0 +1,1299 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <bsdcompat.h>
+#endif
+
+#include "anoubisd.h"
+#include "pe.h"
+
+/**
+ * \file
+ * The file database of a playground. The policy engine remembers the
+ * device and inode number of each file that is instantiated in a
+ * playground together with all path names that the file had. This list
+ * is used to list and commit playground files.
+ *
+ * The files of a playground are kept in a hash table that is indexed by
+ * device and inode number. Path names are split into the directory part
+ * and the last path component. The directory part is stored in a tree of
+ * path components that is shared by all files of the playground. Thus
+ * each directory is stored only once and the files in a directory (and
+ * its sub directories) can be found without a search through all files.
+ * This is used if a directory is renamed: All files below the old name
+ * of the directory get an additional name below the new directory name.
+ *
+ * The database is persistent. Each modification is appended to a
+ * journal file in the playground directory. The journal is replayed if
+ * the daemon starts. The owner of the database is responsible for
+ * compacting the journal once it contains too many stale records (see
+ * pe_pgfiles_needcompact). A compacted journal contains exactly one
+ * record for each path name. Records are stored in host byte order, the
+ * journal is never shared between machines.
+ */
+
+#define PGFILES_MAGIC		0x4a464750	/* "PGFJ" */
+#define PGFILES_VERSION		1
+
+/**
+ * Journal record types. The payload of an ADD record is the path name
+ * (including the terminating NUL byte), a DEL record has no payload and
+ * the payload of a RENAME record consists of the new and the old path
+ * name of the directory.
+ */
+#define PGFILES_ADD		1
+#define PGFILES_DEL		2
+#define PGFILES_RENAME		3
+
+/**
+ * The initial size of the hash tables is 1<<PGFILES_MINSHIFT. The
+ * tables grow if the number of entries exceeds the table size.
+ */
+#define PGFILES_MINSHIFT	6
+
+/**
+ * The number of stale records that are tolerated in the journal before
+ * it should be compacted.
+ */
+#define PGFILES_SLACK		256
+
+/*
+ * Parameters of the 32-bit FNV-1a string hash.
+ */
+#define PGFILES_FNV_INIT	(2166136261U)
+#define PGFILES_FNV_PRIME	(16777619U)
+
+/**
+ * The header at the start of the journal file.
+ */
+struct pgfiles_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+};
+
+/**
+ * The header of a single journal record. The header is followed by
+ * len bytes of payload.
+ */
+struct pgfiles_rec {
+	uint32_t	type;
+	uint32_t	len;
+	uint64_t	dev;
+	uint64_t	ino;
+};
+
+struct pgf_name;
+
+/**
+ * A directory in the path component tree.
+ */
+struct pgf_dir {
+	/**
+	 * The next directory in the same slot of the directory hash.
+	 */
+	struct pgf_dir			*hnext;
+
+	/**
+	 * The parent directory. NULL for the root of the tree.
+	 */
+	struct pgf_dir			*parent;
+
+	/**
+	 * All sub directories that are known in this directory.
+	 */
+	LIST_HEAD(, pgf_dir)		 children;
+
+	/**
+	 * Link for the list of sub directories in the parent.
+	 */
+	LIST_ENTRY(pgf_dir)		 sibling;
+
+	/**
+	 * All path names whose last component is in this directory.
+	 */
+	LIST_HEAD(, pgf_name)		 names;
+
+	/**
+	 * The number of sub directories and path names that reference
+	 * this directory. Directories without references are freed.
+	 */
+	unsigned int			 refs;
+
+	/**
+	 * The hash value of the complete directory path.
+	 */
+	uint32_t			 hv;
+
+	/**
+	 * The length of the path component.
+	 */
+	unsigned int			 len;
+
+	/**
+	 * The path component (NUL terminated).
+	 */
+	char				 name[0];
+};
+
+/**
+ * A single path name of a playground file.
+ */
+struct pgf_name {
+	/**
+	 * Link for the list of names of the file.
+	 */
+	TAILQ_ENTRY(pgf_name)		 flink;
+
+	/**
+	 * Link for the list of names in the directory.
+	 */
+	LIST_ENTRY(pgf_name)		 dlink;
+
+	/**
+	 * The file that this name belongs to.
+	 */
+	struct pgf_file			*file;
+
+	/**
+	 * The directory that contains the last path component.
+	 */
+	struct pgf_dir			*dir;
+
+	/**
+	 * The length of the last path component.
+	 */
+	unsigned int			 len;
+
+	/**
+	 * The last path component (NUL terminated).
+	 */
+	char				 leaf[0];
+};
+
+/**
+ * A playground file.
+ */
+struct pgf_file {
+	/**
+	 * The next file in the same slot of the file hash.
+	 */
+	struct pgf_file			*hnext;
+
+	/**
+	 * The device and inode number of the file.
+	 */
+	uint64_t			 dev;
+	uint64_t			 ino;
+
+	/**
+	 * All path names of the file in the order they were added.
+	 */
+	TAILQ_HEAD(, pgf_name)		 names;
+};
+
+/**
+ * The file database of a single playground.
+ */
+struct pe_pgfiles {
+	/**
+	 * The root of the path component tree. This represents the
+	 * directory part of path names that do not contain a slash.
+	 */
+	struct pgf_dir			*root;
+
+	/**
+	 * The file hash. It has 1<<fshift slots.
+	 */
+	struct pgf_file			**ftab;
+	unsigned int			  fshift;
+	unsigned int			  nfiles;
+
+	/**
+	 * The directory hash. It has 1<<dshift slots. The key of a
+	 * directory is its parent and its path component.
+	 */
+	struct pgf_dir			**dtab;
+	unsigned int			  dshift;
+	unsigned int			  ndirs;
+
+	/**
+	 * The total number of path names.
+	 */
+	unsigned int			  nnames;
+
+	/**
+	 * The file descriptor of the journal or -1 if there is none.
+	 */
+	int				  jfd;
+
+	/**
+	 * The number of records in the journal.
+	 */
+	unsigned int			  nrecs;
+
+	/**
+	 * True if a write to the journal failed. No more records are
+	 * written to the journal until it is replaced.
+	 */
+	int				  jerror;
+};
+
+/**
+ * Map a device and inode number to a slot in the file hash.
+ *
+ * @param dev The device number.
+ * @param ino The inode number.
+ * @param shift The hash table has 1<<shift slots.
+ * @return The slot number.
+ */
+static inline unsigned int
+pgf_filehash(uint64_t dev, uint64_t ino, unsigned int shift)
+{
+	uint64_t	val = ino ^ ((dev << 32) | (dev >> 32));
+
+	val *= 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(val >> (64 - shift));
+}
+
+/**
+ * Add bytes to an FNV-1a hash value.
+ *
+ * @param hv The hash value of the data so far.
+ * @param data The additional data.
+ * @param len The length of the additional data.
+ * @return The new hash value.
+ */
+static inline uint32_t
+pgf_strhash(uint32_t hv, const char *data, unsigned int len)
+{
+	unsigned int	i;
+
+	for (i=0; i<len; ++i) {
+		hv ^= (unsigned char)data[i];
+		hv *= PGFILES_FNV_PRIME;
+	}
+	return hv;
+}
+
+/**
+ * Map the hash value of a directory to a slot in the directory hash.
+ *
+ * @param hv The hash value of the directory.
+ * @param shift The hash table has 1<<shift slots.
+ * @return The slot number.
+ */
+static inline unsigned int
+pgf_dirslot(uint32_t hv, unsigned int shift)
+{
+	return (unsigned int)((hv * 0x9E3779B9U) >> (32 - shift));
+}
+
+/**
+ * Double the size of the file hash. The old table is kept if memory
+ * allocation fails.
+ *
+ * @param db The file database.
+ */
+static void
+pgf_filetab_grow(struct pe_pgfiles *db)
+{
+	unsigned int	  i, size = 1U << db->fshift;
+	struct pgf_file	**ntab, *file;
+
+	ntab = calloc(2 * size, sizeof(struct pgf_file *));
+	if (ntab == NULL)
+		return;
+	for (i=0; i<size; ++i) {
+		while ((file = db->ftab[i]) != NULL) {
+			unsigned int	slot;
+
+			slot = pgf_filehash(file->dev, file->ino,
+			    db->fshift + 1);
+			db->ftab[i] = file->hnext;
+			file->hnext = ntab[slot];
+			ntab[slot] = file;
+		}
+	}
+	free(db->ftab);
+	db->ftab = ntab;
+	db->fshift++;
+}
+
+/**
+ * Double the size of the directory hash. The old table is kept if
+ * memory allocation fails.
+ *
+ * @param db The file database.
+ */
+static void
+pgf_dirtab_grow(struct pe_pgfiles *db)
+{
+	unsigned int	  i, size = 1U << db->dshift;
+	struct pgf_dir	**ntab, *dir;
+
+	ntab = calloc(2 * size, sizeof(struct pgf_dir *));
+	if (ntab == NULL)
+		return;
+	for (i=0; i<size; ++i) {
+		while ((dir = db->dtab[i]) != NULL) {
+			unsigned int	slot;
+
+			slot = pgf_dirslot(dir->hv, db->dshift + 1);
+			db->dtab[i] = dir->hnext;
+			dir->hnext = ntab[slot];
+			ntab[slot] = dir;
+		}
+	}
+	free(db->dtab);
+	db->dtab = ntab;
+	db->dshift++;
+}
+
+/**
+ * Free unreferenced directories. The directory and all of its parents
+ * are removed from the database until a directory that is still
+ * referenced is found.
+ *
+ * @param db The file database.
+ * @param dir The directory.
+ */
+static void
+pgf_dir_prune(struct pe_pgfiles *db, struct pgf_dir *dir)
+{
+	while (dir != db->root && dir->refs == 0) {
+		struct pgf_dir	 *parent = dir->parent;
+		struct pgf_dir	**pp;
+
+		pp = &db->dtab[pgf_dirslot(dir->hv, db->dshift)];
+		while (*pp != dir)
+			pp = &(*pp)->hnext;
+		*pp = dir->hnext;
+		LIST_REMOVE(dir, sibling);
+		db->ndirs--;
+		free(dir);
+		parent->refs--;
+		dir = parent;
+	}
+}
+
+/**
+ * Find a sub directory of a directory.
+ *
+ * @param db The file database.
+ * @param parent The parent directory.
+ * @param name The path component of the sub directory (not NUL
+ *     terminated).
+ * @param len The length of the path component.
+ * @param create True if the sub directory should be created if it
+ *     does not exist. New directories do not have any references, the
+ *     caller must reference or prune them.
+ * @return The sub directory or NULL if it does not exist or if memory
+ *     allocation failed.
+ */
+static struct pgf_dir *
+pgf_dir_child(struct pe_pgfiles *db, struct pgf_dir *parent,
+    const char *name, unsigned int len, int create)
+{
+	uint32_t	 hv;
+	unsigned int	 slot;
+	struct pgf_dir	*dir;
+
+	hv = pgf_strhash(pgf_strhash(parent->hv, "/", 1), name, len);
+	slot = pgf_dirslot(hv, db->dshift);
+	for (dir = db->dtab[slot]; dir; dir = dir->hnext) {
+		if (dir->parent == parent && dir->len == len
+		    && memcmp(dir->name, name, len) == 0)
+			return dir;
+	}
+	if (!create)
+		return NULL;
+	dir = malloc(sizeof(struct pgf_dir) + len + 1);
+	if (dir == NULL)
+		return NULL;
+	dir->parent = parent;
+	LIST_INIT(&dir->children);
+	LIST_INIT(&dir->names);
+	dir->refs = 0;
+	dir->hv = hv;
+	dir->len = len;
+	memcpy(dir->name, name, len);
+	dir->name[len] = 0;
+	dir->hnext = db->dtab[slot];
+	db->dtab[slot] = dir;
+	LIST_INSERT_HEAD(&parent->children, dir, sibling);
+	parent->refs++;
+	db->ndirs++;
+	if (db->ndirs > (1U << db->dshift))
+		pgf_dirtab_grow(db);
+	return dir;
+}
+
+/**
+ * Find the directory for a directory path. Each slash separates two
+ * path components, i.e. a leading slash results in an empty first
+ * path component.
+ *
+ * @param db The file database.
+ * @param path The directory path (need not be NUL terminated).
+ * @param len The length of the directory path.
+ * @param create True if missing directories should be created.
+ * @return The directory or NULL if it does not exist or if memory
+ *     allocation failed.
+ */
+static struct pgf_dir *
+pgf_dir_lookup(struct pe_pgfiles *db, const char *path, unsigned int len,
+    int create)
+{
+	struct pgf_dir	*dir = db->root, *parent;
+	unsigned int	 start = 0, end;
+
+	while (1) {
+		for (end = start; end < len && path[end] != '/'; ++end)
+			;
+		parent = dir;
+		dir = pgf_dir_child(db, parent, path + start, end - start,
+		    create);
+		if (dir == NULL) {
+			if (create)
+				pgf_dir_prune(db, parent);
+			return NULL;
+		}
+		if (end >= len)
+			return dir;
+		start = end + 1;
+	}
+}
+
+/**
+ * Reconstruct the full path name of a playground file name.
+ *
+ * @param db The file database.
+ * @param name The name.
+ * @param buf The path name is stored in this buffer.
+ * @param buflen The length of the buffer.
+ * @return The length of the path name or a negative error code if
+ *     the buffer is too small.
+ */
+static int
+pgf_buildpath(struct pe_pgfiles *db, const struct pgf_name *name,
+    char *buf, unsigned int buflen)
+{
+	struct pgf_dir	*dir;
+	unsigned int	 len = name->len, pos;
+
+	for (dir = name->dir; dir != db->root; dir = dir->parent)
+		len += dir->len + 1;
+	if (len >= buflen)
+		return -ENAMETOOLONG;
+	pos = len - name->len;
+	memcpy(buf + pos, name->leaf, name->len + 1);
+	for (dir = name->dir; dir != db->root; dir = dir->parent) {
+		buf[--pos] = '/';
+		pos -= dir->len;
+		memcpy(buf + pos, dir->name, dir->len);
+	}
+	return len;
+}
+
+/**
+ * Add a path name to a playground file unless the file already has
+ * this name. This does not write a journal record.
+ *
+ * @param db The file database.
+ * @param file The file.
+ * @param path The path name.
+ * @return One if the name was added, zero if the file already had
+ *     this name or a negative error code.
+ */
+static int
+pgf_name_insert(struct pe_pgfiles *db, struct pgf_file *file,
+    const char *path)
+{
+	const char	*leaf = strrchr(path, '/');
+	struct pgf_dir	*dir;
+	struct pgf_name	*name;
+	unsigned int	 len;
+
+	if (leaf) {
+		dir = pgf_dir_lookup(db, path, leaf - path, 1);
+		if (dir == NULL)
+			return -ENOMEM;
+		leaf++;
+	} else {
+		dir = db->root;
+		leaf = path;
+	}
+	len = strlen(leaf);
+	TAILQ_FOREACH(name, &file->names, flink) {
+		if (name->dir == dir && name->len == len
+		    && memcmp(name->leaf, leaf, len) == 0)
+			return 0;
+	}
+	name = malloc(sizeof(struct pgf_name) + len + 1);
+	if (name == NULL) {
+		pgf_dir_prune(db, dir);
+		return -ENOMEM;
+	}
+	name->file = file;
+	name->dir = dir;
+	name->len = len;
+	memcpy(name->leaf, leaf, len + 1);
+	TAILQ_INSERT_TAIL(&file->names, name, flink);
+	LIST_INSERT_HEAD(&dir->names, name, dlink);
+	dir->refs++;
+	db->nnames++;
+	return 1;
+}
+
+/**
+ * Remove a path name from its file and free it.
+ *
+ * @param db The file database.
+ * @param name The name.
+ */
+static void
+pgf_name_free(struct pe_pgfiles *db, struct pgf_name *name)
+{
+	struct pgf_dir	*dir = name->dir;
+
+	TAILQ_REMOVE(&name->file->names, name, flink);
+	LIST_REMOVE(name, dlink);
+	free(name);
+	db->nnames--;
+	dir->refs--;
+	pgf_dir_prune(db, dir);
+}
+
+/**
+ * Find a file in the file hash.
+ *
+ * @param db The file database.
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @return The file or NULL if the file is not known.
+ */
+static struct pgf_file *
+pgf_file_find(struct pe_pgfiles *db, uint64_t dev, uint64_t ino)
+{
+	struct pgf_file	*file;
+
+	file = db->ftab[pgf_filehash(dev, ino, db->fshift)];
+	for (; file; file = file->hnext) {
+		if (file->dev == dev && file->ino == ino)
+			return file;
+	}
+	return NULL;
+}
+
+/**
+ * Create a new file without names and add it to the file hash.
+ *
+ * @param db The file database.
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @return The new file or NULL if memory allocation failed.
+ */
+static struct pgf_file *
+pgf_file_alloc(struct pe_pgfiles *db, uint64_t dev, uint64_t ino)
+{
+	struct pgf_file	*file;
+	unsigned int	 slot = pgf_filehash(dev, ino, db->fshift);
+
+	file = malloc(sizeof(struct pgf_file));
+	if (file == NULL)
+		return NULL;
+	file->dev = dev;
+	file->ino = ino;
+	TAILQ_INIT(&file->names);
+	file->hnext = db->ftab[slot];
+	db->ftab[slot] = file;
+	db->nfiles++;
+	if (db->nfiles > (1U << db->fshift))
+		pgf_filetab_grow(db);
+	return file;
+}
+
+/**
+ * Remove a file and all of its names from the database.
+ *
+ * @param db The file database.
+ * @param file The file.
+ */
+static void
+pgf_file_free(struct pe_pgfiles *db, struct pgf_file *file)
+{
+	struct pgf_file	**pp;
+	struct pgf_name	 *name;
+
+	while ((name = TAILQ_FIRST(&file->names)) != NULL)
+		pgf_name_free(db, name);
+	pp = &db->ftab[pgf_filehash(file->dev, file->ino, db->fshift)];
+	while (*pp != file)
+		pp = &(*pp)->hnext;
+	*pp = file->hnext;
+	db->nfiles--;
+	free(file);
+}
+
+/**
+ * Append a record to the journal. A failure is logged and no more
+ * records are written until the journal is replaced.
+ *
+ * @param db The file database.
+ * @param type The record type.
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @param p1 The first string of the payload (may be NULL).
+ * @param p2 The second string of the payload (may be NULL).
+ */
+static void
+pgf_journal(struct pe_pgfiles *db, uint32_t type, uint64_t dev,
+    uint64_t ino, const char *p1, const char *p2)
+{
+	struct pgfiles_rec	rec;
+	struct iovec		iov[3];
+	int			cnt = 1;
+	ssize_t			ret;
+
+	if (db->jfd < 0 || db->jerror)
+		return;
+	rec.type = type;
+	rec.len = 0;
+	rec.dev = dev;
+	rec.ino = ino;
+	if (p1) {
+		iov[cnt].iov_base = (void *)p1;
+		iov[cnt].iov_len = strlen(p1) + 1;
+		rec.len += iov[cnt++].iov_len;
+	}
+	if (p2) {
+		iov[cnt].iov_base = (void *)p2;
+		iov[cnt].iov_len = strlen(p2) + 1;
+		rec.len += iov[cnt++].iov_len;
+	}
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	ret = writev(db->jfd, iov, cnt);
+	if (ret != (ssize_t)(sizeof(rec) + rec.len)) {
+		log_warn("pgf_journal: Cannot write playground file journal");
+		db->jerror = 1;
+		return;
+	}
+	db->nrecs++;
+}
+
+/**
+ * Create a new and empty file database.
+ *
+ * @return The file database or NULL if memory allocation failed.
+ */
+struct pe_pgfiles *
+pe_pgfiles_create(void)
+{
+	struct pe_pgfiles	*db;
+
+	db = malloc(sizeof(struct pe_pgfiles));
+	if (db == NULL)
+		return NULL;
+	db->root = malloc(sizeof(struct pgf_dir) + 1);
+	db->fshift = db->dshift = PGFILES_MINSHIFT;
+	db->ftab = calloc(1U << db->fshift, sizeof(struct pgf_file *));
+	db->dtab = calloc(1U << db->dshift, sizeof(struct pgf_dir *));
+	if (!db->root || !db->ftab || !db->dtab) {
+		free(db->root);
+		free(db->ftab);
+		free(db->dtab);
+		free(db);
+		return NULL;
+	}
+	db->root->hnext = NULL;
+	db->root->parent = NULL;
+	LIST_INIT(&db->root->children);
+	LIST_INIT(&db->root->names);
+	db->root->refs = 0;
+	db->root->hv = PGFILES_FNV_INIT;
+	db->root->len = 0;
+	db->root->name[0] = 0;
+	db->nfiles = db->ndirs = db->nnames = 0;
+	db->jfd = -1;
+	db->nrecs = 0;
+	db->jerror = 0;
+	return db;
+}
+
+/**
+ * Free a file database. This closes the journal but the journal file
+ * is not removed.
+ *
+ * @param db The file database.
+ */
+void
+pe_pgfiles_destroy(struct pe_pgfiles *db)
+{
+	unsigned int	 i;
+
+	if (db == NULL)
+		return;
+	for (i=0; i < (1U << db->fshift); ++i) {
+		struct pgf_file	*file;
+
+		while ((file = db->ftab[i]) != NULL) {
+			struct pgf_name	*name;
+
+			db->ftab[i] = file->hnext;
+			while ((name = TAILQ_FIRST(&file->names)) != NULL) {
+				TAILQ_REMOVE(&file->names, name, flink);
+				free(name);
+			}
+			free(file);
+		}
+	}
+	for (i=0; i < (1U << db->dshift); ++i) {
+		struct pgf_dir	*dir;
+
+		while ((dir = db->dtab[i]) != NULL) {
+			db->dtab[i] = dir->hnext;
+			free(dir);
+		}
+	}
+	if (db->jfd >= 0)
+		close(db->jfd);
+	free(db->root);
+	free(db->ftab);
+	free(db->dtab);
+	free(db);
+}
+
+/**
+ * Return the number of files in the database.
+ *
+ * @param db The file database.
+ * @return The number of files.
+ */
+int
+pe_pgfiles_count(struct pe_pgfiles *db)
+{
+	return db->nfiles;
+}
+
+/**
+ * Return the total number of path names of all files in the database.
+ *
+ * @param db The file database.
+ * @return The number of path names.
+ */
+int
+pe_pgfiles_names(struct pe_pgfiles *db)
+{
+	return db->nnames;
+}
+
+/**
+ * Add a path name to a playground file. The file is added to the
+ * database if it is not yet known.
+ *
+ * @param db The file database.
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @param path The path name of the file relative to the root of the
+ *     file system.
+ * @return One if the file is new, zero if the file was already known
+ *     (regardless of whether the name was new) or a negative error code.
+ */
+int
+pe_pgfiles_add(struct pe_pgfiles *db, uint64_t dev, uint64_t ino,
+    const char *path)
+{
+	struct pgf_file	*file;
+	int		 newfile = 0, ret;
+
+	if (path == NULL || path[0] == 0)
+		return -EINVAL;
+	if (strlen(path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	file = pgf_file_find(db, dev, ino);
+	if (file == NULL) {
+		file = pgf_file_alloc(db, dev, ino);
+		if (file == NULL)
+			return -ENOMEM;
+		newfile = 1;
+	}
+	ret = pgf_name_insert(db, file, path);
+	if (ret < 0) {
+		if (newfile)
+			pgf_file_free(db, file);
+		return ret;
+	}
+	if (ret > 0)
+		pgf_journal(db, PGFILES_ADD, dev, ino, path, NULL);
+	return newfile;
+}
+
+/**
+ * Remove a playground file and all of its names from the database.
+ *
+ * @param db The file database.
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @return One if the file was removed, zero if it was not known.
+ */
+int
+pe_pgfiles_remove(struct pe_pgfiles *db, uint64_t dev, uint64_t ino)
+{
+	struct pgf_file	*file = pgf_file_find(db, dev, ino);
+
+	if (file == NULL)
+		return 0;
+	pgf_file_free(db, file);
+	pgf_journal(db, PGFILES_DEL, dev, ino, NULL, NULL);
+	return 1;
+}
+
+/**
+ * State for the collection of path names below a renamed directory.
+ */
+struct pgf_collect {
+	struct pgf_dir		 *top;
+	uint64_t		  dev;
+	uint64_t		  ino;
+	struct pgf_name		**names;
+	unsigned int		  cnt;
+	unsigned int		  alloc;
+};
+
+/**
+ * Collect all names in a directory and its sub directories that belong
+ * to files on the device of the renamed directory. Names of the
+ * directory itself are skipped.
+ *
+ * @param col The collection state.
+ * @param dir The current directory.
+ * @return Zero in case of success, a negative error code otherwise.
+ */
+static int
+pgf_collect(struct pgf_collect *col, struct pgf_dir *dir)
+{
+	struct pgf_name	*name;
+	struct pgf_dir	*child;
+	int		 ret;
+
+	LIST_FOREACH(name, &dir->names, dlink) {
+		if (name->file->dev != col->dev || name->file->ino == col->ino)
+			continue;
+		if (dir == col->top && name->len == 0)
+			continue;
+		if (col->cnt == col->alloc) {
+			struct pgf_name	**nnames;
+			unsigned int	  nalloc = 2 * col->alloc + 16;
+
+			nnames = realloc(col->names,
+			    nalloc * sizeof(struct pgf_name *));
+			if (nnames == NULL)
+				return -ENOMEM;
+			col->names = nnames;
+			col->alloc = nalloc;
+		}
+		col->names[col->cnt++] = name;
+	}
+	LIST_FOREACH(child, &dir->children, sibling) {
+		ret = pgf_collect(col, child);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * Handle the rename of a directory in the playground. All files on the
+ * same device that have a name below the old directory name get an
+ * additional name below the new directory name. The files are found
+ * with the path component index, a single journal record describes the
+ * rename.
+ *
+ * @param db The file database.
+ * @param dev The device number of the directory.
+ * @param ino The inode number of the directory.
+ * @param path The new name of the directory (without trailing slash).
+ * @param old_path The old name of the directory (without trailing slash).
+ * @return The number of names that were added or a negative error code.
+ */
+int
+pe_pgfiles_rename_dir(struct pe_pgfiles *db, uint64_t dev, uint64_t ino,
+    const char *path, const char *old_path)
+{
+	struct pgf_collect	 col;
+	struct pgf_dir		*old;
+	unsigned int		 i, oldlen, newlen;
+	int			 ret, added = 0;
+	char			 buf[PATH_MAX], nbuf[PATH_MAX];
+
+	if (path == NULL || old_path == NULL)
+		return -EINVAL;
+	oldlen = strlen(old_path);
+	newlen = strlen(path);
+	old = pgf_dir_lookup(db, old_path, oldlen, 0);
+	if (old == NULL)
+		return 0;
+	col.top = old;
+	col.dev = dev;
+	col.ino = ino;
+	col.names = NULL;
+	col.cnt = col.alloc = 0;
+	ret = pgf_collect(&col, old);
+	for (i=0; ret >= 0 && i<col.cnt; ++i) {
+		int	len = pgf_buildpath(db, col.names[i], buf, sizeof(buf));
+
+		/* By construction buf starts with old_path followed by '/'. */
+		if (len < 0 || newlen + len - oldlen >= sizeof(nbuf))
+			continue;
+		memcpy(nbuf, path, newlen);
+		memcpy(nbuf + newlen, buf + oldlen, len - oldlen + 1);
+		ret = pgf_name_insert(db, col.names[i]->file, nbuf);
+		if (ret > 0)
+			added++;
+	}
+	free(col.names);
+	if (added)
+		pgf_journal(db, PGFILES_RENAME, dev, ino, path, old_path);
+	if (ret < 0)
+		return ret;
+	return added;
+}
+
+/**
+ * Call a function for each path name of each playground file. The
+ * callback must not modify the database.
+ *
+ * @param db The file database.
+ * @param callback The callback function. Its arguments are the device
+ *     and inode number of the file, the path name and the argument
+ *     given to this function. If the callback returns a negative value,
+ *     iteration stops.
+ * @param arg The argument for the callback function.
+ * @return Zero or the negative return value of the callback.
+ */
+int
+pe_pgfiles_foreach(struct pe_pgfiles *db,
+    int (*callback)(uint64_t, uint64_t, const char *, void *), void *arg)
+{
+	unsigned int	 i;
+	char		 buf[PATH_MAX];
+
+	for (i=0; i < (1U << db->fshift); ++i) {
+		struct pgf_file	*file;
+		struct pgf_name	*name;
+
+		for (file = db->ftab[i]; file; file = file->hnext) {
+			TAILQ_FOREACH(name, &file->names, flink) {
+				int	ret;
+
+				if (pgf_buildpath(db, name, buf,
+				    sizeof(buf)) < 0)
+					continue;
+				ret = callback(file->dev, file->ino, buf, arg);
+				if (ret < 0)
+					return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Apply a single journal record to the database.
+ *
+ * @param db The file database.
+ * @param rec The record header.
+ * @param payload The payload of the record (rec->len bytes).
+ * @return Zero if the record was applied, -EINVAL if the record is
+ *     malformed and -ENOMEM if memory allocation failed.
+ */
+static int
+pgf_replay(struct pe_pgfiles *db, const struct pgfiles_rec *rec,
+    const char *payload)
+{
+	unsigned int	len;
+	int		ret = 0;
+
+	if (rec->len && payload[rec->len - 1] != 0)
+		return -EINVAL;
+	switch (rec->type) {
+	case PGFILES_ADD:
+		if (rec->len == 0 || strlen(payload) + 1 != rec->len)
+			return -EINVAL;
+		ret = pe_pgfiles_add(db, rec->dev, rec->ino, payload);
+		break;
+	case PGFILES_DEL:
+		if (rec->len)
+			return -EINVAL;
+		pe_pgfiles_remove(db, rec->dev, rec->ino);
+		break;
+	case PGFILES_RENAME:
+		if (rec->len == 0)
+			return -EINVAL;
+		len = strlen(payload) + 1;
+		if (len >= rec->len
+		    || len + strlen(payload + len) + 1 != rec->len)
+			return -EINVAL;
+		ret = pe_pgfiles_rename_dir(db, rec->dev, rec->ino, payload,
+		    payload + len);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret == -ENOMEM)
+		return ret;
+	return 0;
+}
+
+/**
+ * Replay a journal and attach it to the database. Subsequent
+ * modifications of the database are appended to the journal. An empty
+ * journal file is initialized. A damaged record at the end of the journal
+ * (e.g. due to a crash while it was written) and everything after it is
+ * removed from the journal.
+ *
+ * @param db The file database. It must not have a journal yet.
+ * @param fd The file descriptor of the journal. It must be open for
+ *     reading and writing in append mode. The database owns the file
+ *     descriptor if the function succeeds.
+ * @return Zero in case of success, a negative error code otherwise.
+ *     The database contains the data of all records that could be
+ *     replayed.
+ */
+int
+pe_pgfiles_load(struct pe_pgfiles *db, int fd)
+{
+	struct pgfiles_hdr	 hdr;
+	struct pgfiles_rec	 rec;
+	struct stat		 st;
+	char			*data;
+	size_t			 size, off;
+	unsigned int		 nrecs = 0;
+	int			 ret = 0;
+
+	if (db->jfd >= 0)
+		return -EBUSY;
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if (st.st_size == 0) {
+		hdr.magic = PGFILES_MAGIC;
+		hdr.version = PGFILES_VERSION;
+		if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			return -EIO;
+		goto attach;
+	}
+	size = st.st_size;
+	if (size < sizeof(hdr))
+		return -EINVAL;
+	data = malloc(size);
+	if (data == NULL)
+		return -ENOMEM;
+	for (off = 0; off < size; ) {
+		ssize_t	n = pread(fd, data + off, size - off, off);
+
+		if (n <= 0) {
+			ret = (n < 0) ? -errno : -EIO;
+			free(data);
+			return ret;
+		}
+		off += n;
+	}
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != PGFILES_MAGIC || hdr.version != PGFILES_VERSION) {
+		free(data);
+		return -EINVAL;
+	}
+	off = sizeof(hdr);
+	while (size - off >= sizeof(rec)) {
+		memcpy(&rec, data + off, sizeof(rec));
+		if (rec.len > size - off - sizeof(rec))
+			break;
+		ret = pgf_replay(db, &rec, data + off + sizeof(rec));
+		if (ret == -ENOMEM) {
+			free(data);
+			return ret;
+		}
+		if (ret < 0)
+			break;
+		off += sizeof(rec) + rec.len;
+		nrecs++;
+	}
+	free(data);
+	if (off != size) {
+		log_warnx("pe_pgfiles_load: Discarding %lu bytes at the end "
+		    "of a damaged playground file journal",
+		    (unsigned long)(size - off));
+		if (ftruncate(fd, off) < 0)
+			return -errno;
+	}
+attach:
+	db->jfd = fd;
+	db->nrecs = nrecs;
+	db->jerror = 0;
+	return 0;
+}
+
+/**
+ * Write buffer for pe_pgfiles_save.
+ */
+struct pgf_save {
+	int		fd;
+	unsigned int	len;
+	char		buf[65536];
+};
+
+/**
+ * Write the contents of the save buffer to the file.
+ *
+ * @param save The save buffer.
+ * @return Zero in case of success, a negative error code otherwise.
+ */
+static int
+pgf_save_flush(struct pgf_save *save)
+{
+	unsigned int	off = 0;
+
+	while (off < save->len) {
+		ssize_t	n = write(save->fd, save->buf + off, save->len - off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (n < 0) ? -errno : -EIO;
+		off += n;
+	}
+	save->len = 0;
+	return 0;
+}
+
+/**
+ * Callback for pe_pgfiles_foreach that adds an ADD record for a path
+ * name to the save buffer.
+ */
+static int
+pgf_save_one(uint64_t dev, uint64_t ino, const char *path, void *arg)
+{
+	struct pgf_save		*save = arg;
+	struct pgfiles_rec	 rec;
+	unsigned int		 len = strlen(path) + 1;
+	int			 ret;
+
+	if (save->len + sizeof(rec) + len > sizeof(save->buf)) {
+		ret = pgf_save_flush(save);
+		if (ret < 0)
+			return ret;
+	}
+	rec.type = PGFILES_ADD;
+	rec.len = len;
+	rec.dev = dev;
+	rec.ino = ino;
+	memcpy(save->buf + save->len, &rec, sizeof(rec));
+	memcpy(save->buf + save->len + sizeof(rec), path, len);
+	save->len += sizeof(rec) + len;
+	return 0;
+}
+
+/**
+ * Write a compacted journal that contains the current contents of the
+ * database to a file. The database is not modified, use
+ * pe_pgfiles_setjournal to replace the journal with the new file.
+ *
+ * @param db The file database.
+ * @param fd The file descriptor of the new journal file. The file
+ *     must be empty.
+ * @return Zero in case of success, a negative error code otherwise.
+ */
+int
+pe_pgfiles_save(struct pe_pgfiles *db, int fd)
+{
+	struct pgf_save		*save;
+	struct pgfiles_hdr	 hdr;
+	int			 ret;
+
+	save = malloc(sizeof(struct pgf_save));
+	if (save == NULL)
+		return -ENOMEM;
+	save->fd = fd;
+	hdr.magic = PGFILES_MAGIC;
+	hdr.version = PGFILES_VERSION;
+	memcpy(save->buf, &hdr, sizeof(hdr));
+	save->len = sizeof(hdr);
+	ret = pe_pgfiles_foreach(db, pgf_save_one, save);
+	if (ret == 0)
+		ret = pgf_save_flush(save);
+	free(save);
+	return ret;
+}
+
+/**
+ * Replace the journal of the database with a file that was written by
+ * pe_pgfiles_save. The old journal file descriptor is closed.
+ *
+ * @param db The file database.
+ * @param fd The file descriptor of the new journal. It must be open
+ *     in append mode. The database owns the file descriptor.
+ */
+void
+pe_pgfiles_setjournal(struct pe_pgfiles *db, int fd)
+{
+	if (db->jfd >= 0)
+		close(db->jfd);
+	db->jfd = fd;
+	db->nrecs = db->nnames;
+	db->jerror = 0;
+}
+
+/**
+ * Check if the journal should be compacted. This is the case if it
+ * contains many more records than there are path names in the database
+ * or if a write to the journal failed.
+ *
+ * @param db The file database.
+ * @return True if the journal should be replaced.
+ */
+int
+pe_pgfiles_needcompact(struct pe_pgfiles *db)
+{
+	if (db->jfd < 0)
+		return 0;
+	return db->jerror || db->nrecs > 2 * db->nnames + PGFILES_SLACK;
+}
@@ -74,6 +74,12 @@ struct playground {
 	 */
 	LIST_ENTRY(playground)			 next;
 
+	/**
+	 * Link to the next playground in the same slot of the
+	 * playground hash (see pghash_tab).
+	 */
+	LIST_ENTRY(playground)			 hash_link;
+
 	/**
 	 *  The playground ID of the playground.
 	 */
@@ -105,6 +111,28 @@ struct playground {
 	 */
 	int					 nrfiles;
 
+	/**
+	 * The database of all playground files and their path names.
+	 * It is backed by the journal file PE_PLAYGROUND_JOURNAL in the
+	 * playground directory.
+	 */
+	struct pe_pgfiles			*files;
+
+	/**
+	 * The total number of playground file events (instantiate, rename
+	 * and delete) for this playground since the daemon started.
+	 */
+	uint64_t				 nrevents;
+
+	/**
+	 * Event rate accounting: evcur is the number of events in the
+	 * second evsec, evlast is the number of events in the second
+	 * before evsec.
+	 */
+	time_t					 evsec;
+	unsigned int				 evcur;
+	unsigned int				 evlast;
+
 	/**
 	 * The command (program) that was first started in the playground.
 	 * This is modified once after the first exec in the playground to
@@ -150,8 +178,45 @@ struct playground {
 static LIST_HEAD(, playground)		playgrounds =
 					    LIST_HEAD_INITIALIZER(playgrounds);
 
+#define PGHASH_SHIFT		(8)
+#define PGHASH_NRENTRY		(1<<PGHASH_SHIFT)
+
 /**
- * Search the playground list for a playground with the given ID and
+ * All playgrounds on the playground list are also linked into this hash
+ * table. The slot is determined by the playground ID, see pghash_fn.
+ * This avoids a walk of the complete playground list for each
+ * playground file event.
+ */
+static LIST_HEAD(, playground)		pghash_tab[PGHASH_NRENTRY];
+
+/**
+ * The name of the playground file journal in the playground directory
+ * and the name of the temporary file that is used during compaction.
+ */
+#define PE_PLAYGROUND_JOURNAL		"FILES"
+#define PE_PLAYGROUND_JOURNAL_TMP	"FILES.new"
+
+static void	pe_playground_openjournal(struct playground *pg);
+
+/**
+ * Map a playground ID to a slot in the playground hash. Playground IDs
+ * are assigned sequentially by the kernel, a multiplicative hash
+ * spreads them evenly across the slots.
+ *
+ * @param pgid The playground ID.
+ * @return A value between zero and PGHASH_NRENTRY-1 (inclusive).
+ */
+static inline unsigned int
+pghash_fn(anoubis_cookie_t pgid)
+{
+	uint64_t	val = (uint64_t)pgid;
+
+	val *= 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(val >> (64 - PGHASH_SHIFT));
+}
+
+/**
+ * Search the playground hash for a playground with the given ID and
  * return a pointer to the playground structure.
  *
  * @param pgid The playground ID to search for.
@@ -163,13 +228,62 @@ pe_playground_find(anoubis_cookie_t pgid)
 {
 	struct playground	*pg;
 
-	LIST_FOREACH(pg, &playgrounds, next) {
+	LIST_FOREACH(pg, &pghash_tab[pghash_fn(pgid)], hash_link) {
 		if (pg->pgid == pgid)
 			return pg;
 	}
 	return NULL;
 }
 
+/**
+ * Remove a playground from the playground list and the playground hash.
+ *
+ * @param pg The playground.
+ */
+static void
+pe_playground_unlink(struct playground *pg)
+{
+	LIST_REMOVE(pg, next);
+	LIST_REMOVE(pg, hash_link);
+}
+
+/**
+ * Account for a playground file event in the statistics of the
+ * playground.
+ *
+ * @param pg The playground.
+ */
+static void
+pe_playground_account(struct playground *pg)
+{
+	time_t	now = time(NULL);
+
+	pg->nrevents++;
+	if (now != pg->evsec) {
+		pg->evlast = (now == pg->evsec + 1) ? pg->evcur : 0;
+		pg->evsec = now;
+		pg->evcur = 0;
+	}
+	pg->evcur++;
+}
+
+/**
+ * Return the number of playground file events in the last full second.
+ *
+ * @param pg The playground.
+ * @param now The current time.
+ * @return The number of events.
+ */
+static unsigned int
+pe_playground_evrate(struct playground *pg, time_t now)
+{
+	if (now == pg->evsec)
+		return pg->evlast;
+	if (now == pg->evsec + 1)
+		return pg->evcur;
+	return 0;
+}
+
 /**
  * Create a new playground. This function allocates and initializes a
  * new playground structure. Optionally, it creates the management directory
@@ -205,6 +319,11 @@ pe_playground_create(anoubis_cookie_t pgid, int do_mkdir)
 	pg = abuf_alloc_type(struct playground);
 	if (!pg)
 		return NULL;
+	pg->files = pe_pgfiles_create();
+	if (!pg->files) {
+		abuf_free_type(pg, struct playground);
+		return NULL;
+	}
 	err = atfd_open(&pg->dirfd, pgname);
 	if (err < 0)
 		log_warnx("pe_playground_create: Cannot open playground "
@@ -223,7 +342,14 @@ pe_playground_create(anoubis_cookie_t pgid, int do_mkdir)
 	pg->scandev = 0;
 	pg->scanino = 0;
 	pg->scantok = 0;
+	pg->nrevents = 0;
+	pg->evsec = 0;
+	pg->evcur = 0;
+	pg->evlast = 0;
+	if (err == 0)
+		pe_playground_openjournal(pg);
 	LIST_INSERT_HEAD(&playgrounds, pg, next);
+	LIST_INSERT_HEAD(&pghash_tab[pghash_fn(pgid)], pg, hash_link);
 	return pg;
 }
 
@@ -264,7 +390,8 @@ pe_playground_trykill(struct playground *pg)
 	if (rmdir(buf) != 0)
 		log_warn("pe_playground_trykill: Cannot remove playground "
 		    "directory %" PRIx64, pg->pgid);
-	LIST_REMOVE(pg, next);
+	pe_playground_unlink(pg);
+	pe_pgfiles_destroy(pg->files);
 	if (pg->realcmd)
 		free(pg->realcmd);
 	if (pg->namecmd)
@@ -274,6 +401,90 @@ pe_playground_trykill(struct playground *pg)
 	abuf_free_type(pg, struct playground);
 }
 
+/**
+ * Write a compacted copy of the playground file journal and replace
+ * the current journal with it.
+ *
+ * @param pg The playground.
+ * @return Zero in case of success, a negative error code otherwise. An
+ *     appropriate message is logged in case of errors.
+ */
+static int
+pe_playground_compact(struct playground *pg)
+{
+	int	fd, err;
+
+	fd = atfd_openat(&pg->dirfd, PE_PLAYGROUND_JOURNAL_TMP,
+	    O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0640);
+	if (fd < 0) {
+		err = -errno;
+		log_warn("pe_playground_compact: Cannot create file journal "
+		    "in playground %" PRIx64, pg->pgid);
+		return err;
+	}
+	err = pe_pgfiles_save(pg->files, fd);
+	if (err == 0 && atfd_renameat(&pg->dirfd, PE_PLAYGROUND_JOURNAL_TMP,
+	    PE_PLAYGROUND_JOURNAL) < 0)
+		err = -errno;
+	if (err < 0) {
+		log_warnx("pe_playground_compact: Cannot write file journal "
+		    "in playground %" PRIx64 ": %s", pg->pgid,
+		    anoubis_strerror(-err));
+		close(fd);
+		atfd_unlinkat(&pg->dirfd, PE_PLAYGROUND_JOURNAL_TMP);
+		return err;
+	}
+	pe_pgfiles_setjournal(pg->files, fd);
+	return 0;
+}
+
+/**
+ * Open the playground file journal and replay it into the file
+ * database of the playground. A journal that cannot be replayed is
+ * replaced with the (possibly incomplete) contents of the database.
+ *
+ * @param pg The playground.
+ */
+static void
+pe_playground_openjournal(struct playground *pg)
+{
+	int	fd, err;
+
+	fd = atfd_openat(&pg->dirfd, PE_PLAYGROUND_JOURNAL,
+	    O_RDWR|O_CREAT|O_APPEND, 0640);
+	if (fd < 0) {
+		log_warn("pe_playground_openjournal: Cannot open file journal "
+		    "in playground %" PRIx64, pg->pgid);
+		return;
+	}
+	err = pe_pgfiles_load(pg->files, fd);
+	if (err == -ENOMEM) {
+		log_warnx("pe_playground_openjournal: Out of memory");
+		master_terminate();
+	}
+	if (err < 0) {
+		log_warnx("pe_playground_openjournal: Cannot read file journal "
+		    "in playground %" PRIx64 ": %s", pg->pgid,
+		    anoubis_strerror(-err));
+		close(fd);
+		pe_playground_compact(pg);
+	}
+	pg->nrfiles = pe_pgfiles_count(pg->files);
+}
+
+/**
+ * Compact the file journal of a playground if it contains too many
+ * stale records.
+ *
+ * @param pg The playground.
+ */
+static void
+pe_playground_trycompact(struct playground *pg)
+{
+	if (pe_pgfiles_needcompact(pg->files))
+		pe_playground_compact(pg);
+}
+
 /**
  * Read the contents of a playground file in the given playground and
  * store the data in the buffer. At most bufsize-1 bytes are stored and the
@@ -532,256 +743,12 @@ pe_playground_delete(anoubis_cookie_t pgid, struct pe_proc *proc)
 	}
 }
 
-static void
-pe_playground_devtoname(char *buf, int buflen, uint64_t dev, uint64_t ino)
-{
-	snprintf(buf, buflen, "%" PRIx64 ":%" PRIx64, dev, ino);
-}
-
-/**
- * Add a name to a file in the PG data dir
- *
- * @param pg The playground data structure
- * @param name The name of the PG data file ("device:inode")
- * @param path The new path name to add
- * @return -1 on error, 0 if name was not a new file,
- *         1 if name was a new file
- */
-static int
-pe_playground_file_add(struct playground *pg, const char *name,
-	const char *path)
-{
-	int fd, pathoff;
-	int newfile = 1;
-	int ret = -1;
-	char buf[512];
-
-	fd = atfd_openat(&pg->dirfd, name, O_RDWR | O_CREAT, 0640);
-	if (fd < 0) {
-		log_warn("pe_playground_file_instantiate: Cannot open %s "
-		    "in playground %" PRIx64, name, pg->pgid);
-		return -1;
-	}
-	pathoff = 0;
-	while (1) {
-		int count = read(fd, buf, sizeof(buf));
-		int i;
-
-		if (count == 0)
-			break;
-		if (count < 0) {
-			log_warn("pe_playground_file_instantiate: Error while "
-			    "reading file %s in playgournd %" PRIx64,
-			    name, pg->pgid);
-			goto done;
-		}
-		newfile = 0;
-		for (i=0; i<count; ++i) {
-			if (pathoff < 0) {
-				/*
-				 * This path does not match. Skip up to
-				 * next NUL byte.
-				 */
-				if (buf[i] == 0)
-					pathoff = 0;
-				continue;
-			}
-			/*
-			 * We had a path match to pathoff. Compare the next
-			 * character.
-			 */
-			if (buf[i] == path[pathoff]) {
-				/*
-				 * The next character mathes. Advance pathoff
-				 * or return if the match is complete.
-				 */
-				if (path[pathoff] == 0)
-					goto done;
-				pathoff++;
-			} else {
-				/*
-				 * This character does not match. Skip
-				 * everything up to the next NUL byte in buf.
-				 * If this is a NUL byte, there's nothting to
-				 * skip.
-				 */
-				if (buf[i] == 0)
-					pathoff = 0;
-				else
-					pathoff = -1;
-			}
-		}
-	}
-	/*
-	 * Append the new path name to the file. Make sure that the previous
-	 * pathname is NUL terminated.
-	 */
-	if (pathoff) {
-		log_warnx("pe_playground_file_instantiate: File not NUL "
-		    "termianted.");
-		if (write(fd, "", 1) != 1) {
-			log_warn("pe_playground_file_instantiate: Failed to "
-			    "write path name");
-			goto done;
-		}
-	}
-	pathoff = strlen(path)+1;
-	if (write(fd, path, pathoff) != pathoff) {
-		log_warn("pe_playground_file_instantiate: Failed to "
-		    "write path name");
-		goto done;
-	}
-	ret = newfile;
-done:
-	if (close(fd) < 0) {
-		log_warn("pe_playground_file_instantiate: Failed to "
-		    "write path name");
-		ret = -1;
-	}
-	/* XXX: unlink file again if it was new and there was an error */
-	return ret;
-}
-
-/**
- * Search through one PG data file and look for files in a renamed directory.
- * If any are found, add the corresponding names with the new name of the
- * directory.
- *
- * @param pg The playground data structure
- * @param name The name of the PG data file ("device:inode")
- * @param new_path The new name of the dir (without trailing slash)
- * @param old_path The old name of the dir (with a trailing slash)
- */
-static void
-pe_playground_rename_dir_one_file(struct playground *pg, const char *name,
-    const char *new_path, const char *old_path)
-{
-	int fd;
-	char buf[PATH_MAX];
-	char *bufend = buf + sizeof(buf);	/* end of buffer */
-	char *endp = buf;			/* end of valid data */
-	char *p = buf;				/* start of current name */
-	int pathlen = strlen(old_path);
-	char **files = NULL;
-	int size = 0, alloc = 0;
-
-	fd = atfd_openat(&pg->dirfd, name, O_RDONLY, 0);
-	if (fd < 0) {
-		log_warn("pe_playground_rename_dir_one_file: Cannot open %s "
-		    "in playground %" PRIx64, name, pg->pgid);
-		return;
-	}
-	while (1) {
-		char *nameend;		/* pointer to \0 end of current name */
-		int count = read(fd, endp, bufend - endp);
-
-		if (count == 0)
-			break;
-		if (count < 0) {
-			log_warn("pe_playground_rename_dir_one_file: Error "
-			    "while reading file %s in playgournd %" PRIx64,
-			    name, pg->pgid);
-			goto done;
-		}
-		endp += count;
-
-		while (endp > p) {
-			nameend = memchr(p, '\0', endp - p);
-			if (!nameend) {
-				if (buf == p) {
-					log_warn(
-					   "pe_playground_rename_dir_one_file: "
-					   "Name too long while reading file "
-					   "%s in playgournd %" PRIx64,
-					   name, pg->pgid);
-					return;
-				}
-				/* move data to start of buffer and read more */
-				memmove(buf, p, endp - p);
-				endp = buf + (endp - p);
-				break;
-			}
-			if (nameend - p > pathlen &&
-			    strncmp(old_path, p, pathlen) == 0) {
-				/* match */
-				if (size == alloc) {
-					char **new;
-					alloc += 5;
-					new = realloc(files,
-					    alloc * sizeof(char *));
-					if (!new)
-						goto done;
-					files = new;
-				}
-				if (asprintf(&files[size], "%s/%s", new_path,
-				    p + pathlen) < 0)
-					goto done;
-				size++;
-			}
-			p = nameend + 1;
-		}
-	}
-done:
-	if (close(fd) < 0) {
-		log_warn("pe_playground_rename_dir_one_file: Failed to "
-		    "read %s", name);
-	}
-	if (files) {
-		int i;
-		for (i = 0; i < size; i++) {
-			pe_playground_file_add(pg, name, files[i]);
-			free(files[i]);
-		}
-		free(files);
-	}
-	return;
-}
-
-/**
- * Search through one playground and add new names for files in a renamed
- * directory.
- *
- * @param pg The playground data structure
- * @param dir_dev The device node of the renamed directory
- * @param dir_ino The inode of the renamed directory
- * @param path The new name of the dir (without trailing slash)
- * @param old_path_no_slash The old name of the dir (without trailing slash)
- */
-static void
-pe_playground_dir_rename(struct playground *pg, uint64_t dir_dev,
-    uint64_t dir_ino, const char *path, const char *old_path_no_slash)
-{
-	DIR		*dir;
-	struct dirent	*dent;
-	char *old_path;
-	if (asprintf(&old_path, "%s/", old_path_no_slash) < 0)
-		return;
-
-	dir = atfd_fdopendir(&pg->dirfd);
-	if (dir == NULL) {
-		log_warn("pe_playground_read: Cannot read playground "
-		    "directory for %" PRIx64, pg->pgid);
-		free(old_path);
-		return;
-	}
-	while((dent = readdir(dir)) != NULL) {
-		uint64_t	dev, ino;
-		char		ch;
-		if (sscanf(dent->d_name, "%" PRIx64 ":%" PRIx64 "%c",
-		    &dev, &ino, &ch) == 2) {
-			if (dev == dir_dev && ino != dir_ino)
-				pe_playground_rename_dir_one_file(pg,
-				    dent->d_name, path, old_path);
-		}
-	}
-	closedir(dir);
-	free(old_path);
-}
-
 /**
  * Add the file name of a newly instantiated playground file to the
- * playground structure on disk. If old_path was given, triger a rename
- * of the PG-files in the dir.
+ * file database of the playground. If old_path was given and the file
+ * was already known, the file is a directory that was renamed. In this
+ * case all files below the directory get an additional name below the
+ * new directory name.
  *
  * @param pgid The playground ID.
  * @param dev The device of the file system that the file lives on.
@@ -797,8 +764,7 @@ pe_playground_file_instantiate(anoubis_cookie_t pgid, uint64_t dev,
     uint64_t ino, const char *path, const char *old_path)
 {
 	struct playground *pg;
-	char buf[50];
-	int newfile;
+	int newfile, err = 0;
 
 	if (!path || path[0] == 0)
 		return;
@@ -810,13 +776,22 @@ pe_playground_file_instantiate(anoubis_cookie_t pgid, uint64_t dev,
 		if (!pg)
 			master_terminate();
 	}
-	pe_playground_devtoname(buf, sizeof(buf), dev, ino);
-	newfile = pe_playground_file_add(pg, buf, path);
+	pe_playground_account(pg);
+	newfile = pe_pgfiles_add(pg->files, dev, ino, path);
 	if (newfile == 1)
-		pg->nrfiles++;
-	else if (old_path) {
-		pe_playground_dir_rename(pg, dev, ino, path, old_path);
+		pg->nrfiles = pe_pgfiles_count(pg->files);
+	else if (newfile == 0 && old_path)
+		err = pe_pgfiles_rename_dir(pg->files, dev, ino, path,
+		    old_path);
+	if (newfile == -ENOMEM || err == -ENOMEM) {
+		log_warnx("pe_playground_file_instantiate: Out of memory");
+		master_terminate();
 	}
+	if (newfile < 0)
+		log_warnx("pe_playground_file_instantiate: Cannot add file "
+		    "to playground %" PRIx64 ": %s", pgid,
+		    anoubis_strerror(-newfile));
+	pe_playground_trycompact(pg);
 }
 
 /**
@@ -831,13 +806,13 @@ void
 pe_playground_file_delete(anoubis_cookie_t pgid, uint64_t dev, uint64_t ino)
 {
 	struct playground *pg = pe_playground_find(pgid);
-	char buf[50];
 
 	if (!pg)
 		return;
-	pe_playground_devtoname(buf, sizeof(buf), dev, ino);
-	if (atfd_unlinkat(&pg->dirfd, buf) == 0) {
-		pg->nrfiles--;
+	pe_playground_account(pg);
+	if (pe_pgfiles_remove(pg->files, dev, ino) > 0) {
+		pg->nrfiles = pe_pgfiles_count(pg->files);
+		pe_playground_trycompact(pg);
 		pe_playground_trykill(pg);
 	}
 }
@@ -886,9 +861,66 @@ pe_playground_dump(void)
 
 	log_info("List of known playgrounds:");
 	LIST_FOREACH(pg, &playgrounds, next) {
-		log_info("Playgound ID=%" PRIx64 " procs=%d", pg->pgid,
-		    pg->nrprocs);
+		log_info("Playgound ID=%" PRIx64 " procs=%d files=%d "
+		    "events=%" PRIu64, pg->pgid, pg->nrprocs, pg->nrfiles,
+		    pg->nrevents);
+	}
+}
+
+/**
+ * Import the path names of a playground file from a name list that was
+ * written by older versions of anoubisd. These versions stored the NUL
+ * separated path names of each file in a file named "device:inode" in
+ * the playground directory. This function is called during initialization
+ * and throws a fatal error if memory allocation fails.
+ *
+ * @param pg The playground.
+ * @param name The name of the name list ("device:inode").
+ * @param dev The device number of the file.
+ * @param ino The inode number of the file.
+ * @return None.
+ */
+static void
+pe_playground_import(struct playground *pg, const char *name, uint64_t dev,
+    uint64_t ino)
+{
+	char	 buf[PATH_MAX];
+	int	 fd, len = 0, count;
+
+	fd = atfd_openat(&pg->dirfd, name, O_RDONLY, 0);
+	if (fd < 0) {
+		log_warn("pe_playground_import: Cannot open %s "
+		    "in playground %" PRIx64, name, pg->pgid);
+		return;
 	}
+	do {
+		char	*p = buf, *end;
+
+		count = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (count < 0) {
+			log_warn("pe_playground_import: Error while reading "
+			    "file %s in playground %" PRIx64, name, pg->pgid);
+			break;
+		}
+		len += count;
+		/* A missing NUL byte at the end of the file is tolerated. */
+		if (count == 0)
+			buf[len++] = 0;
+		while ((end = memchr(p, 0, buf + len - p)) != NULL) {
+			if (*p && pe_pgfiles_add(pg->files, dev, ino, p)
+			    == -ENOMEM)
+				fatal("pe_playground_import: Out of memory");
+			p = end + 1;
+		}
+		len = buf + len - p;
+		if (len == (int)sizeof(buf) - 1) {
+			log_warnx("pe_playground_import: Name too long in "
+			    "file %s in playground %" PRIx64, name, pg->pgid);
+			break;
+		}
+		memmove(buf, p, len);
+	} while (count > 0);
+	close(fd);
 }
 
 /**
@@ -906,6 +938,7 @@ pe_playground_read(anoubis_cookie_t pgid)
 	char				 buf[512];
 	DIR				*dir;
 	struct dirent			*dent;
+	int				 imported = 0;
 
 	if (pg) {
 		log_warnx("pe_playground_read: Playground %" PRIx64 " exists",
@@ -953,10 +986,32 @@ pe_playground_read(anoubis_cookie_t pgid)
 		uint64_t	dev, ino;
 		char		ch;
 		if (sscanf(dent->d_name, "%" PRIx64 ":%" PRIx64 "%c",
-		    &dev, &ino, &ch) == 2)
-			pg->nrfiles++;
+		    &dev, &ino, &ch) == 2) {
+			pe_playground_import(pg, dent->d_name, dev, ino);
+			imported++;
+		}
+	}
+	/*
+	 * The per file name lists are only removed once their contents
+	 * are safely stored in the journal.
+	 */
+	if (imported && pe_playground_compact(pg) == 0) {
+		rewinddir(dir);
+		while((dent = readdir(dir)) != NULL) {
+			uint64_t	dev, ino;
+			char		ch;
+			if (sscanf(dent->d_name, "%" PRIx64 ":%" PRIx64 "%c",
+			    &dev, &ino, &ch) != 2)
+				continue;
+			if (atfd_unlinkat(&pg->dirfd, dent->d_name) != 0)
+				log_warn("pe_playground_read: Cannot remove "
+				    "%s in playground %" PRIx64,
+				    dent->d_name, pgid);
+		}
 	}
 	closedir(dir);
+	pg->nrfiles = pe_pgfiles_count(pg->files);
+	pe_playground_trycompact(pg);
 	pe_playground_trykill(pg);
 }
 
@@ -999,7 +1054,8 @@ pe_playground_shutdown(void)
 	struct playground		*pg;
 
 	while ((pg = LIST_FIRST(&playgrounds)) != NULL) {
-		LIST_REMOVE(pg, next);
+		pe_playground_unlink(pg);
+		pe_pgfiles_destroy(pg->files);
 		if (pg->realcmd)
 			free(pg->realcmd);
 		if (pg->namecmd)
@@ -1090,20 +1146,22 @@ pe_playground_send_pglist(uint64_t token, anoubis_cookie_t pgid,
 	struct playground		*pg;
 	struct amsg_list_context	 ctx;
 	int				 error;
+	time_t				 now = time(NULL);
 
 	error = amsg_list_init(&ctx, token, ANOUBIS_REC_PGLIST);
 	if (error < 0)
 		return error;
-	LIST_FOREACH(pg, &playgrounds, next) {
-		unsigned int			 size;
+	pg = pgid ? pe_playground_find(pgid) : LIST_FIRST(&playgrounds);
+	for (; pg; pg = pgid ? NULL : LIST_NEXT(pg, next)) {
+		unsigned int			 size, statoff;
 		Anoubis_PgInfoRecord		*rec;
+		Anoubis_PgStatsRecord		*stats;
 
-		if (pgid && pg->pgid != pgid)
-			continue;
-		size = sizeof(Anoubis_PgInfoRecord) + 1;
+		statoff = sizeof(Anoubis_PgInfoRecord) + 1;
 		if (pg->fullname)
-			size += strlen(pg->fullname);
-		size = (size+7UL) & ~7UL;
+			statoff += strlen(pg->fullname);
+		statoff = (statoff+7UL) & ~7UL;
+		size = statoff + sizeof(Anoubis_PgStatsRecord);
 		if (size > abuf_length(ctx.buf)) {
 			amsg_list_send(&ctx, q);
 			error = amsg_list_init(&ctx, token,
@@ -1130,6 +1188,10 @@ pe_playground_send_pglist(uint64_t token, anoubis_cookie_t pgid,
 		} else {
 			rec->path[0] = 0;
 		}
+		stats = abuf_cast_off(ctx.buf, statoff, Anoubis_PgStatsRecord);
+		set_value(stats->nrevents, pg->nrevents);
+		set_value(stats->evrate, pe_playground_evrate(pg, now));
+		set_value(stats->nrnames, pe_pgfiles_names(pg->files));
 		amsg_list_addrecord(&ctx, size);
 	}
 	ctx.flags |= POLICY_FLAG_END;
@@ -1138,124 +1200,60 @@ pe_playground_send_pglist(uint64_t token, anoubis_cookie_t pgid,
 }
 
 /**
- * Append records for all path names that are known for a single playground
- * file to the message in the reply context. If the message becomes full
- * it is sent to the queue and a new message is created.
+ * The state of a playground file list reply. See
+ * pe_playground_send_filelist.
+ */
+struct pe_playground_listctx {
+	struct amsg_list_context	 ctx;
+	uint64_t			 token;
+	uint64_t			 pgid;
+	Queue				*q;
+};
+
+/**
+ * Append a record for a single path name of a playground file to the
+ * message in the reply context. If the message becomes full it is sent
+ * to the queue and a new message is created. This is a callback function
+ * for pe_pgfiles_foreach.
  *
- * @param ctx The message context containing the current message. This
- *     message may or may not contain records.
- * @param pgid The playground ID of the current file. This value is stored in
- *     each ANOUBIS_REC_PGFILELIST record that is added to the message.
- * @param dev The device ID of the current file. This value is stored in
- *     each ANOUBIS_REC_PGFILELIST record that is added to the message.
- * @param ino The inode number of the  current file. This value is stored in
- *     each ANOUBIS_REC_PGFILELIST record that is added to the message.
- * @param fd The file descriptor of the file that contains the playground
- *     path names for the file. Each pathname results in one record.
- * @param q Completed messages are added to this queue.
+ * @param dev The device ID of the current file.
+ * @param ino The inode number of the  current file.
+ * @param path The path name of the file.
+ * @param arg The reply context (struct pe_playground_listctx).
  * @return Zero in case of success, a negative error code if an error occured.
  */
 static int
-pe_playground_send_onefile(struct amsg_list_context *ctx, uint64_t pgid,
-    uint64_t dev, uint64_t ino, int fd, Queue *q)
+pe_playground_send_onefile(uint64_t dev, uint64_t ino, const char *path,
+    void *arg)
 {
-	char	buf[512];	/* The read buffer. */
-	int	i=0;		/* Current offset in read buffer */
-	int	len=0;		/* Valid bytes in in read buffer */
-	int	recoff = 0;	/* bytes already copied to current record */
-	int	err;
-
-	while (1) {
-		int			 slen, headlen, complete;
-		struct abuf_buffer	 tmp;
-		Anoubis_PgFileRecord	*rec;
-		/*
-		 * If the read buffer is empty (completly processed) try
-		 * to read more data.
-		 */
-		if (i >= len) {
-			len = read(fd, buf, sizeof(buf));
-			if (len < 0)
-				return -errno;
-			if (len == 0)
-				break;
-			i = 0;
-		}
-		/*
-		 * Search for the NUL byte or the end of the buffer and
-		 * copy this data over to the target message.
-		 */
-		complete = 0;
-		for (slen = 0; i+slen < len; slen++) {
-			if (buf[i+slen] == 0) {
-				slen++;
-				complete = 1;
-				break;
-			}
-		}
-		/*
-		 * If this is the start of a new record, we must copy
-		 * the header, otherwise the header is already included.
-		 */
-		if (recoff)
-			headlen = 0;
-		else
-			headlen = sizeof(Anoubis_PgFileRecord);
-		/*
-		 * If the current record (or the known part thereof)
-		 * does not fit into the message, send the message and
-		 * allocate a new one. Partial record data that has
-		 * been copied into the message is first copied over to the
-		 * new message.
-		 */
-		if (recoff + headlen + slen > (int)abuf_length(ctx->buf)) {
-			struct amsg_list_context	nctx;
-
-			err = amsg_list_init(&nctx, ctx->dmsg->token,
-			    ANOUBIS_REC_PGFILELIST);
-			if (err < 0)
-				return err;
-			abuf_copy_part(nctx.buf, 0, ctx->buf, 0, recoff);
-			amsg_list_send(ctx, q);
-			nctx.flags = ctx->flags;
-			(*ctx) = nctx;
-			continue;
-		}
-		/* No header yet, add one. */
-		if (recoff == 0) {
-			rec = abuf_cast(ctx->buf, Anoubis_PgFileRecord);
-			if (!rec)
-				return -ENOMEM;
-			set_value(rec->reclen, 0);
-			set_value(rec->_pad, 0);
-			set_value(rec->pgid, pgid);
-			set_value(rec->dev, dev);
-			set_value(rec->ino, ino);
-			recoff = offsetof(Anoubis_PgFileRecord, path);
-		}
-		/* Append the path data to the current record. */
-		tmp = abuf_open(ctx->buf, recoff);
-		abuf_copy_tobuf(tmp, buf+i, slen);
-		/* Adjust record offset and position in the read buffer. */
-		recoff += slen;
-		i += slen;
-		/*
-		 * If the string is complete (we found a NUL byte) we must
-		 * account for the record in the context.
-		 */
-		if (complete) {
-			int	nrecoff = (recoff + 7UL) & ~7UL;
-
-			if (nrecoff <= (int)abuf_length(ctx->buf))
-				recoff = nrecoff;
-			rec = abuf_cast(ctx->buf, Anoubis_PgFileRecord);
-			if (!rec)
-				return -ENOMEM;
-			set_value(rec->reclen, recoff);
-			amsg_list_addrecord(ctx, recoff);
-			recoff = 0;
-		}
+	struct pe_playground_listctx	*lctx = arg;
+	Anoubis_PgFileRecord		*rec;
+	unsigned int			 size;
+	int				 error;
+
+	size = offsetof(Anoubis_PgFileRecord, path) + strlen(path) + 1;
+	size = (size+7UL) & ~7UL;
+	if (size > abuf_length(lctx->ctx.buf)) {
+		amsg_list_send(&lctx->ctx, lctx->q);
+		error = amsg_list_init(&lctx->ctx, lctx->token,
+		    ANOUBIS_REC_PGFILELIST);
+		if (error < 0)
+			return error;
+		lctx->ctx.flags = 0;
 	}
+	/* Record permanently too long */
+	if (size > abuf_length(lctx->ctx.buf))
+		return -EFAULT;
+	rec = abuf_cast(lctx->ctx.buf, Anoubis_PgFileRecord);
+	if (!rec)
+		return -ENOMEM;
+	set_value(rec->reclen, size);
+	set_value(rec->_pad, 0);
+	set_value(rec->pgid, lctx->pgid);
+	set_value(rec->dev, dev);
+	set_value(rec->ino, ino);
+	strcpy(rec->path, path);
+	amsg_list_addrecord(&lctx->ctx, size);
 	return 0;
 }
 
@@ -1275,53 +1273,30 @@ pe_playground_send_filelist(uint64_t token, uint64_t pgid, uint32_t auth_uid,
     Queue *q)
 {
 	struct playground		*pg;
-	int				 error = 0;
-	DIR				*dir;
-	struct dirent			*dent;
-	struct amsg_list_context	 ctx;
+	struct pe_playground_listctx	 lctx;
+	int				 error;
 
-	ctx.msg = NULL;
 	pg = pe_playground_find(pgid);
 	if (!pg)
 		return -ESRCH;
 	if (pg->uid != auth_uid && auth_uid != 0)
 		return -EPERM;
-	dir = atfd_fdopendir(&pg->dirfd);
-	if (!dir)
-		return -errno;
-	error = amsg_list_init(&ctx, token, ANOUBIS_REC_PGFILELIST);
+	error = amsg_list_init(&lctx.ctx, token, ANOUBIS_REC_PGFILELIST);
 	if (error < 0)
-		goto err;
-
-	while((dent = readdir(dir)) != NULL) {
-		uint64_t		dev, ino;
-		char			ch;
-		int			fd;
-
-		/* Skip entries that do not represent a file. */
-		if (sscanf(dent->d_name, "%" PRIx64 ":%" PRIx64 "%c",
-		    &dev, &ino, &ch) != 2)
-			continue;
-		fd = atfd_openat(&pg->dirfd, dent->d_name, O_RDONLY, 0);
-		if (fd < 0) {
-			error = -errno;
-			goto err;
-		}
-
-		error = pe_playground_send_onefile(&ctx, pgid, dev, ino, fd, q);
-		close(fd);
-		if (error < 0)
-			goto err;
+		return error;
+	lctx.token = token;
+	lctx.pgid = pgid;
+	lctx.q = q;
+	error = pe_pgfiles_foreach(pg->files, pe_playground_send_onefile,
+	    &lctx);
+	if (error < 0) {
+		if (lctx.ctx.msg)
+			free(lctx.ctx.msg);
+		return error;
 	}
-	closedir(dir);
-	ctx.flags |= POLICY_FLAG_END;
-	amsg_list_send(&ctx, q);
+	lctx.ctx.flags |= POLICY_FLAG_END;
+	amsg_list_send(&lctx.ctx, q);
 	return 0;
-err:
-	closedir(dir);
-	if (ctx.msg)
-		free(ctx.msg);
-	return error;
 }
 
 /**
@@ -81,6 +81,7 @@ struct entry {
  * determined by the parameter to pe_prefixhash_create.
  */
 struct pe_prefixhash {
+	struct pe_userdata	 hdr;
 	unsigned int		 tabsize;
 	struct entryarr_array	 tab;
 };
@@ -89,26 +90,67 @@ struct pe_prefixhash {
 #define PREFIXHASH_SHIFT	(24)
 #define PREFIXHASH_MASK		((1UL<<PREFIXHASH_SHIFT)-1)
 
+/*
+ * Parameters of the 32-bit FNV-1a string hash.
+ */
+#define PREFIXHASH_FNV_INIT	(2166136261U)
+#define PREFIXHASH_FNV_PRIME	(16777619U)
+
+/**
+ * Add a single byte to a path name hash. The hash of a string is
+ * computed by starting with PREFIXHASH_FNV_INIT and calling this function
+ * for each byte of the string. Thus the hash of each prefix of a path
+ * is an intermediate result of the hash of the whole path.
+ *
+ * @param hv The hash value of the data so far.
+ * @param c The next byte of the data.
+ * @return The new hash value.
+ */
+static inline u_int32_t
+hash_step(u_int32_t hv, char c)
+{
+	hv ^= (unsigned char)c;
+	return hv * PREFIXHASH_FNV_PRIME;
+}
+
+/**
+ * Map a path name hash to a slot in the hash table. The hash value
+ * is mixed once more (using the finalizer of MurmurHash3) before it is
+ * reduced modulo the table size. This makes sure that all bits of the
+ * hash influence the slot.
+ *
+ * @param hash The prefix hash.
+ * @param hv The hash value.
+ * @return The slot number.
+ */
+static inline unsigned int
+hash_slot(const struct pe_prefixhash *hash, u_int32_t hv)
+{
+	hv ^= hv >> 16;
+	hv *= 0x85ebca6bU;
+	hv ^= hv >> 13;
+	hv *= 0xc2b2ae35U;
+	hv ^= hv >> 16;
+	return hv % hash->tabsize;
+}
+
 /**
  * Calculate a path name hash. The hash consideres the first <code>cnt</code>
- * bytes of the data. The return value is between zero and PREFIXHASH_MASK
- * inclusive.
+ * bytes of the data.
  *
  * @param data The data that should be hashed.
  * @param cnt The length of the data to hash.
+ * @return The hash value.
  */
-static unsigned long
+static u_int32_t
 hash_fn(const char *data, int cnt)
 {
-	unsigned long	ret = 0;
+	u_int32_t	ret = PREFIXHASH_FNV_INIT;
 	int		i;
 
-	for (i=0; i<cnt; ++i,++data) {
-		ret <<= 1;
-		ret ^= *data;
-		ret = (ret ^ (ret >> PREFIXHASH_SHIFT)) & PREFIXHASH_MASK;
-	}
-	return ret & PREFIXHASH_MASK;
+	for (i=0; i<cnt; ++i)
+		ret = hash_step(ret, data[i]);
+	return ret;
 }
 
 /**
@@ -130,6 +172,7 @@ pe_prefixhash_create(unsigned int tabsize)
 	ret = abuf_alloc_type(struct pe_prefixhash);
 	if (!ret)
 		return NULL;
+	ret->hdr.type = PE_USERDATA_PREFIXHASH;
 	ret->tab = entryarr_alloc(tabsize);
 	if (entryarr_size(ret->tab) != tabsize) {
 		pe_prefixhash_destroy(ret);
@@ -186,9 +229,9 @@ pe_prefixhash_add(struct pe_prefixhash *hash, const char *str,
 	struct entry	 *n;
 
 	if (str)
-		hv = hash_fn(str, strlen(str)) % hash->tabsize;
+		hv = hash_slot(hash, hash_fn(str, strlen(str)));
 	else
-		hv = hash_fn(NULL, 0) % hash->tabsize;
+		hv = hash_slot(hash, hash_fn(NULL, 0));
 	pp = &entryarr_access(hash->tab, hv);
 	while (*pp) {
 		pp = &(*pp)->next;
@@ -233,25 +276,20 @@ cmp_entries(const void *a, const void *b)
  *     empty at the first call to this function. Memory will be allocated
  *     and the array grows as neccessary. The caller is responsible for the
  *     array and must free it if the function returns successfully.
- * @param str The path prefix that determines the hash slot. This pointer
- *     can be NULL, <code>len</code> should be zero in this case.
- * @param len The length of the path prefix. Only the first <code>len</code>
- *     bytes are hashed. The path name must be at least <code>len</code> bytes
- *     long but it may be longer.
+ * @param hv The hash value of the path prefix that determines the
+ *     hash slot (see hash_fn).
  * @return Zero on success, a negative error code in case of an error.
  *     In case of an error, the memory associated with the array is freed.
  */
 static inline int
 addslot(struct pe_prefixhash *hash, struct entryarr_array *arr,
-    const char *str, size_t len)
+    u_int32_t hv)
 {
-	int		 hv;
 	size_t		 oldcnt = entryarr_size(*arr);
 	size_t		 ncnt = oldcnt;
 	struct entry	*list, *tmp;
 
-	hv = hash_fn(str, len) % hash->tabsize;
-	list = entryarr_access(hash->tab, hv);
+	list = entryarr_access(hash->tab, hash_slot(hash, hv));
 	if (!list)
 		return 0;
 	for (tmp = list; tmp; tmp = tmp->next)
@@ -286,7 +324,7 @@ int
 pe_prefixhash_getrules(struct pe_prefixhash *hash, const char *str,
     struct apnarr_array *rules)
 {
-	int			 len = 0;
+	u_int32_t		 hv = PREFIXHASH_FNV_INIT;
 	struct entryarr_array	 entries = entryarr_EMPTY;
 	size_t			 i, j, rcnt = 0;
 	struct entry		*prev;
@@ -295,22 +333,19 @@ pe_prefixhash_getrules(struct pe_prefixhash *hash, const char *str,
 	if (str && str[0] != '/')
 		return -EINVAL;
 	/* Empty string: No path required at all. */
-	if (addslot(hash, &entries, NULL, 0) < 0)
+	if (addslot(hash, &entries, hv) < 0)
 		return -ENOMEM;
-	if (str) {
-		len = strlen(str);
-		/* The whole string */
-		if (addslot(hash, &entries, str, len) < 0)
-			return -ENOMEM;
-		/* A single slash ('/') is always a valid prefix. */
-		if (addslot(hash, &entries, str, 1) < 0)
-			return -ENOMEM;
-	}
-	while(len) {
-		if (str[len] == '/')
-			if (addslot(hash, &entries, str, len) < 0)
+	/*
+	 * Hash the path in a single pass and probe the hash for each
+	 * relevant prefix as soon as its hash value is known: A single
+	 * slash ('/') is always a valid prefix, the whole string is a
+	 * valid prefix and so is each prefix that is followed by a slash.
+	 */
+	for (i = 0; str && str[i]; ++i) {
+		hv = hash_step(hv, str[i]);
+		if (i == 0 || str[i+1] == '/' || str[i+1] == 0)
+			if (addslot(hash, &entries, hv) < 0)
 				return -ENOMEM;
-		len--;
 	}
 	if (entryarr_size(entries) == 0)
 		return 0;
@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file
+ * This file implements a path component trie for apn_rule structures.
+ * It is an alternative to the prefix hash in pe_prefixhash.c and
+ * answers the same question: Given a path name, which rules of a
+ * rule block have a path prefix that might apply to the path?
+ *
+ * Each node of the trie represents a single path name component. The
+ * children of a node are kept in an array that is sorted by component
+ * name, i.e. finding the child for a component is a binary search.
+ * Rules without a path prefix and rules with the prefix "/" are attached
+ * to the root node, all other rules are attached to the node that
+ * represents the last component of their prefix. Empty components
+ * (e.g. due to duplicate slashes) are ignored.
+ *
+ * Once all rules are added, pe_prefixtrie_finish precomputes for each
+ * node that carries rules the list of all rules attached to the node
+ * or one of its ancestors, sorted by rule index. A lookup is thus a
+ * single walk along the components of the path that remembers the
+ * deepest node with such a list. The list is returned as is, i.e. a
+ * lookup does not allocate any memory and the result must not be freed.
+ *
+ * Just like the prefix hash, the trie only returns _candidates_. The
+ * caller must still verify that the prefix of each rule in fact matches.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <anoubisd.h>
+#include <anoubis_alloc.h>
+#include <pe.h>
+
+/*
+ * A rule attached to a node together with its index in the rule block.
+ */
+struct trie_cand {
+	int			 idx;
+	struct apn_rule		*rule;
+};
+
+/*
+ * A single node in the trie.
+ */
+struct trie_node {
+	/* The path name component represented by this node. */
+	char			*name;
+	unsigned int		 namelen;
+	/* Child nodes, sorted by (namelen, name). */
+	unsigned int		 nchild;
+	struct trie_node	*child;
+	/*
+	 * Rules attached to this node. Only used while the trie is
+	 * built and freed by pe_prefixtrie_finish.
+	 */
+	unsigned int		 nown;
+	struct trie_cand	*own;
+	/*
+	 * Sorted candidates for paths that end at or below this node.
+	 * Only valid if hascand is true.
+	 */
+	int			 hascand;
+	unsigned int		 ncand;
+	struct apn_rule		**cand;
+};
+
+/**
+ * The trie datastructure itself.
+ */
+struct pe_prefixtrie {
+	struct pe_userdata	 hdr;
+	struct trie_node	 root;
+	/* Rules that do not have a path prefix at all. */
+	unsigned int		 nnopath;
+	struct trie_cand	*nopath;
+	/* Candidates for events without a path. */
+	unsigned int		 nnopathcand;
+	struct apn_rule		**nopathcand;
+	int			 finished;
+};
+
+/**
+ * Compare a path name component with the name of a trie node. The
+ * order is by length first, then by content.
+ *
+ * @param name The component name (need not be NUL terminated).
+ * @param len The length of the component name.
+ * @param node The trie node.
+ * @return An integer less than, equal to or greater than zero if the
+ *     component sorts before, equal to or after the node name.
+ */
+static inline int
+trie_cmp(const char *name, unsigned int len, const struct trie_node *node)
+{
+	if (len != node->namelen)
+		return (len < node->namelen) ? -1 : 1;
+	return memcmp(name, node->name, len);
+}
+
+/**
+ * Find the child of a node that represents the given path name component.
+ *
+ * @param node The parent node.
+ * @param name The component name (need not be NUL terminated).
+ * @param len The length of the component.
+ * @param posp If the child is not found, the index where it must be
+ *     inserted is returned here. May be NULL.
+ * @return The child node or NULL if it does not exist.
+ */
+static struct trie_node *
+trie_find_child(struct trie_node *node, const char *name, unsigned int len,
+    unsigned int *posp)
+{
+	unsigned int	lo = 0, hi = node->nchild;
+
+	while (lo < hi) {
+		unsigned int	mid = (lo + hi) / 2;
+		int		cmp = trie_cmp(name, len, &node->child[mid]);
+
+		if (cmp == 0)
+			return &node->child[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (posp)
+		(*posp) = lo;
+	return NULL;
+}
+
+/**
+ * Return the child of a node that represents the given component.
+ * The child is created if it does not exist. Note that this can move
+ * other children of the same parent in memory.
+ *
+ * @param node The parent node.
+ * @param name The component name (need not be NUL terminated).
+ * @param len The length of the component.
+ * @return The child node or NULL if memory allocation failed.
+ */
+static struct trie_node *
+trie_get_child(struct trie_node *node, const char *name, unsigned int len)
+{
+	struct trie_node	*ret, *nchild;
+	unsigned int		 pos = 0;
+
+	ret = trie_find_child(node, name, len, &pos);
+	if (ret)
+		return ret;
+	nchild = realloc(node->child,
+	    (node->nchild + 1) * sizeof(struct trie_node));
+	if (!nchild)
+		return NULL;
+	node->child = nchild;
+	memmove(&node->child[pos+1], &node->child[pos],
+	    (node->nchild - pos) * sizeof(struct trie_node));
+	node->nchild++;
+	ret = &node->child[pos];
+	memset(ret, 0, sizeof(struct trie_node));
+	ret->name = malloc(len + 1);
+	if (!ret->name) {
+		/* Leave an empty placeholder that never matches a path. */
+		ret->namelen = 0;
+		return NULL;
+	}
+	memcpy(ret->name, name, len);
+	ret->name[len] = 0;
+	ret->namelen = len;
+	return ret;
+}
+
+/**
+ * Append a rule to a candidate list.
+ *
+ * @param listp A pointer to the list.
+ * @param cntp A pointer to the number of entries in the list.
+ * @param rule The rule.
+ * @param idx The index of the rule.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+trie_append(struct trie_cand **listp, unsigned int *cntp,
+    struct apn_rule *rule, int idx)
+{
+	struct trie_cand	*nlist;
+
+	nlist = realloc(*listp, ((*cntp) + 1) * sizeof(struct trie_cand));
+	if (!nlist)
+		return -ENOMEM;
+	nlist[*cntp].idx = idx;
+	nlist[*cntp].rule = rule;
+	(*listp) = nlist;
+	(*cntp)++;
+	return 0;
+}
+
+/**
+ * Free a trie node and all of its children. The memory of the node
+ * itself is not freed.
+ *
+ * @param node The node.
+ * @return None.
+ */
+static void
+trie_free_node(struct trie_node *node)
+{
+	unsigned int	i;
+
+	for (i=0; i<node->nchild; ++i)
+		trie_free_node(&node->child[i]);
+	free(node->child);
+	free(node->name);
+	free(node->own);
+	free(node->cand);
+}
+
+/**
+ * Create a new, empty prefix trie.
+ *
+ * @return A new pe_prefixtrie structure or NULL in case of an error.
+ */
+struct pe_prefixtrie *
+pe_prefixtrie_create(void)
+{
+	struct pe_prefixtrie	*ret;
+
+	ret = abuf_zalloc_type(struct pe_prefixtrie);
+	if (!ret)
+		return NULL;
+	ret->hdr.type = PE_USERDATA_PREFIXTRIE;
+	return ret;
+}
+
+/**
+ * Free all memory associated with the prefix trie <code>trie</code>.
+ *
+ * @param trie The prefix trie.
+ * @return None.
+ */
+void
+pe_prefixtrie_destroy(struct pe_prefixtrie *trie)
+{
+	trie_free_node(&trie->root);
+	free(trie->nopath);
+	free(trie->nopathcand);
+	abuf_free_type(trie, struct pe_prefixtrie);
+}
+
+/**
+ * Add the rule <code>rule</code> to the prefix trie. Rules must be
+ * added in ascending index order. This function must not be called
+ * after pe_prefixtrie_finish.
+ *
+ * @param trie The prefix trie.
+ * @param str The path prefix associated with the rule (may be NULL).
+ * @param rule The actual rule.
+ * @param idx The index of the rule.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+int
+pe_prefixtrie_add(struct pe_prefixtrie *trie, const char *str,
+    struct apn_rule *rule, int idx)
+{
+	struct trie_node	*node = &trie->root;
+
+	if (trie->finished)
+		return -EINVAL;
+	if (str == NULL)
+		return trie_append(&trie->nopath, &trie->nnopath, rule, idx);
+	/*
+	 * A relative prefix can never be a prefix of an absolute path.
+	 * The prefix hash never returns such rules either.
+	 */
+	if (str[0] != '/')
+		return 0;
+	while (1) {
+		const char	*end;
+
+		while (*str == '/')
+			str++;
+		if (*str == 0)
+			break;
+		for (end = str; *end && *end != '/'; ++end)
+			;
+		node = trie_get_child(node, str, end - str);
+		if (!node)
+			return -ENOMEM;
+		str = end;
+	}
+	return trie_append(&node->own, &node->nown, rule, idx);
+}
+
+/**
+ * Convert a sorted candidate list into a list of rule pointers.
+ *
+ * @param list The candidate list.
+ * @param cnt The number of entries in the list.
+ * @param cntp The number of rules is returned here.
+ * @return The list of rule pointers or NULL if the list is empty or
+ *     memory allocation failed. If cnt is not zero and NULL is returned
+ *     memory allocation failed.
+ */
+static struct apn_rule **
+trie_rulelist(const struct trie_cand *list, unsigned int cnt,
+    unsigned int *cntp)
+{
+	struct apn_rule		**ret;
+	unsigned int		  i;
+
+	(*cntp) = 0;
+	if (cnt == 0)
+		return NULL;
+	ret = malloc(cnt * sizeof(struct apn_rule *));
+	if (!ret)
+		return NULL;
+	for (i=0; i<cnt; ++i)
+		ret[i] = list[i].rule;
+	(*cntp) = cnt;
+	return ret;
+}
+
+/**
+ * Precompute the candidate lists of a node and all of its children.
+ *
+ * @param node The node.
+ * @param parent The sorted list of rules attached to the ancestors
+ *     of the node.
+ * @param nparent The number of entries in the parent list.
+ * @param isroot True if this is the root node. The root node always
+ *     gets a candidate list.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+trie_finish_node(struct trie_node *node, const struct trie_cand *parent,
+    unsigned int nparent, int isroot)
+{
+	const struct trie_cand	*list = parent;
+	struct trie_cand	*merged = NULL;
+	unsigned int		 cnt = nparent, i;
+	int			 ret = 0;
+
+	if (node->nown) {
+		unsigned int	p = 0, o = 0;
+
+		cnt = nparent + node->nown;
+		merged = malloc(cnt * sizeof(struct trie_cand));
+		if (!merged)
+			return -ENOMEM;
+		for (i=0; i<cnt; ++i) {
+			if (o == node->nown || (p < nparent
+			    && parent[p].idx < node->own[o].idx))
+				merged[i] = parent[p++];
+			else
+				merged[i] = node->own[o++];
+		}
+		list = merged;
+		free(node->own);
+		node->own = NULL;
+		node->nown = 0;
+	}
+	if (merged || isroot) {
+		node->cand = trie_rulelist(list, cnt, &node->ncand);
+		if (cnt && !node->cand) {
+			free(merged);
+			return -ENOMEM;
+		}
+		node->hascand = 1;
+	}
+	for (i=0; ret == 0 && i<node->nchild; ++i)
+		ret = trie_finish_node(&node->child[i], list, cnt, 0);
+	free(merged);
+	return ret;
+}
+
+/**
+ * Precompute the candidate lists of the trie. This must be called
+ * after all rules are added and before the first lookup.
+ *
+ * @param trie The prefix trie.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+int
+pe_prefixtrie_finish(struct pe_prefixtrie *trie)
+{
+	int	ret;
+
+	if (trie->finished)
+		return 0;
+	trie->nopathcand = trie_rulelist(trie->nopath, trie->nnopath,
+	    &trie->nnopathcand);
+	if (trie->nnopath && !trie->nopathcand)
+		return -ENOMEM;
+	ret = trie_finish_node(&trie->root, trie->nopath, trie->nnopath, 1);
+	if (ret < 0)
+		return ret;
+	free(trie->nopath);
+	trie->nopath = NULL;
+	trie->nnopath = 0;
+	trie->finished = 1;
+	return 0;
+}
+
+/**
+ * Find all rules registered in the prefix trie that might match a given
+ * path name. This function does _not_ check if the rules actually match.
+ * However, it guarantees that all rules that match the path name are
+ * within the list of rule candidates. The rules are returned in index
+ * order.
+ *
+ * @param trie The prefix trie. pe_prefixtrie_finish must have been called.
+ * @param str The path name string (may be NULL).
+ * @param rules An apnarr_array that contains pointers to struct apn_rules.
+ *     The array refers to memory owned by the trie. The caller must
+ *     not free it and must not use it after the trie is destroyed.
+ * @return Zero in case of success, a negative error code in case of an error.
+ */
+int
+pe_prefixtrie_getrules(struct pe_prefixtrie *trie, const char *str,
+    struct apnarr_array *rules)
+{
+	struct trie_node	*node = &trie->root, *best = &trie->root;
+	struct apn_rule		**cand;
+	unsigned int		  ncand;
+
+	(*rules) = apnarr_EMPTY;
+	if (!trie->finished)
+		return -EINVAL;
+	if (str && str[0] != '/')
+		return -EINVAL;
+	if (str == NULL) {
+		cand = trie->nopathcand;
+		ncand = trie->nnopathcand;
+	} else {
+		while (1) {
+			const char	*end;
+
+			while (*str == '/')
+				str++;
+			if (*str == 0)
+				break;
+			for (end = str; *end && *end != '/'; ++end)
+				;
+			node = trie_find_child(node, str, end - str, NULL);
+			if (!node)
+				break;
+			if (node->hascand)
+				best = node;
+			str = end;
+		}
+		cand = best->cand;
+		ncand = best->ncand;
+	}
+	if (ncand)
+		(*rules) = apnarr_open(abuf_open_frommem(cand,
+		    ncand * sizeof(struct apn_rule *)));
+	return 0;
+}
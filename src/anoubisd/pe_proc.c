@@ -65,6 +65,7 @@ static int			 have_task_tracking = 0;
 
 static void			 pe_proc_track(struct pe_proc *);
 static void			 pe_proc_untrack(struct pe_proc *);
+static void			 pe_proc_refresh(struct pe_proc *);
 static struct pe_proc		*pe_proc_alloc(uid_t uid, anoubis_cookie_t,
 				    struct pe_proc_ident *, anoubis_cookie_t);
 static inline unsigned int	 pe_proc_get_flag(struct pe_proc *,
@@ -86,6 +87,84 @@ static inline void		 pe_proc_secure_inherit(struct pe_proc *,
  */
 TAILQ_HEAD(tracker, pe_proc) tracker;
 
+/**
+ * The next process in the tracker list that pe_proc_refresh_stale will
+ * look at and the policy database generation that it is refreshing
+ * processes for. Processes before the cursor are up to date.
+ */
+static struct pe_proc		*refresh_cursor;
+static unsigned long		 refresh_gen;
+
+#define PROCHASH_SHIFT		(13)
+#define PROCHASH_NRENTRY	(1<<PROCHASH_SHIFT)
+
+/**
+ * All processes in the tracker list are also linked into this hash
+ * table. The slot is determined by the task cookie, see prochash_fn.
+ * This avoids a walk of the complete tracker list for each event.
+ */
+static TAILQ_HEAD(, pe_proc) prochash_tab[PROCHASH_NRENTRY];
+
+/**
+ * Map a task cookie to a slot in the process hash. Task cookies are
+ * usually assigned sequentially by the kernel. A multiplicative hash
+ * spreads them evenly across the slots even if only some of the bits
+ * change.
+ *
+ * @param cookie The task cookie.
+ * @return A value between zero and PROCHASH_NRENTRY-1 (inclusive).
+ */
+static inline unsigned int
+prochash_fn(anoubis_cookie_t cookie)
+{
+	uint64_t	val = (uint64_t)cookie;
+
+	val *= 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(val >> (64 - PROCHASH_SHIFT));
+}
+
+/**
+ * Move a process to the front of its slot in the process hash.
+ * Lookups for busy processes are usually followed by more lookups
+ * for the same cookie.
+ *
+ * @param slot The hash slot of the process.
+ * @param proc The process. It must be linked into the given slot.
+ */
+static inline void
+pe_proc_hash_promote(unsigned int slot, struct pe_proc *proc)
+{
+	if (proc == TAILQ_FIRST(&prochash_tab[slot]))
+		return;
+	TAILQ_REMOVE(&prochash_tab[slot], proc, hash_link);
+	TAILQ_INSERT_HEAD(&prochash_tab[slot], proc, hash_link);
+}
+
+/**
+ * Find the process with the given task cookie in the process hash.
+ * No reference is taken on the process.
+ *
+ * NOTE: This modifies the hash chain. A process that is found is
+ *     moved to the front of its slot (see pe_proc_hash_promote).
+ *
+ * @param cookie The task cookie.
+ * @return The process or NULL if the cookie is not tracked.
+ */
+static struct pe_proc *
+pe_proc_lookup(anoubis_cookie_t cookie)
+{
+	unsigned int	 slot = prochash_fn(cookie);
+	struct pe_proc	*proc;
+
+	TAILQ_FOREACH(proc, &prochash_tab[slot], hash_link) {
+		if (proc->task_cookie == cookie)
+			break;
+	}
+	if (proc)
+		pe_proc_hash_promote(slot, proc);
+	return proc;
+}
+
 /**
  * Fill the process identifier with a copy of the data given as parameters.
  * Any memory associated with the old process identifier is freed.
@@ -151,7 +230,13 @@ pe_proc_ident_put(struct pe_proc_ident *pident)
 void
 pe_proc_init(void)
 {
+	int	i;
+
 	TAILQ_INIT(&tracker);
+	refresh_cursor = NULL;
+	refresh_gen = 0;
+	for (i=0; i<PROCHASH_NRENTRY; ++i)
+		TAILQ_INIT(&prochash_tab[i]);
 }
 
 /**
@@ -172,7 +257,9 @@ pe_proc_shutdown(void)
 /**
  * Return the process structure for the given task cookie. If a process
  * with the given task cookie exists, a reference to its proc structure is
- * acquired and a pointer to the structure is returned.
+ * acquired and a pointer to the structure is returned. The contexts of
+ * the process are refreshed first if the policy database changed since
+ * the last refresh.
  *
  * @param cookie The task cookie.
  * @return NULL if the process is not tracked or a pointer to the proc
@@ -183,14 +270,13 @@ pe_proc_get(anoubis_cookie_t cookie)
 {
 	struct pe_proc	*proc;
 
-	TAILQ_FOREACH(proc, &tracker, entry) {
-		if (proc->task_cookie == cookie)
-			break;
-	}
+	proc = pe_proc_lookup(cookie);
 	if (proc) {
 		DEBUG(DBG_PE_TRACKER, "pe_proc_get: proc %p pid %d cookie "
 		    "0x%08" PRIx64, proc, (int)proc->pid, proc->task_cookie);
 		proc->refcount++;
+		if (proc->dbgen != pe_user_generation())
+			pe_proc_refresh(proc);
 	}
 	return (proc);
 }
@@ -302,6 +388,7 @@ pe_proc_alloc(uid_t uid, anoubis_cookie_t cookie, struct pe_proc_ident *pident,
 #endif
 	proc->ident.pathhint = NULL;
 	proc->ident.csum = ABUF_EMPTY;
+	proc->dbgen = pe_user_generation();
 	if (pident)
 		pe_proc_ident_set(&proc->ident, pident->csum, pident->pathhint);
 	DEBUG(DBG_PE_TRACKER, "pe_proc_alloc: proc %p uid %u cookie 0x%08"
@@ -321,9 +408,9 @@ oom:
 }
 
 /**
- * Add the given process to the global list of tracked processes.
- * This function takes an additional reference count on the process that
- * will be released be pe_proc_untrack.
+ * Add the given process to the global list of tracked processes and
+ * to the process hash. This function takes an additional reference
+ * count on the process that will be released be pe_proc_untrack.
  *
  * @param proc The process.
  */
@@ -339,11 +426,14 @@ pe_proc_track(struct pe_proc *proc)
 	proc->refcount++;
 	proc->instances = 1;
 	TAILQ_INSERT_TAIL(&tracker, proc, entry);
+	TAILQ_INSERT_HEAD(&prochash_tab[prochash_fn(proc->task_cookie)],
+	    proc, hash_link);
 }
 
 /**
- * Remove the process from the list of tracked processes. This function
- * drops the reference on the process that was obtained by pe_proc_track.
+ * Remove the process from the list of tracked processes and from the
+ * process hash. This function drops the reference on the process that
+ * was obtained by pe_proc_track.
  *
  * @param proc The process.
  */
@@ -352,7 +442,11 @@ pe_proc_untrack(struct pe_proc *proc)
 {
 	if (!proc)
 		return;
+	if (proc == refresh_cursor)
+		refresh_cursor = TAILQ_NEXT(proc, entry);
 	TAILQ_REMOVE(&tracker, proc, entry);
+	TAILQ_REMOVE(&prochash_tab[prochash_fn(proc->task_cookie)],
+	    proc, hash_link);
 	pe_proc_put(proc);
 }
 
@@ -628,11 +722,9 @@ void pe_proc_exit(anoubis_cookie_t cookie)
 int
 pe_proc_is_running(anoubis_cookie_t cookie)
 {
-	int ret;
-	struct pe_proc	*proc = pe_proc_get(cookie);
-	ret = proc && (proc->threads > 0 || have_task_tracking == 0);
-	pe_proc_put(proc);
-	return ret;
+	struct pe_proc	*proc = pe_proc_lookup(cookie);
+
+	return proc && (proc->threads > 0 || have_task_tracking == 0);
 }
 
 /**
@@ -803,28 +895,63 @@ pe_proc_flag_transition(struct pe_proc *proc, struct pe_file_event *fevent)
 }
 
 /**
- * Refresh process contexts after a new policy database was loaded.
- * This iterates over all processes and creates new process contexts that
- * reference the newly loaded policies. No context switches happen.
+ * Refresh the contexts of a process after a new policy database was
+ * activated. The new contexts reference the policies in the active
+ * database. No context switches happen.
  *
- * @param newpdb The new policy database.
+ * @param proc The process.
  * @return None.
  */
-void
-pe_proc_update_db(struct pe_policy_db *newpdb)
+static void
+pe_proc_refresh(struct pe_proc *proc)
+{
+	int	i;
+
+	DEBUG(DBG_PE_POLICY, "pe_proc_refresh: proc %p generation %lu -> %lu",
+	    proc, proc->dbgen, pe_user_generation());
+	proc->dbgen = pe_user_generation();
+	for (i = 0; i < PE_PRIO_MAX; i++)
+		pe_context_refresh(proc, i);
+}
+
+/**
+ * Refresh the contexts of processes that still use an old policy
+ * database. Processes are usually refreshed with their next event
+ * (see pe_proc_get). This function is called periodically to refresh
+ * idle processes, too. Otherwise they would keep old policy databases
+ * alive for a long time. The number of processes that are refreshed
+ * per call is limited to avoid long delays. Each call continues where
+ * the previous call for the same database generation stopped.
+ *
+ * @param max The maximum number of processes to refresh.
+ * @return The number of processes that were refreshed.
+ */
+int
+pe_proc_refresh_stale(int max)
 {
 	struct pe_proc		*proc;
-	int			 i;
+	unsigned long		 gen = pe_user_generation();
+	int			 cnt = 0;
 
-	if (newpdb == NULL) {
-		log_warnx("pe_proc_update_db: empty database pointer");
-		return;
+	if (pe_user_retired_dbs() == 0)
+		return 0;
+	/*
+	 * New processes are added at the tail of the tracker list and
+	 * they always use the current generation.
+	 */
+	if (refresh_gen != gen) {
+		refresh_gen = gen;
+		refresh_cursor = TAILQ_FIRST(&tracker);
 	}
-
-	TAILQ_FOREACH(proc, &tracker, entry) {
-		for (i = 0; i < PE_PRIO_MAX; i++)
-			pe_context_refresh(proc, i, newpdb);
+	for (proc = refresh_cursor; proc && cnt < max;
+	    proc = TAILQ_NEXT(proc, entry)) {
+		if (proc->dbgen == gen)
+			continue;
+		pe_proc_refresh(proc);
+		cnt++;
 	}
+	refresh_cursor = proc;
+	return cnt;
 }
 
 /**
@@ -857,7 +984,7 @@ pe_proc_update_db_one(struct apn_ruleset *oldrs, int prio, uid_t uid)
 			continue;
 		if ((pe_context_uses_rs(oldctx, oldrs) != 0)
 		    || (oldrs == NULL && pe_proc_get_uid(proc) == uid)) {
-			pe_context_refresh(proc, prio, NULL);
+			pe_context_refresh(proc, prio);
 		}
 	}
 	DEBUG(DBG_TRACE, "<pe_proc_update_db_one");
@@ -60,6 +60,12 @@ struct pe_proc {
 	 */
 	TAILQ_ENTRY(pe_proc)	 entry;
 
+	/**
+	 * Used to link all processes with the same hash value of
+	 * their task cookie in one slot of the process hash.
+	 */
+	TAILQ_ENTRY(pe_proc)	 hash_link;
+
 	/**
 	 * The reference count of this sturcture. The structure is
 	 * kept alive as long as there is at least one reference count
@@ -141,6 +147,14 @@ struct pe_proc {
 	 * context from. This is NULL if the current context is not borrowed.
 	 */
 	struct pe_context	*saved_ctx[PE_PRIO_MAX];
+
+	/**
+	 * The generation of the policy database that was active when
+	 * the contexts of the process were last refreshed. If this differs
+	 * from the generation of the active database, the contexts are
+	 * refreshed before the process is used (see pe_proc_get).
+	 */
+	unsigned long		 dbgen;
 };
 
 #endif	/* _PE_PROC_INTERNALS_H_ */
@@ -165,12 +165,13 @@ pe_sb_evaluate(struct apnarr_array rulelist, struct pe_file_event *sbevent,
 			    sbrule->rule.sbaccess.cs.value.uid, &csum);
 			break;
 		case APN_CS_KEY_SELF: {
-			char	*keyid;
-			keyid = cert_keyid_for_uid(sbevent->uid);
-			if (!keyid)
+			struct cert	*cert;
+
+			cert = cert_get_by_uid(sbevent->uid);
+			if (!cert)
 				break;
-			ret = sfshash_get_key(sbevent->path, keyid, &csum);
-			free(keyid);
+			ret = sfshash_get_keyid(sbevent->path, cert->keyid,
+			    &csum);
 			break;
 		}
 		case APN_CS_KEY:
@@ -235,7 +236,7 @@ err:
 
 /**
  * Return a list of candidate sandbox rules of the given  process that
- * might match the given path. The prefix hash is used to find candidate
+ * might match the given path. The prefix index is used to find candidate
  * rules. It is not guaranteed that all candidate rules in fact match.
  * This must be verified by the caller.
  *
@@ -243,16 +244,17 @@ err:
  * @param uid The uid of the process.
  * @param prio The rule priority.
  * @param path The path to find candidates for.
- * @param rulelist The rule list is returned here.
+ * @param blockp The rule block that the rules belong to is returned here.
+ * @param rulelist The rule list is returned here. The list must be
+ *     released with pe_prefix_putrules.
  * @return Zero in case of success, a negative error code in case of
  *     an error.
  */
 int
 pe_sb_getrules(struct pe_proc *proc, uid_t uid, int prio, const char *path,
-    struct apnarr_array *rulelist)
+    struct apn_rule **blockp, struct apnarr_array *rulelist)
 {
 	struct apn_rule	*sbrules;
-	int		 error;
 	int		 ispg = (pe_proc_get_playgroundid(proc) != 0);
 
 	/*
@@ -283,6 +285,7 @@ pe_sb_getrules(struct pe_proc *proc, uid_t uid, int prio, const char *path,
 	}
 
 	(*rulelist) = apnarr_EMPTY;
+	(*blockp) = sbrules;
 	/*
 	 * Give the next priority a chance if we do not have
 	 * any policy. This is default allow.
@@ -290,12 +293,7 @@ pe_sb_getrules(struct pe_proc *proc, uid_t uid, int prio, const char *path,
 	if (!sbrules)
 		return (0);
 
-	if (!sbrules->userdata) {
-		error = pe_build_prefixhash(sbrules);
-		if (error < 0)
-			return error;
-	}
-	return pe_prefixhash_getrules(sbrules->userdata, path, rulelist);
+	return pe_prefix_getrules(sbrules, path, rulelist);
 }
 
 /**
@@ -363,10 +361,11 @@ pe_decide_sandbox(struct pe_proc *proc, struct pe_file_event *sbevent)
 	final.decision = -1;
 	for (i=0; i<PE_PRIO_MAX; ++i) {
 		struct apnarr_array	rulelist;
+		struct apn_rule		*block = NULL;
 		int			error;
 
 		error = pe_sb_getrules(proc, sbevent->uid, i, sbevent->path,
-		    &rulelist);
+		    &block, &rulelist);
 		if (error < 0) {
 			final.decision = APN_ACTION_DENY;
 			break;
@@ -382,7 +381,7 @@ pe_decide_sandbox(struct pe_proc *proc, struct pe_file_event *sbevent)
 		pe_sb_evaluate(rulelist, sbevent, &res[0], APN_SBA_READ, i);
 		pe_sb_evaluate(rulelist, sbevent, &res[1], APN_SBA_WRITE, i);
 		pe_sb_evaluate(rulelist, sbevent, &res[2], APN_SBA_EXEC, i);
-		apnarr_free(rulelist);
+		pe_prefix_putrules(block, rulelist);
 
 		/*
 		 * If any of the events results in DENY we are done here.
@@ -134,12 +134,12 @@ pe_sfs_match_one(struct apn_rule *rule, struct pe_file_event *fevent,
 		sfshash_get_uid(fevent->path, fevent->uid, &csum);
 		break;
 	case APN_CS_KEY_SELF: {
-		char		*keyid;
-		keyid = cert_keyid_for_uid(fevent->uid);
-		if (!keyid)
+		struct cert	*cert;
+
+		cert = cert_get_by_uid(fevent->uid);
+		if (!cert)
 			break;
-		sfshash_get_key(fevent->path, keyid, &csum);
-		free(keyid);
+		sfshash_get_keyid(fevent->path, cert->keyid, &csum);
 		break;
 	}
 	}
@@ -176,26 +176,28 @@ pe_sfs_match_one(struct apn_rule *rule, struct pe_file_event *fevent,
 
 /**
  * Get a list of rule candidates that might match the given path.
- * The prefix hash is used to get a list of candidates. The list will
+ * The prefix index is used to get a list of candidates. The list will
  * contain all rules that match but additional rule that do not match
  * may be included, too. The caller must verify this.
  *
  * @param uid The user ID of the user.
  * @param prio The priority of the ruleset.
  * @param path The path prefix to find candidates for.
- * @param rulesp The rules are returned in this array.
+ * @param blockp The rule block that the rules belong to is returned here.
+ * @param rulesp The rules are returned in this array. The array must be
+ *     released with pe_prefix_putrules.
  * @return Zero in case of success, a negative error code in case of
  *     an erorr.
  */
 int
 pe_sfs_getrules(uid_t uid, int prio, const char *path,
-	struct apnarr_array *rulesp)
+	struct apn_rule **blockp, struct apnarr_array *rulesp)
 {
 	struct apn_ruleset	*rs;
 	struct apn_rule		*sfsrules;
-	int			 error;
 
 	(*rulesp) = apnarr_EMPTY;
+	(*blockp) = NULL;
 	rs = pe_user_get_ruleset(uid, prio, NULL);
 	if (rs == NULL)
 		return 0;
@@ -208,13 +210,9 @@ pe_sfs_getrules(uid_t uid, int prio, const char *path,
 
 	if (TAILQ_EMPTY(&sfsrules->rule.chain))
 		return 0;
-	if (sfsrules->userdata == NULL) {
-		error = pe_build_prefixhash(sfsrules);
-		if (error < 0)
-			return error;
-	}
+	(*blockp) = sfsrules;
 
-	return pe_prefixhash_getrules(sfsrules->userdata, path, rulesp);
+	return pe_prefix_getrules(sfsrules, path, rulesp);
 }
 
 /**
@@ -256,6 +254,7 @@ pe_decide_sfs(struct pe_proc *proc, struct pe_file_event *fevent)
 
 	for (i = 0; i < PE_PRIO_MAX; i++) {
 		struct apnarr_array	  rules = apnarr_EMPTY;
+		struct apn_rule		 *block = NULL;
 		size_t			  r, rulecnt;
 
 		if (secure
@@ -266,7 +265,8 @@ pe_decide_sfs(struct pe_proc *proc, struct pe_file_event *fevent)
 			continue;
 		}
 
-		if (pe_sfs_getrules(fevent->uid, i, fevent->path, &rules) < 0) {
+		if (pe_sfs_getrules(fevent->uid, i, fevent->path,
+		    &block, &rules) < 0) {
 			decision = APN_ACTION_DENY;
 			break;
 		}
@@ -314,7 +314,7 @@ pe_decide_sfs(struct pe_proc *proc, struct pe_file_event *fevent)
 			    "rule %d prio %d", decision, rule_id, prio);
 			break;
 		}
-		apnarr_free(rules);
+		pe_prefix_putrules(block, rules);
 		if (decision != -1 && decision != APN_ACTION_ALLOW)
 			break;
 	}
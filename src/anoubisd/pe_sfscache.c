@@ -30,7 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <ctype.h>
+#include <limits.h>
 #include <sys/types.h>
 
 #include <sys/queue.h>
@@ -46,86 +46,265 @@
 #define CSTYPE_KEY		2
 
 
+/**
+ * The maximum length of a binary key-ID.
+ */
+#define SFSHASH_MAXKEYLEN	 (64)
+
 /**
  * This structure represents a single entry in the sfs checksum cache.
- * It contains a checksum and the path and uid/key.
+ * It contains a checksum and the path and uid/key. The checksum (if any),
+ * the binary key-ID and the path are stored inline at the end of the
+ * structure, i.e. each entry is a single memory allocation.
  */
 struct sfshash_entry {
 	TAILQ_ENTRY(sfshash_entry)	hash_link;
 	TAILQ_ENTRY(sfshash_entry)	lru_link;
+	/** The full hash value of path and uid/key. */
+	u_int32_t			hv;
 	int				cstype;
-	int				slot;
-	union {
-		char			*key;
-		uid_t			 uid;
-	} u;
-	char				*path;
-	struct abuf_buffer		 csum;
+	uid_t				uid;
+	/** The number of bytes accounted for this entry. */
+	unsigned int			size;
+	/** The length of the checksum (zero for negative entries). */
+	unsigned short			csumlen;
+	/** The length of the binary key-ID (CSTYPE_KEY only). */
+	unsigned short			keylen;
+	/** Checksum, binary key-ID and NUL-terminated path. */
+	u_int8_t			data[0];
+};
+
+#define ENTRY_CSUM(E)		((E)->data)
+#define ENTRY_KEY(E)		((E)->data + (E)->csumlen)
+#define ENTRY_PATH(E)		((char *)(E)->data + (E)->csumlen + (E)->keylen)
+
+TAILQ_HEAD(sfshash_list, sfshash_entry);
+
+/**
+ * The cache is split into shards. The shard of an entry is determined
+ * by the topmost bits of its hash value. Each shard has its own hash
+ * table, LRU list and an equal share of the memory limit.
+ */
+#define SFSHASH_SHARDSHIFT	 (4)
+#define SFSHASH_NSHARD		 (1<<SFSHASH_SHARDSHIFT)
+
+/**
+ * Initial and maximum number of hash slots per shard. The hash table
+ * of a shard grows if there are more than SFSHASH_LOAD entries per slot
+ * on average.
+ */
+#define SFSHASH_INITSLOTS	 (512)
+#define SFSHASH_MAXSLOTS	 (1<<20)
+#define SFSHASH_LOAD		 (2)
+
+/**
+ * A single shard of the sfs cache.
+ */
+struct sfshash_shard {
+	struct sfshash_list		*tab;
+	unsigned int			 tabsize;
+	struct sfshash_list		 lru;
+	unsigned int			 entries;
+	unsigned long			 bytes;
+	u_int64_t			 evictions;
 };
 
-#define SFSHASH_SHIFT		 (13)
-#define SFSHASH_NRENTRY		 (1<<13)
-#define SFSHASH_MASK		 (SFSHASH_NRENTRY-1)
-#define SFSHASH_MAX		 (4*SFSHASH_NRENTRY)
+static struct sfshash_shard	sfshash_shards[SFSHASH_NSHARD];
 
-TAILQ_HEAD(, sfshash_entry)	sfshash_tab[SFSHASH_NRENTRY];
-TAILQ_HEAD(, sfshash_entry)	sfshash_lru;
-int				sfshash_entries;
+/**
+ * The maximum number of bytes that all cache entries may use.
+ */
+static unsigned long		sfshash_limit = ANOUBISD_SFSCACHE_SIZE;
+
+/**
+ * The number of checksum requests that were answered from the cache
+ * (hits) or required a lookup in the on-disk checksum tree (misses).
+ */
+static u_int64_t		sfshash_hits;
+static u_int64_t		sfshash_misses;
+
+/**
+ * Number of probes per path in the negative lookup filter, the minimum
+ * size of the filter and the number of bits per file in the SFS tree.
+ */
+#define SFSFILTER_PROBES	 (4)
+#define SFSFILTER_MINBITS	 (1<<16)
+#define SFSFILTER_BITSPERFILE	 (16)
+
+/**
+ * A bloom filter that contains the path hash of all files that have
+ * a checksum or signature in the SFS tree. Lookups for path names that
+ * are not in the filter are answered without a lookup in the SFS tree
+ * and without creating a negative cache entry. This is the common case
+ * as most files do not have a checksum. The filter is only used if
+ * the SFS tree could be scanned completely. The filter is built once
+ * at startup and then maintained incrementally: New checksums are added
+ * when the master reports them with an invalidate message. Removed
+ * checksums are not removed from the filter, i.e. the filter might
+ * produce more false positives until the daemon is restarted.
+ */
+struct sfshash_filter {
+	u_int8_t	*bits;
+	u_int32_t	 mask;
+	/** The number of path hashes added to the filter. */
+	unsigned int	 nfiles;
+	/** The number of lookups that were answered by the filter. */
+	u_int64_t	 filtered;
+};
+
+static struct sfshash_filter	sfshash_filter;
+
+/**
+ * Return the shard that is responsible for a given hash value.
+ *
+ * @param hv The hash value.
+ * @return The shard.
+ */
+static inline struct sfshash_shard *
+sfshash_shard(u_int32_t hv)
+{
+	return &sfshash_shards[hv >> (32 - SFSHASH_SHARDSHIFT)];
+}
+
+/**
+ * Return the hash slot of a hash value within its shard.
+ *
+ * @param shard The shard.
+ * @param hv The hash value.
+ * @return The hash slot.
+ */
+static inline struct sfshash_list *
+sfshash_slot(struct sfshash_shard *shard, u_int32_t hv)
+{
+	return &shard->tab[hv & (shard->tabsize - 1)];
+}
 
 /**
  * Initialize the sfshash. This must be called at program startup
  * before the hash is used for the first time. This hash itself
- * cannot be destroyed.
+ * cannot be destroyed. Calling this function again flushes the hash.
  */
 void
 sfshash_init(void)
 {
-	int i;
+	int		 i;
+	unsigned int	 j;
 
-	TAILQ_INIT(&sfshash_lru);
-	for (i=0; i<SFSHASH_NRENTRY; ++i)
-		TAILQ_INIT(&sfshash_tab[i]);
-	sfshash_entries = 0;
+	for (i=0; i<SFSHASH_NSHARD; ++i) {
+		struct sfshash_shard	*shard = &sfshash_shards[i];
+
+		if (shard->tab) {
+			sfshash_flush();
+			continue;
+		}
+		TAILQ_INIT(&shard->lru);
+		shard->tab = malloc(SFSHASH_INITSLOTS
+		    * sizeof(struct sfshash_list));
+		if (shard->tab == NULL) {
+			log_warn("sfshash_init: Out of memory");
+			master_terminate();
+		}
+		shard->tabsize = SFSHASH_INITSLOTS;
+		for (j=0; j<shard->tabsize; ++j)
+			TAILQ_INIT(&shard->tab[j]);
+		shard->entries = 0;
+		shard->bytes = 0;
+	}
 }
 
 /**
- * This is the hash function that is used to convert a path and a
- * Key-ID and User-ID to a hash value. The caller should either specify
- * the user-ID as (uid_t)-1 or the Key-ID as NULL.
+ * Calculate the hash value of a path name. This value is calculated
+ * once per lookup. It is used for the negative lookup filter and as
+ * the base of the hash value of the cache entry (see sfshash_fn).
  *
  * @param path The path name of the file.
- * @param key The Key-ID of the key that stored this checksum. This value
- *     can be NULL. If it is not NULL it should be a string of printable hex
- *     digits. These are treated case insensitive.
- * @param uid The user-ID of the user.
- * @return A value between zero and SFSHASH_MASK (inclusive). If the
- *     function is called with the same parameters, it will return the
- *     same value.
- *
- * @note As of today not only the key-ID but also the path name is hashed
- *       case insensitive. This might be better if a file system does not
- *       use case sensitive path names and will probably not lead to
- *       more collisions.
+ * @return The FNV-1a hash value of the path name.
  */
-static unsigned long
-sfshash_fn(const char *path, const char * key, uid_t uid)
+static u_int32_t
+sfshash_pathhash(const char *path)
 {
-	unsigned long ret = uid & SFSHASH_MASK;
+	u_int32_t	ret = 2166136261U;
+
 	for (; *path; path++) {
-		char	tmp = tolower(*path);
-		ret <<= 1;
-		ret ^= tmp;
-		ret = (ret ^ (ret >> SFSHASH_SHIFT)) & SFSHASH_MASK;
+		ret ^= (unsigned char)*path;
+		ret *= 16777619U;
 	}
+	return ret;
+}
+
+/**
+ * This is the hash function that is used to convert a path and a
+ * Key-ID or User-ID to a hash value. The path hash is extended with
+ * the user-ID (CSTYPE_UID) or the binary key-ID (CSTYPE_KEY) and the
+ * result is passed through the finalizer of MurmurHash3.
+ *
+ * @param phash The hash value of the path (see sfshash_pathhash).
+ * @param key The binary Key-ID of the key that stored this checksum
+ *     or NULL for CSTYPE_UID entries.
+ * @param keylen The length of the key-ID.
+ * @param uid The user-ID of the user. Only used if key is NULL.
+ * @return The hash value. If the function is called with the same
+ *     parameters, it will return the same value.
+ */
+static u_int32_t
+sfshash_fn(u_int32_t phash, const u_int8_t *key, unsigned int keylen,
+    uid_t uid)
+{
+	u_int32_t	ret = phash;
+	unsigned int	i;
+
 	if (key) {
-		for (; *key; key++) {
-			char	tmp = tolower(*key);
-			ret <<= 1;
-			ret ^= tmp;
-			ret = (ret ^ (ret >> SFSHASH_SHIFT)) & SFSHASH_MASK;
+		for (i=0; i<keylen; ++i) {
+			ret ^= key[i];
+			ret *= 16777619U;
+		}
+	} else {
+		for (i=0; i<sizeof(uid); ++i) {
+			ret ^= (uid >> (8*i)) & 0xff;
+			ret *= 16777619U;
+		}
+	}
+	ret ^= ret >> 16;
+	ret *= 0x85ebca6bU;
+	ret ^= ret >> 13;
+	ret *= 0xc2b2ae35U;
+	ret ^= ret >> 16;
+	return ret;
+}
+
+/**
+ * Double the size of the hash table of a shard. Nothing happens if
+ * the table already has the maximum size or if memory allocation fails.
+ *
+ * @param shard The shard.
+ * @return None.
+ */
+static void
+sfshash_grow(struct sfshash_shard *shard)
+{
+	struct sfshash_list	*ntab, *otab = shard->tab;
+	unsigned int		 i, osize = shard->tabsize;
+
+	if (osize >= SFSHASH_MAXSLOTS)
+		return;
+	ntab = malloc(2 * osize * sizeof(struct sfshash_list));
+	if (ntab == NULL)
+		return;
+	shard->tab = ntab;
+	shard->tabsize = 2 * osize;
+	for (i=0; i<shard->tabsize; ++i)
+		TAILQ_INIT(&ntab[i]);
+	for (i=0; i<osize; ++i) {
+		struct sfshash_entry	*entry;
+
+		while ((entry = TAILQ_FIRST(&otab[i])) != NULL) {
+			TAILQ_REMOVE(&otab[i], entry, hash_link);
+			TAILQ_INSERT_TAIL(sfshash_slot(shard, entry->hv),
+			    entry, hash_link);
 		}
 	}
-	return ret & SFSHASH_MASK;
+	free(otab);
+	DEBUG(DBG_SFSCACHE, " sfshash_grow: %d slots", shard->tabsize);
 }
 
 /**
@@ -136,50 +315,45 @@ sfshash_fn(const char *path, const char * key, uid_t uid)
 static void
 sfshash_remove_entry(struct sfshash_entry *entry)
 {
-	int slot = entry->slot;
-	int is_key = (entry->cstype & CSTYPE_MASK) == CSTYPE_KEY;
-	int is_uid = (entry->cstype & CSTYPE_MASK) == CSTYPE_UID;
+	struct sfshash_shard	*shard = sfshash_shard(entry->hv);
 
-	DEBUG(DBG_SFSCACHE, ">sfshash_remove_entry: %s %d %s %s", entry->path,
-	    is_uid ? (int)entry->u.uid : -1, is_key ? entry->u.key : NULL,
+	DEBUG(DBG_SFSCACHE, ">sfshash_remove_entry: %s %d %s",
+	    ENTRY_PATH(entry), (int)entry->uid,
 	    (entry->cstype & CSTYPE_NEGATIVE) ? "negative" : "positive");
-	TAILQ_REMOVE(&sfshash_tab[slot], entry, hash_link);
-	TAILQ_REMOVE(&sfshash_lru, entry, lru_link);
-	if (entry->path)
-		free(entry->path);
-	if (is_key)
-		free(entry->u.key);
-	abuf_free(entry->csum);
-	abuf_free_type(entry, struct sfshash_entry);
-	sfshash_entries--;
+	TAILQ_REMOVE(sfshash_slot(shard, entry->hv), entry, hash_link);
+	TAILQ_REMOVE(&shard->lru, entry, lru_link);
+	shard->entries--;
+	shard->bytes -= entry->size;
+	free(entry);
 }
 
 /**
  * Insert a new entry into the sfs hash. This function does fill the
- * new entry it simply inserts it into the hash table. If the total number
- * of entries exceeds the limit SFSHASH_MAX some entries are removed and
- * freed as a side effect. Entries that have not been used for a long
+ * new entry it simply inserts it into the hash table. If the memory used
+ * by the shard exceeds its share of the limit some entries are removed
+ * and freed as a side effect. Entries that have not been used for a long
  * period of time ar removed first.
  *
- * @param slot The hash slot
  * @param entry The new entry.
  */
 static void
-sfshash_insert_entry(int slot, struct sfshash_entry *entry)
+sfshash_insert_entry(struct sfshash_entry *entry)
 {
-	int is_key = (entry->cstype & CSTYPE_MASK) == CSTYPE_KEY;
-	int is_uid = (entry->cstype & CSTYPE_MASK) == CSTYPE_UID;
+	struct sfshash_shard	*shard = sfshash_shard(entry->hv);
 
-	DEBUG(DBG_SFSCACHE, ">sfshash_insert_entry: %s %d %s %s", entry->path,
-	    is_uid ? (int)entry->u.uid : -1, is_key ? entry->u.key : NULL,
+	DEBUG(DBG_SFSCACHE, ">sfshash_insert_entry: %s %d %s",
+	    ENTRY_PATH(entry), (int)entry->uid,
 	    (entry->cstype & CSTYPE_NEGATIVE) ? "negative" : "positive");
-	entry->slot = slot;
-	TAILQ_INSERT_HEAD(&sfshash_tab[slot], entry, hash_link);
-	TAILQ_INSERT_TAIL(&sfshash_lru, entry, lru_link);
-	sfshash_entries++;
-	while(sfshash_entries > SFSHASH_MAX) {
-		sfshash_remove_entry(TAILQ_FIRST(&sfshash_lru));
+	TAILQ_INSERT_HEAD(sfshash_slot(shard, entry->hv), entry, hash_link);
+	TAILQ_INSERT_TAIL(&shard->lru, entry, lru_link);
+	shard->entries++;
+	shard->bytes += entry->size;
+	while(shard->bytes > sfshash_limit / SFSHASH_NSHARD) {
+		sfshash_remove_entry(TAILQ_FIRST(&shard->lru));
+		shard->evictions++;
 	}
+	if (shard->entries > SFSHASH_LOAD * shard->tabsize)
+		sfshash_grow(shard);
 }
 
 /**
@@ -195,11 +369,13 @@ sfshash_insert_entry(int slot, struct sfshash_entry *entry)
 static void
 sfshash_touch(struct sfshash_entry *entry)
 {
-	int slot = entry->slot;
-	TAILQ_REMOVE(&sfshash_tab[slot], entry, hash_link);
-	TAILQ_INSERT_HEAD(&sfshash_tab[slot], entry, hash_link);
-	TAILQ_REMOVE(&sfshash_lru, entry, lru_link);
-	TAILQ_INSERT_TAIL(&sfshash_lru, entry, lru_link);
+	struct sfshash_shard	*shard = sfshash_shard(entry->hv);
+	struct sfshash_list	*slot = sfshash_slot(shard, entry->hv);
+
+	TAILQ_REMOVE(slot, entry, hash_link);
+	TAILQ_INSERT_HEAD(slot, entry, hash_link);
+	TAILQ_REMOVE(&shard->lru, entry, lru_link);
+	TAILQ_INSERT_TAIL(&shard->lru, entry, lru_link);
 }
 
 /**
@@ -211,187 +387,306 @@ sfshash_touch(struct sfshash_entry *entry)
 void
 sfshash_flush(void)
 {
-	while (!TAILQ_EMPTY(&sfshash_lru))
-		sfshash_remove_entry(TAILQ_FIRST(&sfshash_lru));
+	int	i;
+
+	for (i=0; i<SFSHASH_NSHARD; ++i) {
+		struct sfshash_shard	*shard = &sfshash_shards[i];
+
+		if (shard->tab == NULL)
+			continue;
+		while (!TAILQ_EMPTY(&shard->lru))
+			sfshash_remove_entry(TAILQ_FIRST(&shard->lru));
+	}
 }
 
 /**
- * Common code that inserts a new entry into the sfs hash.
+ * Change the maximum amount of memory used by the sfs hash. Entries
+ * are removed immediately if the hash uses more memory than the
+ * new limit allows.
  *
- * @param path The path name of the file.
- * @param csum The checksum. This function takes over ownership for this buffer.
- *     It will be freed once the entry is removed from the hash. It will
- *     be freed in case of an error, too.
- * @param cstype The checksum type: either CSTYPE_UID or CSTYPE_KEY.
- * @param uid For CSTYPE_UID requests this is the user-ID of the user that
- *     stored the checksum. It must be (uid_t)-1 for CSTYPE_KEY requests.
- * @param key For CSTYPE_KEY requests this is the key-ID of the key that
- *     stored the checksum. It must be NULL for CSTYPE_UID requests and
- *     a string of printable hex digits for CSTYPE_KEY requests.
- * @return Zero in case of success, a negative error code in case of an
- *     error.
- *
- * The path name and the key-ID are copied into the sfs entry, i.e. the
- * caller retains ownership of the memory pointed to by path and key.
- * However, ownership of the checksum buffer is taken over by this
- * function and the caller must not free it on its own.
- *
- * This function will _not_ remove a pre-existing entry for the same
- * path/uid or path/key pair. The caller must do a lookup before calling
- * this function.
+ * @param bytes The new limit in bytes. The limit applies to the
+ *     memory of the cache entries (excluding the hash tables). Zero
+ *     disables the cache.
+ * @return None.
  */
-static int
-sfshash_insert_common(const char *path, struct abuf_buffer csum,
-    int cstype, uid_t uid, const char *key)
+void
+sfshash_set_limit(unsigned long bytes)
 {
-	struct sfshash_entry	*entry;
-	int			 slot, ret;
+	int	i;
 
-	entry = abuf_alloc_type(struct sfshash_entry);
-	if (entry == NULL) {
-		abuf_free(csum);
-		return -ENOMEM;
+	sfshash_limit = bytes;
+	for (i=0; i<SFSHASH_NSHARD; ++i) {
+		struct sfshash_shard	*shard = &sfshash_shards[i];
+
+		if (shard->tab == NULL)
+			continue;
+		while (shard->bytes > sfshash_limit / SFSHASH_NSHARD) {
+			sfshash_remove_entry(TAILQ_FIRST(&shard->lru));
+			shard->evictions++;
+		}
 	}
-	ret = -EINVAL;
-	entry->path = NULL;
-	entry->cstype = cstype;
-	entry->csum = csum;
-	switch(cstype & CSTYPE_MASK) {
-	case CSTYPE_UID:
-		entry->u.uid = uid;
-		break;
-	case CSTYPE_KEY:
-		if (!key)
-			goto err;
-		ret = -ENOMEM;
-		entry->u.key = strdup(key);
-		if (entry->u.key == NULL)
-			goto err;
-		break;
-	default:
-		goto err;
+}
+
+/**
+ * Return statistics about the sfs hash. The values are summed up over
+ * all shards.
+ *
+ * @param stats The statistics are returned in this structure.
+ * @return None.
+ */
+void
+sfshash_getstats(struct sfshash_stats *stats)
+{
+	int	i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->limit = sfshash_limit;
+	stats->hits = sfshash_hits;
+	stats->misses = sfshash_misses;
+	stats->filtered = sfshash_filter.filtered;
+	for (i=0; i<SFSHASH_NSHARD; ++i) {
+		struct sfshash_shard	*shard = &sfshash_shards[i];
+
+		stats->evictions += shard->evictions;
+		stats->entries += shard->entries;
+		stats->bytes += shard->bytes;
 	}
-	ret = -ENOMEM;
-	entry->path = strdup(path);
-	if (entry->path == NULL)
-		goto err;
-	slot = sfshash_fn(path, key, uid);
-	sfshash_insert_entry(slot, entry);
-	return 0;
-err:
-	if (entry->path)
-		free(entry->path);
-	if ((entry->cstype & CSTYPE_MASK) == CSTYPE_KEY && entry->u.key)
-		free(entry->u.key);
-	abuf_free(entry->csum);
-	abuf_free_type(entry, struct sfshash_entry);
-	return ret;
 }
 
 /**
- * Insert a new checksum for the given path and user-ID into the
- * hash.
+ * Calculate the second hash value of a path that is used to derive
+ * the positions of the filter bits (double hashing).
  *
- * @param path The path name.
- * @param uid The user-ID of the user.
- * @param csum The checksum. Ownership of the checksum buffer is taken over
- *     by this function. It must not be freed by the caller.
+ * @param phash The path hash.
+ * @return The second hash value. It is always odd.
  */
-static int
-sfshash_insert_uid(const char *path, uid_t uid, struct abuf_buffer csum)
+static inline u_int32_t
+sfshash_filter_hash2(u_int32_t phash)
 {
-	return sfshash_insert_common(path, csum, CSTYPE_UID, uid, NULL);
+	phash ^= phash >> 16;
+	phash *= 0x85ebca6bU;
+	phash ^= phash >> 13;
+	return phash | 1;
 }
 
 /**
- * Insert a negative entry into the sfshash for the given path and user-ID.
- * Subsequent lookups will return -ENOENT for this path/uid pair.
+ * Add a path hash to the negative lookup filter.
  *
- * @param path The path name.
- * @param uid The user-ID.
+ * @param phash The path hash (see sfshash_pathhash).
+ * @return None.
  */
-static int
-sfshash_insert_uid_negative(const char *path, uid_t uid)
+static void
+sfshash_filter_add(u_int32_t phash)
 {
-	return sfshash_insert_common(path, ABUF_EMPTY,
-	    CSTYPE_UID|CSTYPE_NEGATIVE, uid, NULL);
+	u_int32_t	h2 = sfshash_filter_hash2(phash);
+	int		i;
+
+	if (sfshash_filter.bits == NULL)
+		return;
+	for (i=0; i<SFSFILTER_PROBES; ++i, phash += h2) {
+		u_int32_t	bit = phash & sfshash_filter.mask;
+
+		sfshash_filter.bits[bit >> 3] |= (1 << (bit & 7));
+	}
+	sfshash_filter.nfiles++;
 }
 
 /**
- * Insert a new checksum for the given path and key-ID into the hash.
+ * Check if a path might have a checksum in the SFS tree.
  *
- * @param path The path name.
- * @param key The key-ID of the key as a string of printable hey digits.
- * @param csum The checksum data. Ownership of the buffer is taken over
- *     by this function, i.e. the buffer must not be freed by the caller.
+ * @param phash The path hash (see sfshash_pathhash).
+ * @return True if the path is in the filter or if the filter is not
+ *     available, false if the path definitely has no checksum.
  */
 static int
-sfshash_insert_key(const char *path, const char *key, struct abuf_buffer csum)
+sfshash_filter_check(u_int32_t phash)
 {
-	return sfshash_insert_common(path, csum, CSTYPE_KEY, (uid_t)-1, key);
+	u_int32_t	h2 = sfshash_filter_hash2(phash);
+	int		i;
+
+	if (sfshash_filter.bits == NULL)
+		return 1;
+	for (i=0; i<SFSFILTER_PROBES; ++i, phash += h2) {
+		u_int32_t	bit = phash & sfshash_filter.mask;
+
+		if ((sfshash_filter.bits[bit >> 3] & (1 << (bit & 7))) == 0)
+			return 0;
+	}
+	return 1;
 }
 
 /**
- * Insert a negative entry for the path/key-ID into the hash. Subsequent
- * lookups will return -ENOENT for this path/uid pair.
+ * Temporary storage for the path hashes collected during a scan of the
+ * SFS tree.
+ */
+struct sfshash_filter_scan {
+	u_int32_t	*hashes;
+	unsigned int	 count;
+	unsigned int	 size;
+	int		 error;
+};
+
+/**
+ * Callback function for sfs_foreach_file_chroot. Stores the hash
+ * value of the path name.
  *
- * @param path The path name.
- * @param key The key-ID as a string of printable hex digits.
+ * @param path The path name of a file with a checksum or signature.
+ * @param arg The scan state (struct sfshash_filter_scan).
+ * @return None.
  */
-static int
-sfshash_insert_key_negative(const char *path, const char *key)
+static void
+sfshash_filter_collect(const char *path, void *arg)
+{
+	struct sfshash_filter_scan	*scan = arg;
+
+	if (scan->error)
+		return;
+	if (scan->count == scan->size) {
+		unsigned int	 nsize = scan->size ? 2 * scan->size : 1024;
+		u_int32_t	*nhashes;
+
+		nhashes = realloc(scan->hashes, nsize * sizeof(u_int32_t));
+		if (nhashes == NULL) {
+			scan->error = -ENOMEM;
+			return;
+		}
+		scan->hashes = nhashes;
+		scan->size = nsize;
+	}
+	scan->hashes[scan->count++] = sfshash_pathhash(path);
+}
+
+/**
+ * Build the negative lookup filter from the SFS tree. The filter is
+ * disabled if the SFS tree cannot be scanned completely. This scans
+ * the complete SFS tree synchronously and must only be called once
+ * after the cache was initialized. The filter survives sfshash_flush.
+ * Checksums of existing files that are modified without an invalidate
+ * message (e.g. during an upgrade) do not affect the filter.
+ */
+void
+sfshash_load_filter(void)
 {
-	return sfshash_insert_common(path, ABUF_EMPTY,
-	    CSTYPE_KEY|CSTYPE_NEGATIVE, (uid_t)-1, key);
+	struct sfshash_filter_scan	 scan = { NULL, 0, 0, 0 };
+	unsigned int			 i, nbits = SFSFILTER_MINBITS;
+	int				 ret;
+
+	free(sfshash_filter.bits);
+	sfshash_filter.bits = NULL;
+	sfshash_filter.nfiles = 0;
+
+	ret = sfs_foreach_file_chroot(sfshash_filter_collect, &scan);
+	if (ret == 0)
+		ret = scan.error;
+	if (ret < 0) {
+		log_warnx("Cannot scan sfs tree (error %d), negative lookup "
+		    "filter disabled", -ret);
+		free(scan.hashes);
+		return;
+	}
+	while (nbits / SFSFILTER_BITSPERFILE < scan.count && nbits < (1U<<31))
+		nbits *= 2;
+	sfshash_filter.bits = calloc(nbits / 8, 1);
+	if (sfshash_filter.bits) {
+		sfshash_filter.mask = nbits - 1;
+		for (i=0; i<scan.count; ++i)
+			sfshash_filter_add(scan.hashes[i]);
+	}
+	free(scan.hashes);
+	DEBUG(DBG_SFSCACHE, " sfshash_load_filter: %d files, %d bits",
+	    scan.count, nbits);
 }
 
 /**
- * Search for the hash entry for the given path and user-ID.
+ * Common code that inserts a new entry into the sfs hash.
  *
+ * @param phash The hash value of the path name.
  * @param path The path name.
- * @param uid The user-ID.
- * @return A pointer to the hash entry or NULL if no matching entry
- *     was found.
+ * @param csum The checksum data (NULL for negative entries).
+ * @param csumlen The length of the checksum data.
+ * @param cstype The checksum type: either CSTYPE_UID or CSTYPE_KEY
+ *     possibly combined with CSTYPE_NEGATIVE.
+ * @param uid For CSTYPE_UID requests this is the user-ID of the user that
+ *     stored the checksum. It must be (uid_t)-1 for CSTYPE_KEY requests.
+ * @param key For CSTYPE_KEY requests this is the binary key-ID of the
+ *     key that stored the checksum. It must be NULL for CSTYPE_UID
+ *     requests.
+ * @param keylen The length of the key-ID.
+ * @return Zero in case of success, a negative error code in case of an
+ *     error.
+ *
+ * The path name, the key-ID and the checksum are copied into the sfs
+ * entry, i.e. the caller retains ownership of all memory.
+ *
+ * This function will _not_ remove a pre-existing entry for the same
+ * path/uid or path/key pair. The caller must do a lookup before calling
+ * this function.
  */
-static struct sfshash_entry *
-sfshash_find_uid(const char *path, uid_t uid)
+static int
+sfshash_insert_common(u_int32_t phash, const char *path, const void *csum,
+    unsigned int csumlen, int cstype, uid_t uid, const u_int8_t *key,
+    unsigned int keylen)
 {
-	int			 slot = sfshash_fn(path, NULL, uid);
 	struct sfshash_entry	*entry;
+	size_t			 pathlen, size;
 
-	TAILQ_FOREACH(entry, &sfshash_tab[slot], hash_link) {
-		if ((entry->cstype & CSTYPE_MASK) != CSTYPE_UID)
-			continue;
-		if (entry->u.uid != uid)
-			continue;
-		if (strcmp(path, entry->path) == 0)
-			break;
-	}
-	if (entry)
-		sfshash_touch(entry);
-	return entry;
+	if (sfshash_limit == 0)
+		return 0;
+	pathlen = strlen(path) + 1;
+	if (csumlen + keylen + pathlen > USHRT_MAX)
+		return -ENAMETOOLONG;
+	size = sizeof(struct sfshash_entry) + csumlen + keylen + pathlen;
+	entry = malloc(size);
+	if (entry == NULL)
+		return -ENOMEM;
+	entry->hv = sfshash_fn(phash, key, keylen, uid);
+	entry->cstype = cstype;
+	entry->uid = uid;
+	entry->size = size;
+	entry->csumlen = csumlen;
+	entry->keylen = keylen;
+	if (csumlen)
+		memcpy(ENTRY_CSUM(entry), csum, csumlen);
+	if (keylen)
+		memcpy(ENTRY_KEY(entry), key, keylen);
+	memcpy(ENTRY_PATH(entry), path, pathlen);
+	sfshash_insert_entry(entry);
+	return 0;
 }
 
 /**
- * Search for the hash entry for the given path and key-ID.
+ * Search for the hash entry for the given path and user-ID or key-ID.
  *
+ * @param phash The hash value of the path name.
  * @param path The path name.
- * @param key The key-ID as a string of printable hex digits.
+ * @param cstype Either CSTYPE_UID or CSTYPE_KEY.
+ * @param uid The user-ID (CSTYPE_UID only).
+ * @param key The binary key-ID (CSTYPE_KEY only, NULL otherwise).
+ * @param keylen The length of the key-ID.
  * @return A pointer to the hash entry or NULL if no matching entry
  *     was found.
  */
 static struct sfshash_entry *
-sfshash_find_key(const char *path, const char *key)
+sfshash_find(u_int32_t phash, const char *path, int cstype, uid_t uid,
+    const u_int8_t *key, unsigned int keylen)
 {
-	int			 slot = sfshash_fn(path, key, (uid_t)-1);
+	u_int32_t		 hv = sfshash_fn(phash, key, keylen, uid);
+	struct sfshash_shard	*shard = sfshash_shard(hv);
 	struct sfshash_entry	*entry;
 
-	TAILQ_FOREACH(entry, &sfshash_tab[slot], hash_link) {
-		if ((entry->cstype & CSTYPE_MASK) != CSTYPE_KEY)
+	if (shard->tab == NULL)
+		return NULL;
+	TAILQ_FOREACH(entry, sfshash_slot(shard, hv), hash_link) {
+		if (entry->hv != hv)
 			continue;
-		if (strcasecmp(entry->u.key, key) != 0)
+		if ((entry->cstype & CSTYPE_MASK) != cstype)
 			continue;
-		if (strcmp(path, entry->path) == 0)
+		if (cstype == CSTYPE_UID && entry->uid != uid)
+			continue;
+		if (cstype == CSTYPE_KEY && (entry->keylen != keylen
+		    || memcmp(ENTRY_KEY(entry), key, keylen) != 0))
+			continue;
+		if (strcmp(path, ENTRY_PATH(entry)) == 0)
 			break;
 	}
 	if (entry)
@@ -399,6 +694,23 @@ sfshash_find_key(const char *path, const char *key)
 	return entry;
 }
 
+/**
+ * Return a copy of the checksum stored in a cache entry.
+ *
+ * @param entry The entry.
+ * @return A newly allocated buffer with the checksum. The buffer is
+ *     empty if memory allocation fails.
+ */
+static struct abuf_buffer
+sfshash_entry_csum(struct sfshash_entry *entry)
+{
+	struct abuf_buffer	ret = abuf_alloc(entry->csumlen);
+
+	if (!abuf_empty(ret))
+		abuf_copy_tobuf(ret, ENTRY_CSUM(entry), entry->csumlen);
+	return ret;
+}
+
 /**
  * Utility function that converts upper and lower case hex digits to their
  * corresponding integer value.
@@ -423,6 +735,35 @@ chartohex(char ch)
 	return -1;
 }
 
+/**
+ * Convert a key-ID given as a string of printable hex digits into
+ * its binary representation.
+ *
+ * @param key The key-ID string.
+ * @param buf The binary key-ID is stored here. The buffer must be
+ *     SFSHASH_MAXKEYLEN bytes long.
+ * @return The length of the binary key-ID or -ENOENT if the string is
+ *     not a valid key-ID.
+ */
+static int
+sfshash_parsekey(const char *key, u_int8_t *buf)
+{
+	int	i, len = strlen(key);
+
+	if (len % 2 || len / 2 > SFSHASH_MAXKEYLEN)
+		return -ENOENT;
+	len /= 2;
+	for (i=0; i<len; ++i) {
+		int	c1 = chartohex(key[2*i]);
+		int	c2 = chartohex(key[2*i+1]);
+
+		if (c1 < 0 || c2 < 0)
+			return -ENOENT;
+		buf[i] = 16*c1 + c2;
+	}
+	return len;
+}
+
 /**
  * Read the checksum data of the specified type from the on-disk
  * SFS tree. The checksum data (if any) is stored in a new buffer.
@@ -430,9 +771,9 @@ chartohex(char ch)
  *
  * @param path The path name of the file.
  * @param cstype This is either CSTYPE_UID or CSTYPE_KEY
- * @param key The Key-ID for CSTYPE_KEY request. The key-ID is given in
- *     human readable form (i.e. a string of printable hex digits). It
- *     should be NULL if the request type is not CSTYPE_KEY.
+ * @param key The binary Key-ID for CSTYPE_KEY request. It should be
+ *     NULL if the request type is not CSTYPE_KEY.
+ * @param keylen The length of the Key-ID.
  * @param uid The user-ID for CSTYPE_UID requests.
  * @param csum This should point to an emtpy abuf buffer. The buffer
  *     will be allocated and filled with the checksum data in case of success.
@@ -444,14 +785,13 @@ chartohex(char ch)
  *     occurs.
  */
 static int
-sfshash_readsum(const char *path, int cstype, const char *key, uid_t uid,
-    struct abuf_buffer *csum)
+sfshash_readsum(const char *path, int cstype, const u_int8_t *key,
+    unsigned int keylen, uid_t uid, struct abuf_buffer *csum)
 {
 	int			 ret;
 	struct abuf_buffer	 sigbuf = ABUF_EMPTY;
 	struct sfs_checksumop	 csop;
 	struct sfs_data		 tmpdata;
-	struct abuf_buffer	 keybuf = ABUF_EMPTY;
 
 	csop.path = path;
 	csop.sigbuf = ABUF_EMPTY;
@@ -465,36 +805,15 @@ sfshash_readsum(const char *path, int cstype, const char *key, uid_t uid,
 		csop.op = ANOUBIS_CHECKSUM_OP_GET2;
 		csop.keyid = ABUF_EMPTY;
 		break;
-	case CSTYPE_KEY: {
-		int			 i, j, len = strlen(key);
-		uint8_t			*keyptr;
-
+	case CSTYPE_KEY:
 		csop.uid = 0;
 		csop.op = ANOUBIS_CHECKSUM_OP_GETSIG2;
-		if (len % 2)
-			return -ENOENT;
-		len /= 2;
-		keybuf = abuf_alloc(len);
-		if (abuf_empty(keybuf))
-			return -ENOMEM;
-		keyptr = abuf_toptr(keybuf, 0, len);
-		for (i=j=0; i<len; ++i) {
-			int		c1, c2;
-			c1 = chartohex(key[j++]);
-			c2 = chartohex(key[j++]);
-			if (c1 < 0 || c2 < 0) {
-				abuf_free(keybuf);
-				return -ENOENT;
-			}
-			keyptr[i] = 16*c1 + c2;
-		}
-		csop.keyid = keybuf;
+		csop.keyid = abuf_open_frommem((void *)key, keylen);
 		break;
-	} default:
+	default:
 		return -EINVAL;
 	}
 	ret = sfs_checksumop_chroot(&csop, &tmpdata);
-	abuf_free(keybuf);
 	if (ret < 0)
 		return ret;
 	if (cstype == CSTYPE_UID) {
@@ -515,20 +834,66 @@ sfshash_readsum(const char *path, int cstype, const char *key, uid_t uid,
 		return -ENOENT;
 	}
 	/*
-	 * Clone the first ANOUBIS_CS_LEN bytes of the buffer if the buffer
-	 * contains additional data.
+	 * Only return the first ANOUBIS_CS_LEN bytes of the buffer if the
+	 * buffer contains additional data.
 	 */
-	if (abuf_length(sigbuf) > ANOUBIS_CS_LEN) {
-		abuf_limit(&sigbuf, ANOUBIS_CS_LEN);
-		(*csum) = abuf_clone(sigbuf);
-		abuf_free(sigbuf);
+	abuf_limit(&sigbuf, ANOUBIS_CS_LEN);
+	(*csum) = sigbuf;
+
+	return 0;
+}
+
+/**
+ * Common lookup function for signed and unsigned checksums. The
+ * checksum is looked up in the cache first. If it is not found and
+ * the path might have a checksum according to the negative lookup
+ * filter, the checksum is read from the SFS tree and added to the cache.
+ *
+ * @param path The path of the file.
+ * @param cstype The checksum type (CSTYPE_UID or CSTYPE_KEY).
+ * @param uid The user-ID (CSTYPE_UID only).
+ * @param key The binary key-ID (CSTYPE_KEY only, NULL otherwise).
+ * @param keylen The length of the key-ID.
+ * @param csum The checksum data will be returned in this buffer.
+ * @return Zero in case of success, a negative error code in case of an
+ *     error.
+ */
+static int
+sfshash_get(const char *path, int cstype, uid_t uid, const u_int8_t *key,
+    unsigned int keylen, struct abuf_buffer *csum)
+{
+	struct sfshash_entry	*entry;
+	struct abuf_buffer	 tmpbuf = ABUF_EMPTY;
+	u_int32_t		 phash = sfshash_pathhash(path);
+	int			 ret;
+
+	(*csum) = ABUF_EMPTY;
+	entry = sfshash_find(phash, path, cstype, uid, key, keylen);
+	if (entry) {
+		sfshash_hits++;
+		if (entry->cstype & CSTYPE_NEGATIVE)
+			return -ENOENT;
+		(*csum) = sfshash_entry_csum(entry);
 		if (abuf_empty(*csum))
 			return -ENOMEM;
-	} else {
-		(*csum) = sigbuf;
+		return 0;
 	}
-
-	return 0;
+	if (!sfshash_filter_check(phash)) {
+		sfshash_filter.filtered++;
+		return -ENOENT;
+	}
+	sfshash_misses++;
+	ret = sfshash_readsum(path, cstype, key, keylen, uid, &tmpbuf);
+	if (ret == -ENOENT) {
+		sfshash_insert_common(phash, path, NULL, 0,
+		    cstype | CSTYPE_NEGATIVE, uid, key, keylen);
+	} else if (ret == 0) {
+		sfshash_insert_common(phash, path,
+		    abuf_toptr(tmpbuf, 0, ANOUBIS_CS_LEN), ANOUBIS_CS_LEN,
+		    cstype, uid, key, keylen);
+		(*csum) = tmpbuf;
+	}
+	return ret;
 }
 
 /**
@@ -547,49 +912,48 @@ sfshash_readsum(const char *path, int cstype, const char *key, uid_t uid,
 int
 sfshash_get_uid(const char *path, uid_t uid, struct abuf_buffer *csum)
 {
-	struct sfshash_entry	*entry;
-	int			 ret;
-
+	int	ret;
 
 	DEBUG(DBG_SFSCACHE, ">sfshash_get_uid: %s %d", path, (int)uid);
-	(*csum) = ABUF_EMPTY;
-	entry = sfshash_find_uid(path, uid);
-	if (entry) {
-		if (entry->cstype & CSTYPE_NEGATIVE) {
-			DEBUG(DBG_SFSCACHE, "<sfshash_get_uid: ok "
-			    "%s %d (negative)", path, (int)uid);
-			return -ENOENT;
-		}
-		(*csum) = abuf_clone(entry->csum);
-	} else {
-		struct abuf_buffer	 tmpbuf = ABUF_EMPTY;
-		ret = sfshash_readsum(path, CSTYPE_UID, NULL, uid, &tmpbuf);
-		if (ret < 0) {
-			abuf_free(tmpbuf);
-			if (ret == -ENOENT) {
-				sfshash_insert_uid_negative(path, uid);
-				DEBUG(DBG_SFSCACHE, "<sfshash_get_uid: ok "
-				    "%s %d (negative)", path, (int)uid);
-			} else {
-				DEBUG(DBG_SFSCACHE, "<sfshash_get_uid: fail "
-				    "%s %d error %d", path, (int)uid, -ret);
-			}
-			return ret;
-		}
-		(*csum) = abuf_clone(tmpbuf);
-		/* This takes over control of the buffer @tmpbuf. */
-		sfshash_insert_uid(path, uid, tmpbuf);
-	}
-	if (abuf_empty(*csum))
-		return -ENOMEM;
-	DEBUG(DBG_SFSCACHE, "<sfshash_get_uid: ok %s %d ", path, (int)uid);
-	return 0;
+	ret = sfshash_get(path, CSTYPE_UID, uid, NULL, 0, csum);
+	DEBUG(DBG_SFSCACHE, "<sfshash_get_uid: %s %d error %d", path,
+	    (int)uid, -ret);
+	return ret;
 }
 
 /**
- * Return the unsigned signed checksum associated with a given path.
+ * Return the signed checksum associated with a given path.
  * The checksum data (if any) is returned in an abuf_buffer that is
- * allocated by this function and must be freed by the calle.
+ * allocated by this function and must be freed by the caller.
+ *
+ * @param path The path of the file.
+ * @param keyid The binary Key-ID of the key that stored the checksum.
+ * @param csum The checksum data will be returned in this buffer.
+ *     The buffer will be usable but empty if an error is returned.
+ *     The caller is responsible for the memory associated with the buffer.
+ * @return Zero in case of success, a negative error code in case of an
+ *     error.
+ */
+int
+sfshash_get_keyid(const char *path, const struct abuf_buffer keyid,
+    struct abuf_buffer *csum)
+{
+	unsigned int	 keylen = abuf_length(keyid);
+	int		 ret;
+
+	(*csum) = ABUF_EMPTY;
+	if (keylen == 0 || keylen > SFSHASH_MAXKEYLEN)
+		return -ENOENT;
+	ret = sfshash_get(path, CSTYPE_KEY, (uid_t)-1,
+	    abuf_toptr(keyid, 0, keylen), keylen, csum);
+	DEBUG(DBG_SFSCACHE, "<sfshash_get_keyid: %s error %d", path, -ret);
+	return ret;
+}
+
+/**
+ * Return the signed checksum associated with a given path. This is
+ * the same as sfshash_get_keyid except that the key-ID is given as
+ * a string of printable hex digits (e.g. from a policy rule).
  *
  * @param path The path of the file.
  * @param key The Key-ID of the key that stored the checksum. The Key-ID
@@ -603,46 +967,20 @@ sfshash_get_uid(const char *path, uid_t uid, struct abuf_buffer *csum)
 int
 sfshash_get_key(const char *path, const char *key, struct abuf_buffer *csum)
 {
-	struct sfshash_entry	*entry;
-	int			 ret;
+	u_int8_t	buf[SFSHASH_MAXKEYLEN];
+	int		len;
 
-	DEBUG(DBG_SFSCACHE, ">sfshash_get_key: %s %s", path, key);
-	entry = sfshash_find_key(path, key);
-	if (entry) {
-		if (entry->cstype & CSTYPE_NEGATIVE) {
-			DEBUG(DBG_SFSCACHE, "<sfshash_get_key: ok "
-			    "%s %s negative", path, key);
-			return -ENOENT;
-		}
-		(*csum) = abuf_clone(entry->csum);
-	} else {
-		struct abuf_buffer	tmpbuf = ABUF_EMPTY;
-
-		ret = sfshash_readsum(path, CSTYPE_KEY, key, (uid_t)-1,
-		    &tmpbuf);
-		if (ret < 0) {
-			if (ret == -ENOENT) {
-				sfshash_insert_key_negative(path, key);
-				DEBUG(DBG_SFSCACHE, "<sfshash_get_key: ok "
-				    "%s %s negative", path, key);
-			} else {
-				DEBUG(DBG_SFSCACHE, "<sfshash_get_key: fail "
-				    "%s %s error %d", path, key, -ret);
-			}
-			return ret;
-		}
-		(*csum) = abuf_clone(tmpbuf);
-		sfshash_insert_key(path, key, tmpbuf);
-	}
-	if (abuf_empty(*csum))
-		return -ENOMEM;
-	DEBUG(DBG_SFSCACHE, "<sfshash_get_key: ok %s %s", path, key);
-	return 0;
+	(*csum) = ABUF_EMPTY;
+	len = sfshash_parsekey(key, buf);
+	if (len <= 0)
+		return -ENOENT;
+	return sfshash_get_keyid(path, abuf_open_frommem(buf, len), csum);
 }
 
 /**
  * Remove an unsigned checksum from the hash (if it exists). This is
- * used if the checksum data on disk changes.
+ * used if the checksum data on disk changes. The path is added to the
+ * negative lookup filter because the checksum might have been added.
  *
  * @param path The path of the file.
  * @param uid The user-ID of the user that stored the checksum.
@@ -652,25 +990,35 @@ void
 sfshash_invalidate_uid(const char *path,  uid_t uid)
 {
 	struct sfshash_entry	*entry;
+	u_int32_t		 phash = sfshash_pathhash(path);
 
-	if ((entry = sfshash_find_uid(path, uid)))
+	entry = sfshash_find(phash, path, CSTYPE_UID, uid, NULL, 0);
+	if (entry)
 		sfshash_remove_entry(entry);
+	sfshash_filter_add(phash);
 }
 
 /**
  * Remove a signed checksum from the hash (if it exists). This is used if
- * the checksum data on disk changes.
+ * the checksum data on disk changes. The path is added to the negative
+ * lookup filter because the signature might have been added.
  *
  * @param path The path of the file.
- * @param key The Key-ID of the key that stored the signature. The Key-ID
- *     is given as a string of printable hex digits.
+ * @param keyid The binary Key-ID of the key that stored the signature.
  * @return None.
  */
 void
-sfshash_invalidate_key(const char *path, const char *key)
+sfshash_invalidate_keyid(const char *path, const struct abuf_buffer keyid)
 {
 	struct sfshash_entry	*entry;
+	u_int32_t		 phash = sfshash_pathhash(path);
+	unsigned int		 keylen = abuf_length(keyid);
 
-	if ((entry = sfshash_find_key(path, key)))
-		sfshash_remove_entry(entry);
+	if (keylen && keylen <= SFSHASH_MAXKEYLEN) {
+		entry = sfshash_find(phash, path, CSTYPE_KEY, (uid_t)-1,
+		    abuf_toptr(keyid, 0, keylen), keylen);
+		if (entry)
+			sfshash_remove_entry(entry);
+	}
+	sfshash_filter_add(phash);
 }
@@ -43,6 +43,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #ifdef OPENBSD
 #include <sys/limits.h>
 #endif
@@ -59,6 +60,8 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
+#include <openssl/sha.h>
+
 
 
 #ifdef LINUX
@@ -88,6 +91,12 @@ struct pe_user {
 	 */
 	TAILQ_ENTRY(pe_user)	 entry;
 
+	/**
+	 * This is used to link users with the same hash value in one
+	 * slot of the user hash of the policy database.
+	 */
+	TAILQ_ENTRY(pe_user)	 hash_link;
+
 	/**
 	 * The user ID of the user.
 	 */
@@ -100,10 +109,74 @@ struct pe_user {
 	struct apn_ruleset	*prio[PE_PRIO_MAX];
 };
 
+#define PE_USER_HASH_NRENTRY	(1<<10)
+#define PE_USER_HASH_MASK	(PE_USER_HASH_NRENTRY-1)
+
+/**
+ * The policy database. All users are linked in a list. Additionally,
+ * users are indexed by their user ID in a hash table and the default
+ * user (user ID -1) is cached. This makes ruleset lookups for a user
+ * independent of the total number of users with a policy.
+ *
+ * A policy database that was loaded from disk is never modified except
+ * for policies that are replaced by the user (pe_user_insert_rs).
+ * A reload builds a new database and replaces the active database
+ * in one step. Process contexts (and ALF jobs) that still use rules
+ * from the old database hold a reference to it. The old database is
+ * freed when the last reference is dropped. Processes switch to the
+ * new database when they trigger their next event (see pe_proc_get).
+ */
+struct pe_policy_db {
+	/**
+	 * The number of references to this database. The active
+	 * database holds one reference of its own.
+	 */
+	int			 refcount;
+
+	/**
+	 * The generation of the database. Each database that is
+	 * activated gets a new generation number.
+	 */
+	unsigned long		 generation;
+
+	/**
+	 * The list of all users in the database.
+	 */
+	TAILQ_HEAD(, pe_user)	 users;
+
+	/**
+	 * The hash table of all users, indexed by user ID.
+	 */
+	TAILQ_HEAD(, pe_user)	 hash[PE_USER_HASH_NRENTRY];
+
+	/**
+	 * The user structure for the default policies (user ID -1) or
+	 * NULL if there are no default policies.
+	 */
+	struct pe_user		*defuser;
+};
+
 /**
  * The active user database.
  */
-TAILQ_HEAD(pe_policy_db, pe_user) *pdb;
+struct pe_policy_db *pdb;
+
+/**
+ * The generation number of the most recently activated database.
+ */
+static unsigned long		 pe_user_lastgen = 0;
+
+/**
+ * The number of databases that were replaced but are still in use.
+ */
+static int			 pe_user_retired = 0;
+
+/**
+ * Map a user ID to a slot in the user hash of a policy database.
+ * User IDs tend to be assigned sequentially, i.e. the lower bits are
+ * already well distributed.
+ */
+#define PE_USER_HASH(UID)	((unsigned int)(UID) & PE_USER_HASH_MASK)
 
 /**
  * String constants for the policy directories.
@@ -214,12 +287,33 @@ struct pe_policy_request {
  */
 LIST_HEAD(, pe_policy_request) preqs;
 
+/**
+ * The magic number at the start of a compiled policy cache file ("PCC1").
+ */
+#define PE_USER_CACHE_MAGIC	0x50434331U
+
+/**
+ * The header of a compiled policy cache file. The header identifies
+ * the policy source that the cached rule set was compiled from. It is
+ * followed by the serialized rule set (see apn_serialize_ruleset).
+ * A cache file is only used if its header matches the current policy
+ * source exactly.
+ */
+struct pe_user_cache_header {
+	u_int32_t	magic;		/**< PE_USER_CACHE_MAGIC */
+	u_int32_t	flags;		/**< The flags passed to the parser. */
+	u_int64_t	size;		/**< Size of the policy source. */
+	u_int64_t	mtime;		/**< Modification time of the source. */
+	u_int8_t	csum[SHA256_DIGEST_LENGTH]; /**< SHA256 of the source. */
+};
+
 /* Prototypes */
+static struct pe_policy_db	*pe_user_alloc_db(void);
 static int			 pe_user_load_db(struct pe_policy_db *);
 static int			 pe_user_load_dir(const char *, unsigned int,
 				     struct pe_policy_db *);
 static struct apn_ruleset	*pe_user_load_policy(const char *name,
-				     int flags);
+				     int flags, int usecache);
 static void			 pe_user_insert_rs(struct apn_ruleset *,
 				     uid_t, unsigned int,
 				     struct pe_policy_db *);
@@ -237,14 +331,11 @@ pe_user_init(void)
 
 	LIST_INIT(&preqs);
 
-	if ((pp = calloc(1, sizeof(struct pe_policy_db))) == NULL) {
-		log_warn("calloc");
-		master_terminate();
-	}
-	TAILQ_INIT(pp);
+	pp = pe_user_alloc_db();
 
 	/* We die gracefully if loading fails. */
 	count = pe_user_load_db(pp);
+	pp->generation = ++pe_user_lastgen;
 	pdb = pp;
 
 	log_info("pe_user_init: %d policies loaded to pdb %p", count, pp);
@@ -253,9 +344,14 @@ pe_user_init(void)
 /**
  * Reconfigure the user database. This function tries to load the
  * policy data from disk. If this is successful the active policy database
- * is replaced with the new data and the old policy database is freed.
- * Before freeing the old database all contexts in all processes are
- * updated (pe_proc_update_db).
+ * is replaced with the new data. The old database is freed once it is
+ * no longer used by any process context.
+ *
+ * Processes are not updated by this function. Instead, they notice
+ * the new generation of the active database with their next event and
+ * refresh their contexts at that time (pe_proc_get). Thus the time
+ * required to activate a new database does not depend on the number
+ * of processes.
  */
 void
 pe_user_reconfigure(void)
@@ -263,22 +359,111 @@ pe_user_reconfigure(void)
 	struct pe_policy_db	*newpdb, *oldpdb;
 	int			 count;
 
-	if ((newpdb = calloc(1, sizeof(struct pe_policy_db))) == NULL) {
-		log_warn("calloc");
-		master_terminate();
-	}
-	TAILQ_INIT(newpdb);
+	newpdb = pe_user_alloc_db();
 	count = pe_user_load_db(newpdb);
 
-	/* Switch to new policy database */
+	/*
+	 * Switch to new policy database. Jobs of the worker threads
+	 * and process contexts keep the old database alive as long as
+	 * they need it.
+	 */
 	oldpdb = pdb;
+	newpdb->generation = ++pe_user_lastgen;
 	pdb = newpdb;
 
-	pe_proc_update_db(newpdb);
-	pe_user_flush_db(oldpdb);
+	pe_alf_invalidate();
+	pe_user_retired++;
+	pe_user_db_put(oldpdb);
+
+	log_info("pe_user_reconfigure: loaded %d policies to new pdb %p "
+	    "(generation %lu), retired old pdb %p", count, newpdb,
+	    newpdb->generation, oldpdb);
+}
+
+/**
+ * Return the generation of the active policy database. Process contexts
+ * that were created for an older generation must be refreshed.
+ *
+ * @return The generation number.
+ */
+unsigned long
+pe_user_generation(void)
+{
+	return pdb->generation;
+}
+
+/**
+ * Return the number of policy databases that were replaced by a newer
+ * database but are still referenced.
+ *
+ * @return The number of retired databases.
+ */
+int
+pe_user_retired_dbs(void)
+{
+	return pe_user_retired;
+}
+
+/**
+ * Acquire a reference to the active policy database. The rulesets
+ * in the database are not freed while the reference is held, even
+ * if the database is replaced by a reload.
+ *
+ * @return The active database.
+ */
+struct pe_policy_db *
+pe_user_db_get(void)
+{
+	pdb->refcount++;
+	return pdb;
+}
 
-	log_info("pe_user_reconfigure: loaded %d policies to new pdb %p, "
-	    "flushed old pdb %p", count, newpdb, oldpdb);
+/**
+ * Drop a reference to a policy database. If this was the last reference
+ * the database and all of its rulesets are freed.
+ *
+ * @param p The policy database (may be NULL).
+ */
+void
+pe_user_db_put(struct pe_policy_db *p)
+{
+	if (p == NULL || --(p->refcount))
+		return;
+	if (p == pdb) {
+		log_warnx("pe_user_db_put: PANIC: active database freed");
+		master_terminate();
+	}
+	pe_user_flush_db(p);
+	pe_user_retired--;
+	DEBUG(DBG_PE_POLICY, "pe_user_db_put: freed pdb %p (generation %lu)",
+	    p, p->generation);
+	free(p);
+}
+
+/**
+ * Allocate a new and empty policy database.
+ *
+ * @return The new database. This function does not return if memory
+ *     allocation fails.
+ */
+static struct pe_policy_db *
+pe_user_alloc_db(void)
+{
+	struct pe_policy_db	*p;
+	int			 i;
+
+	if ((p = calloc(1, sizeof(struct pe_policy_db))) == NULL) {
+		log_warn("calloc");
+		master_terminate();
+	}
+	TAILQ_INIT(&p->users);
+	for (i = 0; i < PE_USER_HASH_NRENTRY; i++)
+		TAILQ_INIT(&p->hash[i]);
+	p->defuser = NULL;
+	p->refcount = 1;
+	p->generation = 0;
+
+	return p;
 }
 
 /**
@@ -295,14 +480,16 @@ pe_user_flush_db(struct pe_policy_db *ppdb)
 
 	if (ppdb == NULL)
 		ppdb = pdb;
-	for (p = TAILQ_FIRST(ppdb); p != TAILQ_END(ppdb); p = pnext) {
+	for (p = TAILQ_FIRST(&ppdb->users); p != NULL; p = pnext) {
 		pnext = TAILQ_NEXT(p, entry);
-		TAILQ_REMOVE(ppdb, p, entry);
+		TAILQ_REMOVE(&ppdb->users, p, entry);
+		TAILQ_REMOVE(&ppdb->hash[PE_USER_HASH(p->uid)], p, hash_link);
 
 		for (i = 0; i < PE_PRIO_MAX; i++)
 			apn_free_ruleset(p->prio[i]);
 		free(p);
 	}
+	ppdb->defuser = NULL;
 }
 
 /**
@@ -338,6 +525,9 @@ pe_user_load_db(struct pe_policy_db *p)
  * All policies are clean when they are read from disk. This means that
  * rules that are no longer in scope are removed.
  *
+ * Unsigned policies are loaded from their compiled policy cache if
+ * the cache is up to date.
+ *
  * @param dirname The directory to load policies from.
  * @param prio The priority of the policies in that directory. It this is
  *     PE_PRIO_ADMIN, the ruleset must not contain ASK rules.
@@ -431,7 +621,11 @@ pe_user_load_dir(const char *dirname, unsigned int prio, struct pe_policy_db *p)
 				continue;
 			}
 		}
-		rs = pe_user_load_policy(filename, flags);
+		/*
+		 * The compiled policy cache is not used for signed
+		 * policies. The signature only covers the source.
+		 */
+		rs = pe_user_load_policy(filename, flags, pub == NULL);
 		free(filename);
 
 		/* If parsing fails, we just continue */
@@ -483,31 +677,255 @@ pe_user_scope_check(struct apn_scope * scope, void * data)
 	return 0;
 }
 
+/**
+ * Return the name of the compiled policy cache of a policy file. The
+ * cache is stored in the same directory as the policy. Its name starts
+ * with a dot, i.e. pe_user_load_dir skips it.
+ *
+ * @param name The file name of the policy.
+ * @return The file name of the cache. The caller must free it. NULL
+ *     is returned if memory is short.
+ */
+static char *
+pe_user_cache_name(const char *name)
+{
+	const char	*base = strrchr(name, '/');
+	char		*ret;
+
+	base = base ? base + 1 : name;
+	if (asprintf(&ret, "%.*s.%s.cache", (int)(base - name), name,
+	    base) < 0)
+		return NULL;
+	return ret;
+}
+
+/**
+ * Read exactly len bytes from a file descriptor.
+ *
+ * @param fd The file descriptor.
+ * @param buf The data is stored here.
+ * @param len The number of bytes to read.
+ * @return Zero in case of success, -1 if the data could not be read.
+ */
+static int
+pe_user_readall(int fd, void *buf, size_t len)
+{
+	ssize_t		ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Write exactly len bytes to a file descriptor.
+ *
+ * @param fd The file descriptor.
+ * @param buf The data.
+ * @param len The number of bytes to write.
+ * @return Zero in case of success, -1 if the data could not be written.
+ */
+static int
+pe_user_writeall(int fd, const void *buf, size_t len)
+{
+	ssize_t		ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Read a policy file into memory and fill in the cache header that
+ * corresponds to its current content.
+ *
+ * @param name The file name of the policy.
+ * @param flags The flags for the parser.
+ * @param hdr The cache header is stored here. The length of the
+ *     policy is in hdr->size.
+ * @return The content of the policy file. The caller must free it.
+ *     NULL is returned if the file could not be read.
+ */
+static char *
+pe_user_read_policy(const char *name, int flags,
+    struct pe_user_cache_header *hdr)
+{
+	struct stat	 statbuf;
+	SHA256_CTX	 ctx;
+	char		*buf = NULL;
+	int		 fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+		goto err;
+	if ((buf = malloc(statbuf.st_size + 1)) == NULL)
+		goto err;
+	if (pe_user_readall(fd, buf, statbuf.st_size) < 0)
+		goto err;
+	close(fd);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = PE_USER_CACHE_MAGIC;
+	hdr->flags = flags;
+	hdr->size = statbuf.st_size;
+	hdr->mtime = statbuf.st_mtime;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, buf, statbuf.st_size);
+	SHA256_Final(hdr->csum, &ctx);
+	return buf;
+err:
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/**
+ * Load a rule set from the compiled policy cache.
+ *
+ * @param cachename The file name of the cache.
+ * @param hdr The cache header of the current policy source. The cache
+ *     is only used if its header is identical.
+ * @return The rule set or NULL if the cache does not exist, is out of
+ *     date or is invalid.
+ */
+static struct apn_ruleset *
+pe_user_cache_load(const char *cachename,
+    const struct pe_user_cache_header *hdr)
+{
+	struct pe_user_cache_header	 chdr;
+	struct apn_ruleset		*rs = NULL;
+	struct stat			 statbuf;
+	char				*buf;
+	size_t				 len;
+	int				 fd;
+
+	if ((fd = open(cachename, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t)sizeof(chdr)
+	    || pe_user_readall(fd, &chdr, sizeof(chdr)) < 0
+	    || memcmp(&chdr, hdr, sizeof(chdr)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	len = statbuf.st_size - sizeof(chdr);
+	if ((buf = malloc(len)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (pe_user_readall(fd, buf, len) == 0
+	    && apn_unserialize_ruleset(buf, len, &rs) < 0)
+		rs = NULL;
+	free(buf);
+	close(fd);
+	return rs;
+}
+
+/**
+ * Write a rule set to the compiled policy cache. The cache is
+ * replaced atomically. Errors are not fatal, the policy is simply
+ * parsed again on the next load.
+ *
+ * @param cachename The file name of the cache.
+ * @param hdr The cache header of the policy source.
+ * @param rs The rule set that was compiled from the policy source.
+ */
+static void
+pe_user_cache_store(const char *cachename,
+    const struct pe_user_cache_header *hdr, struct apn_ruleset *rs)
+{
+	void		*image;
+	size_t		 len;
+	char		*tmp;
+	int		 fd, ret = -1;
+
+	if (apn_serialize_ruleset(rs, &image, &len) < 0)
+		return;
+	if (asprintf(&tmp, "%s.tmp", cachename) < 0) {
+		free(image);
+		return;
+	}
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd >= 0) {
+		ret = pe_user_writeall(fd, hdr, sizeof(*hdr));
+		if (ret == 0)
+			ret = pe_user_writeall(fd, image, len);
+		if (close(fd) < 0)
+			ret = -1;
+		if (ret == 0 && rename(tmp, cachename) < 0)
+			ret = -1;
+		if (ret < 0)
+			unlink(tmp);
+	}
+	if (ret < 0)
+		DEBUG(DBG_PE_POLICY, "pe_user_cache_store: could not write %s",
+		    cachename);
+	free(tmp);
+	free(image);
+}
+
 /**
  * Load a policy from disk and return its parsed version. This function
  * is only called if the daemon is started or after a reload. Thus we have
  * to kill all scopes.
  *
+ * If the compiled policy cache of the policy is up to date, the rule
+ * set is loaded from the cache instead of running the parser. Otherwise
+ * the policy is parsed and the cache is rewritten.
+ *
  * @param name The name of the policy file. No signatures are checked, this
  *     must be done by the caller.
+ * @param flags The flags for the parser.
+ * @param usecache True if the compiled policy cache should be used.
  * @return The cleaned ruleset. This ruleset destructor is set to
- *     &pe_prefixhash_destroy. In case of a parse error NULL is returned
+ *     &pe_userdata_destroy. In case of a parse error NULL is returned
  *     and a warning is issued.
  */
 static struct apn_ruleset *
-pe_user_load_policy(const char *name, int flags)
+pe_user_load_policy(const char *name, int flags, int usecache)
 {
-	struct apn_ruleset	*rs;
-	time_t			 now = 0;
-	int			 ret;
-	char			*errstr;
+	struct apn_ruleset		*rs = NULL;
+	struct pe_user_cache_header	 hdr;
+	struct iovec			 iov;
+	time_t				 now = 0;
+	int				 ret;
+	char				*errstr;
+	char				*src = NULL, *cachename = NULL;
 
 	DEBUG(DBG_PE_POLICY, "pe_user_load_policy: %s", name);
 
-	ret = apn_parse(name, &rs, flags);
+	if (usecache && (cachename = pe_user_cache_name(name)) != NULL)
+		src = pe_user_read_policy(name, flags, &hdr);
+	if (src) {
+		rs = pe_user_cache_load(cachename, &hdr);
+		if (rs) {
+			DEBUG(DBG_PE_POLICY, "pe_user_load_policy: "
+			    "using %s", cachename);
+			goto out;
+		}
+		iov.iov_base = src;
+		iov.iov_len = hdr.size;
+		ret = apn_parse_iovec(name, &iov, 1, &rs, flags);
+	} else {
+		ret = apn_parse(name, &rs, flags);
+	}
 	if (ret == -1) {
 		log_warnx("could not parse \"%s\"", name);
-		return NULL;
+		rs = NULL;
+		goto out;
 	}
 	if (ret != 0) {
 		errstr = apn_one_error(rs);
@@ -516,10 +934,17 @@ pe_user_load_policy(const char *name, int flags)
 		else
 			log_warnx("could not parse \"%s\"", name);
 		apn_free_ruleset(rs);
-		return NULL;
+		rs = NULL;
+		goto out;
 	}
 	apn_clean_ruleset(rs, &pe_user_scope_check, &now);
-	rs->destructor = (void*)&pe_prefixhash_destroy;
+	if (src)
+		pe_user_cache_store(cachename, &hdr, rs);
+out:
+	free(src);
+	free(cachename);
+	if (rs)
+		rs->destructor = &pe_userdata_destroy;
 	return rs;
 }
 
@@ -555,10 +980,18 @@ pe_user_insert_rs(struct apn_ruleset *rs, uid_t uid, unsigned int prio,
 			master_terminate();
 		}
 		user->uid = uid;
-		TAILQ_INSERT_TAIL(p, user, entry);
+		TAILQ_INSERT_TAIL(&p->users, user, entry);
+		TAILQ_INSERT_HEAD(&p->hash[PE_USER_HASH(uid)], user,
+		    hash_link);
+		if (uid == (uid_t)-1)
+			p->defuser = user;
 	}
+	if (orig_p == NULL)
+		pe_workers_drain();
 	oldrs = user->prio[prio];
 	user->prio[prio] = rs;
+	if (orig_p == NULL)
+		pe_alf_invalidate();
 	/*
 	 * Refresh even if oldrs == NULL. New contexts will be created
 	 * in this case.
@@ -590,7 +1023,7 @@ pe_user_get(uid_t uid, struct pe_policy_db *p)
 		p = pdb;
 
 	user = NULL;
-	TAILQ_FOREACH(puser, p, entry) {
+	TAILQ_FOREACH(puser, &p->hash[PE_USER_HASH(uid)], hash_link) {
 		if (puser->uid != uid)
 			continue;
 		user = puser;
@@ -628,7 +1061,7 @@ pe_user_get_ruleset(uid_t uid, unsigned int prio, struct pe_policy_db *p)
 	user = pe_user_get(uid, p);
 	if (user && user->prio[prio])
 		return user->prio[prio];
-	user = pe_user_get(-1, p);
+	user = p->defuser;
 	if (!user)
 		return NULL;
 	return user->prio[prio];
@@ -785,8 +1218,9 @@ pe_user_dump(void)
 	struct apn_ruleset	*rs;
 	struct apn_rule		*rp;
 
-	log_info("policies (pdb %p)", pdb);
-	TAILQ_FOREACH(user, pdb, entry) {
+	log_info("policies (pdb %p generation %lu, %d retired)", pdb,
+	    pdb->generation, pe_user_retired);
+	TAILQ_FOREACH(user, &pdb->users, entry) {
 		log_info("uid %d", (int)user->uid);
 		for (i = 0; i < PE_PRIO_MAX; i++) {
 			if (user->prio[i] == NULL)
@@ -1109,7 +1543,7 @@ pe_dispatch_policy(struct anoubisd_msg *msg)
 				error = EINVAL;
 				goto reply;
 			}
-			ruleset->destructor = (void*)&pe_prefixhash_destroy;
+			ruleset->destructor = &pe_userdata_destroy;
 			DEBUG(DBG_TRACE, "    fsync & rename: %s->%s",
 				req->tmpname, req->realname);
 			if (fsync(req->fd) < 0 ||
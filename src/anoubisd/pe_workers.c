@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "anoubisd.h"
+#include "pe.h"
+
+/*
+ * The worker pool of the policy engine. The policy engine itself is
+ * single threaded, i.e. all data structures (process tracking, contexts,
+ * the policy database, caches) are only modified by the main thread.
+ * The main thread can hand off jobs to a pool of worker threads. The
+ * run callback of a job is called in a worker thread and must only
+ * read data that is guaranteed not to change while the job is in flight.
+ * In particular, it must not allocate or free policy engine data and it
+ * must not log. Once a job is complete, its done callback is called
+ * in the main thread.
+ *
+ * The rule blocks used by a job must not change while the job is in
+ * flight. A job holds a reference to the policy database that contains
+ * its rules, i.e. a reload of the policy does not free them. Functions
+ * that modify the active policy database in place call pe_workers_drain
+ * before they do so. Processes and contexts used by a job must be
+ * referenced by the submitter and released by the done callback.
+ *
+ * Completed jobs are reported to the main thread via a pipe. The read
+ * end of the pipe is returned by pe_workers_fd and should be added to
+ * the event loop. pe_workers_complete must be called if the pipe
+ * becomes readable.
+ *
+ * If the number of workers is zero, jobs are processed synchronously
+ * by pe_workers_submit.
+ */
+
+/**
+ * The maximum number of worker threads.
+ */
+#define PE_WORKERS_MAX		64
+
+TAILQ_HEAD(pe_joblist, pe_job);
+
+/**
+ * Protects all variables below that are accessed by the worker threads,
+ * i.e. the job lists, the number of pending jobs and the shutdown flag.
+ */
+static pthread_mutex_t	 pe_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Signaled if a new job is added to the todo list or if the workers
+ * should terminate.
+ */
+static pthread_cond_t	 pe_workers_work = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Signaled if the number of pending jobs drops to zero.
+ */
+static pthread_cond_t	 pe_workers_idle = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Jobs that are not yet processed by a worker thread.
+ */
+static struct pe_joblist pe_workers_todo =
+    TAILQ_HEAD_INITIALIZER(pe_workers_todo);
+
+/**
+ * Jobs that are processed but whose done callback was not yet called.
+ */
+static struct pe_joblist pe_workers_done =
+    TAILQ_HEAD_INITIALIZER(pe_workers_done);
+
+/**
+ * The number of jobs that are submitted but not yet in the done list.
+ */
+static int		 pe_workers_pending = 0;
+
+/**
+ * True if the worker threads should terminate.
+ */
+static int		 pe_workers_shutdown = 0;
+
+/**
+ * The number of worker threads. Only used by the main thread.
+ */
+static int		 pe_workers_cnt = 0;
+
+/**
+ * The thread IDs of the worker threads. Only used by the main thread.
+ */
+static pthread_t	 pe_workers_threads[PE_WORKERS_MAX];
+
+/**
+ * The notification pipe. Index zero is the read end, index one is
+ * the write end.
+ */
+static int		 pe_workers_pipe[2] = { -1, -1 };
+
+/**
+ * The main function of a worker thread. It takes jobs from the todo
+ * list, runs them and moves them to the done list. The main thread is
+ * notified via the pipe if the done list was empty.
+ *
+ * @param arg The callback argument (unused).
+ * @return Always NULL.
+ */
+static void *
+pe_workers_main(void *arg __used)
+{
+	struct pe_job	*job;
+	int		 notify;
+	char		 c = 0;
+
+	pthread_mutex_lock(&pe_workers_lock);
+	while (1) {
+		while (TAILQ_EMPTY(&pe_workers_todo) && !pe_workers_shutdown)
+			pthread_cond_wait(&pe_workers_work, &pe_workers_lock);
+		job = TAILQ_FIRST(&pe_workers_todo);
+		if (job == NULL)
+			break;
+		TAILQ_REMOVE(&pe_workers_todo, job, next);
+		pthread_mutex_unlock(&pe_workers_lock);
+
+		job->run(job);
+
+		pthread_mutex_lock(&pe_workers_lock);
+		notify = TAILQ_EMPTY(&pe_workers_done);
+		TAILQ_INSERT_TAIL(&pe_workers_done, job, next);
+		if (--pe_workers_pending == 0)
+			pthread_cond_broadcast(&pe_workers_idle);
+		/*
+		 * The pipe is non-blocking. If it is full, the main
+		 * thread will see the pending notifications anyway.
+		 */
+		if (notify && write(pe_workers_pipe[1], &c, 1) < 0
+		    && errno != EAGAIN)
+			log_warn("pe_workers: notify");
+	}
+	pthread_mutex_unlock(&pe_workers_lock);
+	return NULL;
+}
+
+/**
+ * Start the worker threads. Existing worker threads are stopped
+ * before the new threads are started. Worker threads do not receive
+ * signals.
+ *
+ * @param cnt The number of worker threads. If this is zero, jobs are
+ *     processed synchronously.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. Jobs are processed synchronously in case of an error.
+ */
+int
+pe_workers_start(int cnt)
+{
+	sigset_t	 all, old;
+	int		 i, ret;
+
+	pe_workers_stop();
+	if (cnt <= 0)
+		return 0;
+	if (cnt > PE_WORKERS_MAX)
+		cnt = PE_WORKERS_MAX;
+	if (pipe(pe_workers_pipe) < 0)
+		return -errno;
+	for (i = 0; i < 2; ++i) {
+		if (fcntl(pe_workers_pipe[i], F_SETFL, O_NONBLOCK) < 0
+		    || fcntl(pe_workers_pipe[i], F_SETFD, FD_CLOEXEC) < 0) {
+			ret = -errno;
+			pe_workers_stop();
+			return ret;
+		}
+	}
+	pe_workers_shutdown = 0;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < cnt; ++i) {
+		ret = -pthread_create(&pe_workers_threads[i], NULL,
+		    &pe_workers_main, NULL);
+		if (ret < 0)
+			break;
+		pe_workers_cnt++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (pe_workers_cnt != cnt) {
+		pe_workers_stop();
+		return ret;
+	}
+	DEBUG(DBG_PE, "pe_workers_start: %d worker threads", cnt);
+	return 0;
+}
+
+/**
+ * Stop all worker threads. Jobs that are still in flight are completed
+ * first (see pe_workers_drain).
+ */
+void
+pe_workers_stop(void)
+{
+	int	i;
+
+	pe_workers_drain();
+	if (pe_workers_cnt) {
+		pthread_mutex_lock(&pe_workers_lock);
+		pe_workers_shutdown = 1;
+		pthread_cond_broadcast(&pe_workers_work);
+		pthread_mutex_unlock(&pe_workers_lock);
+		for (i = 0; i < pe_workers_cnt; ++i)
+			pthread_join(pe_workers_threads[i], NULL);
+		pe_workers_cnt = 0;
+	}
+	for (i = 0; i < 2; ++i) {
+		if (pe_workers_pipe[i] >= 0)
+			close(pe_workers_pipe[i]);
+		pe_workers_pipe[i] = -1;
+	}
+}
+
+/**
+ * Return the number of worker threads.
+ *
+ * @return The number of worker threads. Zero means that jobs are
+ *     processed synchronously.
+ */
+int
+pe_workers_active(void)
+{
+	return pe_workers_cnt;
+}
+
+/**
+ * Return the file descriptor that becomes readable if jobs complete.
+ *
+ * @return The file descriptor or -1 if there are no worker threads.
+ */
+int
+pe_workers_fd(void)
+{
+	return pe_workers_pipe[0];
+}
+
+/**
+ * Submit a job. The caller must not touch the job until its done
+ * callback is called. The done callback is either called before this
+ * function returns (no worker threads) or from pe_workers_complete or
+ * pe_workers_drain.
+ *
+ * @param job The job.
+ */
+void
+pe_workers_submit(struct pe_job *job)
+{
+	if (pe_workers_cnt == 0) {
+		job->run(job);
+		job->done(job);
+		return;
+	}
+	pthread_mutex_lock(&pe_workers_lock);
+	TAILQ_INSERT_TAIL(&pe_workers_todo, job, next);
+	pe_workers_pending++;
+	pthread_cond_signal(&pe_workers_work);
+	pthread_mutex_unlock(&pe_workers_lock);
+}
+
+/**
+ * Call the done callbacks of all jobs that are complete. This function
+ * does not wait for jobs that are still in flight.
+ *
+ * @return The number of completed jobs.
+ */
+int
+pe_workers_complete(void)
+{
+	struct pe_joblist	 list = TAILQ_HEAD_INITIALIZER(list);
+	struct pe_job		*job;
+	char			 buf[64];
+	int			 cnt = 0;
+
+	if (pe_workers_pipe[0] >= 0) {
+		while (read(pe_workers_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	pthread_mutex_lock(&pe_workers_lock);
+	while ((job = TAILQ_FIRST(&pe_workers_done)) != NULL) {
+		TAILQ_REMOVE(&pe_workers_done, job, next);
+		TAILQ_INSERT_TAIL(&list, job, next);
+	}
+	pthread_mutex_unlock(&pe_workers_lock);
+	while ((job = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, job, next);
+		job->done(job);
+		cnt++;
+	}
+	return cnt;
+}
+
+/**
+ * Wait until all jobs that are in flight are processed and call
+ * their done callbacks. This must be called before data that might
+ * be used by a job is modified.
+ */
+void
+pe_workers_drain(void)
+{
+	if (pe_workers_cnt == 0)
+		return;
+	pthread_mutex_lock(&pe_workers_lock);
+	while (pe_workers_pending)
+		pthread_cond_wait(&pe_workers_idle, &pe_workers_lock);
+	pthread_mutex_unlock(&pe_workers_lock);
+	pe_workers_complete();
+}
@@ -77,6 +77,9 @@ static void	dispatch_m2p(int, short, void *);
 static void	dispatch_p2m(int, short, void *);
 static void	dispatch_s2p(int, short, void *);
 static void	dispatch_p2s(int, short, void *);
+static void	dispatch_workers(int, short, void *);
+static void	dispatch_reply(struct anoubisd_msg *, struct anoubisd_reply *);
+static void	policy_start_workers(void);
 static int	policy_upgrade_fill_chunk(char *buf, int maxlen);
 
 /**
@@ -153,6 +156,12 @@ static struct event		ev_s2p;
  */
 static struct event		ev_m2p;
 
+/**
+ * The event for the notification pipe of the policy engine's worker
+ * threads. Only used if there are worker threads.
+ */
+static struct event		ev_workers;
+
 /**
  * The timer event that is used to timeout pending escalations.
  */
@@ -166,6 +175,12 @@ struct timeval			tv = {
 					.tv_usec = 0,
 				};
 
+/**
+ * The maximum number of idle processes whose contexts are refreshed
+ * per timer event after a policy reload (see pe_proc_refresh_stale).
+ */
+#define POLICY_REFRESH_BATCH	1000
+
 /**
  * Events for signals. They are stored globally, because the
  * signal handler must be able to remove them from the event
@@ -382,9 +397,15 @@ policy_main(int pipes[], int loggers[])
 	evtimer_set(&ev_timer, &dispatch_timer, NULL);
 	event_add(&ev_timer, &tv);
 
+	/* The policy engine only reads checksums. */
+	if (sfs_backend_init(anoubisd_config.sfs_store, 1) < 0)
+		fatal("Cannot open " SFS_STOREDIR_CHROOT);
+
 	/* Start policy engine */
 	pe_init();
+	sfshash_set_limit(anoubisd_config.sfscache_size);
 	pe_playground_init();
+	policy_start_workers();
 
 	setproctitle("policy engine");
 
@@ -408,6 +429,9 @@ policy_main(int pipes[], int loggers[])
  * via the master process. The error code used is EPERM. Additionally, the
  * UIs must be notified via the session engine, too.
  *
+ * The timer is also used to refresh the contexts of idle processes
+ * after a policy reload in small batches.
+ *
  * @param sig The signal that triggered the event (unused).
  * @param event The details of the event (unused).
  * @param arg The callback argument of the event (unused).
@@ -463,8 +487,10 @@ dispatch_timer(int sig __used, short event __used, void *arg __used)
 		}
 		abuf_free_type(msg_wait, struct reply_wait);
 	}
-	if (terminate < 3)
+	if (terminate < 3) {
+		pe_proc_refresh_stale(POLICY_REFRESH_BATCH);
 		event_add(&ev_timer, &tv);
+	}
 
 	DEBUG(DBG_TRACE, "<dispatch_timer");
 }
@@ -497,12 +523,12 @@ dispatch_sfscache_invalidate(struct anoubisd_msg *msg)
 		return;
 	}
 	invmsg->payload[invmsg->plen-1] = 0;
-	invmsg->payload[invmsg->plen + invmsg->keylen - 1] = 0;
 	if (invmsg->keylen) {
-		sfshash_invalidate_key(invmsg->payload,
-		    invmsg->payload + invmsg->plen);
+		sfshash_invalidate_keyid(invmsg->payload,
+		    abuf_open_frommem(invmsg->payload + invmsg->plen,
+		    invmsg->keylen));
 		DEBUG(DBG_SFSCACHE, " dispatch_sfscache_invalidate: path %s "
-		    "key %s", invmsg->payload, invmsg->payload+invmsg->plen);
+		    "keylen %d", invmsg->payload, invmsg->keylen);
 	} else {
 		sfshash_invalidate_uid(invmsg->payload, (uid_t)invmsg->uid);
 		DEBUG(DBG_SFSCACHE, " dispatch_sfscache_invalidate: path %s "
@@ -510,6 +536,47 @@ dispatch_sfscache_invalidate(struct anoubisd_msg *msg)
 	}
 }
 
+/**
+ * Append the statistics of the policy engine to a statistics message
+ * of the kernel. The result is forwarded to the session engine which
+ * sends it to all clients that are registered for statistics.
+ *
+ * @param msg The statistics message (of type ANOUBISD_MSG_EVENTDEV with
+ *     source ANOUBIS_SOURCE_STAT). The message is freed by this function.
+ * @return None.
+ */
+static void
+dispatch_stat(struct anoubisd_msg *msg)
+{
+	struct sfshash_stats		 sfsstats;
+	struct anoubis_stat_value	 vals[7];
+	const int			 nvals = sizeof(vals) / sizeof(vals[0]);
+	int				 i;
+
+	sfshash_getstats(&sfsstats);
+	for (i=0; i<nvals; ++i)
+		vals[i].subsystem = ANOUBIS_STAT_SUBSYS_SFSCACHE;
+	vals[0].key = ANOUBIS_STAT_SFSCACHE_HITS;
+	vals[0].value = sfsstats.hits;
+	vals[1].key = ANOUBIS_STAT_SFSCACHE_MISSES;
+	vals[1].value = sfsstats.misses;
+	vals[2].key = ANOUBIS_STAT_SFSCACHE_EVICTIONS;
+	vals[2].value = sfsstats.evictions;
+	vals[3].key = ANOUBIS_STAT_SFSCACHE_ENTRIES;
+	vals[3].value = sfsstats.entries;
+	vals[4].key = ANOUBIS_STAT_SFSCACHE_BYTES;
+	vals[4].value = sfsstats.bytes;
+	vals[5].key = ANOUBIS_STAT_SFSCACHE_LIMIT;
+	vals[5].value = sfsstats.limit;
+	vals[6].key = ANOUBIS_STAT_SFSCACHE_FILTERED;
+	vals[6].value = sfsstats.filtered;
+	msg = msg_append_stats(msg, vals, nvals);
+	if (msg == NULL)
+		return;
+	enqueue(&eventq_p2s, msg);
+	DEBUG(DBG_QUEUE, " >eventq_p2s: stat");
+}
+
 /**
  * Send an upgrade start message to the upgrade process (relayed via
  * the master process) and initialize the upgrade iterator. The upgrade
@@ -840,6 +907,145 @@ fill_eventask_message(int type, struct eventdev_hdr *hdr,
 	return msg;
 }
 
+/**
+ * Process the reply of the policy engine for a kernel event. Events
+ * that must be escalated are forwarded to the session engine and
+ * tracked in the reply queue. For all other events a reply is sent
+ * to the master. This is also used as the callback for events that
+ * are processed asynchronously by the policy engine.
+ *
+ * @param msg The message that contains the kernel event. This message
+ *     is freed.
+ * @param reply The reply of the policy engine. NULL if the event does
+ *     not need a reply. The reply is freed.
+ */
+static void
+dispatch_reply(struct anoubisd_msg *msg, struct anoubisd_reply *reply)
+{
+	struct reply_wait			*msg_wait;
+	struct anoubisd_msg			*msg_reply;
+	struct eventdev_hdr			*hdr;
+	struct eventdev_reply			*rep;
+	eventdev_token				 token;
+
+	if (reply == NULL) {
+		free(msg);
+		return;
+	}
+	hdr = (struct eventdev_hdr *)msg->msg;
+	token = hdr->msg_token;
+
+	if (reply->ask) {
+		struct anoubisd_msg	*nmsg;
+
+		nmsg = fill_eventask_message(ANOUBISD_MSG_EVENTASK,
+		    hdr, reply);
+		if (!nmsg) {
+			free(msg);
+			free(reply);
+			master_terminate();
+		}
+		/* The hdr is in the freed message! */
+		hdr = NULL;
+		free(msg);
+
+		msg = nmsg;
+		msg_wait = abuf_alloc_type(struct reply_wait);
+		if (msg_wait == NULL) {
+			log_warn("dispatch_m2p: can't allocate memory");
+			free(reply);
+			master_terminate();
+		}
+
+		msg_wait->token = token;
+		if (time(&msg_wait->starttime) == -1) {
+			free(msg);
+			free(reply);
+			log_warn("dispatch_m2p: failed to get time");
+			master_terminate();
+		}
+		msg_wait->flags = ANOUBIS_RET_FLAGS(reply->reply);
+		msg_wait->timeout = reply->timeout;
+		msg_wait->log = reply->log;
+
+		TAILQ_INSERT_TAIL(&replyq, msg_wait, next);
+		DEBUG(DBG_QUEUE, " >replyq: %x flags=%x",
+		    msg_wait->token, msg_wait->flags);
+
+		/* send msg to the session */
+		enqueue(&eventq_p2s, msg);
+		DEBUG(DBG_QUEUE, " >eventq_p2s: %x", token);
+	} else {
+		int	hold = reply->hold;
+		msg_reply = msg_factory(ANOUBISD_MSG_EVENTREPLY,
+		    sizeof(struct eventdev_reply));
+		if (!msg_reply) {
+			free(msg);
+			free(reply);
+			master_terminate();
+		}
+		rep = (struct eventdev_reply *)msg_reply->msg;
+		rep->msg_token = token;
+		rep->reply = reply->reply;
+
+		free(msg);
+
+		if (hold) {
+			enqueue(&eventq_p2m_hold, msg_reply);
+			DEBUG(DBG_QUEUE, " >eventq_p2m_hold: %x", token);
+		} else {
+			enqueue(&eventq_p2m, msg_reply);
+			DEBUG(DBG_QUEUE, " >eventq_p2m: %x", token);
+		}
+	}
+
+	free(reply);
+}
+
+/**
+ * This is the event handler for the notification pipe of the policy
+ * engine's worker threads. It completes all events that were processed
+ * by the worker threads.
+ *
+ * @param fd The file descriptor for the event (unused).
+ * @param sig The event details (unused).
+ * @param arg The callback argument of the event (unused).
+ */
+static void
+dispatch_workers(int fd __used, short sig __used, void *arg __used)
+{
+	int	cnt;
+
+	DEBUG(DBG_TRACE, ">dispatch_workers");
+	cnt = pe_workers_complete();
+	DEBUG(DBG_TRACE, "<dispatch_workers: %d", cnt);
+}
+
+/**
+ * (Re-)Start the worker threads of the policy engine with the number
+ * of threads given in the configuration. Events that are currently
+ * processed by the old worker threads are completed first.
+ */
+static void
+policy_start_workers(void)
+{
+	int	ret;
+
+	if (pe_workers_fd() >= 0)
+		event_del(&ev_workers);
+	ret = pe_workers_start(anoubisd_config.policy_workers);
+	if (ret < 0) {
+		errno = -ret;
+		log_warn("policy: cannot start worker threads");
+	}
+	if (pe_workers_fd() >= 0) {
+		event_set(&ev_workers, pe_workers_fd(), EV_READ | EV_PERSIST,
+		    dispatch_workers, NULL);
+		event_add(&ev_workers, NULL);
+	}
+	log_info("policy: %d worker threads", pe_workers_active());
+}
+
 /**
  * Process a message received from the master. If end of file is detected
  * on the incoming pipe a graceful termination is initiated or continued.
@@ -850,7 +1056,9 @@ fill_eventask_message(int type, struct eventdev_hdr *hdr,
  *     relevant policies or the event is forwarded to the sesssion engine.
  *     In the latter case a the event is tracked and a timeout is attached
  *     to it. The event will be denied if the session engine does not answer
- *     the event within this timeout.
+ *     the event within this timeout. Statistics messages are forwarded
+ *     to the session engine after the policy engine's own statistics
+ *     are appended.
  * ANOUBISD_MSG_UPGRADE: Upgrade messages.
  * ANOUBISD_MSG_CONFIG: Configuration changes.
  * ANOUBISD_MSG_PGCOMMIT_REPLY: Replies to commit request for the playground.
@@ -862,12 +1070,9 @@ fill_eventask_message(int type, struct eventdev_hdr *hdr,
 static void
 dispatch_m2p(int fd, short sig __used, void *arg __used)
 {
-	struct reply_wait			*msg_wait;
 	struct anoubisd_msg			*msg;
-	struct anoubisd_msg			*msg_reply;
 	struct anoubisd_reply			*reply;
 	struct eventdev_hdr			*hdr;
-	struct eventdev_reply			*rep;
 
 	DEBUG(DBG_TRACE, ">dispatch_m2p");
 
@@ -883,6 +1088,10 @@ dispatch_m2p(int fd, short sig __used, void *arg __used)
 			continue;
 		case ANOUBISD_MSG_EVENTDEV:
 			hdr = (struct eventdev_hdr *)msg->msg;
+			if (hdr->msg_source == ANOUBIS_SOURCE_STAT) {
+				dispatch_stat(msg);
+				continue;
+			}
 			break;
 		case ANOUBISD_MSG_UPGRADE:
 			dispatch_upgrade(msg);
@@ -892,6 +1101,10 @@ dispatch_m2p(int fd, short sig __used, void *arg __used)
 			pe_reconfigure();
 			if (cfg_msg_parse(msg) == 0) {
 				log_info("policy: reconfigure");
+				sfshash_set_limit(anoubisd_config.sfscache_size);
+				if (anoubisd_config.policy_workers
+				    != pe_workers_active())
+					policy_start_workers();
 				/* XXX ch: do we need to do more? */
 			} else {
 				log_warnx("policy: reconfigure failed");
@@ -926,81 +1139,12 @@ dispatch_m2p(int fd, short sig __used, void *arg __used)
 			DEBUG(DBG_TRACE, "<dispatch_m2p (not NEED_REPLY)");
 			continue;
 		}
-		reply = policy_engine(msg);
-
-		if (reply == NULL) {
-			free(msg);
+		if (policy_engine_async(msg, &dispatch_reply)) {
+			DEBUG(DBG_TRACE, "<dispatch_m2p (async)");
 			continue;
 		}
-
-		if (reply->ask) {
-			struct anoubisd_msg	*nmsg;
-			eventdev_token		 token = hdr->msg_token;
-
-			nmsg = fill_eventask_message(ANOUBISD_MSG_EVENTASK,
-			    hdr, reply);
-			if (!nmsg) {
-				free(msg);
-				free(reply);
-				master_terminate();
-			}
-			/* The hdr is in the freed message! */
-			hdr = NULL;
-			free(msg);
-
-			msg = nmsg;
-			msg_wait = abuf_alloc_type(struct reply_wait);
-			if (msg_wait == NULL) {
-				log_warn("dispatch_m2p: can't allocate memory");
-				free(reply);
-				master_terminate();
-			}
-
-			msg_wait->token = token;
-			if (time(&msg_wait->starttime) == -1) {
-				free(msg);
-				free(reply);
-				log_warn("dispatch_m2p: failed to get time");
-				master_terminate();
-			}
-			msg_wait->flags = ANOUBIS_RET_FLAGS(reply->reply);
-			msg_wait->timeout = reply->timeout;
-			msg_wait->log = reply->log;
-
-			TAILQ_INSERT_TAIL(&replyq, msg_wait, next);
-			DEBUG(DBG_QUEUE, " >replyq: %x flags=%x",
-			    msg_wait->token, msg_wait->flags);
-
-			/* send msg to the session */
-			enqueue(&eventq_p2s, msg);
-			DEBUG(DBG_QUEUE, " >eventq_p2s: %x", token);
-		} else {
-			int	hold = reply->hold;
-			msg_reply = msg_factory(ANOUBISD_MSG_EVENTREPLY,
-			    sizeof(struct eventdev_reply));
-			if (!msg_reply) {
-				free(msg);
-				free(reply);
-				master_terminate();
-			}
-			rep = (struct eventdev_reply *)msg_reply->msg;
-			rep->msg_token = hdr->msg_token;
-			rep->reply = reply->reply;
-
-			free(msg);
-
-			if (hold) {
-				enqueue(&eventq_p2m_hold, msg_reply);
-				DEBUG(DBG_QUEUE, " >eventq_p2m_hold: %x",
-				    hdr->msg_token);
-			} else {
-				enqueue(&eventq_p2m, msg_reply);
-				DEBUG(DBG_QUEUE, " >eventq_p2m: %x",
-				    hdr->msg_token);
-			}
-		}
-
-		free(reply);
+		reply = policy_engine(msg);
+		dispatch_reply(msg, reply);
 
 		DEBUG(DBG_TRACE, "<dispatch_m2p (loop)");
 	}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <bsdcompat.h>
+#endif
+
+#include "anoubisd.h"
+#include <anoubis_alloc.h>
+
+/**
+ * \file
+ * The persistent cache of playground scanner verdicts. The cache remembers
+ * that a scanner accepted a file with a particular content. A commit of
+ * the same content does not need to run the scanner again as long as the
+ * cache entry is not older than the configured TTL.
+ *
+ * The cache is a single file that consists of a header and a fixed
+ * number of slots. The key of an entry is provided by the caller (a
+ * SHA-256 hash over the content checksum and the identity of the scanner).
+ * The first bytes of the key select a slot and an entry is stored in one
+ * of the SCANCACHE_PROBE slots that follow. If all of these slots are in
+ * use the oldest entry is replaced. Thus the size of the file never
+ * changes and neither lookups nor updates need more than a single read
+ * and write.
+ *
+ * Several scanner children can use the cache at the same time. Access
+ * is serialized with flock(2). The cache is re-initialized if the
+ * configured number of slots changes or if the header is damaged. As the
+ * cache only ever allows the omission of a scan, losing it is harmless.
+ *
+ * All values are stored in host byte order, the file is never shared
+ * between machines.
+ */
+
+#define SCANCACHE_MAGIC		0x43534353	/* "SCSC" */
+#define SCANCACHE_VERSION	1
+
+/**
+ * The number of slots that are searched for a key.
+ */
+#define SCANCACHE_PROBE		8
+
+/**
+ * The header at the start of the cache file.
+ */
+struct scancache_hdr {
+	u_int32_t	magic;
+	u_int32_t	version;
+	u_int32_t	nslots;
+	u_int32_t	reclen;
+};
+
+/**
+ * A single slot of the cache.
+ */
+struct scancache_rec {
+	/**
+	 * The key of the entry.
+	 */
+	u_int8_t	key[SCANCACHE_KEYLEN];
+
+	/**
+	 * The time when the verdict was stored. Zero for unused slots.
+	 */
+	int64_t		time;
+};
+
+/**
+ * An open scanner cache.
+ */
+struct scancache {
+	/**
+	 * The file descriptor of the cache file.
+	 */
+	int		fd;
+
+	/**
+	 * The number of slots in the cache file.
+	 */
+	unsigned int	nslots;
+};
+
+/**
+ * Return the offset of a slot in the cache file.
+ *
+ * @param slot The slot number.
+ * @return The file offset.
+ */
+static off_t
+scancache_off(unsigned int slot)
+{
+	return sizeof(struct scancache_hdr)
+	    + (off_t)slot * sizeof(struct scancache_rec);
+}
+
+/**
+ * Read the SCANCACHE_PROBE slots that may contain a key. The window
+ * wraps around at the end of the file.
+ *
+ * @param cache The cache.
+ * @param key The key.
+ * @param recs The slots are stored here.
+ * @param first The number of the first slot is returned here.
+ * @return Zero in case of success, a negative error code if the slots
+ *     could not be read.
+ */
+static int
+scancache_read(struct scancache *cache, const u_int8_t *key,
+    struct scancache_rec *recs, unsigned int *first)
+{
+	unsigned int	i, slot;
+	u_int32_t	hash;
+
+	memcpy(&hash, key, sizeof(hash));
+	slot = hash % cache->nslots;
+	*first = slot;
+	for (i=0; i<SCANCACHE_PROBE; ++i) {
+		if (pread(cache->fd, &recs[i], sizeof(recs[i]),
+		    scancache_off(slot)) != sizeof(recs[i]))
+			return errno ? -errno : -EIO;
+		slot = (slot + 1) % cache->nslots;
+	}
+	return 0;
+}
+
+/**
+ * Open the scanner cache and initialize it if required. The file
+ * descriptor of the cache is not inherited by programs that are
+ * started with exec(2).
+ *
+ * @param path The path of the cache file.
+ * @param nslots The number of entries in the cache.
+ * @param cachep The cache is returned here.
+ * @return Zero in case of success, a negative error code in case
+ *     of an error.
+ */
+int
+scancache_open(const char *path, unsigned int nslots,
+    struct scancache **cachep)
+{
+	struct scancache	*cache;
+	struct scancache_hdr	 hdr;
+	struct scancache_rec	 rec;
+	unsigned int		 i;
+	int			 ret;
+
+	if (nslots < SCANCACHE_PROBE)
+		return -EINVAL;
+	cache = abuf_alloc_type(struct scancache);
+	if (cache == NULL)
+		return -ENOMEM;
+	cache->nslots = nslots;
+	cache->fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if (cache->fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if (fcntl(cache->fd, F_SETFD, FD_CLOEXEC) < 0
+	    || flock(cache->fd, LOCK_EX) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if (pread(cache->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+	    && hdr.magic == SCANCACHE_MAGIC
+	    && hdr.version == SCANCACHE_VERSION
+	    && hdr.nslots == nslots
+	    && hdr.reclen == sizeof(struct scancache_rec)) {
+		flock(cache->fd, LOCK_UN);
+		*cachep = cache;
+		return 0;
+	}
+	/* Initialize a new or incompatible cache. */
+	if (ftruncate(cache->fd, 0) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	memset(&rec, 0, sizeof(rec));
+	for (i=0; i<nslots; ++i) {
+		if (pwrite(cache->fd, &rec, sizeof(rec), scancache_off(i))
+		    != sizeof(rec)) {
+			ret = errno ? -errno : -EIO;
+			goto err;
+		}
+	}
+	hdr.magic = SCANCACHE_MAGIC;
+	hdr.version = SCANCACHE_VERSION;
+	hdr.nslots = nslots;
+	hdr.reclen = sizeof(struct scancache_rec);
+	if (pwrite(cache->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		ret = errno ? -errno : -EIO;
+		goto err;
+	}
+	flock(cache->fd, LOCK_UN);
+	*cachep = cache;
+	return 0;
+err:
+	if (cache->fd >= 0)
+		close(cache->fd);
+	abuf_free_type(cache, struct scancache);
+	return ret;
+}
+
+/**
+ * Close the scanner cache and free all resources.
+ *
+ * @param cache The cache.
+ * @return None.
+ */
+void
+scancache_close(struct scancache *cache)
+{
+	if (cache == NULL)
+		return;
+	close(cache->fd);
+	abuf_free_type(cache, struct scancache);
+}
+
+/**
+ * Return the file descriptor of the cache. The caller must not use it
+ * for anything except keeping it open.
+ *
+ * @param cache The cache.
+ * @return The file descriptor.
+ */
+int
+scancache_fd(struct scancache *cache)
+{
+	return cache->fd;
+}
+
+/**
+ * Search the cache for a verdict.
+ *
+ * @param cache The cache.
+ * @param key The key of the entry.
+ * @param now The current time.
+ * @param ttl The maximum age of a valid entry in seconds.
+ * @return One if a valid entry was found, zero if there is no such entry
+ *     and a negative error code if an error occured.
+ */
+int
+scancache_lookup(struct scancache *cache, const u_int8_t *key, time_t now,
+    time_t ttl)
+{
+	struct scancache_rec	recs[SCANCACHE_PROBE];
+	unsigned int		i, first;
+	int			ret;
+
+	if (flock(cache->fd, LOCK_SH) < 0)
+		return -errno;
+	ret = scancache_read(cache, key, recs, &first);
+	flock(cache->fd, LOCK_UN);
+	if (ret < 0)
+		return ret;
+	for (i=0; i<SCANCACHE_PROBE; ++i) {
+		if (recs[i].time == 0
+		    || memcmp(recs[i].key, key, SCANCACHE_KEYLEN) != 0)
+			continue;
+		/* Entries from the future are not trusted. */
+		if (recs[i].time > now || now - recs[i].time >= ttl)
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Store a verdict in the cache. An existing entry with the same key
+ * is refreshed. Otherwise, the entry replaces an unused or the oldest
+ * slot.
+ *
+ * @param cache The cache.
+ * @param key The key of the entry.
+ * @param now The current time.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+int
+scancache_store(struct scancache *cache, const u_int8_t *key, time_t now)
+{
+	struct scancache_rec	recs[SCANCACHE_PROBE];
+	unsigned int		i, first, victim = 0;
+	int			ret;
+
+	if (flock(cache->fd, LOCK_EX) < 0)
+		return -errno;
+	ret = scancache_read(cache, key, recs, &first);
+	if (ret < 0)
+		goto out;
+	for (i=0; i<SCANCACHE_PROBE; ++i) {
+		if (memcmp(recs[i].key, key, SCANCACHE_KEYLEN) == 0) {
+			victim = i;
+			break;
+		}
+		if (recs[i].time < recs[victim].time)
+			victim = i;
+	}
+	memcpy(recs[victim].key, key, SCANCACHE_KEYLEN);
+	recs[victim].time = now;
+	if (pwrite(cache->fd, &recs[victim], sizeof(recs[victim]),
+	    scancache_off((first + victim) % cache->nslots))
+	    != sizeof(recs[victim]))
+		ret = errno ? -errno : -EIO;
+out:
+	flock(cache->fd, LOCK_UN);
+	return ret;
+}
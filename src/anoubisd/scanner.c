@@ -28,8 +28,12 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
@@ -41,6 +45,7 @@
 #include <pwd.h>
 #include <syslog.h>
 #include <inttypes.h>
+#include <openssl/sha.h>
 
 #ifdef LINUX
 #include "linux/anoubis.h"
@@ -79,6 +84,27 @@ struct scanproc {
 	 */
 	int				 scanfile;
 
+	/**
+	 * Private file descriptors for the file that is being scanned.
+	 * There is one descriptor per scanner and each descriptor has
+	 * its own file offset. This allows the scanners to run concurrently.
+	 * NULL if the file could not be reopened. In this case scanners
+	 * share the scanfile and run one at a time (only used in the
+	 * scanner child).
+	 */
+	int				*scanfds;
+
+	/**
+	 * The number of file descriptors in scanfds.
+	 */
+	int				 nscanfds;
+
+	/**
+	 * The scanner cache or NULL if the cache is not available (only
+	 * used in the scanner child).
+	 */
+	struct scancache		*cache;
+
 	/**
 	 * The pipe between the scanner child and the anoubis daemon master.
 	 * The read end is held open by the master, the write end by the scanner
@@ -126,7 +152,7 @@ LIST_HEAD(, scanproc)	scanprocs = LIST_HEAD_INITIALIZER(scanproc);
 
 /**
  * This structure encapsulates the result of a single scanner. It is
- * only used internally in scanner_run and scanner_main.
+ * only used internally by scanner_main and the functions that it calls.
  */
 struct scanresult {
 	/**
@@ -151,8 +177,90 @@ struct scanresult {
 	 * the parent process (anoubisd master) reconfigures the scanner list.
 	 */
 	struct anoubisd_pg_scanner	*scanner;
+
+	/**
+	 * The file descriptor of the scanned file that is passed to the
+	 * scanner on stdin.
+	 */
+	int				 scanfd;
+
+	/**
+	 * The process ID of the scanner sub process. Zero if the scanner
+	 * is not running.
+	 */
+	pid_t				 pid;
+
+	/**
+	 * The read end of the pipe that collects the scanner output or
+	 * -1 if the pipe is closed.
+	 */
+	int				 outfd;
+
+	/**
+	 * The time when the scanner was started.
+	 */
+	struct timeval			 start;
+
+	/**
+	 * The time when the scanner was sent a SIGTERM. The value of
+	 * tv_sec is zero if no signal was sent.
+	 */
+	struct timeval			 killed;
+
+	/**
+	 * The time that the scanner needed in milliseconds.
+	 */
+	unsigned int			 msec;
+
+	/**
+	 * True if the scanner did not run to completion because the
+	 * file was already rejected by a required scanner or because the
+	 * scan was terminated.
+	 */
+	int				 aborted;
+
+	/**
+	 * The key of the scanner verdict in the scanner cache. Only
+	 * valid if cacheable is true.
+	 */
+	u_int8_t			 cachekey[SCANCACHE_KEYLEN];
+
+	/**
+	 * True if the verdict of this scanner can be stored in the
+	 * scanner cache.
+	 */
+	int				 cacheable;
+
+	/**
+	 * True if the scanner accepted the same content before. The
+	 * scanner is not started in this case.
+	 */
+	int				 cached;
 };
 
+/**
+ * Declaration of the list of scanner results.
+ */
+CIRCLEQ_HEAD(scanresult_list, scanresult);
+
+/**
+ * The number of seconds that a scanner has to exit after it was sent
+ * a SIGTERM. The scanner is killed with SIGKILL after this time.
+ */
+#define SCANNER_KILL_DELAY	5
+
+/**
+ * The maximum size of the latency report in a commit reply.
+ */
+#define SCANNER_LATENCY_MAX	1000
+
+/**
+ * The maximum payload size of a commit reply. The master does not
+ * accept messages from the scanner child that exceed 8000 bytes.
+ */
+#define SCANNER_REPLY_MAX	(8000 - sizeof(struct anoubisd_msg)	\
+				    - sizeof(struct anoubisd_msg_pgcommit_reply))
+
 static char *envp[] = {
 	"PATH=" _PATH_STDPATH,
 	NULL, /* will be set to HOME */
@@ -186,9 +294,10 @@ scanproc_by_uid(uid_t uid)
 static volatile sig_atomic_t		terminate;
 
 /**
- * Dummy handler for signals. The handler does nothing. It is used here
- * instead of SIG_IGN to make sure that the signal interrupts system calls.
- * The interrupt is used to check for timeouts.
+ * Dummy handler for signals. The handler does nothing except for
+ * recording termination requests. It is used here instead of SIG_IGN
+ * to make sure that the signal interrupts system calls. This makes sure
+ * that poll(2) returns early if a scanner exits.
  */
 static void
 sighandler(int sig)
@@ -372,9 +481,205 @@ out:
 }
 
 /**
- * Run a single scanner synchronously in a sub process and report the
- * result of the scan. The output of the scanner is limited to 1000 bytes,
- * the rest of the output will be ignored.
+ * Return the number of milliseconds between two points in time.
+ *
+ * @param from The start time.
+ * @param to The end time.
+ * @return The difference in milliseconds.
+ */
+static long
+scanner_msec(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000
+	    + (to->tv_usec - from->tv_usec) / 1000;
+}
+
+/**
+ * Open a private file descriptor of the scanned file for each scanner
+ * that will run. The file is reopened via /proc/self/fd. Unlike dup(2)
+ * this creates a new open file with its own file offset, i.e. concurrent
+ * scanners do not disturb each other's reads. This must be called
+ * before privileges are dropped because the scanner user need not have
+ * access to the file.
+ *
+ * If any of the file descriptors cannot be opened, sp->scanfds remains
+ * NULL and the scanners will run one after the other on sp->scanfile.
+ *
+ * @param sp The description of this scanner process.
+ * @param flags If flags is non-zero only required scanners are run.
+ * @return None.
+ */
+static void
+scanner_reopen(struct scanproc *sp, int flags)
+{
+#ifdef LINUX
+	struct anoubisd_pg_scanner	*scanner;
+	struct stat			 orig, sbuf;
+	char				 path[64];
+	int				 i, fd, cnt = 0;
+
+	CIRCLEQ_FOREACH(scanner, &anoubisd_config.pg_scanner, link) {
+		if (flags && !scanner->required)
+			continue;
+		cnt++;
+	}
+	if (cnt < 2 || fstat(sp->scanfile, &orig) < 0)
+		return;
+	sp->scanfds = malloc(cnt * sizeof(int));
+	if (sp->scanfds == NULL)
+		return;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", sp->scanfile);
+	for (i=0; i<cnt; ++i) {
+		fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0)
+			break;
+		sp->scanfds[sp->nscanfds++] = fd;
+		if (fstat(fd, &sbuf) < 0 || sbuf.st_dev != orig.st_dev
+		    || sbuf.st_ino != orig.st_ino)
+			break;
+		/* Scanners must only inherit their own descriptor. */
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+			break;
+	}
+	if (i == cnt)
+		return;
+	for (i=0; i<sp->nscanfds; ++i)
+		close(sp->scanfds[i]);
+	free(sp->scanfds);
+	sp->scanfds = NULL;
+	sp->nscanfds = 0;
+#endif
+}
+
+/**
+ * Calculate the SHA-256 checksum of the content of the scanned file.
+ * The file offset is not modified.
+ *
+ * @param fd The file descriptor of the scanned file.
+ * @param csum The checksum is stored here. The buffer must be
+ *     SHA256_DIGEST_LENGTH bytes long.
+ * @return Zero in case of success, a negative error code if the
+ *     file could not be read.
+ */
+static int
+scanner_csum(int fd, u_int8_t *csum)
+{
+	SHA256_CTX	 ctx;
+	char		 buf[32768];
+	off_t		 off = 0;
+	ssize_t		 len;
+
+	SHA256_Init(&ctx);
+	while ((len = pread(fd, buf, sizeof(buf), off)) > 0) {
+		SHA256_Update(&ctx, buf, len);
+		off += len;
+	}
+	if (len < 0)
+		return -errno;
+	SHA256_Final(csum, &ctx);
+	return 0;
+}
+
+/**
+ * Calculate the key of a scanner verdict in the scanner cache. The
+ * key is a SHA-256 hash over the content checksum of the file, the
+ * path of the scanner and the identity of the scanner binary (device,
+ * inode, size, modification and change time). Thus a new version of
+ * the scanner binary invalidates all of its cached verdicts.
+ *
+ * @param scanner The scanner.
+ * @param csum The content checksum of the scanned file.
+ * @param key The key is stored here.
+ * @return Zero in case of success, a negative error code if the scanner
+ *     binary does not exist.
+ */
+static int
+scanner_cachekey(struct anoubisd_pg_scanner *scanner, const u_int8_t *csum,
+    u_int8_t *key)
+{
+	SHA256_CTX	 ctx;
+	struct stat	 sbuf;
+	int64_t		 id[5];
+
+	if (stat(scanner->path, &sbuf) < 0)
+		return -errno;
+	id[0] = sbuf.st_dev;
+	id[1] = sbuf.st_ino;
+	id[2] = sbuf.st_size;
+	id[3] = sbuf.st_mtime;
+	id[4] = sbuf.st_ctime;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, csum, SHA256_DIGEST_LENGTH);
+	SHA256_Update(&ctx, scanner->path, strlen(scanner->path) + 1);
+	SHA256_Update(&ctx, id, sizeof(id));
+	SHA256_Final(key, &ctx);
+	return 0;
+}
+
+/**
+ * Look up the verdicts of all scanners in the scanner cache. Scanners
+ * that accepted the same content before are marked as cached and
+ * will not be started. The special scanners "allow" and "deny" are
+ * never cached.
+ *
+ * @param sp The description of this scanner process.
+ * @param results The list of scanner results.
+ * @return None.
+ */
+static void
+scanner_cache_lookup(struct scanproc *sp, struct scanresult_list *results)
+{
+	struct scanresult	*result;
+	u_int8_t		 csum[SHA256_DIGEST_LENGTH];
+	const char		*path;
+	time_t			 now = time(NULL);
+
+	if (scanner_csum(sp->scanfile, csum) < 0)
+		return;
+	CIRCLEQ_FOREACH(result, results, next) {
+		path = result->scanner->path;
+		if (strcasecmp(path, "allow") == 0
+		    || strcasecmp(path, "deny") == 0)
+			continue;
+		if (scanner_cachekey(result->scanner, csum,
+		    result->cachekey) < 0)
+			continue;
+		result->cacheable = 1;
+		if (scancache_lookup(sp->cache, result->cachekey, now,
+		    anoubisd_config.scanner_cache_ttl) > 0) {
+			result->cached = 1;
+			result->exitcode = 0;
+		}
+	}
+}
+
+/**
+ * Store the verdicts of all scanners that accepted the file in the
+ * scanner cache. Rejections are not cached. Neither are the results of
+ * scanners that were terminated.
+ *
+ * @param sp The description of this scanner process.
+ * @param results The list of scanner results.
+ * @return None.
+ */
+static void
+scanner_cache_store(struct scanproc *sp, struct scanresult_list *results)
+{
+	struct scanresult	*result;
+	time_t			 now = time(NULL);
+
+	CIRCLEQ_FOREACH(result, results, next) {
+		if (!result->cacheable || result->cached || result->aborted)
+			continue;
+		if (result->killed.tv_sec || result->exitcode != 0)
+			continue;
+		scancache_store(sp->cache, result->cachekey, now);
+	}
+}
+
+/**
+ * Start a single scanner in a sub process. The result of the scan
+ * is collected by scanner_run_all.
  *
  * The file to scan is provided to the scanner on stdin, the output
  * of the scanner is collected on stdout and stderr. All of the standard
@@ -387,53 +692,52 @@ out:
  * NOTE: Memory management is not important here because this all
  * happens in sub-processes that will exit after the scan.
  *
- * @param scanner The description of the scanner to run.
- * @param fd The file descriptor to scan.
+ * @param result The result structure of the scanner. The scanner and
+ *     the file descriptor to scan must be initialized.
  * @param toclose A list of file desciptors (terminated by -1) that will
- *     be closed in the child process. The child process always closes
- * @return  The result of the scan.
+ *     be closed in the child process.
+ * @return None. If result->pid is zero after this function returns, the
+ *     result of the scanner is already complete. This is the case for
+ *     the special scanners and if the scanner could not be started.
  */
-static struct scanresult *
-scanner_run(struct anoubisd_pg_scanner *scanner, int fd, int toclose[])
+static void
+scanner_start(struct scanresult *result, int toclose[])
 {
-	struct scanresult	*result;
-	pid_t			 pid;
-	int			 fds[2];
-	int			 status;
-	time_t			 starttime, now;
-	time_t			 timeout = anoubisd_config.scanner_timeout;
-	const char		*str;
-
-	result = abuf_alloc_type(struct scanresult);
-	if (result == NULL)
-		return NULL;
-	result->exitcode = 2;
-	result->off = 0;
-	result->text = ABUF_EMPTY;
-	result->scanner = scanner;
+	struct anoubisd_pg_scanner	*scanner = result->scanner;
+	int				 fds[2];
+	pid_t				 pid;
+	const char			*str;
 
 	/* Handle special scanners "allow" and "deny". */
 	if (strcasecmp(scanner->path, "allow") == 0) {
 		result->exitcode = 0;
-		return result;
+		return;
 	}
 	if (strcasecmp(scanner->path, "deny") == 0) {
 		result->exitcode = 1;
-		return result;
+		return;
 	}
 
 	result->text = abuf_alloc(1000);
-	if (time(&starttime) < 0)
+	if (gettimeofday(&result->start, NULL) < 0)
 		goto err;
-	if (lseek(fd, 0, SEEK_SET) < 0)
+	if (lseek(result->scanfd, 0, SEEK_SET) < 0)
 		goto err;
 
 	/*
 	 * Create the pipe for the scanner output. The write end
-	 * will be mapped to stdout and stderr of the scanner.
+	 * will be mapped to stdout and stderr of the scanner. The read
+	 * end is non-blocking because the output of several scanners
+	 * is collected concurrently.
 	 */
 	if (pipe(fds) < 0)
 		goto err;
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0
+	    || fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		goto err;
+	}
 
 	pid = fork();
 	if (pid < 0) {
@@ -449,9 +753,9 @@ scanner_run(struct anoubisd_pg_scanner *scanner, int fd, int toclose[])
 		for (i=0; toclose[i] >= 0; ++i)
 			close(toclose[i]);
 		close(0);
-		if (dup(fd) != 0)
+		if (dup(result->scanfd) != 0)
 			_exit(2);
-		close(fd);
+		close(result->scanfd);
 		close(1);
 		close(2);
 		if (dup(fds[1]) != 1)
@@ -467,14 +771,34 @@ scanner_run(struct anoubisd_pg_scanner *scanner, int fd, int toclose[])
 			perror(scanner->path);
 		_exit(2);
 	}
-	/*
-	 * Parent process:
-	 * Read scanner output and store it in the result. This is done
-	 * synchronously. Note that this is one of the very few instances
-	 * in the anoubis daemon where the file descriptor that we read from
-	 * is delibarately set to be blocking.
-	 */
 	close(fds[1]);
+	result->pid = pid;
+	result->outfd = fds[0];
+	return;
+err:
+	result->exitcode = 2;
+	str = strerror(errno);
+	result->off = strlen(str);
+	if (result->off > (int)abuf_length(result->text))
+		result->off = abuf_length(result->text);
+	abuf_copy_tobuf(result->text, str, result->off);
+	abuf_limit(&result->text, result->off);
+}
+
+/**
+ * Read the available output of a scanner and store it in the result.
+ * The output of the scanner is limited to the size of the result buffer
+ * (1000 bytes) and ends at the first NUL byte. The rest of the output
+ * is ignored. The pipe is closed as soon as the output is complete.
+ *
+ * @param result The result structure of the scanner.
+ * @return None.
+ */
+static void
+scanner_read(struct scanresult *result)
+{
+	if (result->outfd < 0)
+		return;
 	while (1) {
 		int		 ret, len;
 		char		*ptr;
@@ -483,13 +807,11 @@ scanner_run(struct anoubisd_pg_scanner *scanner, int fd, int toclose[])
 		if (len <= 0)
 			break;
 		ptr = abuf_toptr(result->text, result->off, len);
-		ret = read(fds[0], ptr, len);
-		if (ret == 0)
-			break;
-		if (ret < 0 && errno != EAGAIN && errno != EINTR) {
-			terminate = 1;
+		ret = read(result->outfd, ptr, len);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret <= 0)
 			break;
-		}
 		/* Stop at the first NUL byte in the scanner output. */
 		for (len=0; len<ret; ++len)
 			if (ptr[len] == 0)
@@ -497,55 +819,206 @@ scanner_run(struct anoubisd_pg_scanner *scanner, int fd, int toclose[])
 		result->off += len;
 		if (len < ret)
 			break;
-		/* Zero means: No timeout. */
-		if (timeout && (time(&now) < 0 || now - starttime > timeout))
-			terminate = 1;
-		/* Can be set by the signal handler, too. */
-		if (terminate)
-			break;
 	}
-	close(fds[0]);
-	if (terminate)
-		kill(pid, SIGTERM);
-	abuf_limit(&result->text, result->off);
-	while (wait(&status) != pid) {
-		if (terminate) {
-			kill(pid, SIGKILL);
-		} else if (timeout) {
-			if (time(&now) < 0 || now - starttime > timeout) {
-				kill(pid, SIGTERM);
-				terminate = 1;
-			}
-		}
+	close(result->outfd);
+	result->outfd = -1;
+}
+
+/**
+ * Ask a running scanner to terminate. The scanner is sent a SIGTERM
+ * and will be killed if it does not exit within SCANNER_KILL_DELAY
+ * seconds. Nothing happens if the scanner was already signalled.
+ *
+ * @param result The result structure of the scanner.
+ * @param now The current time.
+ * @return None.
+ */
+static void
+scanner_kill(struct scanresult *result, const struct timeval *now)
+{
+	if (result->pid == 0 || result->killed.tv_sec)
+		return;
+	kill(result->pid, SIGTERM);
+	result->killed = *now;
+}
+
+/**
+ * Record the exit of a scanner sub process in the result structure.
+ * Output that is still available in the pipe is read but the pipe is
+ * closed in any case, even if the scanner left behind other processes
+ * that still hold the write end open.
+ *
+ * @param result The result structure of the scanner.
+ * @param status The exit status of the scanner process.
+ * @param now The current time.
+ * @return None.
+ */
+static void
+scanner_reap(struct scanresult *result, int status, const struct timeval *now)
+{
+	result->pid = 0;
+	scanner_read(result);
+	if (result->outfd >= 0) {
+		close(result->outfd);
+		result->outfd = -1;
 	}
+	abuf_limit(&result->text, result->off);
+	result->msec = scanner_msec(&result->start, now);
 	if (WIFEXITED(status))
 		result->exitcode = WEXITSTATUS(status);
 	/* Forceful termination can  never result in a successful scan. */
-	if (terminate && result->exitcode == 0)
+	if (result->killed.tv_sec && result->exitcode == 0)
 		result->exitcode = 2;
-	return result;
-err:
-	result->exitcode = 2;
-	str = strerror(errno);
-	result->off = strlen(str);
-	if (result->off > (int)abuf_length(result->text))
-		result->off = abuf_length(result->text);
-	abuf_copy_tobuf(result->text, str, result->off);
-	abuf_limit(&result->text, result->off);
-	return result;
+}
+
+/**
+ * Run all scanners in the result list and wait for their completion.
+ * At most parallel scanners run at the same time. The output of the
+ * running scanners is collected with poll(2). A scanner that exceeds the
+ * scanner timeout is terminated. Once a required scanner rejected the file
+ * the result of the scan is known: Scanners that are still running are
+ * terminated and scanners that did not start yet are skipped. The results
+ * of these scanners are marked as aborted. The same happens if the
+ * scanner child is asked to terminate.
+ *
+ * @param results The list of scanner results. There is one result
+ *     structure for each scanner that must run.
+ * @param cnt The number of entries in the result list.
+ * @param parallel The maximum number of concurrent scanners.
+ * @param toclose A list of file descriptors (terminated by -1) that
+ *     must be closed in the scanner sub processes.
+ * @return Zero in case of success, a negative error code if an error
+ *     occured.
+ */
+static int
+scanner_run_all(struct scanresult_list *results, int cnt, int parallel,
+    int toclose[])
+{
+	struct scanresult	*result, *pending;
+	struct scanresult	**pres;
+	struct pollfd		*pfds;
+	struct timeval		 now;
+	time_t			 timeout = anoubisd_config.scanner_timeout;
+	int			 i, nfds, status, running = 0, rejected = 0;
+	long			 left, tmo;
+	pid_t			 pid;
+
+	if (cnt == 0)
+		return 0;
+	pfds = malloc(cnt * sizeof(struct pollfd));
+	pres = malloc(cnt * sizeof(struct scanresult *));
+	if (pfds == NULL || pres == NULL)
+		return -ENOMEM;
+	pending = CIRCLEQ_FIRST(results);
+	while (1) {
+		/* Start pending scanners. */
+		while (pending != CIRCLEQ_END(results) && running < parallel) {
+			result = pending;
+			pending = CIRCLEQ_NEXT(pending, next);
+			if (result->cached)
+				continue;
+			if (rejected || terminate) {
+				result->aborted = 1;
+				continue;
+			}
+			scanner_start(result, toclose);
+			if (result->pid)
+				running++;
+			else if (result->exitcode && result->scanner->required)
+				rejected = 1;
+		}
+		if (running == 0)
+			break;
+
+		/*
+		 * Handle timeouts and terminate scanners if necessary.
+		 * Collect the output pipes of all running scanners.
+		 */
+		gettimeofday(&now, NULL);
+		tmo = 1000;
+		nfds = 0;
+		CIRCLEQ_FOREACH(result, results, next) {
+			if (result->pid == 0)
+				continue;
+			if ((rejected || terminate) && !result->killed.tv_sec) {
+				result->aborted = 1;
+				scanner_kill(result, &now);
+			}
+			if (result->killed.tv_sec) {
+				left = SCANNER_KILL_DELAY * 1000
+				    - scanner_msec(&result->killed, &now);
+				if (left <= 0) {
+					kill(result->pid, SIGKILL);
+					left = 1000;
+				}
+			} else if (timeout) {
+				left = timeout * 1000
+				    - scanner_msec(&result->start, &now);
+				if (left <= 0) {
+					scanner_kill(result, &now);
+					left = SCANNER_KILL_DELAY * 1000;
+				}
+			} else {
+				left = tmo;
+			}
+			if (result->outfd >= 0) {
+				pfds[nfds].fd = result->outfd;
+				pfds[nfds].events = POLLIN;
+				pres[nfds++] = result;
+			} else if (left > 100) {
+				/*
+				 * The scanner closed its output but is still
+				 * running. SIGCHLD interrupts poll(2) but
+				 * we might have missed the signal already.
+				 */
+				left = 100;
+			}
+			if (left < tmo)
+				tmo = left;
+		}
+		if (poll(pfds, nfds, tmo) > 0) {
+			for (i=0; i<nfds; ++i) {
+				if (pfds[i].revents)
+					scanner_read(pres[i]);
+			}
+		}
+
+		/* Collect the exit status of terminated scanners. */
+		gettimeofday(&now, NULL);
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			CIRCLEQ_FOREACH(result, results, next) {
+				if (result->pid == pid)
+					break;
+			}
+			if (result == CIRCLEQ_END(results))
+				continue;
+			scanner_reap(result, status, &now);
+			running--;
+			if (result->exitcode && result->scanner->required)
+				rejected = 1;
+		}
+	}
+	free(pfds);
+	free(pres);
+	return 0;
 }
 
 /**
  * The main loop of the scanner. This function spawns a child process
  * for each scanner that is configured and collects all scanner results.
- * The scanner results are then combined into a single reply message with
- * a payload of at most 8000 bytes. Each scanner that wants to report an
+ * If possible, the scanners run concurrently and each scanner reads
+ * the file through its own file descriptor (see scanner_reopen).
+ * Scanners that accepted the same content before are not run at all
+ * if the scanner cache is enabled. The scanner results are then combined into a single reply message with
+ * a payload of less than 8000 bytes. Each scanner that wants to report an
  * error can contribute proportionally to these 8000 bytes.
  *
  * The format of the result is a sequence of strings. There are two
  * strings per scanner, the first is the scanner's description from the
  * config file and the second is the error output of the scanner. Only
- * outpt of failed scanners is reported.
+ * outpt of failed scanners is reported. The strings are followed by
+ * a latency report for all scanners that is not NUL-terminated (see
+ * ANOUBIS_PGCOMMIT_LATENCY).
  *
  * Scanners that are not required (i.e. recommended) are only run if flags
  * is zero. An empty list of scanners means that the file must not be
@@ -569,19 +1042,22 @@ err:
 __dead static void __attribute__((noinline))
 scanner_main(struct scanproc *sp, int flags)
 {
-	int					 i, off;
+	int					 i, j, off;
 	struct anoubisd_msg			*msg;
 	struct anoubisd_msg_pgcommit_reply	*pgrep;
 	void					*buf;
 	int					 err = 0;
-	CIRCLEQ_HEAD(, scanresult)		 results;
+	struct scanresult_list			 results;
 	struct scanresult			*result;
 	struct anoubisd_pg_scanner		*scanner;
-	int					 toclose[2];
+	int					 toclose[3];
 	struct abuf_buffer			 resbuf = ABUF_EMPTY;
+	int					 nscanners = 0, parallel;
 	int					 nresults = 0, limit = 0;
 	struct sigaction			 action;
-	struct itimerval			 timer;
+	char					 latency[SCANNER_LATENCY_MAX];
+	int					 latlen, n;
+	const char				*status;
 
 	CIRCLEQ_INIT(&results);
 	/*
@@ -595,27 +1071,32 @@ scanner_main(struct scanproc *sp, int flags)
 			continue;
 		if (i == sp->scanfile)
 			continue;
+		for (j=0; j<sp->nscanfds; ++j)
+			if (i == sp->scanfds[j])
+				break;
+		if (j < sp->nscanfds)
+			continue;
+		if (sp->cache && i == scancache_fd(sp->cache))
+			continue;
 		close(i);
 	}
 
-	/* Setup signals and timeouts. */
+	/* Setup signals. Timeouts are handled by poll(2). */
 	action.sa_flags = 0;		/* No SA_RESTART! */
 	action.sa_handler = sighandler;
 	sigemptyset(&action.sa_mask);
 	if (sigaction(SIGINT, &action, NULL) < 0
 	    || sigaction(SIGTERM, &action, NULL) < 0
-	    || sigaction(SIGALRM, &action, NULL) < 0)
-		_exit(2);
-
-	/* Fire every ten seconds. */
-	timer.it_interval.tv_sec = 10;
-	timer.it_interval.tv_usec = 0;
-	timer.it_value = timer.it_interval;
-	if (setitimer(ITIMER_REAL, &timer, NULL) < 0)
+	    || sigaction(SIGCHLD, &action, NULL) < 0)
 		_exit(2);
 
+	/*
+	 * The scanners only need the original file descriptor if they
+	 * share it, i.e. if the file could not be reopened.
+	 */
 	toclose[0] = sp->pipe[1];
-	toclose[1] = -1;
+	toclose[1] = sp->scanfds ? sp->scanfile : -1;
+	toclose[2] = -1;
 
 	setproctitle("scanner uid=%d", (int)sp->uid);
 
@@ -627,24 +1108,63 @@ scanner_main(struct scanproc *sp, int flags)
 		/* Skip non-required scanners if flags are non-zero. */
 		if (flags && !scanner->required)
 			continue;
-		result = scanner_run(scanner, sp->scanfile, toclose);
+		result = abuf_zalloc_type(struct scanresult);
 		if (result == NULL)
 			goto out;
+		result->exitcode = 2;
+		result->text = ABUF_EMPTY;
+		result->scanner = scanner;
+		result->outfd = -1;
+		if (nscanners < sp->nscanfds)
+			result->scanfd = sp->scanfds[nscanners];
+		else
+			result->scanfd = sp->scanfile;
 		CIRCLEQ_INSERT_TAIL(&results, result, next);
-		if (result->exitcode != 0)
+		nscanners++;
+	}
+	if (sp->cache)
+		scanner_cache_lookup(sp, &results);
+	parallel = sp->scanfds ? nscanners : 1;
+	err = scanner_run_all(&results, nscanners, parallel, toclose);
+	if (err < 0)
+		goto out;
+	if (terminate) {
+		err = -EINTR;
+		goto out;
+	}
+	if (sp->cache)
+		scanner_cache_store(sp, &results);
+
+	/* Build the latency report. */
+	latlen = strlcpy(latency, ANOUBIS_PGCOMMIT_LATENCY, sizeof(latency));
+	CIRCLEQ_FOREACH(result, &results, next) {
+		if (result->aborted) {
+			status = "aborted";
+		} else if (result->cached) {
+			status = "cached";
+		} else if (result->exitcode) {
+			status = "failed";
 			nresults++;
-		if (terminate) {
-			err = -EINTR;
-			goto out;
+		} else {
+			status = "ok";
 		}
+		n = snprintf(latency + latlen, sizeof(latency) - latlen,
+		    "%u %s %s\n", result->msec, status,
+		    result->scanner->description);
+		if (n < 0 || n >= (int)sizeof(latency) - latlen)
+			continue;
+		latlen += n;
 	}
+
 	err = -EFAULT;
+	resbuf = abuf_alloc(SCANNER_REPLY_MAX);
+	if (abuf_empty(resbuf))
+		goto out;
 	if (nresults) {
-		resbuf = abuf_alloc(8000);
-		limit = abuf_length(resbuf) / nresults;
+		limit = (abuf_length(resbuf) - latlen) / nresults;
+		if (limit < 100)
+			goto out;
 	}
-	if (nresults && limit < 100)
-		goto out;
 	err = 0;
 	off = 0;
 	CIRCLEQ_FOREACH(result, &results, next) {
@@ -652,7 +1172,7 @@ scanner_main(struct scanproc *sp, int flags)
 		char		*ptr;
 
 		scanner = result->scanner;
-		if (result->exitcode == 0)
+		if (result->exitcode == 0 || result->aborted)
 			continue;
 		if (scanner->required) {
 			err = -EPERM;
@@ -676,6 +1196,8 @@ scanner_main(struct scanproc *sp, int flags)
 		abuf_copy_tobuf(abuf_open(resbuf, off), "", 1);
 		off++;
 	}
+	abuf_copy_tobuf(abuf_open(resbuf, off), latency, latlen);
+	off += latlen;
 	abuf_limit(&resbuf, off);
 
 out:
@@ -732,6 +1254,9 @@ anoubisd_scan_start(uint64_t token, int fd, uint64_t auth_uid, int flags)
 	sp->msgoff = 0;
 	sp->token = token;
 	sp->scanfile = fd;
+	sp->scanfds = NULL;
+	sp->nscanfds = 0;
+	sp->cache = NULL;
 	sp->uid = auth_uid;
 	if (pipe(sp->pipe) < 0 || fcntl(sp->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
 		ret = -errno;
@@ -751,6 +1276,22 @@ anoubisd_scan_start(uint64_t token, int fd, uint64_t auth_uid, int flags)
 	if (sp->childpid == 0) {
 		struct passwd	*pw;
 
+		/*
+		 * Reopen the file and open the scanner cache while we
+		 * still have the privileges.
+		 */
+		scanner_reopen(sp, flags);
+		if (anoubisd_config.scanner_cache_size > 0
+		    && anoubisd_config.scanner_cache_ttl > 0) {
+			ret = scancache_open(ANOUBISD_SCANCACHE,
+			    anoubisd_config.scanner_cache_size, &sp->cache);
+			if (ret < 0) {
+				syslog(LOG_WARNING, "Cannot open scanner "
+				    "cache: %s", strerror(-ret));
+				sp->cache = NULL;
+			}
+		}
+
 		/* Drop privileges */
 		if ((pw = getpwnam(SCAN_USER)) == NULL) {
 			syslog(LOG_CRIT, "getpwnam failed for %s: %s",
@@ -782,7 +1323,7 @@ anoubisd_scan_start(uint64_t token, int fd, uint64_t auth_uid, int flags)
 		_exit(126);
 	}
 	close(sp->pipe[1]);
-	event_set(&sp->event, sp->scanfile, EV_READ|EV_PERSIST,
+	event_set(&sp->event, sp->pipe[0], EV_READ|EV_PERSIST,
 	    dispatch_scand2m, sp);
 	event_add(&sp->event, NULL);
 	LIST_INSERT_HEAD(&scanprocs, sp, next);
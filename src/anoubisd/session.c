@@ -228,6 +228,7 @@ static void	dispatch_m2s_checksum_reply(const struct anoubisd_msg *msg);
 static void	dispatch_m2s_upgrade_notify(const struct anoubisd_msg *msg);
 static void	session_rxclient(int, short, void *);
 static void	session_txclient(int, short, void *);
+static void	session_corkall(int);
 static struct achat_channel*	setup_listening_socket(void);
 static void	session_destroy(struct session *);
 static int	dispatch_generic_reply(void *cbdata, int error,
@@ -403,12 +404,18 @@ static void
 session_rxclient(int fd __used, short event __used, void *arg)
 {
 	struct session		*session = arg;
-	struct anoubis_msg	*m;
+	void			*buf;
+	size_t			 len;
 	int			 ret;
 
 	DEBUG(DBG_TRACE, ">session_rxclient");
 	while(1) {
-		ret = get_client_msg(session->channel->fd, &m);
+		/*
+		 * The message is processed in place in the receive
+		 * buffer. It is only valid until the next call to
+		 * get_client_msg.
+		 */
+		ret = get_client_msg(session->channel->fd, &buf, &len);
 		if (ret == 0) {
 			session_destroy(session);
 			DEBUG(DBG_TRACE, "<session_rxclient (receivemsg)");
@@ -417,14 +424,14 @@ session_rxclient(int fd __used, short event __used, void *arg)
 		if (ret < 0)
 			goto err;
 		/* Only incomplete message. Nothing to do */
-		if (!m) {
+		if (!buf) {
 			DEBUG(DBG_TRACE,
 			    " session_rxclient: Incomplete message");
 			break;
 		} else {
 			DEBUG(DBG_TRACE,
 			    " session_rxclient: got message (size=%d)",
-			    m->length);
+			    (int)len);
 		}
 		/* At this point we actually got a message. */
 		if (!session->proto)
@@ -433,11 +440,9 @@ session_rxclient(int fd __used, short event __used, void *arg)
 		 * Return codes: less than zero is an error. Zero means no
 		 * error but message did not fit into protocol stream.
 		 */
-		ret = anoubis_server_process(session->proto,
-		    m->u.buf, m->length);
+		ret = anoubis_server_process(session->proto, buf, len);
 		if (ret < 0)
 			goto err;
-		anoubis_msg_free(m);
 		if (anoubis_server_eof(session->proto)) {
 			session_destroy(session);
 			break;
@@ -446,8 +451,6 @@ session_rxclient(int fd __used, short event __used, void *arg)
 	DEBUG(DBG_TRACE, "<session_rxclient");
 	return;
 err:
-	if (m)
-		anoubis_msg_free(m);
 	session_destroy(session);
 	log_warnx("session_rxclient: error processing client message %d", ret);
 
@@ -473,6 +476,31 @@ session_txclient(int fd __used, short event __used, void *arg)
 	acc_flush(sess->channel);
 }
 
+/**
+ * Cork or uncork the channels of all sessions. This is used while
+ * a batch of messages from the master or the policy engine is processed.
+ * Notifications and replies produced for these messages are queued
+ * and sent with a single write per session when the channels are
+ * uncorked.
+ *
+ * @param cork True to cork the channels, false to uncork them.
+ * @return None.
+ */
+static void
+session_corkall(int cork)
+{
+	struct session	*sess;
+
+	LIST_FOREACH(sess, &sessionList, nextSession) {
+		if (sess->channel == NULL)
+			continue;
+		if (cork)
+			acc_cork(sess->channel);
+		else
+			acc_uncork(sess->channel);
+	}
+}
+
 /**
  * This is the main entry point for the session engine. The master
  * calls this function to start the session process. This function
@@ -672,8 +700,8 @@ notify_callback(struct anoubis_notify_head *head, int verdict, void *_cbdata)
 /**
  * Send a notification message (i.e. a message that does not expect a
  * reply) to all interested (and authorized) user session. This function
- * creates the notification head and iterates over all sessions sending
- * the message if appropriate.
+ * creates the notification head and sends the message to all sessions
+ * that registered for it. The message is encoded only once.
  *
  * @param m The notification message.
  * @return None.
@@ -681,7 +709,6 @@ notify_callback(struct anoubis_notify_head *head, int verdict, void *_cbdata)
 static void
 __send_notify(struct anoubis_msg *m)
 {
-	struct session			*sess;
 	struct anoubis_notify_head	*head;
 
 	head = anoubis_notify_create_head(m, NULL, NULL);
@@ -693,16 +720,7 @@ __send_notify(struct anoubis_msg *m)
 	}
 	DEBUG(DBG_TRACE, " >anoubis_notify_create_head");
 
-	LIST_FOREACH(sess, &sessionList, nextSession) {
-		struct anoubis_notify_group * ng;
-
-		if (sess->proto == NULL)
-			continue;
-		ng = anoubis_server_getnotify(sess->proto);
-		if (!ng)
-			continue;
-		anoubis_notify(ng, head, ANOUBISD_MAX_PENDNG_EVENTS);
-	}
+	anoubis_notify_all(head, ANOUBISD_MAX_PENDNG_EVENTS, NULL);
 	anoubis_notify_destroy_head(head);
 	DEBUG(DBG_TRACE, " >anoubis_notify_destroy_head");
 }
@@ -712,7 +730,9 @@ __send_notify(struct anoubis_msg *m)
  * requests received from a user session. It translates the request into
  * a ANOUBISD_MSG_CSMULTIREQUEST daemon message and forwards it to
  * the anoubis daemon master process. policy_comm is used to track
- * pending requests.
+ * pending requests. A client can send up to ANOUBIS_CSMULTI_MAXWINDOW
+ * CSMULTI requests before it waits for the replies. The master process
+ * handles them in order.
  *
  * @param server The server object associated with the client session.
  * @param m The request message as received from the client.
@@ -743,10 +763,8 @@ dispatch_csmulti(struct anoubis_server *server, struct anoubis_msg *m,
 	csum_msg->uid = uid;
 	csum_msg->len = m->length;
 	memcpy(csum_msg->msg, m->u.buf, m->length);
-	err = anoubis_policy_comm_addrequest(policy_comm, chan,
-	    POLICY_FLAG_START | POLICY_FLAG_END,
-	    &dispatch_csmulti_reply, NULL, server,
-	    &csum_msg->token);
+	err = anoubis_policy_comm_addpipelined(policy_comm, chan,
+	    &dispatch_csmulti_reply, NULL, server, &csum_msg->token);
 	if (err < 0) {
 		log_warnx("Dropping checksum request (error %d)", err);
 		free(s2m_msg);
@@ -1459,28 +1477,26 @@ dispatch_checksum_reply(void *cbdata, int error, const void *data,
 
 /**
  * Forward the reply to a CSMULTI checksum request from the master process
- * to the client.
+ * to the client. The master can split the reply into several messages,
+ * each of them is forwarded as a separate Anoubis_CSMultiReplyMessage.
  *
  * @param cbdata The server object of the client connection.
  * @param error The error code for the request.
  * @param data The payload data (an Anoubis_CSMultiReplyMessage).
  * @param len The length of the payload data.
- * @param flags Policy flags. Must always be
- *     (POLICY_FLAG_START | POLICY_FLAG_END).
+ * @param flags Policy flags (unused).
  * @return Zero if the message could be sent, a negative error code in
  *     case of an error.
  */
 static int
 dispatch_csmulti_reply(void *cbdata, int error, const void *data,
-    int len, int flags)
+    int len, int flags __used)
 {
 	struct anoubis_server		*server = cbdata;
 	struct anoubis_msg		*m;
 	int				 ret;
 
 	DEBUG(DBG_TRACE, ">dispatch_csmulti_reply");
-	if (flags != (POLICY_FLAG_START | POLICY_FLAG_END))
-		log_warnx("Wrong flags value in dispatch_csmulti_reply");
 	if (error)
 		goto err;
 	if (len < (int)sizeof(Anoubis_CSMultiReplyMessage)) {
@@ -1642,6 +1658,65 @@ dispatch_policy(struct anoubis_policy_comm *comm __used, uint64_t token,
 	return 0;
 }
 
+/**
+ * Send a kernel event that does not need a reply as a notification to
+ * all interested sessions. Such events are received from the master
+ * process (kernel notifications) or from the policy process (statistics).
+ *
+ * @param msg The message (of type ANOUBISD_MSG_EVENTDEV). The message
+ *     is not freed by this function.
+ * @return None.
+ */
+static void
+dispatch_eventdev_notify(struct anoubisd_msg *msg)
+{
+	struct anoubis_msg		*m;
+	struct eventdev_hdr		*hdr;
+	unsigned int			 extra;
+	u_int64_t			 task;
+
+	hdr = (struct eventdev_hdr *)msg->msg;
+
+	DEBUG(DBG_QUEUE, " >notify: %x", hdr->msg_token);
+
+	if (hdr->msg_flags & EVENTDEV_NEED_REPLY) {
+		log_warnx("dispatch_eventdev_notify: bad flags %x",
+		    hdr->msg_flags);
+	}
+
+	extra = hdr->msg_size -  sizeof(struct eventdev_hdr);
+	task = 0;
+	if (extra >= sizeof(struct anoubis_event_common))
+		task = ((struct anoubis_event_common *)
+		    (hdr+1))->task_cookie;
+	m = anoubis_msg_new(sizeof(Anoubis_NotifyMessage) + extra);
+	if (!m) {
+		/* malloc failure, then we don't send the message */
+		return;
+	}
+	set_value(m->u.notify->type, ANOUBIS_N_NOTIFY);
+	m->u.notify->token = hdr->msg_token;
+	set_value(m->u.notify->pid, hdr->msg_pid);
+	set_value(m->u.notify->task_cookie, task);
+	set_value(m->u.notify->rule_id, 0);
+	set_value(m->u.notify->prio, 0);
+	set_value(m->u.notify->uid, hdr->msg_uid);
+	set_value(m->u.notify->subsystem, hdr->msg_source);
+	set_value(m->u.notify->sfsmatch, ANOUBIS_SFS_NONE);
+	set_value(m->u.notify->csumoff, 0);
+	set_value(m->u.notify->csumlen, 0);
+	set_value(m->u.notify->pathoff, 0);
+	set_value(m->u.notify->pathlen, 0);
+	set_value(m->u.notify->ctxcsumoff, 0);
+	set_value(m->u.notify->ctxcsumlen, 0);
+	set_value(m->u.notify->ctxpathoff, 0);
+	set_value(m->u.notify->ctxpathlen, 0);
+	set_value(m->u.notify->evoff, 0);
+	set_value(m->u.notify->evlen, extra);
+	memcpy(m->u.notify->payload, &hdr[1], extra);
+	__send_notify(m);
+}
+
 /**
  * Handle messages received from the master process by the session engine.
  * Possible messages include replies to checksum or authentication requests,
@@ -1660,15 +1735,12 @@ dispatch_policy(struct anoubis_policy_comm *comm __used, uint64_t token,
 static void
 dispatch_m2s(int fd, short sig __used, void *arg __used)
 {
-	struct anoubis_msg		*m;
 	struct anoubisd_msg		*msg;
-	struct eventdev_hdr		*hdr;
-	unsigned int			 extra;
 
 	DEBUG(DBG_TRACE, ">dispatch_m2s");
 
+	session_corkall(1);
 	for (;;) {
-		u_int64_t	task;
 		if ((msg = get_msg(fd)) == NULL)
 			break;
 		if (msg->mtype == ANOUBISD_MSG_CHECKSUMREPLY
@@ -1728,54 +1800,12 @@ dispatch_m2s(int fd, short sig __used, void *arg __used)
 			continue;
 		}
 
-		hdr = (struct eventdev_hdr *)msg->msg;
-
-		DEBUG(DBG_QUEUE, " >m2s: %x", hdr->msg_token);
-
-		if (hdr->msg_flags & EVENTDEV_NEED_REPLY) {
-			log_warnx("dispatch_m2s: bad flags %x", hdr->msg_flags);
-		}
-
-		hdr = (struct eventdev_hdr *)msg->msg;
-		DEBUG(DBG_QUEUE, " >m2s: %x", hdr->msg_token);
-
-		extra = hdr->msg_size -  sizeof(struct eventdev_hdr);
-		task = 0;
-		if (extra >= sizeof(struct anoubis_event_common))
-			task = ((struct anoubis_event_common *)
-			    (hdr+1))->task_cookie;
-		m = anoubis_msg_new(sizeof(Anoubis_NotifyMessage) + extra);
-		if (!m) {
-			/* malloc failure, then we don't send the message */
-			free(msg);
-			DEBUG(DBG_TRACE, "<dispatch_m2s (new)");
-			continue;
-		}
-		set_value(m->u.notify->type, ANOUBIS_N_NOTIFY);
-		m->u.notify->token = hdr->msg_token;
-		set_value(m->u.notify->pid, hdr->msg_pid);
-		set_value(m->u.notify->task_cookie, task);
-		set_value(m->u.notify->rule_id, 0);
-		set_value(m->u.notify->prio, 0);
-		set_value(m->u.notify->uid, hdr->msg_uid);
-		set_value(m->u.notify->subsystem, hdr->msg_source);
-		set_value(m->u.notify->sfsmatch, ANOUBIS_SFS_NONE);
-		set_value(m->u.notify->csumoff, 0);
-		set_value(m->u.notify->csumlen, 0);
-		set_value(m->u.notify->pathoff, 0);
-		set_value(m->u.notify->pathlen, 0);
-		set_value(m->u.notify->ctxcsumoff, 0);
-		set_value(m->u.notify->ctxcsumlen, 0);
-		set_value(m->u.notify->ctxpathoff, 0);
-		set_value(m->u.notify->ctxpathlen, 0);
-		set_value(m->u.notify->evoff, 0);
-		set_value(m->u.notify->evlen, extra);
-		memcpy(m->u.notify->payload, &hdr[1], extra);
+		dispatch_eventdev_notify(msg);
 		free(msg);
-		__send_notify(m);
 
 		DEBUG(DBG_TRACE, "<dispatch_m2s (loop)");
 	}
+	session_corkall(0);
 	if (msg_eof(fd)) {
 		session_sighandler(SIGTERM, 0, NULL);
 		event_del(&ev_m2s);
@@ -1806,6 +1836,7 @@ dispatch_p2s(int fd, short sig __used, void *arg __used)
 
 	DEBUG(DBG_TRACE, ">dispatch_p2s");
 
+	session_corkall(1);
 	for (;;) {
 		if ((msg = get_msg(fd)) == NULL)
 			break;
@@ -1858,6 +1889,11 @@ dispatch_p2s(int fd, short sig __used, void *arg __used)
 			dispatch_p2s_evt_cancel(msg);
 			break;
 
+		case ANOUBISD_MSG_EVENTDEV:
+			DEBUG(DBG_QUEUE, " >p2s: notify");
+			dispatch_eventdev_notify(msg);
+			break;
+
 		default:
 			log_warnx("dispatch_p2s: bad mtype %d", msg->mtype);
 			break;
@@ -1867,6 +1903,7 @@ dispatch_p2s(int fd, short sig __used, void *arg __used)
 
 		DEBUG(DBG_TRACE, "<dispatch_p2s (loop)");
 	}
+	session_corkall(0);
 	if (msg_eof(fd)) {
 		session_sighandler(SIGTERM, 0, NULL);
 		event_del(&ev_p2s);
@@ -2075,9 +2112,8 @@ dispatch_p2s_evt_request(const struct anoubisd_msg *msg)
 	struct anoubis_notify_head		*head;
 	struct anoubis_msg			*m;
 	const struct anoubisd_msg_eventask	*eventask = NULL;
-	struct session				*sess;
 	struct cbdata				*cbdata;
-	int					 sent;
+	int					 sent, errors;
 
 	DEBUG(DBG_TRACE, ">dispatch_p2s_evt_request");
 
@@ -2106,25 +2142,13 @@ dispatch_p2s_evt_request(const struct anoubisd_msg *msg)
 		return;
 	}
 
-	sent = 0;
-	LIST_FOREACH(sess, &sessionList, nextSession) {
-		struct anoubis_notify_group * ng;
-		int ret;
-
-		if (sess->proto == NULL)
-			continue;
-		ng = anoubis_server_getnotify(sess->proto);
-		if (!ng)
-			continue;
-		ret = anoubis_notify(ng, head, ANOUBISD_MAX_PENDNG_EVENTS);
-		if (ret < 0)
-			log_warnx("anoubis_notify: Error code %d", -ret);
-		if (ret > 0) {
-			DEBUG(DBG_TRACE, " >anoubis_notify: %x",
-			    cbdata->ev_token);
-			sent = 1;
-		}
-	}
+	sent = anoubis_notify_all(head, ANOUBISD_MAX_PENDNG_EVENTS, &errors);
+	if (errors)
+		log_warnx("anoubis_notify: Failed to notify %d sessions",
+		    errors);
+	if (sent)
+		DEBUG(DBG_TRACE, " >anoubis_notify: %x to %d sessions",
+		    cbdata->ev_token, sent);
 
 	if (sent) {
 		TAILQ_INSERT_TAIL(&headq, cbdata, next);
@@ -141,6 +141,119 @@ static int	 sfs_readsfsdata(const char *csum_file,
 		     struct sfs_data *sfsdata);
 static int	 sfs_deletechecksum(const char *csum_file);
 static int	 check_empty_dir(const char *path);
+static int	 sfs_wantentry(const struct sfs_checksumop *,
+		     const char *sfs_path, const char *entryname);
+static void	 sfs_remove_index(const char *,
+		     const struct sfs_checksumop *);
+
+/**
+ * Callback type for functions that iterate over the entries of a
+ * storage backend. The arguments are the path name of the file, the ID
+ * of the entry (user-ID or 'k' followed by the key ID) and the callback
+ * argument. A non-zero return value stops the iteration.
+ */
+typedef int (*sfs_foreach_cb)(const char *, const char *, void *);
+
+/**
+ * A storage backend for checksums and signatures. The SFS tree is the
+ * default backend, the indexed store (see sfs_store.c) can be selected
+ * in the configuration file. Each entry is identified by the path
+ * name of the file and an ID. The ID is the decimal user-ID for unsigned
+ * checksums and the letter 'k' followed by the hex representation of
+ * the key ID for signatures.
+ */
+struct sfs_backend {
+	/**
+	 * Read the entry for a path name and an ID. Returns -ENOENT
+	 * (or -ENOTDIR) if the entry does not exist. Chroot-ed processes
+	 * must set is_chroot.
+	 */
+	int	(*read)(const char *path, const char *id,
+		    struct sfs_data *data, int is_chroot);
+	/**
+	 * Create or replace the entry for a path name and an ID. The
+	 * upgrade checksum is only stored if it differs from the signed
+	 * checksum.
+	 */
+	int	(*write)(const char *path, const char *id,
+		    const struct sfs_data *data);
+	/**
+	 * Remove the entry for a path name and an ID.
+	 */
+	int	(*remove)(const char *path, const char *id);
+	/**
+	 * Call a function for each entry of a path name.
+	 */
+	int	(*foreach_id)(const char *path, int is_chroot,
+		    sfs_foreach_cb callback, void *arg);
+	/**
+	 * Call a function once for each path name with at least one entry.
+	 */
+	int	(*foreach_file)(int is_chroot,
+		    void (*callback)(const char *, void *), void *arg);
+	/**
+	 * Call a function for each name that is part of a list request.
+	 */
+	int	(*list)(const struct sfs_checksumop *csop,
+		    int (*callback)(const char *, void *), void *arg);
+};
+
+static int	 sfs_tree_read(const char *, const char *, struct sfs_data *,
+		     int);
+static int	 sfs_tree_write(const char *, const char *,
+		     const struct sfs_data *);
+static int	 sfs_tree_remove(const char *, const char *);
+static int	 sfs_tree_foreach_id(const char *, int, sfs_foreach_cb,
+		     void *);
+static int	 sfs_tree_foreach_file(int, void (*)(const char *, void *),
+		     void *);
+static int	 sfs_tree_list(const struct sfs_checksumop *,
+		     int (*)(const char *, void *), void *);
+static int	 sfs_indexed_read(const char *, const char *,
+		     struct sfs_data *, int);
+static int	 sfs_indexed_write(const char *, const char *,
+		     const struct sfs_data *);
+static int	 sfs_indexed_remove(const char *, const char *);
+static int	 sfs_indexed_foreach_id(const char *, int, sfs_foreach_cb,
+		     void *);
+static int	 sfs_indexed_foreach_file(int,
+		     void (*)(const char *, void *), void *);
+static int	 sfs_indexed_list(const struct sfs_checksumop *,
+		     int (*)(const char *, void *), void *);
+
+/**
+ * The backend that stores checksums in the SFS tree.
+ */
+static const struct sfs_backend sfs_tree_backend = {
+	.read = sfs_tree_read,
+	.write = sfs_tree_write,
+	.remove = sfs_tree_remove,
+	.foreach_id = sfs_tree_foreach_id,
+	.foreach_file = sfs_tree_foreach_file,
+	.list = sfs_tree_list,
+};
+
+/**
+ * The backend that stores checksums in the indexed store sfs_db.
+ */
+static const struct sfs_backend sfs_indexed_backend = {
+	.read = sfs_indexed_read,
+	.write = sfs_indexed_write,
+	.remove = sfs_indexed_remove,
+	.foreach_id = sfs_indexed_foreach_id,
+	.foreach_file = sfs_indexed_foreach_file,
+	.list = sfs_indexed_list,
+};
+
+/**
+ * The active storage backend (see sfs_backend_init).
+ */
+static const struct sfs_backend	*sfs_backend = &sfs_tree_backend;
+
+/**
+ * The indexed store if the indexed backend is active.
+ */
+static struct sfs_store		*sfs_db = NULL;
 
 /**
  * Initialize a struct sfs_data structure.
@@ -229,6 +342,388 @@ mkpath(const char *path)
 	return 0;
 }
 
+#ifdef HAVE_OPENAT
+
+/**
+ * The maximum number of directory file descriptors that are kept open
+ * by sfs_tree_dirfd.
+ */
+#define SFS_DIRCACHE_SIZE	64
+
+/**
+ * An open directory in the SFS tree. The entries are kept in a list
+ * that is ordered by the time of the last use.
+ */
+struct sfs_dircache_ent {
+	TAILQ_ENTRY(sfs_dircache_ent)	 next;
+	char				*path;
+	unsigned int			 len;
+	int				 fd;
+};
+
+/**
+ * The directory cache. The most recently used entry is at the head
+ * of the list.
+ */
+static TAILQ_HEAD(sfs_dircache_list, sfs_dircache_ent) sfs_dircache =
+    TAILQ_HEAD_INITIALIZER(sfs_dircache);
+
+/**
+ * The number of entries in the directory cache.
+ */
+static int	sfs_dircache_cnt = 0;
+
+/**
+ * Remove an entry from the directory cache and close its file descriptor.
+ *
+ * @param ent The entry.
+ */
+static void
+sfs_dircache_remove(struct sfs_dircache_ent *ent)
+{
+	TAILQ_REMOVE(&sfs_dircache, ent, next);
+	sfs_dircache_cnt--;
+	close(ent->fd);
+	free(ent->path);
+	free(ent);
+}
+
+/**
+ * Remove the entry for a directory from the directory cache. This
+ * must be called if a directory in the SFS tree is removed.
+ *
+ * @param path The path name of the directory.
+ */
+static void
+sfs_dircache_drop(const char *path)
+{
+	struct sfs_dircache_ent	*ent;
+	unsigned int		 len = strlen(path);
+
+	TAILQ_FOREACH(ent, &sfs_dircache, next) {
+		if (ent->len == len && memcmp(ent->path, path, len) == 0) {
+			sfs_dircache_remove(ent);
+			return;
+		}
+	}
+}
+
+/**
+ * Return an open file descriptor for a directory in the SFS tree. The
+ * file descriptor is owned by the directory cache and must not be
+ * closed by the caller. If the cache is full, the least recently used
+ * directory is closed.
+ *
+ * A directory that is removed while it is cached is detected by its
+ * link count. This happens if the policy engine has the directory
+ * open and the master removes it.
+ *
+ * @param path The path name of the directory. It need not be NUL
+ *     terminated.
+ * @param len The length of the path name.
+ * @param create True if the directory should be created if it does
+ *     not exist.
+ * @return The file descriptor or a negative error code.
+ */
+static int
+sfs_dircache_get(const char *path, unsigned int len, int create)
+{
+	struct sfs_dircache_ent	*ent;
+	struct stat		 statbuf;
+	int			 ret;
+
+	TAILQ_FOREACH(ent, &sfs_dircache, next) {
+		if (ent->len != len || memcmp(ent->path, path, len) != 0)
+			continue;
+		if (fstat(ent->fd, &statbuf) < 0 || statbuf.st_nlink == 0) {
+			sfs_dircache_remove(ent);
+			break;
+		}
+		if (ent != TAILQ_FIRST(&sfs_dircache)) {
+			TAILQ_REMOVE(&sfs_dircache, ent, next);
+			TAILQ_INSERT_HEAD(&sfs_dircache, ent, next);
+		}
+		return ent->fd;
+	}
+	ent = malloc(sizeof(struct sfs_dircache_ent));
+	if (ent == NULL)
+		return -ENOMEM;
+	ent->path = malloc(len + 1);
+	if (ent->path == NULL) {
+		free(ent);
+		return -ENOMEM;
+	}
+	memcpy(ent->path, path, len);
+	ent->path[len] = 0;
+	ent->len = len;
+	ent->fd = open(ent->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (ent->fd < 0 && errno == ENOENT && create) {
+		ret = mkpath(ent->path);
+		if (ret < 0) {
+			free(ent->path);
+			free(ent);
+			return ret;
+		}
+		ent->fd = open(ent->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	}
+	if (ent->fd < 0) {
+		ret = -errno;
+		free(ent->path);
+		free(ent);
+		return ret;
+	}
+	if (sfs_dircache_cnt >= SFS_DIRCACHE_SIZE)
+		sfs_dircache_remove(TAILQ_LAST(&sfs_dircache,
+		    sfs_dircache_list));
+	TAILQ_INSERT_HEAD(&sfs_dircache, ent, next);
+	sfs_dircache_cnt++;
+	return ent->fd;
+}
+
+/**
+ * Split a path name in the SFS tree into a cached directory and a
+ * name relative to that directory. The directory is the parent of the
+ * SFS tree directory that belongs to a file, i.e. all files in the same
+ * directory share a single directory file descriptor and the kernel
+ * only resolves the last path components.
+ *
+ * @param path The path name in the SFS tree.
+ * @param ncomp The number of trailing path components that are part of
+ *     the relative name: One for the directory of a file, two for a
+ *     checksum file.
+ * @param create True if the directory should be created if it does
+ *     not exist.
+ * @param name The relative name is returned here. It points into
+ *     <code>path</code>.
+ * @return The directory file descriptor (see sfs_dircache_get) or a
+ *     negative error code.
+ */
+static int
+sfs_tree_dirfd(const char *path, int ncomp, int create, const char **name)
+{
+	int	len = strlen(path);
+
+	while (len > 0) {
+		if (path[--len] == '/' && --ncomp == 0)
+			break;
+	}
+	if (ncomp || len == 0)
+		return -EINVAL;
+	(*name) = path + len + 1;
+	return sfs_dircache_get(path, len, create);
+}
+
+/**
+ * Create the SFS tree directory that contains a checksum file. The
+ * directory is owned by the anoubisd group.
+ *
+ * @param dirfd The directory file descriptor.
+ * @param name The name of the checksum file relative to dirfd.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_tree_mkdirat(int dirfd, const char *name)
+{
+	char	*dir;
+	int	 ret = 0;
+
+	dir = strdup(name);
+	if (dir == NULL)
+		return -ENOMEM;
+	*strchr(dir, '/') = '\0';
+	if (mkdirat(dirfd, dir, 0750) < 0) {
+		if (errno != EEXIST)
+			ret = -errno;
+	} else if (fchownat(dirfd, dir, -1, anoubisd_gid, 0) < 0) {
+		ret = -errno;
+	}
+	free(dir);
+	return ret;
+}
+
+#endif
+
+/**
+ * Open a checksum file in the SFS tree. The file is opened relative to
+ * a cached directory file descriptor if possible (see sfs_tree_dirfd).
+ * Missing directories are created if O_CREAT is given.
+ *
+ * @param csum_file The path name of the checksum file.
+ * @param flags The flags for open(2).
+ * @param mode The mode for open(2).
+ * @return The file descriptor or a negative error code.
+ */
+static int
+sfs_tree_open(const char *csum_file, int flags, mode_t mode)
+{
+	int		 fd, ret;
+#ifdef HAVE_OPENAT
+	const char	*name;
+	int		 dirfd;
+
+	dirfd = sfs_tree_dirfd(csum_file, 2, flags & O_CREAT, &name);
+	if (dirfd < 0)
+		return dirfd;
+	fd = openat(dirfd, name, flags, mode);
+	if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+		ret = sfs_tree_mkdirat(dirfd, name);
+		if (ret < 0)
+			return ret;
+		fd = openat(dirfd, name, flags, mode);
+	}
+#else
+	char		*csum_path, *p;
+
+	fd = open(csum_file, flags, mode);
+	if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+		csum_path = strdup(csum_file);
+		if (csum_path == NULL)
+			return -ENOMEM;
+		p = strrchr(csum_path, '/');
+		if (p)
+			*p = 0;
+		ret = mkpath(csum_path);
+		free(csum_path);
+		if (ret < 0)
+			return ret;
+		fd = open(csum_file, flags, mode);
+	}
+#endif
+	if (fd < 0)
+		return -errno;
+	return fd;
+}
+
+/**
+ * Open an SFS tree directory that belongs to a file for reading. See
+ * sfs_tree_open.
+ *
+ * @param csum_path The path name of the directory.
+ * @return The directory stream or NULL with errno set in case of an error.
+ */
+static DIR *
+sfs_tree_opendir(const char *csum_path)
+{
+#ifdef HAVE_OPENAT
+	const char	*name;
+	DIR		*dir;
+	int		 dirfd, fd;
+
+	dirfd = sfs_tree_dirfd(csum_path, 1, 0, &name);
+	if (dirfd < 0) {
+		errno = -dirfd;
+		return NULL;
+	}
+	fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return NULL;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		int	err = errno;
+		close(fd);
+		errno = err;
+	}
+	return dir;
+#else
+	return opendir(csum_path);
+#endif
+}
+
+/**
+ * Rename a checksum file in the SFS tree. Both names must be in the
+ * same directory.
+ *
+ * @param from The old path name.
+ * @param to The new path name.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_tree_rename(const char *from, const char *to)
+{
+#ifdef HAVE_OPENAT
+	const char	*oldname, *newname;
+	int		 dirfd;
+
+	dirfd = sfs_tree_dirfd(to, 2, 0, &newname);
+	if (dirfd < 0)
+		return dirfd;
+	if (sfs_tree_dirfd(from, 2, 0, &oldname) != dirfd)
+		return -EINVAL;
+	if (renameat(dirfd, oldname, dirfd, newname) < 0)
+		return -errno;
+#else
+	if (rename(from, to) < 0)
+		return -errno;
+#endif
+	return 0;
+}
+
+/**
+ * Remove the SFS tree directory that contains a checksum file. This
+ * fails if the directory is not empty.
+ *
+ * @param csum_file The path name of the checksum file.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_tree_rmdir(const char *csum_file)
+{
+	char		*dir;
+	int		 ret = 0;
+#ifdef HAVE_OPENAT
+	const char	*name;
+	int		 dirfd;
+
+	dirfd = sfs_tree_dirfd(csum_file, 2, 0, &name);
+	if (dirfd < 0)
+		return dirfd;
+	dir = strdup(name);
+	if (dir == NULL)
+		return -ENOMEM;
+	*strchr(dir, '/') = '\0';
+	if (unlinkat(dirfd, dir, AT_REMOVEDIR) < 0)
+		ret = -errno;
+#else
+	dir = strdup(csum_file);
+	if (dir == NULL)
+		return -ENOMEM;
+	*strrchr(dir, '/') = '\0';
+	if (rmdir(dir) < 0)
+		ret = -errno;
+#endif
+	free(dir);
+	return ret;
+}
+
+/**
+ * Remove a checksum file from the SFS tree.
+ *
+ * @param csum_file The path name of the file.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_tree_unlink(const char *csum_file)
+{
+#ifdef HAVE_OPENAT
+	const char	*name;
+	int		 dirfd;
+
+	dirfd = sfs_tree_dirfd(csum_file, 2, 0, &name);
+	if (dirfd < 0)
+		return dirfd;
+	if (unlinkat(dirfd, name, 0) < 0)
+		return -errno;
+#else
+	if (unlink(csum_file) < 0)
+		return -errno;
+#endif
+	return 0;
+}
+
 /**
  * Insert escape characters into a path name for the SFS-tree.
  * Each star ('*') in the path name is replaced by two stars. If
@@ -322,7 +817,7 @@ insert_escape_seq(const char *path, int dir)
  * @return The path name component with the stars removed. NULL in case of
  *     an error.
  */
-char *
+static char *
 remove_escape_seq(const char *name)
 {
 	char *newpath = NULL;
@@ -371,31 +866,21 @@ remove_escape_seq(const char *name)
 }
 
 /**
- * Convert a user path name to the corresponding directory name in the
- * SFS tree. The given path name must be absolute and must not contain
- * any additional components (.e.g /../, /./, duplicate or trailing slashes).
- * This prevents path name based attacks via the SFS tree.
- * This function inserts escape characters as required and prepends the
- * checksum tree root.
+ * Check a user path name. The given path name must be absolute and must
+ * not contain any additional components (.e.g /../, /./, duplicate or
+ * trailing slashes). This prevents path name based attacks via the SFS
+ * tree and makes sure that each file has a unique name in all backends.
  *
  * @param path The original user provided path name.
- * @param dir A pointer to the result will be stored in dir. The memory
- *     for the string is allocated using malloc(3c) and must be freed
- *     by the caller.
  * @param is_dir True if the user path names a directory (e.g. for list
  *     operations).
- * @param is_chroot True if the name conversion should assume that the
- *     process is chroot-ed and needs a shorted shadow tree preifx.
- * @return Zero in case of success, a negative error code in case of
- *     an error.
+ * @return Zero if the path name is acceptable, -EINVAL otherwise.
  */
 static int
-__convert_user_path(const char * path, char **dir, int is_dir, int is_chroot)
+sfs_check_user_path(const char *path, int is_dir)
 {
 	int	i;
-	char	*newpath = NULL;
 
-	*dir = NULL;
 	if (!path || path[0] != '/')
 		return -EINVAL;
 	if (strstr(path, "/../") != NULL)
@@ -425,6 +910,37 @@ __convert_user_path(const char * path, char **dir, int is_dir, int is_chroot)
 		if (!is_dir || i)
 			return -EINVAL;
 	}
+	return 0;
+}
+
+/**
+ * Convert a user path name to the corresponding directory name in the
+ * SFS tree. The given path name must be acceptable for
+ * sfs_check_user_path.
+ * This function inserts escape characters as required and prepends the
+ * checksum tree root.
+ *
+ * @param path The original user provided path name.
+ * @param dir A pointer to the result will be stored in dir. The memory
+ *     for the string is allocated using malloc(3c) and must be freed
+ *     by the caller.
+ * @param is_dir True if the user path names a directory (e.g. for list
+ *     operations).
+ * @param is_chroot True if the name conversion should assume that the
+ *     process is chroot-ed and needs a shorted shadow tree preifx.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+__convert_user_path(const char * path, char **dir, int is_dir, int is_chroot)
+{
+	char	*newpath = NULL;
+	int	 ret;
+
+	*dir = NULL;
+	ret = sfs_check_user_path(path, is_dir);
+	if (ret < 0)
+		return ret;
 
 	newpath = insert_escape_seq(path, is_dir);
 	if (newpath == NULL)
@@ -450,7 +966,7 @@ __convert_user_path(const char * path, char **dir, int is_dir, int is_chroot)
  * @param is_dir True if the path name corresponds to a directory.
  * @return Zero in case of success. A negative error code in case of errors.
  */
-int
+static int
 convert_user_path(const char * path, char **dir, int is_dir)
 {
 	return __convert_user_path(path, dir, is_dir, 0);
@@ -479,7 +995,7 @@ static int
 __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
     int is_chroot)
 {
-	char		*csum_path = NULL, *csum_file, *keystring;
+	char		*id, *keystring;
 	unsigned int	 realsiglen = 0;
 	int		 error = -EINVAL;
 	struct cert	*cert = NULL;
@@ -501,7 +1017,7 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 		break;
 	}
 
-	error = __convert_user_path(csop->path, &csum_path, 0, is_chroot);
+	error = sfs_check_user_path(csop->path, 0);
 	if (error < 0)
 		return error;
 
@@ -511,40 +1027,31 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 	case ANOUBIS_CHECKSUM_OP_ADDSUM:
 	case ANOUBIS_CHECKSUM_OP_GET2:
 	case ANOUBIS_CHECKSUM_OP_DEL:
-		error = -EPERM;
 		if (csop->uid != csop->auth_uid && csop->auth_uid != 0)
-			goto err1;
-		error = -EINVAL;
+			return -EPERM;
 		if (csop->op == ANOUBIS_CHECKSUM_OP_ADDSUM) {
 			if (abuf_length(csop->sigbuf) != ANOUBIS_CS_LEN)
-				goto err1;
+				return -EINVAL;
 		}
-		error = -ENOMEM;
-		if (asprintf(&csum_file, "%s/%d", csum_path, csop->uid) < 0)
-			goto err1;
+		if (asprintf(&id, "%d", csop->uid) < 0)
+			return -ENOMEM;
 		break;
 	case ANOUBIS_CHECKSUM_OP_ADDSIG:
 	case ANOUBIS_CHECKSUM_OP_GETSIG2:
 	case ANOUBIS_CHECKSUM_OP_DELSIG:
-		error = -EINVAL;
 		if (abuf_empty(csop->keyid))
-			goto err1;
+			return -EINVAL;
 		cert = cert_get_by_keyid(csop->keyid);
-		if (cert == NULL) {
-			error = -A_EPERM_NO_CERTIFICATE;
-			goto err1;
-		}
-		if (cert->uid != csop->auth_uid && csop->auth_uid != 0) {
-			error = -A_EPERM_UID_MISMATCH;
-			goto err1;
-		}
+		if (cert == NULL)
+			return -A_EPERM_NO_CERTIFICATE;
+		if (cert->uid != csop->auth_uid && csop->auth_uid != 0)
+			return -A_EPERM_UID_MISMATCH;
 		realsiglen = EVP_PKEY_size(cert->pubkey);
-		error = -EINVAL;
 		if (csop->op == ANOUBIS_CHECKSUM_OP_ADDSIG) {
 			int ret;
 			if (realsiglen + ANOUBIS_CS_LEN !=
 			    abuf_length(csop->sigbuf))
-				goto err1;
+				return -EINVAL;
 			ret = anoubisd_verify_csum(cert->pubkey,
 			    abuf_toptr(csop->sigbuf, 0, ANOUBIS_CS_LEN),
 			    abuf_toptr(csop->sigbuf, ANOUBIS_CS_LEN,
@@ -552,30 +1059,26 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 			    realsiglen);
 			if (ret != 1) {
 				DEBUG(DBG_CSUM, "Signature verifcation failed");
-				error = -EPERM;
-				goto err1;
+				return -EPERM;
 			}
 		}
-		error = -ENOMEM;
 		keystring = abuf_convert_tohexstr(csop->keyid);
 		if (keystring == NULL)
-			goto err1;
-		if (asprintf(&csum_file, "%s/k%s", csum_path, keystring) < 0) {
+			return -ENOMEM;
+		if (asprintf(&id, "k%s", keystring) < 0) {
 			free(keystring);
-			goto err1;
+			return -ENOMEM;
 		}
 		free(keystring);
 		break;
 	default:
-		error = -EINVAL;
-		goto err1;
+		return -EINVAL;
 	}
 	switch(csop->op) {
 	case ANOUBIS_CHECKSUM_OP_ADDSUM:
 		sfsdata.csdata = csop->sigbuf;
 		if (!abuf_empty(sfsdata.csdata)) {
-			error = sfs_writesfsdata(csum_file, csum_path,
-			    &sfsdata);
+			error = sfs_backend->write(csop->path, id, &sfsdata);
 		} else {
 			error = -ENOMEM;
 		}
@@ -583,21 +1086,20 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 	case ANOUBIS_CHECKSUM_OP_ADDSIG:
 		sfsdata.sigdata = csop->sigbuf;
 		if (!abuf_empty(sfsdata.sigdata)) {
-			error = sfs_writesfsdata(csum_file, csum_path,
-			    &sfsdata);
+			error = sfs_backend->write(csop->path, id, &sfsdata);
 		} else {
 			error = -ENOMEM;
 		}
 		break;
 	case ANOUBIS_CHECKSUM_OP_GET2:
 	case ANOUBIS_CHECKSUM_OP_GETSIG2:
-		error = sfs_readsfsdata(csum_file, &sfsdata);
+		error = sfs_backend->read(csop->path, id, &sfsdata, is_chroot);
 		if (error < 0)
-			goto err2;
+			goto err1;
 		if (abuf_length(sfsdata.csdata)
 		    && abuf_length(sfsdata.csdata) != ANOUBIS_CS_LEN) {
 			error = -EINVAL;
-			goto err3;
+			goto err2;
 		}
 		if (abuf_length(sfsdata.sigdata) && realsiglen && cert) {
 			int		ret;
@@ -605,7 +1107,7 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 			if (abuf_length(sfsdata.sigdata) !=
 			    ANOUBIS_CS_LEN + realsiglen) {
 				error = -ENOENT;
-				goto err3;
+				goto err2;
 			}
 			ret = anoubisd_verify_csum(cert->pubkey,
 			    abuf_toptr(sfsdata.sigdata, 0,
@@ -614,7 +1116,7 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 			    ANOUBIS_CS_LEN, realsiglen), realsiglen);
 			if (ret != 1) {
 				error = -ENOENT;
-				goto err3;
+				goto err2;
 			}
 		} else {
 			abuf_free(sfsdata.sigdata);
@@ -629,23 +1131,20 @@ __sfs_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data,
 		break;
 	case ANOUBIS_CHECKSUM_OP_DEL:
 	case ANOUBIS_CHECKSUM_OP_DELSIG:
-		error = sfs_deletechecksum(csum_file);
+		error = sfs_backend->remove(csop->path, id);
 		break;
 	}
 	if (error < 0)
-		goto err2;
-	free(csum_file);
-	free(csum_path);
+		goto err1;
+	free(id);
 	DEBUG(DBG_CSUM, " <sfs_checksumop: sucess path=%s op=%d", csop->path,
 	    csop->op);
 
 	return 0;
-err3:
-	sfs_freesfsdata(&sfsdata);
 err2:
-	free(csum_file);
+	sfs_freesfsdata(&sfsdata);
 err1:
-	free(csum_path);
+	free(id);
 	return error;
 }
 
@@ -781,7 +1280,57 @@ sfs_checksumop_chroot(const struct sfs_checksumop *csop, struct sfs_data *data)
 }
 
 /**
- * Go through the directory looking for registered uids and keyids.
+ * Update a single entry during sfs_update_all. Unsigned checksums
+ * are replaced, signatures get a new upgrade checksum.
+ *
+ * @param path The path name of the file.
+ * @param id The ID of the entry.
+ * @param arg A pointer to the new checksum.
+ * @return Always zero. Errors are only logged, i.e. a transient error
+ *     in the update of one entry does not prevent updates of other entries.
+ */
+static int
+sfs_update_one(const char *path, const char *id, void *arg)
+{
+	struct abuf_buffer	*md = arg;
+	char			 testarg;
+	unsigned int		 uid;
+	int			 ret;
+	struct sfs_data		 sfsdata;
+
+	if (sscanf(id, "%u%c", &uid, &testarg) == 1) {
+		sfs_initsfsdata(&sfsdata);
+		sfsdata.csdata = *md;
+		ret = sfs_backend->write(path, id, &sfsdata);
+	} else if (id[0] == 'k') {
+		ret = sfs_backend->read(path, id, &sfsdata, 0);
+		if (ret < 0) {
+			log_warnx("Cannot update checksum for %s "
+			    "(key %s)", path, id+1);
+			return 0;
+		}
+		if (abuf_empty(sfsdata.sigdata)) {
+			sfs_freesfsdata(&sfsdata);
+			return 0;
+		}
+		if (abuf_length(sfsdata.upgradecsdata))
+			abuf_free(sfsdata.upgradecsdata);
+		sfsdata.upgradecsdata = *md;
+		ret = sfs_backend->write(path, id, &sfsdata);
+		sfsdata.upgradecsdata = ABUF_EMPTY;
+		sfs_freesfsdata(&sfsdata);
+	} else {
+		return 0;
+	}
+	if (ret < 0)
+		log_warnx("Cannot update checksum for %s "
+		    "(file=%s, error=%d)", path, id, ret);
+	return 0;
+}
+
+/**
+ * Go through all entries of the file looking for registered uids and
+ * keyids.
  * Update all unsigned checksum for all users to the value given by
  * <code>md</code> and add (or replace) an upgrade checksum for all keyids.
  * This function is used during upgrade if checksum/signature updates are
@@ -791,97 +1340,35 @@ sfs_checksumop_chroot(const struct sfs_checksumop *csop, struct sfs_data *data)
  * @param md The new checksum.
  * @return Zero in case of sucess, a negative error code in case of an
  *     error. Some errors are only indicated by log messages. In particular,
- *     a transient error in the update of one file does not prevent updates
- *     of other files in the directory.
+ *     a transient error in the update of one entry does not prevent
+ *     updates of other entries.
  */
 int
 sfs_update_all(const char *path, struct abuf_buffer md)
 {
-	DIR		*sfs_dir = NULL;
-	struct dirent	*sfs_ent = NULL;
-	char		 testarg;
-	char		*csum_file = NULL;
-	char		*sfs_path;
-	unsigned int	 uid;
 	int		 ret;
-	struct sfs_data	 sfsdata;
 
 	if (path == NULL || abuf_length(md) != ANOUBIS_CS_LEN)
 		return -EINVAL;
-	ret = convert_user_path(path, &sfs_path, 0);
-	if (ret < 0)
-		return ret;
-
-	sfs_dir = opendir(sfs_path);
-	if (sfs_dir == NULL) {
-		/* since we just update we don't create new one */
-		ret = errno;
-		if (errno == ENOENT)
-			ret = 0;
-		free(sfs_path);
-		return -ret;
-	}
-	while ((sfs_ent = readdir(sfs_dir)) != NULL) {
-		if (strcmp(sfs_ent->d_name, ".") == 0 ||
-		    strcmp(sfs_ent->d_name, "..") == 0)
-			continue;
-		if (asprintf(&csum_file, "%s/%s", sfs_path,
-		    sfs_ent->d_name) < 0) {
-			closedir(sfs_dir);
-			free(sfs_path);
-			return -ENOMEM;
-		}
-		if (sscanf(sfs_ent->d_name, "%u%c", &uid, &testarg) == 1) {
-			sfs_initsfsdata(&sfsdata);
-			sfsdata.csdata = md;
-			ret = sfs_writesfsdata(csum_file, sfs_path, &sfsdata);
-			sfsdata.csdata = ABUF_EMPTY;
-			sfs_freesfsdata(&sfsdata);
-		} else if (sfs_ent->d_name[0] == 'k') {
-			ret = sfs_readsfsdata(csum_file, &sfsdata);
-			if (ret < 0) {
-				log_warnx("Cannot update checksum for %s "
-				    "(key %s)", csum_file, sfs_ent->d_name+1);
-				free(csum_file);
-				continue;
-			}
-			if (abuf_empty(sfsdata.sigdata)) {
-				free(csum_file);
-				sfs_freesfsdata(&sfsdata);
-				continue;
-			}
-			if (abuf_length(sfsdata.upgradecsdata))
-				abuf_free(sfsdata.upgradecsdata);
-			sfsdata.upgradecsdata = md;
-			ret = sfs_writesfsdata(csum_file, sfs_path, &sfsdata);
-			sfsdata.upgradecsdata = ABUF_EMPTY;
-			sfs_freesfsdata(&sfsdata);
-		} else {
-			free(csum_file);
-			continue;
-		}
-		if (ret < 0)
-			log_warnx("Cannot update checksum for %s "
-			    "(file=%s, error=%d)", path, sfs_ent->d_name, ret);
-		free(csum_file);
-	}
-	free(sfs_path);
-	closedir(sfs_dir);
-	return 0;
+	ret = sfs_backend->foreach_id(path, 0, sfs_update_one, &md);
+	/* since we just update we don't create new one */
+	if (ret == -ENOENT)
+		ret = 0;
+	return ret;
 }
 
 /**
  * Update the signature assocated with <code>cert</code>for the file
  * <code>path</code>
- * The signature is updated if the corresponding file in the sfs tree
- * exists.
+ * The signature is updated if the file already has a signature for
+ * this certificate.
  *
  * @param path The path name of the file.
  * @param cert The certificate structure. A private key must be loaded
  *     for a successful update!
  * @param md The checksum to sign.
  * @return The return value is zero in case of success (either the
- *     signature file did not exist or it could be updated successfully).
+ *     signature did not exist or it could be updated successfully).
  *     If an error occurs a negative errno value is returned.
  *
  * @note This function is used during a system upgrade if the passphrase
@@ -894,33 +1381,35 @@ sfs_update_signature(const char *path, struct cert *cert,
     struct abuf_buffer md)
 {
 	int		 ret;
-	char		*sfs_path = NULL, *sfs_file = NULL, *keystr = NULL;
+	char		*id = NULL, *keystr = NULL;
 	struct sfs_data	 sfs_data;
 	unsigned int	 keylen, siglen;
-	struct stat	 statbuf;
 	EVP_MD_CTX	 ctx;
 
 	if (path == NULL || abuf_length(md) != ANOUBIS_CS_LEN)
 		return -EINVAL;
 	if (cert->privkey == NULL || abuf_empty(cert->keyid))
 		return -EINVAL;
-	ret = convert_user_path(path, &sfs_path, 0);
+	ret = sfs_check_user_path(path, 0);
 	if (ret < 0)
 		return ret;
 	ret = -ENOMEM;
 	keystr = abuf_convert_tohexstr(cert->keyid);
 	if (keystr == NULL)
 		goto out;
-	if (asprintf(&sfs_file, "%s/k%s", sfs_path, keystr) < 0) {
-		sfs_file = NULL;
+	if (asprintf(&id, "k%s", keystr) < 0) {
+		id = NULL;
 		goto out;
 	}
-	if (stat(sfs_file, &statbuf) < 0) {
-		ret = -errno;
-		if (ret == -ENOTDIR || ret == -ENOENT)
-			ret = 0;
+	/* Damaged entries are overwritten. */
+	ret = sfs_backend->read(path, id, &sfs_data, 0);
+	if (ret == -ENOTDIR || ret == -ENOENT) {
+		ret = 0;
 		goto out;
 	}
+	if (ret == 0)
+		sfs_freesfsdata(&sfs_data);
+	ret = -ENOMEM;
 	sfs_initsfsdata(&sfs_data);
 	siglen = keylen = EVP_PKEY_size(cert->privkey);
 	sfs_data.sigdata = abuf_alloc(abuf_length(md) + keylen);
@@ -943,15 +1432,13 @@ sfs_update_signature(const char *path, struct cert *cert,
 		goto out;
 	}
 	EVP_MD_CTX_cleanup(&ctx);
-	ret = sfs_writesfsdata(sfs_file, sfs_path, &sfs_data);
+	ret = sfs_backend->write(path, id, &sfs_data);
 	sfs_freesfsdata(&sfs_data);
 out:
-	if (sfs_path)
-		free(sfs_path);
 	if (keystr)
 		free(keystr);
-	if (sfs_file)
-		free(sfs_file);
+	if (id)
+		free(id);
 	return ret;
 }
 
@@ -1111,6 +1598,47 @@ sfs_need_upgrade_data(const struct abuf_buffer updata,
 	return 0;
 }
 
+/**
+ * Check the data of an entry before it is written and count the
+ * number of fields that must be stored.
+ *
+ * @param sfsdata The sfs data to write. The upgrade checksum (if present)
+ *     is only counted if a signature is present and the checksum in the
+ *     signature differs from the upgrade checksum.
+ * @return The number of fields that must be stored or a negative error
+ *     code if the data is not valid.
+ */
+static int
+sfs_count_sfsdata(const struct sfs_data *sfsdata)
+{
+	int		 num_entries = 0;
+	unsigned int	 len;
+
+	if (!abuf_empty(sfsdata->csdata)) {
+		num_entries++;
+		len = abuf_length(sfsdata->csdata);
+		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
+			return -EINVAL;
+	}
+	if (!abuf_empty(sfsdata->sigdata)) {
+		num_entries++;
+		len = abuf_length(sfsdata->sigdata);
+		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
+			return -EINVAL;
+	}
+	if (sfs_need_upgrade_data(sfsdata->upgradecsdata, sfsdata->sigdata)
+	    && !abuf_empty(sfsdata->upgradecsdata)) {
+		num_entries++;
+		len = abuf_length(sfsdata->upgradecsdata);
+		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
+			return -EINVAL;
+	}
+
+	if (num_entries == 0)
+		return -EINVAL;
+	return num_entries;
+}
+
 /**
  * Estimate the number of sfs writes that can be performed without
  * reaching the file sytem limit.
@@ -1196,8 +1724,8 @@ sfs_space_available(void)
  * in any way.
  *
  * @param csum_file The file name that the data should be written to.
- * @param csum_path The function ensures that this directory exists before
- *     trying to open <code>csum_file</code>.
+ * @param csum_path The directory of <code>csum_file</code>. It is created
+ *     if it does not exist (see sfs_tree_open).
  * @param sfsdata The sfs data to write. The upgrade checksum (if present)
  *     is only written if a signature is present and the checksum in the
  *     signature differs from the upgrade checksum.
@@ -1213,8 +1741,7 @@ sfs_writesfsdata(const char *csum_file, const char *csum_path,
 	u_int32_t	 version = SFSDATA_FORMAT_VERSION;
 	u_int32_t	 toc_entry[3] = { 0, 0, 0 };
 	int		 offset = 0;
-	int		 num_entries = 0;
-	unsigned int	 len;
+	int		 num_entries;
 	int		 need_upgrade_data;
 
 	if (sfsdata == NULL || csum_file == NULL || csum_path == NULL)
@@ -1225,38 +1752,17 @@ sfs_writesfsdata(const char *csum_file, const char *csum_path,
 		return ret;
 	need_upgrade_data = sfs_need_upgrade_data(sfsdata->upgradecsdata,
 	    sfsdata->sigdata);
-	if (!abuf_empty(sfsdata->csdata)) {
-		num_entries++;
-		len = abuf_length(sfsdata->csdata);
-		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
-			return -EINVAL;
-	}
-	if (!abuf_empty(sfsdata->sigdata)) {
-		num_entries++;
-		len = abuf_length(sfsdata->sigdata);
-		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
-			return -EINVAL;
-	}
-	if (need_upgrade_data && !abuf_empty(sfsdata->upgradecsdata)) {
-		num_entries++;
-		len = abuf_length(sfsdata->upgradecsdata);
-		if (len == 0 || len > SFSDATA_MAX_FIELD_LENGTH)
-			return -EINVAL;
-	}
-
-	if (num_entries == 0)
-		return -EINVAL;
-
-	ret = mkpath(csum_path);
-	if (ret < 0)
-		return ret;
+	num_entries = sfs_count_sfsdata(sfsdata);
+	if (num_entries < 0)
+		return num_entries;
 
 	if (asprintf(&csum_tmp, "%s%s", csum_file, ".tmp") == -1)
 		return -ENOMEM;
 
-	fd = open(csum_tmp, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+	fd = sfs_tree_open(csum_tmp, O_WRONLY|O_CREAT|O_TRUNC, 0640);
 	if (fd < 0) {
-		ret = -errno;
+		ret = fd;
+		errno = -ret;
 		log_warn("sfsdata: Could not write %s:", csum_tmp);
 		free(csum_tmp);
 		return ret;
@@ -1332,16 +1838,15 @@ sfs_writesfsdata(const char *csum_file, const char *csum_path,
 		if (ret < 0)
 			goto err;
 	}
-	if (rename(csum_tmp, csum_file) < 0) {
-		ret = -errno;
+	ret = sfs_tree_rename(csum_tmp, csum_file);
+	if (ret < 0)
 		goto err;
-	}
 
 	goto out;
 
 err:
 	log_warn("sfsdata %s: Write error", csum_tmp);
-	unlink(csum_tmp);
+	sfs_tree_unlink(csum_tmp);
 out:
 	free(csum_tmp);
 	close(fd);
@@ -1431,9 +1936,9 @@ sfs_readsfsdata(const char *csum_file, struct sfs_data *sfsdata)
 
 	sfs_initsfsdata(sfsdata);
 
-	fd = open(csum_file, O_RDONLY);
+	fd = sfs_tree_open(csum_file, O_RDONLY, 0);
 	if (fd < 0)
-		return -errno;
+		return fd;
 
 	ret = read_bytes(fd, &version, sizeof(version));
 	if (ret < 0)
@@ -1564,6 +2069,17 @@ err:
 	goto out;
 }
 
+/**
+ * Callback for sfs_haschecksum_chroot. Stops the iteration at the
+ * first entry.
+ */
+static int
+sfs_has_entry(const char *path __used, const char *id __used,
+    void *arg __used)
+{
+	return 1;
+}
+
 /**
  * Check if the file in <code>path</code> has at least one checksum or signature
  * assigned to it.
@@ -1575,36 +2091,102 @@ err:
 int
 sfs_haschecksum_chroot(const char *path)
 {
-	DIR *dir = NULL;
-	struct dirent *sfs_ent = NULL;
-	unsigned int uid;
-	char testarg;
-	char *csum_path = NULL;
-	int ret;
+	return sfs_backend->foreach_id(path, 1, sfs_has_entry, NULL);
+}
 
-	ret = __convert_user_path(path, &csum_path, 0, 1);
-	if (ret < 0)
-		return ret;
+/**
+ * Recursive helper for sfs_tree_foreach_file. Walks the SFS tree
+ * directory in sfspath that corresponds to the directory upath in the
+ * file system.
+ *
+ * @param sfspath The SFS tree directory. The buffer must be PATH_MAX
+ *     bytes long, it is used to construct the names of subdirectories.
+ * @param sfslen The length of the string in sfspath.
+ * @param upath The file system path that corresponds to sfspath. This
+ *     buffer must be PATH_MAX bytes long, too.
+ * @param ulen The length of the string in upath.
+ * @param callback The callback function.
+ * @param arg The callback argument.
+ * @return Zero in case of success, a negative error code if some part
+ *     of the tree could not be read.
+ */
+static int
+__sfs_foreach_file(char *sfspath, size_t sfslen, char *upath, size_t ulen,
+    void (*callback)(const char *, void *), void *arg)
+{
+	DIR		*dir;
+	struct dirent	*ent;
+	int		 ret = 0;
 
-	dir = opendir(csum_path);
-	if (dir == NULL) {
-		free(csum_path);
-		return -1;
-	}
-	while ((sfs_ent = readdir(dir)) != NULL) {
-		if (strcmp(sfs_ent->d_name, ".") == 0 ||
-		    strcmp(sfs_ent->d_name, "..") == 0)
+	dir = opendir(sfspath);
+	if (dir == NULL)
+		return -errno;
+	while ((ent = readdir(dir)) != NULL) {
+		const char	*name = ent->d_name;
+		size_t		 namelen = strlen(name), i, k;
+		int		 stars = 0;
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
 			continue;
-		if (sscanf(sfs_ent->d_name, "%u%c", &uid, &testarg) == 1
-		    || sfs_ent->d_name[0] == 'k') {
-			closedir(dir);
-			free(csum_path);
-			return 1;
+#ifdef DT_DIR
+		if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+			continue;
+#endif
+		if (sfslen + namelen + 2 > PATH_MAX
+		    || ulen + namelen + 2 > PATH_MAX) {
+			ret = -ENAMETOOLONG;
+			break;
+		}
+		for (i=0; i<namelen; ++i)
+			if (name[i] == '*')
+				stars++;
+		/*
+		 * Remove the escape sequences (see insert_escape_seq). An
+		 * odd number of stars marks an entry for a regular file.
+		 */
+		k = ulen;
+		upath[k++] = '/';
+		for (i = stars % 2; i<namelen; ++i) {
+			if (name[i] == '*')
+				i++;
+			upath[k++] = name[i];
 		}
+		upath[k] = 0;
+		if (stars % 2) {
+			callback(upath, arg);
+			continue;
+		}
+		sfspath[sfslen] = '/';
+		memcpy(sfspath + sfslen + 1, name, namelen + 1);
+		ret = __sfs_foreach_file(sfspath, sfslen + namelen + 1,
+		    upath, k, callback, arg);
+		sfspath[sfslen] = 0;
+		if (ret == -ENOTDIR || ret == -ENOENT)
+			ret = 0;
+		if (ret < 0)
+			break;
 	}
 	closedir(dir);
-	free(csum_path);
-	return 0;
+	upath[ulen] = 0;
+	return ret;
+}
+
+/**
+ * Call a function for each file that has at least one checksum or
+ * signature. The function must be called from a chroot-ed process.
+ *
+ * @param callback This function is called with the path name of the
+ *     file and the callback argument. The path name is only valid during
+ *     the call.
+ * @param arg The callback argument.
+ * @return Zero in case of success, a negative error code if some
+ *     part of the checksum data could not be read. The callback might
+ *     have been called for some files even if an error is returned.
+ */
+int
+sfs_foreach_file_chroot(void (*callback)(const char *, void *), void *arg)
+{
+	return sfs_backend->foreach_file(1, callback, arg);
 }
 
 /**
@@ -1630,14 +2212,23 @@ sfs_deletechecksum(const char *csum_file)
 		free(tmppath);
 		return -EINVAL;
 	}
-	ret = unlink(csum_file);
+	ret = sfs_tree_unlink(csum_file);
 	if (ret < 0) {
-		ret = -errno;
 		free(tmppath);
 		return ret;
 	}
+	/*
+	 * Other checksum files for the same file usually prevent the
+	 * removal of its directory. Parent directories are only checked
+	 * if this succeeds.
+	 */
+	if (sfs_tree_rmdir(csum_file) < 0) {
+		free(tmppath);
+		return 0;
+	}
 
-	k = path_len;
+	*strrchr(tmppath, '/') = '\0';
+	k = strrchr(tmppath, '/') - tmppath;
 	while (k > root_len) {
 		if (tmppath[k] == '/') {
 			tmppath[k] = '\0';
@@ -1645,6 +2236,9 @@ sfs_deletechecksum(const char *csum_file)
 				break;
 			if (rmdir(tmppath) < 0)
 				break;
+#ifdef HAVE_OPENAT
+			sfs_dircache_drop(tmppath);
+#endif
 		}
 		k--;
 	}
@@ -2235,7 +2829,7 @@ sfs_check_for_key(const char *sfs_path, const char *entryname,
  * @param entryname The name of the entry.
  * @return True if the entry should be part of the listing.
  */
-int
+static int
 sfs_wantentry(const struct sfs_checksumop *csop, const char *sfs_path,
     const char *entryname)
 {
@@ -2304,8 +2898,8 @@ sfs_wantentry(const struct sfs_checksumop *csop, const char *sfs_path,
  * @param csop The checksum list request that did not return entries.
  * @return None.
  */
-void
-sfs_remove_index(const char *path, struct sfs_checksumop *csop)
+static void
+sfs_remove_index(const char *path, const struct sfs_checksumop *csop)
 {
 	char	*idxfile;
 	if ((csop->listflags & ANOUBIS_CSUM_UPGRADED) == 0)
@@ -2330,3 +2924,597 @@ sfs_remove_index(const char *path, struct sfs_checksumop *csop)
 		free(idxfile);
 	}
 }
+
+/*
+ * The SFS tree backend.
+ */
+
+/**
+ * Construct the names of the SFS tree directory and file for an entry.
+ *
+ * @param path The path name of the file.
+ * @param id The ID of the entry.
+ * @param is_chroot True if the caller is chroot-ed.
+ * @param csum_path The directory name is returned here.
+ * @param csum_file The file name is returned here.
+ * @return Zero in case of success, a negative error code in case of an
+ *     error. Both names are allocated dynamically and must be freed by
+ *     the caller in case of success.
+ */
+static int
+sfs_tree_file(const char *path, const char *id, int is_chroot,
+    char **csum_path, char **csum_file)
+{
+	int	ret;
+
+	ret = __convert_user_path(path, csum_path, 0, is_chroot);
+	if (ret < 0)
+		return ret;
+	if (asprintf(csum_file, "%s/%s", *csum_path, id) < 0) {
+		free(*csum_path);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Read an entry from the SFS tree (see struct sfs_backend).
+ */
+static int
+sfs_tree_read(const char *path, const char *id, struct sfs_data *data,
+    int is_chroot)
+{
+	char	*csum_path, *csum_file;
+	int	 ret;
+
+	ret = sfs_tree_file(path, id, is_chroot, &csum_path, &csum_file);
+	if (ret < 0)
+		return ret;
+	ret = sfs_readsfsdata(csum_file, data);
+	free(csum_file);
+	free(csum_path);
+	return ret;
+}
+
+/**
+ * Write an entry to the SFS tree (see struct sfs_backend).
+ */
+static int
+sfs_tree_write(const char *path, const char *id,
+    const struct sfs_data *data)
+{
+	char	*csum_path, *csum_file;
+	int	 ret;
+
+	ret = sfs_tree_file(path, id, 0, &csum_path, &csum_file);
+	if (ret < 0)
+		return ret;
+	ret = sfs_writesfsdata(csum_file, csum_path, data);
+	free(csum_file);
+	free(csum_path);
+	return ret;
+}
+
+/**
+ * Remove an entry from the SFS tree (see struct sfs_backend).
+ */
+static int
+sfs_tree_remove(const char *path, const char *id)
+{
+	char	*csum_path, *csum_file;
+	int	 ret;
+
+	ret = sfs_tree_file(path, id, 0, &csum_path, &csum_file);
+	if (ret < 0)
+		return ret;
+	ret = sfs_deletechecksum(csum_file);
+	free(csum_file);
+	free(csum_path);
+	return ret;
+}
+
+/**
+ * Call a function for all user-ID and key ID files in the SFS tree
+ * directory of a file (see struct sfs_backend).
+ */
+static int
+sfs_tree_foreach_id(const char *path, int is_chroot, sfs_foreach_cb callback,
+    void *arg)
+{
+	DIR		*dir;
+	struct dirent	*sfs_ent;
+	unsigned int	 uid;
+	char		 testarg;
+	char		*csum_path;
+	int		 ret;
+
+	ret = __convert_user_path(path, &csum_path, 0, is_chroot);
+	if (ret < 0)
+		return ret;
+	dir = sfs_tree_opendir(csum_path);
+	if (dir == NULL) {
+		ret = -errno;
+		free(csum_path);
+		return ret;
+	}
+	while ((sfs_ent = readdir(dir)) != NULL) {
+		if (strcmp(sfs_ent->d_name, ".") == 0 ||
+		    strcmp(sfs_ent->d_name, "..") == 0)
+			continue;
+		if (sscanf(sfs_ent->d_name, "%u%c", &uid, &testarg) != 1
+		    && sfs_ent->d_name[0] != 'k')
+			continue;
+		ret = callback(path, sfs_ent->d_name, arg);
+		if (ret)
+			break;
+	}
+	closedir(dir);
+	free(csum_path);
+	return ret;
+}
+
+/**
+ * Call a function for each file in the SFS tree (see struct sfs_backend).
+ */
+static int
+sfs_tree_foreach_file(int is_chroot, void (*callback)(const char *, void *),
+    void *arg)
+{
+	char	sfspath[PATH_MAX], upath[PATH_MAX];
+
+	strlcpy(sfspath, is_chroot ? SFS_CHECKSUMCHROOT : SFS_CHECKSUMROOT,
+	    sizeof(sfspath));
+	upath[0] = 0;
+	return __sfs_foreach_file(sfspath, strlen(sfspath), upath, 0,
+	    callback, arg);
+}
+
+/**
+ * List the entries of an SFS tree directory (see struct sfs_backend).
+ * Stale upgrade index files are removed if the listing is empty.
+ */
+static int
+sfs_tree_list(const struct sfs_checksumop *csop,
+    int (*callback)(const char *, void *), void *arg)
+{
+	char		*sfs_path, *name;
+	DIR		*sfs_dir;
+	struct dirent	*entry;
+	int		 ret = 0, found = 0, wantids;
+
+	wantids = (csop->listflags & ANOUBIS_CSUM_WANTIDS);
+	ret = convert_user_path(csop->path, &sfs_path, !wantids);
+	if (ret < 0)
+		return ret;
+	sfs_dir = opendir(sfs_path);
+	if (sfs_dir == NULL) {
+		ret = -errno;
+		free(sfs_path);
+		if (ret == -ENOENT || ret == -ENOTDIR)
+			return 0;
+		return ret;
+	}
+	while ((entry = readdir(sfs_dir)) != NULL) {
+		if (!sfs_wantentry(csop, sfs_path, entry->d_name))
+			continue;
+		found = 1;
+		if (wantids) {
+			name = strdup(entry->d_name);
+		} else {
+			name = remove_escape_seq(entry->d_name);
+		}
+		if (name == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = callback(name, arg);
+		free(name);
+		if (ret < 0)
+			break;
+	}
+	closedir(sfs_dir);
+	if (!found)
+		sfs_remove_index(sfs_path, csop);
+	free(sfs_path);
+	return ret;
+}
+
+/*
+ * The indexed store backend.
+ */
+
+/**
+ * Read an entry from the indexed store (see struct sfs_backend).
+ */
+static int
+sfs_indexed_read(const char *path, const char *id, struct sfs_data *data,
+    int is_chroot __used)
+{
+	int	ret;
+
+	ret = sfs_check_user_path(path, 0);
+	if (ret < 0)
+		return ret;
+	return sfs_store_get(sfs_db, path, id, data);
+}
+
+/**
+ * Write an entry to the indexed store (see struct sfs_backend).
+ */
+static int
+sfs_indexed_write(const char *path, const char *id,
+    const struct sfs_data *data)
+{
+	struct sfs_data	tmp = *data;
+	int		ret;
+
+	ret = sfs_check_user_path(path, 0);
+	if (ret < 0)
+		return ret;
+	ret = sfs_count_sfsdata(data);
+	if (ret < 0)
+		return ret;
+	if (!sfs_need_upgrade_data(data->upgradecsdata, data->sigdata))
+		tmp.upgradecsdata = ABUF_EMPTY;
+	return sfs_store_put(sfs_db, path, id, &tmp);
+}
+
+/**
+ * Remove an entry from the indexed store (see struct sfs_backend).
+ */
+static int
+sfs_indexed_remove(const char *path, const char *id)
+{
+	int	ret;
+
+	ret = sfs_check_user_path(path, 0);
+	if (ret < 0)
+		return ret;
+	return sfs_store_del(sfs_db, path, id);
+}
+
+/**
+ * Call a function for all entries of a file in the indexed store
+ * (see struct sfs_backend).
+ */
+static int
+sfs_indexed_foreach_id(const char *path, int is_chroot __used,
+    sfs_foreach_cb callback, void *arg)
+{
+	int	ret;
+
+	ret = sfs_check_user_path(path, 0);
+	if (ret < 0)
+		return ret;
+	return sfs_store_foreach(sfs_db, path, 0, callback, arg);
+}
+
+/**
+ * State of sfs_indexed_foreach_file.
+ */
+struct sfs_indexed_files {
+	void	 (*callback)(const char *, void *);
+	void	  *arg;
+	/** The path name of the previous entry. */
+	char	  *last;
+};
+
+/**
+ * Call the callback of sfs_indexed_foreach_file once per path name.
+ * The entries are sorted by path name.
+ */
+static int
+sfs_indexed_file(const char *path, const char *id __used, void *arg)
+{
+	struct sfs_indexed_files	*files = arg;
+
+	if (files->last && strcmp(files->last, path) == 0)
+		return 0;
+	free(files->last);
+	files->last = strdup(path);
+	if (files->last == NULL)
+		return -ENOMEM;
+	files->callback(path, files->arg);
+	return 0;
+}
+
+/**
+ * Call a function for each file in the indexed store
+ * (see struct sfs_backend).
+ */
+static int
+sfs_indexed_foreach_file(int is_chroot __used,
+    void (*callback)(const char *, void *), void *arg)
+{
+	struct sfs_indexed_files	files = { callback, arg, NULL };
+	int				ret;
+
+	ret = sfs_store_foreach(sfs_db, NULL, 0, sfs_indexed_file, &files);
+	free(files.last);
+	return ret;
+}
+
+/**
+ * State of sfs_indexed_list.
+ */
+struct sfs_indexed_listing {
+	const struct sfs_checksumop	 *csop;
+	int				(*callback)(const char *, void *);
+	void				 *arg;
+	/** The ID of the user-ID entries that are listed. */
+	char				  uid[16];
+	/** The ID of the signature entries that are listed (or NULL). */
+	char				 *keyid;
+	/** The length of the directory prefix of all path names. */
+	size_t				  plen;
+	/** The name that was reported last. */
+	char				 *last;
+};
+
+/**
+ * Return true if an entry of the indexed store matches the user-ID or
+ * key ID of a list request.
+ */
+static int
+sfs_indexed_match(struct sfs_indexed_listing *listing, const char *path,
+    const char *id)
+{
+	unsigned int	listflags = listing->csop->listflags;
+	struct sfs_data	data;
+	int		ret;
+
+	/*
+	 * We do not support ANOUBIS_CSUM_ALL for uids and signatures
+	 * separately.
+	 */
+	if (listflags & ANOUBIS_CSUM_ALL)
+		return 1;
+	if (!((listflags & ANOUBIS_CSUM_UID)
+	    && strcmp(id, listing->uid) == 0)
+	    && !((listflags & ANOUBIS_CSUM_KEY) && listing->keyid
+	    && strcmp(id, listing->keyid) == 0))
+		return 0;
+	if ((listflags & ANOUBIS_CSUM_UPGRADED) == 0)
+		return 1;
+	if (sfs_store_get(sfs_db, path, id, &data) < 0)
+		return 0;
+	ret = !abuf_empty(data.upgradecsdata);
+	sfs_freesfsdata(&data);
+	return ret;
+}
+
+/**
+ * Report the IDs of a file for a list request with ANOUBIS_CSUM_WANTIDS.
+ */
+static int
+sfs_indexed_listid(const char *path __used, const char *id, void *arg)
+{
+	struct sfs_indexed_listing	*listing = arg;
+	unsigned int			 listflags = listing->csop->listflags;
+
+	if (isdigit(id[0]) && (listflags & ANOUBIS_CSUM_UID))
+		return listing->callback(id, listing->arg);
+	if (id[0] == 'k' && (listflags & ANOUBIS_CSUM_KEY))
+		return listing->callback(id, listing->arg);
+	return 0;
+}
+
+/**
+ * Report the directory entry that contains a matching entry of the
+ * indexed store. Subdirectories are reported with a trailing slash.
+ * The entries are sorted by path name, i.e. all entries below the
+ * same subdirectory are adjacent.
+ */
+static int
+sfs_indexed_listdir(const char *path, const char *id, void *arg)
+{
+	struct sfs_indexed_listing	*listing = arg;
+	const char			*name = path + listing->plen;
+	const char			*slash;
+	size_t				 len;
+
+	if (!sfs_indexed_match(listing, path, id))
+		return 0;
+	slash = strchr(name, '/');
+	len = slash ? (size_t)(slash - name + 1) : strlen(name);
+	if (listing->last && strlen(listing->last) == len
+	    && strncmp(listing->last, name, len) == 0)
+		return 0;
+	free(listing->last);
+	listing->last = malloc(len + 1);
+	if (listing->last == NULL)
+		return -ENOMEM;
+	memcpy(listing->last, name, len);
+	listing->last[len] = 0;
+	return listing->callback(listing->last, listing->arg);
+}
+
+/**
+ * List the IDs of a file or the contents of a directory in the indexed
+ * store (see struct sfs_backend).
+ */
+static int
+sfs_indexed_list(const struct sfs_checksumop *csop,
+    int (*callback)(const char *, void *), void *arg)
+{
+	struct sfs_indexed_listing	 listing;
+	char				*keystr;
+	int				 ret, wantids;
+
+	wantids = (csop->listflags & ANOUBIS_CSUM_WANTIDS);
+	ret = sfs_check_user_path(csop->path, !wantids);
+	if (ret < 0)
+		return ret;
+	memset(&listing, 0, sizeof(listing));
+	listing.csop = csop;
+	listing.callback = callback;
+	listing.arg = arg;
+	if (wantids)
+		return sfs_store_foreach(sfs_db, csop->path, 0,
+		    sfs_indexed_listid, &listing);
+	snprintf(listing.uid, sizeof(listing.uid), "%d", csop->uid);
+	if ((csop->listflags & ANOUBIS_CSUM_KEY) && !abuf_empty(csop->keyid)) {
+		keystr = abuf_convert_tohexstr(csop->keyid);
+		if (keystr == NULL)
+			return -ENOMEM;
+		ret = asprintf(&listing.keyid, "k%s", keystr);
+		free(keystr);
+		if (ret < 0)
+			return -ENOMEM;
+	}
+	listing.plen = strlen(csop->path);
+	if (csop->path[listing.plen - 1] != '/')
+		listing.plen++;
+	ret = sfs_store_foreach(sfs_db, csop->path, 1, sfs_indexed_listdir,
+	    &listing);
+	free(listing.keyid);
+	free(listing.last);
+	return ret;
+}
+
+/*
+ * Functions that work with all backends.
+ */
+
+/**
+ * Select the storage backend. This must be called once before any
+ * checksum operation. Changes of the backend require a restart of
+ * the daemon.
+ *
+ * @param store The configured backend.
+ * @param is_chroot True if the caller is chroot-ed. Chroot-ed
+ *     processes open the indexed store read-only. The master process
+ *     is the only writer.
+ * @return Zero in case of success, a negative error code if the
+ *     indexed store cannot be opened.
+ */
+int
+sfs_backend_init(anoubisd_sfs_store store, int is_chroot)
+{
+	int	ret;
+
+	if (sfs_db) {
+		sfs_store_close(sfs_db);
+		sfs_db = NULL;
+	}
+	sfs_backend = &sfs_tree_backend;
+	if (store != ANOUBISD_SFS_STORE_INDEXED)
+		return 0;
+	ret = sfs_store_open(is_chroot ? SFS_STOREDIR_CHROOT : SFS_STOREDIR,
+	    !is_chroot, &sfs_db);
+	if (ret < 0)
+		return ret;
+	sfs_backend = &sfs_indexed_backend;
+	return 0;
+}
+
+/**
+ * Process a checksum list request. The callback function is called for
+ * each name that is part of the result. This is an ID (see struct
+ * sfs_backend) if ANOUBIS_CSUM_WANTIDS is set in the request. Otherwise,
+ * it is the name of a file or the name of a subdirectory followed by a
+ * slash.
+ *
+ * @param csop The list request.
+ * @param callback The callback function. The name is only valid during
+ *     the call. A negative return value is an error and stops the listing.
+ * @param arg The callback argument.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. A directory without entries is not an error.
+ */
+int
+sfs_list(const struct sfs_checksumop *csop,
+    int (*callback)(const char *, void *), void *arg)
+{
+	if (csop->op != ANOUBIS_CHECKSUM_OP_GENERIC_LIST)
+		return -EINVAL;
+	return sfs_backend->list(csop, callback, arg);
+}
+
+/**
+ * State of a migration from the SFS tree to the indexed store.
+ */
+struct sfs_migration {
+	struct sfs_store	*store;
+	unsigned int		 entries;
+	unsigned int		 skipped;
+	int			 error;
+};
+
+/**
+ * Copy a single entry from the SFS tree to the indexed store.
+ */
+static int
+sfs_migrate_entry(const char *path, const char *id, void *arg)
+{
+	struct sfs_migration	*migration = arg;
+	struct sfs_data		 data;
+	int			 ret;
+
+	ret = sfs_tree_read(path, id, &data, 0);
+	if (ret < 0) {
+		log_warnx("Skipping damaged checksum for %s (file=%s, "
+		    "error=%d)", path, id, ret);
+		migration->skipped++;
+		return 0;
+	}
+	ret = sfs_store_put(migration->store, path, id, &data);
+	sfs_freesfsdata(&data);
+	if (ret < 0) {
+		migration->error = ret;
+		return ret;
+	}
+	migration->entries++;
+	return 0;
+}
+
+/**
+ * Copy all entries of a file from the SFS tree to the indexed store.
+ */
+static void
+sfs_migrate_file(const char *path, void *arg)
+{
+	struct sfs_migration	*migration = arg;
+	int			 ret;
+
+	if (migration->error)
+		return;
+	ret = sfs_tree_foreach_id(path, 0, sfs_migrate_entry, migration);
+	if (ret < 0 && ret != -ENOENT && ret != -ENOTDIR
+	    && migration->error == 0)
+		migration->error = ret;
+}
+
+/**
+ * Copy all checksums and signatures from the SFS tree to the indexed
+ * store. Existing entries in the store are replaced. The SFS tree is
+ * not modified. This must not be called while the daemon is running.
+ *
+ * @return The number of copied entries or a negative error code in
+ *     case of an error.
+ */
+int
+sfs_migrate_tree(void)
+{
+	struct sfs_migration	migration;
+	int			ret;
+
+	memset(&migration, 0, sizeof(migration));
+	ret = sfs_store_open(SFS_STOREDIR, 1, &migration.store);
+	if (ret < 0)
+		return ret;
+	ret = sfs_tree_foreach_file(0, sfs_migrate_file, &migration);
+	if (ret == -ENOENT)
+		ret = 0;
+	if (ret == 0)
+		ret = migration.error;
+	if (ret == 0)
+		ret = sfs_store_compact(migration.store);
+	sfs_store_close(migration.store);
+	if (ret < 0)
+		return ret;
+	if (migration.skipped)
+		log_warnx("%u damaged checksum(s) were not migrated",
+		    migration.skipped);
+	return migration.entries;
+}
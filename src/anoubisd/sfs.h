@@ -171,29 +171,74 @@ int	 sfs_checksumop_chroot(const struct sfs_checksumop *csop,
 	     struct sfs_data *data);
 void	 sfs_freesfsdata(struct sfs_data *);
 int	 sfs_haschecksum_chroot(const char *path);
+int	 sfs_foreach_file_chroot(void (*)(const char *, void *), void *);
 int	 sfs_update_all(const char *path, struct abuf_buffer md);
 int	 sfs_update_signature(const char *path, struct cert *cert,
 	     struct abuf_buffer md);
-int	 convert_user_path(const char *path, char **dir, int is_dir);
-char	*remove_escape_seq(const char *name);
-void	 sfs_remove_index(const char *, struct sfs_checksumop *);
-int	 sfs_wantentry(const struct sfs_checksumop *, const char *sfs_path,
-	     const char *entryname);
+int	 sfs_list(const struct sfs_checksumop *csop,
+	     int (*)(const char *, void *), void *);
+int	 sfs_backend_init(anoubisd_sfs_store store, int is_chroot);
+int	 sfs_migrate_tree(void);
 int	 sfs_parse_checksumop(struct sfs_checksumop *dst,
 	     struct anoubis_msg *m, uid_t auth_uid);
 int	 sfs_parse_csmulti(struct sfs_checksumop *dst,
 	     struct abuf_buffer msg, uid_t auth_uid);
 
+/*
+ * Public functions of the indexed SFS store.
+ *
+ * Implementation and inline documentation can be found in sfs_store.c.
+ */
+struct sfs_store;
+
+int	 sfs_store_open(const char *dir, int writable, struct sfs_store **);
+void	 sfs_store_close(struct sfs_store *);
+int	 sfs_store_exists(const char *dir);
+int	 sfs_store_get(struct sfs_store *, const char *path, const char *id,
+	     struct sfs_data *);
+int	 sfs_store_put(struct sfs_store *, const char *path, const char *id,
+	     const struct sfs_data *);
+int	 sfs_store_del(struct sfs_store *, const char *path, const char *id);
+int	 sfs_store_foreach(struct sfs_store *, const char *path, int subtree,
+	     int (*)(const char *, const char *, void *), void *);
+int	 sfs_store_compact(struct sfs_store *);
+
 /*
  * Public SFS-Cache functions.
  *
  * Implementation and inline documentation can be found in pe_sfscache.c.
  */
+
+/**
+ * Statistics of the SFS-Cache (see sfshash_getstats).
+ */
+struct sfshash_stats {
+	/** Lookups that were answered from the cache. */
+	u_int64_t	hits;
+	/** Lookups that required access to the on-disk checksum tree. */
+	u_int64_t	misses;
+	/** Lookups answered by the negative lookup filter. */
+	u_int64_t	filtered;
+	/** Entries removed to stay within the memory limit. */
+	u_int64_t	evictions;
+	/** Current number of entries. */
+	u_int64_t	entries;
+	/** Memory currently used by the entries. */
+	u_int64_t	bytes;
+	/** The memory limit. */
+	u_int64_t	limit;
+};
+
 void	 sfshash_init(void);
 void	 sfshash_flush(void);
+void	 sfshash_set_limit(unsigned long);
+void	 sfshash_getstats(struct sfshash_stats *);
+void	 sfshash_load_filter(void);
 void	 sfshash_invalidate_uid(const char *, uid_t);
-void	 sfshash_invalidate_key(const char *, const char*);
+void	 sfshash_invalidate_keyid(const char *, const struct abuf_buffer);
 int	 sfshash_get_uid(const char *, uid_t, struct abuf_buffer *);
 int	 sfshash_get_key(const char *, const char *, struct abuf_buffer *);
+int	 sfshash_get_keyid(const char *, const struct abuf_buffer,
+	     struct abuf_buffer *);
 
 #endif	/* _SFS_H_ */
@@ -0,0 +1,1621 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <bsdcompat.h>
+#endif
+
+#include <anoubis_crc32.h>
+
+#include "anoubisd.h"
+#include "sfs.h"
+#include <anoubis_alloc.h>
+
+/**
+ * \file
+ * The indexed SFS store. This is an alternative to the SFS tree that
+ * keeps all checksums and signatures in two files in a single directory:
+ *
+ * - The log file (SFS_STORE_LOG) contains all modifications as records
+ *   that are only ever appended. A PUT record stores the complete
+ *   sfs_data of an entry, a DEL record removes the entry. Each record
+ *   is protected by a CRC32. A record that is incomplete or damaged
+ *   marks the end of the log. The writer truncates the log at this point
+ *   when the store is opened.
+ * - The index file (SFS_STORE_INDEX) is a sorted table of all live entries
+ *   that are contained in the first part of the log. It is mapped into
+ *   memory and searched with a binary search. Records that were appended
+ *   after the index was written are kept in an in-memory hash table
+ *   (the overlay) that takes precedence over the index.
+ *
+ * The key of an entry is the path name of the file followed by the ID
+ * of the entry, both including the terminating NUL byte. The ID uses
+ * the same names as the files in the SFS tree, i.e. the decimal user-ID
+ * for unsigned checksums and the letter 'k' followed by the hex
+ * representation of the key ID for signatures. Sorting by key orders
+ * the entries by path name and entries of the same file are adjacent.
+ *
+ * Only one process (the master) may open the store for writing. The
+ * writer writes a new index (checkpoint) if the overlay grows too large.
+ * The index is written to a temporary file that is renamed once it is
+ * complete. The writer compacts the log if more than half of it consists
+ * of records that are no longer live. A compaction writes a new log with a
+ * new generation number and a matching index to temporary files and
+ * renames them. An index whose generation does not match the log is
+ * ignored, i.e. a crash between the two renames only costs a full scan
+ * of the log during the next open.
+ *
+ * Readers (the policy engine) detect changes with a single stat(2) of
+ * the log file per operation: A new inode means that the log was
+ * compacted and the store is re-opened, a larger size means that records
+ * must be added to the overlay.
+ *
+ * All values are stored in host byte order, the files are never shared
+ * between machines.
+ */
+
+/**
+ * The name of the log file in the store directory.
+ */
+#define SFS_STORE_LOG		"sfs.log"
+
+/**
+ * The name of the index file in the store directory.
+ */
+#define SFS_STORE_INDEX		"sfs.idx"
+
+/**
+ * Suffix for temporary files during checkpoints and compaction.
+ */
+#define SFS_STORE_TMP		".tmp"
+
+#define SFS_STORE_LOGMAGIC	0x4c534653	/* "SFSL" */
+#define SFS_STORE_IDXMAGIC	0x49534653	/* "SFSI" */
+#define SFS_STORE_RECMAGIC	0x52534653	/* "SFSR" */
+#define SFS_STORE_VERSION	1
+
+/**
+ * Record types in the log.
+ */
+#define SFS_STORE_PUT		1
+#define SFS_STORE_DEL		2
+
+/**
+ * The maximum length of the ID part of a key.
+ */
+#define SFS_STORE_MAXID		128
+
+/**
+ * The maximum length of a key and of the data of a single record.
+ */
+#define SFS_STORE_MAXKEY	(PATH_MAX + SFS_STORE_MAXID + 2)
+#define SFS_STORE_MAXDATA	(3 * (sizeof(u_int32_t) \
+				    + SFSDATA_MAX_FIELD_LENGTH))
+
+/**
+ * The number of hash buckets in the overlay.
+ */
+#define SFS_STORE_HASHSIZE	1024
+
+/**
+ * A checkpoint is written if the overlay contains this many entries
+ * or a quarter of the number of entries in the index, whichever is larger.
+ */
+#define SFS_STORE_CHECKPOINT	1024
+
+/**
+ * The log is never compacted if it is smaller than this.
+ */
+#define SFS_STORE_COMPACTSIZE	(1024 * 1024)
+
+/**
+ * Records and the log header are aligned to this many bytes.
+ */
+#define SFS_STORE_ALIGN(X)	(((X) + 7) & ~7UL)
+
+/**
+ * The header at the start of the log file.
+ */
+struct sfs_store_loghdr {
+	u_int32_t	magic;
+	u_int32_t	version;
+	u_int64_t	generation;
+};
+
+/**
+ * The header of a log record. It is followed by the key and the data.
+ * The CRC covers everything after the crc field up to the end of the
+ * data. The data of a PUT record consists of three lengths (checksum,
+ * signature, upgrade checksum) followed by the data itself. DEL records
+ * do not have data.
+ */
+struct sfs_store_rec {
+	u_int32_t	magic;
+	u_int32_t	crc;
+	u_int32_t	type;
+	u_int32_t	keylen;
+	u_int32_t	datalen;
+	u_int32_t	pad;
+};
+
+/**
+ * The header of the index file. It is followed by nentries index
+ * entries and strsize bytes of key data.
+ */
+struct sfs_store_idxhdr {
+	u_int32_t	magic;
+	u_int32_t	version;
+	u_int64_t	generation;
+	/** The log is covered by the index up to this offset. */
+	u_int64_t	logsize;
+	/** The total size of all live records. */
+	u_int64_t	live;
+	u_int32_t	nentries;
+	u_int32_t	strsize;
+};
+
+/**
+ * An entry in the index file.
+ */
+struct sfs_store_idxent {
+	/** The offset of the PUT record in the log. */
+	u_int64_t	offset;
+	/** The total length of the record in the log. */
+	u_int32_t	reclen;
+	/** The offset of the key relative to the start of the key data. */
+	u_int32_t	keyoff;
+	u_int32_t	keylen;
+	u_int32_t	pad;
+};
+
+/**
+ * An entry in the in-memory overlay. An entry with a record length
+ * of zero records a deleted key.
+ */
+struct sfs_store_ent {
+	LIST_ENTRY(sfs_store_ent)	 next;
+	u_int64_t			 offset;
+	u_int32_t			 reclen;
+	u_int32_t			 hash;
+	unsigned int			 keylen;
+	char				 key[0];
+};
+
+/**
+ * A live entry of the store. This is used for scans of the store.
+ * The key memory belongs to the index or to the overlay.
+ */
+struct sfs_store_item {
+	const char	*key;
+	unsigned int	 keylen;
+	u_int64_t	 offset;
+	u_int32_t	 reclen;
+};
+
+/**
+ * An open indexed SFS store.
+ */
+struct sfs_store {
+	/** True if this is the (only) writer. */
+	int				 writable;
+	char				*logpath;
+	char				*idxpath;
+	char				*dirpath;
+	/** The log file descriptor or -1 if there is no log (readers). */
+	int				 logfd;
+	dev_t				 logdev;
+	ino_t				 logino;
+	u_int64_t			 generation;
+	/** The log is applied to the overlay up to this offset. */
+	u_int64_t			 logsize;
+	/** The total size of all live records. */
+	u_int64_t			 live;
+	/** The mapped index (NULL if none). */
+	void				*map;
+	size_t				 maplen;
+	ino_t				 idxino;
+	const struct sfs_store_idxent	*ents;
+	const char			*strs;
+	unsigned int			 nents;
+	/** The overlay. */
+	LIST_HEAD(, sfs_store_ent)	 hash[SFS_STORE_HASHSIZE];
+	unsigned int			 noverlay;
+};
+
+static int	sfs_store_checkpoint(struct sfs_store *);
+
+/**
+ * Compare two keys.
+ *
+ * @param k1 The first key.
+ * @param l1 The length of the first key.
+ * @param k2 The second key.
+ * @param l2 The length of the second key.
+ * @return A value smaller than, equal to or larger than zero if the
+ *     first key is smaller than, equal to or larger than the second key.
+ */
+static int
+sfs_store_keycmp(const char *k1, unsigned int l1, const char *k2,
+    unsigned int l2)
+{
+	int	ret;
+
+	ret = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+	if (ret)
+		return ret;
+	return (int)l1 - (int)l2;
+}
+
+/**
+ * Compare function for qsort(3) on store items.
+ */
+static int
+sfs_store_itemcmp(const void *a, const void *b)
+{
+	const struct sfs_store_item	*i1 = a, *i2 = b;
+
+	return sfs_store_keycmp(i1->key, i1->keylen, i2->key, i2->keylen);
+}
+
+/**
+ * Hash function for the overlay (FNV-1a).
+ */
+static u_int32_t
+sfs_store_hash(const char *key, unsigned int keylen)
+{
+	u_int32_t	h = 2166136261U;
+	unsigned int	i;
+
+	for (i = 0; i < keylen; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/**
+ * Build the key for a path name and an ID.
+ *
+ * @param path The path name.
+ * @param id The ID (user-ID or 'k' followed by the key ID).
+ * @param keylen The length of the key is returned here.
+ * @return The key. The memory is allocated with malloc(3) and must
+ *     be freed by the caller. NULL if memory is exhausted or the
+ *     path name or ID are too long.
+ */
+static char *
+sfs_store_mkkey(const char *path, const char *id, unsigned int *keylen)
+{
+	size_t	 plen = strlen(path), ilen = strlen(id);
+	char	*key;
+
+	if (plen >= PATH_MAX || ilen == 0 || ilen >= SFS_STORE_MAXID)
+		return NULL;
+	key = malloc(plen + ilen + 2);
+	if (key == NULL)
+		return NULL;
+	memcpy(key, path, plen + 1);
+	memcpy(key + plen + 1, id, ilen + 1);
+	*keylen = plen + ilen + 2;
+	return key;
+}
+
+/**
+ * Return true if the key is well formed, i.e. if it consists of two
+ * non-empty NUL terminated strings.
+ */
+static int
+sfs_store_validkey(const char *key, unsigned int keylen)
+{
+	const char	*p;
+
+	if (keylen < 4 || keylen > SFS_STORE_MAXKEY || key[keylen-1])
+		return 0;
+	p = memchr(key, 0, keylen - 1);
+	return p != NULL && p != key && p + 2 < key + keylen;
+}
+
+/**
+ * Find an entry in the overlay.
+ *
+ * @return The entry (possibly a deleted entry) or NULL.
+ */
+static struct sfs_store_ent *
+sfs_store_overlay_find(struct sfs_store *store, const char *key,
+    unsigned int keylen, u_int32_t hash)
+{
+	struct sfs_store_ent	*ent;
+
+	LIST_FOREACH(ent, &store->hash[hash % SFS_STORE_HASHSIZE], next) {
+		if (ent->hash == hash && ent->keylen == keylen
+		    && memcmp(ent->key, key, keylen) == 0)
+			return ent;
+	}
+	return NULL;
+}
+
+/**
+ * Remove all entries from the overlay.
+ */
+static void
+sfs_store_overlay_clear(struct sfs_store *store)
+{
+	struct sfs_store_ent	*ent;
+	int			 i;
+
+	for (i = 0; i < SFS_STORE_HASHSIZE; ++i) {
+		while ((ent = LIST_FIRST(&store->hash[i])) != NULL) {
+			LIST_REMOVE(ent, next);
+			free(ent);
+		}
+	}
+	store->noverlay = 0;
+}
+
+/**
+ * Return the index of the first index entry whose key is larger than
+ * or equal to the given key.
+ */
+static unsigned int
+sfs_store_lowerbound(const struct sfs_store *store, const char *key,
+    unsigned int keylen)
+{
+	unsigned int	lo = 0, hi = store->nents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sfs_store_keycmp(store->strs + store->ents[mid].keyoff,
+		    store->ents[mid].keylen, key, keylen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Look up a key in the overlay and the index.
+ *
+ * @param store The store.
+ * @param key The key.
+ * @param keylen The length of the key.
+ * @param offset The offset of the record is returned here.
+ * @param reclen The length of the record is returned here.
+ * @return True if the key exists.
+ */
+static int
+sfs_store_lookup(struct sfs_store *store, const char *key,
+    unsigned int keylen, u_int64_t *offset, u_int32_t *reclen)
+{
+	struct sfs_store_ent	*ent;
+	unsigned int		 idx;
+
+	ent = sfs_store_overlay_find(store, key, keylen,
+	    sfs_store_hash(key, keylen));
+	if (ent) {
+		*offset = ent->offset;
+		*reclen = ent->reclen;
+		return ent->reclen != 0;
+	}
+	idx = sfs_store_lowerbound(store, key, keylen);
+	if (idx >= store->nents || sfs_store_keycmp(store->strs
+	    + store->ents[idx].keyoff, store->ents[idx].keylen,
+	    key, keylen) != 0)
+		return 0;
+	*offset = store->ents[idx].offset;
+	*reclen = store->ents[idx].reclen;
+	return 1;
+}
+
+/**
+ * Apply a log record to the overlay.
+ *
+ * @param store The store.
+ * @param type The record type.
+ * @param key The key of the record.
+ * @param keylen The length of the key.
+ * @param offset The offset of the record in the log.
+ * @param reclen The total length of the record in the log.
+ * @return Zero in case of success, a negative error code if memory
+ *     is exhausted.
+ */
+static int
+sfs_store_apply(struct sfs_store *store, int type, const char *key,
+    unsigned int keylen, u_int64_t offset, u_int32_t reclen)
+{
+	struct sfs_store_ent	*ent;
+	u_int32_t		 hash = sfs_store_hash(key, keylen);
+	u_int32_t		 oldlen;
+	u_int64_t		 oldoff;
+
+	if (sfs_store_lookup(store, key, keylen, &oldoff, &oldlen))
+		store->live -= oldlen;
+	if (type == SFS_STORE_DEL)
+		reclen = 0;
+	store->live += reclen;
+	ent = sfs_store_overlay_find(store, key, keylen, hash);
+	if (ent == NULL) {
+		ent = malloc(sizeof(struct sfs_store_ent) + keylen);
+		if (ent == NULL)
+			return -ENOMEM;
+		ent->hash = hash;
+		ent->keylen = keylen;
+		memcpy(ent->key, key, keylen);
+		LIST_INSERT_HEAD(&store->hash[hash % SFS_STORE_HASHSIZE],
+		    ent, next);
+		store->noverlay++;
+	}
+	ent->offset = offset;
+	ent->reclen = reclen;
+	return 0;
+}
+
+/**
+ * Read bytes at a given offset. Interrupted and partial reads are
+ * resumed.
+ *
+ * @return Zero if all bytes could be read, -EIO at the end of the file
+ *     and a negative error code in case of an error.
+ */
+static int
+sfs_store_pread(int fd, void *buf, size_t len, u_int64_t offset)
+{
+	ssize_t		ret;
+	size_t		done = 0;
+
+	while (done < len) {
+		ret = pread(fd, (char *)buf + done, len - done,
+		    offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -EIO;
+		done += ret;
+	}
+	return 0;
+}
+
+/**
+ * Write a buffer. Interrupted and partial writes are resumed.
+ *
+ * @return Zero if all bytes were written, a negative error code otherwise.
+ */
+static int
+sfs_store_write(int fd, const void *buf, size_t len)
+{
+	ssize_t		ret;
+	size_t		done = 0;
+
+	while (done < len) {
+		ret = write(fd, (const char *)buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		done += ret;
+	}
+	return 0;
+}
+
+/**
+ * Compute the CRC of a record in a buffer. The CRC covers everything
+ * after the crc field of the record header.
+ */
+static u_int32_t
+sfs_store_reccrc(const void *buf)
+{
+	const struct sfs_store_rec	*rec = buf;
+	size_t				 off;
+
+	off = offsetof(struct sfs_store_rec, type);
+	return anoubis_crc32_update(ANOUBIS_CRC32_INIT, (const char *)buf
+	    + off, sizeof(*rec) - off + rec->keylen + rec->datalen);
+}
+
+/**
+ * Read a record from the log and verify its header and CRC.
+ *
+ * @param store The store.
+ * @param offset The offset of the record.
+ * @param reclen The length of the record. If this is zero, the length
+ *     is taken from the record header.
+ * @param bufp The record is returned here. The memory is allocated
+ *     with malloc(3) and must be freed by the caller.
+ * @return The length of the record. A negative error code if the
+ *     record cannot be read. -EIO means that the record is incomplete
+ *     or damaged.
+ */
+static int
+sfs_store_readrec(struct sfs_store *store, u_int64_t offset,
+    u_int32_t reclen, char **bufp)
+{
+	struct sfs_store_rec	 rec;
+	char			*buf;
+	int			 ret;
+
+	ret = sfs_store_pread(store->logfd, &rec, sizeof(rec), offset);
+	if (ret < 0)
+		return ret;
+	if (rec.magic != SFS_STORE_RECMAGIC || rec.keylen > SFS_STORE_MAXKEY
+	    || rec.datalen > SFS_STORE_MAXDATA
+	    || (rec.type != SFS_STORE_PUT && rec.type != SFS_STORE_DEL))
+		return -EIO;
+	if (reclen == 0)
+		reclen = SFS_STORE_ALIGN(sizeof(rec) + rec.keylen
+		    + rec.datalen);
+	else if (reclen != SFS_STORE_ALIGN(sizeof(rec) + rec.keylen
+	    + rec.datalen))
+		return -EIO;
+	buf = malloc(reclen);
+	if (buf == NULL)
+		return -ENOMEM;
+	ret = sfs_store_pread(store->logfd, buf, reclen, offset);
+	if (ret == 0 && (memcmp(buf, &rec, sizeof(rec)) != 0
+	    || sfs_store_reccrc(buf) != rec.crc
+	    || !sfs_store_validkey(buf + sizeof(rec), rec.keylen)))
+		ret = -EIO;
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+	*bufp = buf;
+	return reclen;
+}
+
+/**
+ * Apply all complete records in the log starting at store->logsize to
+ * the overlay. The writer truncates the log after the last valid record.
+ *
+ * @param store The store.
+ * @param size The current size of the log file.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_store_scan(struct sfs_store *store, u_int64_t size)
+{
+	struct sfs_store_rec	*rec;
+	char			*buf;
+	int			 ret;
+
+	while (store->logsize < size) {
+		ret = sfs_store_readrec(store, store->logsize, 0, &buf);
+		if (ret == -EIO)
+			break;
+		if (ret < 0)
+			return ret;
+		rec = (struct sfs_store_rec *)buf;
+		if (store->logsize + ret > size) {
+			free(buf);
+			break;
+		}
+		ret = sfs_store_apply(store, rec->type, buf + sizeof(*rec),
+		    rec->keylen, store->logsize, ret);
+		if (ret < 0) {
+			free(buf);
+			return ret;
+		}
+		store->logsize += SFS_STORE_ALIGN(sizeof(*rec) + rec->keylen
+		    + rec->datalen);
+		free(buf);
+	}
+	if (store->logsize < size && store->writable) {
+		log_warnx("%s: Discarding %llu bytes of incomplete data",
+		    store->logpath,
+		    (unsigned long long)(size - store->logsize));
+		if (ftruncate(store->logfd, store->logsize) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Unmap the index.
+ */
+static void
+sfs_store_unmap(struct sfs_store *store)
+{
+	if (store->map)
+		munmap(store->map, store->maplen);
+	store->map = NULL;
+	store->maplen = 0;
+	store->ents = NULL;
+	store->strs = NULL;
+	store->nents = 0;
+	store->idxino = 0;
+}
+
+/**
+ * Map the index file. The index is only used if it belongs to the
+ * current generation of the log and if it does not cover more data
+ * than the log contains. The overlay must be empty.
+ *
+ * @param store The store.
+ * @param size The current size of the log file.
+ * @return Zero if the index was mapped, a negative error code if
+ *     there is no usable index.
+ */
+static int
+sfs_store_loadindex(struct sfs_store *store, u_int64_t size)
+{
+	const struct sfs_store_idxhdr	*hdr;
+	struct stat			 statbuf;
+	unsigned int			 i;
+	int				 fd;
+	void				*map;
+
+	fd = open(store->idxpath, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &statbuf) < 0
+	    || statbuf.st_size < (off_t)sizeof(struct sfs_store_idxhdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+	hdr = map;
+	if (hdr->magic != SFS_STORE_IDXMAGIC
+	    || hdr->version != SFS_STORE_VERSION
+	    || hdr->generation != store->generation || hdr->logsize > size
+	    || hdr->logsize < sizeof(struct sfs_store_loghdr)
+	    || (u_int64_t)statbuf.st_size != sizeof(*hdr) + hdr->strsize
+	    + (u_int64_t)hdr->nentries * sizeof(struct sfs_store_idxent))
+		goto bad;
+	store->map = map;
+	store->maplen = statbuf.st_size;
+	store->ents = (const struct sfs_store_idxent *)(hdr + 1);
+	store->strs = (const char *)(store->ents + hdr->nentries);
+	store->nents = hdr->nentries;
+	for (i = 0; i < store->nents; ++i) {
+		const struct sfs_store_idxent	*ent = &store->ents[i];
+
+		if ((u_int64_t)ent->keyoff + ent->keylen > hdr->strsize
+		    || !sfs_store_validkey(store->strs + ent->keyoff,
+		    ent->keylen) || ent->offset + ent->reclen > hdr->logsize)
+			goto bad;
+		if (i && sfs_store_keycmp(store->strs + ent[-1].keyoff,
+		    ent[-1].keylen, store->strs + ent->keyoff,
+		    ent->keylen) >= 0)
+			goto bad;
+	}
+	store->idxino = statbuf.st_ino;
+	store->logsize = hdr->logsize;
+	store->live = hdr->live;
+	return 0;
+bad:
+	store->map = NULL;
+	store->ents = NULL;
+	store->strs = NULL;
+	store->nents = 0;
+	munmap(map, statbuf.st_size);
+	log_warnx("%s: Ignoring stale or damaged index", store->idxpath);
+	return -EINVAL;
+}
+
+/**
+ * Close the log and forget all state derived from it.
+ */
+static void
+sfs_store_reset(struct sfs_store *store)
+{
+	if (store->logfd >= 0)
+		close(store->logfd);
+	store->logfd = -1;
+	store->logino = 0;
+	store->logdev = 0;
+	store->generation = 0;
+	store->logsize = 0;
+	store->live = 0;
+	sfs_store_unmap(store);
+	sfs_store_overlay_clear(store);
+}
+
+/**
+ * Open the log file, map the index and apply all records that are not
+ * covered by the index. The writer creates the log if it does not exist.
+ *
+ * @param store The store. It must not have an open log.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. -ENOENT means that the store does not exist (readers).
+ */
+static int
+sfs_store_load(struct sfs_store *store)
+{
+	struct sfs_store_loghdr	 hdr;
+	struct stat		 statbuf;
+	int			 ret;
+
+	/*
+	 * All store descriptors are close-on-exec. The master opens the
+	 * store before it forks and execs the unprivileged scanners.
+	 */
+	if (store->writable) {
+		store->logfd = open(store->logpath,
+		    O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0640);
+	} else {
+		store->logfd = open(store->logpath, O_RDONLY|O_CLOEXEC);
+	}
+	if (store->logfd < 0)
+		return -errno;
+	if (fstat(store->logfd, &statbuf) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if (statbuf.st_size == 0 && store->writable) {
+		if (fchown(store->logfd, -1, anoubisd_gid) < 0) {
+			ret = -errno;
+			goto err;
+		}
+		hdr.magic = SFS_STORE_LOGMAGIC;
+		hdr.version = SFS_STORE_VERSION;
+		hdr.generation = 1;
+		ret = sfs_store_write(store->logfd, &hdr, sizeof(hdr));
+		if (ret == 0 && fsync(store->logfd) < 0)
+			ret = -errno;
+		if (ret < 0) {
+			if (ftruncate(store->logfd, 0) < 0)
+				ret = -errno;
+			goto err;
+		}
+		statbuf.st_size = sizeof(hdr);
+	} else {
+		ret = sfs_store_pread(store->logfd, &hdr, sizeof(hdr), 0);
+		if (ret < 0)
+			goto err;
+		ret = -EINVAL;
+		if (hdr.magic != SFS_STORE_LOGMAGIC) {
+			log_warnx("%s: Bad magic", store->logpath);
+			goto err;
+		}
+		ret = -EOPNOTSUPP;
+		if (hdr.version != SFS_STORE_VERSION) {
+			log_warnx("%s: Format version %u not supported",
+			    store->logpath, hdr.version);
+			goto err;
+		}
+	}
+	store->logdev = statbuf.st_dev;
+	store->logino = statbuf.st_ino;
+	store->generation = hdr.generation;
+	if (sfs_store_loadindex(store, statbuf.st_size) < 0) {
+		store->logsize = sizeof(hdr);
+		store->live = 0;
+	}
+	ret = sfs_store_scan(store, statbuf.st_size);
+	if (ret < 0)
+		goto err;
+	if (store->writable && store->noverlay)
+		sfs_store_checkpoint(store);
+	return 0;
+err:
+	sfs_store_reset(store);
+	return ret;
+}
+
+/**
+ * Bring the view of a reader up to date. The log is re-opened if it
+ * was replaced by a compaction. Records that were appended since the
+ * last call are added to the overlay. If the overlay grows large and the
+ * writer wrote a new checkpoint, the new index is mapped instead.
+ *
+ * @param store The store.
+ * @return Zero in case of success, a negative error code in case of an
+ *     error. A store that does not exist is treated as an empty store.
+ */
+static int
+sfs_store_refresh(struct sfs_store *store)
+{
+	struct stat	statbuf;
+	u_int64_t	oldsize;
+	int		ret;
+
+	if (store->writable)
+		return 0;
+	if (stat(store->logpath, &statbuf) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		return -errno;
+	}
+	if (store->logfd < 0 || statbuf.st_ino != store->logino
+	    || statbuf.st_dev != store->logdev) {
+		sfs_store_reset(store);
+		ret = sfs_store_load(store);
+		if (ret == -ENOENT)
+			return 0;
+		return ret;
+	}
+	if ((u_int64_t)statbuf.st_size <= store->logsize)
+		return 0;
+	oldsize = store->logsize;
+	ret = sfs_store_scan(store, statbuf.st_size);
+	if (ret < 0 || store->logsize == oldsize)
+		return ret;
+	if (store->noverlay < SFS_STORE_CHECKPOINT
+	    || store->noverlay < store->nents / 4)
+		return 0;
+	if (stat(store->idxpath, &statbuf) < 0
+	    || statbuf.st_ino == store->idxino)
+		return 0;
+	sfs_store_reset(store);
+	ret = sfs_store_load(store);
+	if (ret == -ENOENT)
+		return 0;
+	return ret;
+}
+
+/**
+ * Create the list of live entries whose keys start with the given prefix
+ * in key order.
+ *
+ * @param store The store.
+ * @param prefix The prefix (need not be NUL terminated).
+ * @param plen The length of the prefix.
+ * @param itemsp The list is returned here. The memory is allocated
+ *     with malloc(3) and must be freed by the caller. The keys in the
+ *     items reference memory of the store and are only valid until
+ *     the store is modified or refreshed.
+ * @return The number of items or a negative error code.
+ */
+static int
+sfs_store_collect(struct sfs_store *store, const char *prefix,
+    unsigned int plen, struct sfs_store_item **itemsp)
+{
+	struct sfs_store_item	*base, *ovl, *items;
+	struct sfs_store_ent	*ent;
+	unsigned int		 nbase = 0, novl = 0, n = 0, i, j, idx;
+
+	base = malloc((store->nents + 1) * sizeof(struct sfs_store_item));
+	ovl = malloc((store->noverlay + 1) * sizeof(struct sfs_store_item));
+	items = malloc((store->nents + store->noverlay + 1)
+	    * sizeof(struct sfs_store_item));
+	if (base == NULL || ovl == NULL || items == NULL) {
+		free(base);
+		free(ovl);
+		free(items);
+		return -ENOMEM;
+	}
+	for (idx = sfs_store_lowerbound(store, prefix, plen);
+	    idx < store->nents; ++idx) {
+		const struct sfs_store_idxent	*e = &store->ents[idx];
+		const char			*key = store->strs + e->keyoff;
+
+		if (e->keylen < plen || memcmp(key, prefix, plen) != 0)
+			break;
+		if (sfs_store_overlay_find(store, key, e->keylen,
+		    sfs_store_hash(key, e->keylen)))
+			continue;
+		base[nbase].key = key;
+		base[nbase].keylen = e->keylen;
+		base[nbase].offset = e->offset;
+		base[nbase].reclen = e->reclen;
+		nbase++;
+	}
+	for (i = 0; i < SFS_STORE_HASHSIZE; ++i) {
+		LIST_FOREACH(ent, &store->hash[i], next) {
+			if (ent->reclen == 0 || ent->keylen < plen
+			    || memcmp(ent->key, prefix, plen) != 0)
+				continue;
+			ovl[novl].key = ent->key;
+			ovl[novl].keylen = ent->keylen;
+			ovl[novl].offset = ent->offset;
+			ovl[novl].reclen = ent->reclen;
+			novl++;
+		}
+	}
+	qsort(ovl, novl, sizeof(struct sfs_store_item), sfs_store_itemcmp);
+	i = j = 0;
+	while (i < nbase || j < novl) {
+		if (j == novl || (i < nbase
+		    && sfs_store_itemcmp(&base[i], &ovl[j]) < 0))
+			items[n++] = base[i++];
+		else
+			items[n++] = ovl[j++];
+	}
+	free(base);
+	free(ovl);
+	*itemsp = items;
+	return n;
+}
+
+/**
+ * Write an index file for a list of items.
+ *
+ * @param path The file name of the index.
+ * @param items The live entries in key order.
+ * @param n The number of items.
+ * @param generation The generation of the log.
+ * @param logsize The size of the log that is covered by the index.
+ * @param live The total size of all live records.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_store_writeindex(const char *path, const struct sfs_store_item *items,
+    unsigned int n, u_int64_t generation, u_int64_t logsize, u_int64_t live)
+{
+	struct sfs_store_idxhdr	*hdr;
+	struct sfs_store_idxent	*ents;
+	char			*buf, *strs;
+	size_t			 len, strsize = 0;
+	unsigned int		 i;
+	int			 fd, ret;
+
+	for (i = 0; i < n; ++i)
+		strsize += items[i].keylen;
+	if (strsize > UINT_MAX)
+		return -EFBIG;
+	len = sizeof(*hdr) + n * sizeof(*ents) + strsize;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -ENOMEM;
+	hdr = (struct sfs_store_idxhdr *)buf;
+	ents = (struct sfs_store_idxent *)(hdr + 1);
+	strs = (char *)(ents + n);
+	hdr->magic = SFS_STORE_IDXMAGIC;
+	hdr->version = SFS_STORE_VERSION;
+	hdr->generation = generation;
+	hdr->logsize = logsize;
+	hdr->live = live;
+	hdr->nentries = n;
+	hdr->strsize = strsize;
+	strsize = 0;
+	for (i = 0; i < n; ++i) {
+		ents[i].offset = items[i].offset;
+		ents[i].reclen = items[i].reclen;
+		ents[i].keyoff = strsize;
+		ents[i].keylen = items[i].keylen;
+		ents[i].pad = 0;
+		memcpy(strs + strsize, items[i].key, items[i].keylen);
+		strsize += items[i].keylen;
+	}
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0640);
+	if (fd < 0) {
+		ret = -errno;
+		free(buf);
+		return ret;
+	}
+	ret = 0;
+	if (fchown(fd, -1, anoubisd_gid) < 0)
+		ret = -errno;
+	if (ret == 0)
+		ret = sfs_store_write(fd, buf, len);
+	if (ret == 0 && fsync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	free(buf);
+	if (ret < 0)
+		unlink(path);
+	return ret;
+}
+
+/**
+ * Flush the directory of the store to disk after a rename.
+ */
+static void
+sfs_store_syncdir(struct sfs_store *store)
+{
+	int	fd;
+
+	fd = open(store->dirpath, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	(void)fsync(fd);
+	close(fd);
+}
+
+/**
+ * Write a new index that covers the complete log and clear the overlay.
+ * Only the writer can do this.
+ *
+ * @param store The store.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. The store remains usable in case of an error.
+ */
+static int
+sfs_store_checkpoint(struct sfs_store *store)
+{
+	struct sfs_store_item	*items;
+	u_int64_t		 size;
+	char			*tmp;
+	int			 n, ret;
+
+	if (!store->writable)
+		return -EPERM;
+	if (asprintf(&tmp, "%s%s", store->idxpath, SFS_STORE_TMP) < 0)
+		return -ENOMEM;
+	n = sfs_store_collect(store, "", 0, &items);
+	if (n < 0) {
+		free(tmp);
+		return n;
+	}
+	/* The index must not reference log data that is not on disk. */
+	ret = 0;
+	if (fsync(store->logfd) < 0)
+		ret = -errno;
+	if (ret == 0)
+		ret = sfs_store_writeindex(tmp, items, n, store->generation,
+		    store->logsize, store->live);
+	free(items);
+	if (ret == 0 && rename(tmp, store->idxpath) < 0) {
+		ret = -errno;
+		unlink(tmp);
+	}
+	free(tmp);
+	if (ret < 0) {
+		log_warnx("%s: Cannot write checkpoint (error %d)",
+		    store->idxpath, ret);
+		return ret;
+	}
+	sfs_store_syncdir(store);
+	sfs_store_unmap(store);
+	sfs_store_overlay_clear(store);
+	size = store->logsize;
+	ret = sfs_store_loadindex(store, size);
+	if (ret < 0) {
+		/* Should not happen. Fall back to a full scan of the log. */
+		store->logsize = sizeof(struct sfs_store_loghdr);
+		store->live = 0;
+		ret = sfs_store_scan(store, size);
+	}
+	return ret;
+}
+
+/**
+ * Write a new log that only contains the live records and a matching
+ * index. Only the writer can do this. The new files replace the old
+ * files once they are complete.
+ *
+ * @param store The store.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. The store remains usable in case of an error.
+ */
+int
+sfs_store_compact(struct sfs_store *store)
+{
+	struct sfs_store_loghdr	 hdr;
+	struct sfs_store_item	*items = NULL;
+	struct stat		 statbuf;
+	char			*logtmp = NULL, *idxtmp = NULL, *buf;
+	u_int64_t		 off;
+	int			 i, n, fd = -1, ret;
+
+	if (!store->writable)
+		return -EPERM;
+	if (asprintf(&logtmp, "%s%s", store->logpath, SFS_STORE_TMP) < 0)
+		return -ENOMEM;
+	ret = -ENOMEM;
+	if (asprintf(&idxtmp, "%s%s", store->idxpath, SFS_STORE_TMP) < 0) {
+		idxtmp = NULL;
+		goto out;
+	}
+	n = ret = sfs_store_collect(store, "", 0, &items);
+	if (ret < 0)
+		goto out;
+	fd = open(logtmp, O_RDWR|O_APPEND|O_CREAT|O_TRUNC|O_CLOEXEC,
+	    0640);
+	if (fd < 0 || fstat(fd, &statbuf) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (fchown(fd, -1, anoubisd_gid) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	hdr.magic = SFS_STORE_LOGMAGIC;
+	hdr.version = SFS_STORE_VERSION;
+	hdr.generation = store->generation + 1;
+	ret = sfs_store_write(fd, &hdr, sizeof(hdr));
+	if (ret < 0)
+		goto out;
+	off = sizeof(hdr);
+	for (i = 0; i < n; ++i) {
+		ret = sfs_store_readrec(store, items[i].offset,
+		    items[i].reclen, &buf);
+		if (ret < 0)
+			goto out;
+		ret = sfs_store_write(fd, buf, items[i].reclen);
+		free(buf);
+		if (ret < 0)
+			goto out;
+		items[i].offset = off;
+		off += items[i].reclen;
+	}
+	ret = 0;
+	if (fsync(fd) < 0)
+		ret = -errno;
+	if (ret == 0)
+		ret = sfs_store_writeindex(idxtmp, items, n, hdr.generation,
+		    off, off - sizeof(hdr));
+	if (ret < 0)
+		goto out;
+	/*
+	 * The old index does not match the new log. A crash between the
+	 * two renames results in a full scan of the new log.
+	 */
+	if (rename(logtmp, store->logpath) < 0) {
+		ret = -errno;
+		unlink(idxtmp);
+		goto out;
+	}
+	if (rename(idxtmp, store->idxpath) < 0)
+		unlink(idxtmp);
+	sfs_store_syncdir(store);
+	free(items);
+	items = NULL;
+
+	/* Switch to the new log. */
+	sfs_store_reset(store);
+	store->logfd = fd;
+	store->logdev = statbuf.st_dev;
+	store->logino = statbuf.st_ino;
+	store->generation = hdr.generation;
+	if (sfs_store_loadindex(store, off) < 0) {
+		store->logsize = sizeof(hdr);
+		store->live = 0;
+	}
+	ret = sfs_store_scan(store, off);
+	free(logtmp);
+	free(idxtmp);
+	return ret;
+out:
+	log_warnx("%s: Compaction failed (error %d)", store->logpath, ret);
+	if (fd >= 0) {
+		close(fd);
+		unlink(logtmp);
+	}
+	free(items);
+	free(logtmp);
+	free(idxtmp);
+	return ret;
+}
+
+/**
+ * Write a checkpoint or compact the log if the overlay is large.
+ */
+static void
+sfs_store_maintain(struct sfs_store *store)
+{
+	if (store->noverlay < SFS_STORE_CHECKPOINT
+	    || store->noverlay < store->nents / 4)
+		return;
+	if (store->logsize > SFS_STORE_COMPACTSIZE
+	    && store->live < store->logsize / 2) {
+		if (sfs_store_compact(store) == 0)
+			return;
+	}
+	sfs_store_checkpoint(store);
+}
+
+/**
+ * Append a record to the log and apply it to the overlay. The record is
+ * written with a single write(2). If the write fails, the log is
+ * truncated to its previous size.
+ *
+ * @param store The store.
+ * @param type The record type.
+ * @param key The key.
+ * @param keylen The length of the key.
+ * @param data The data of a PUT record (NULL for DEL records).
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+static int
+sfs_store_append(struct sfs_store *store, int type, const char *key,
+    unsigned int keylen, const struct sfs_data *data)
+{
+	struct sfs_store_rec	*rec;
+	const struct abuf_buffer *fields[3];
+	u_int32_t		*lens;
+	size_t			 reclen, datalen = 0, off;
+	char			*buf;
+	int			 i, ret;
+
+	if (data) {
+		fields[0] = &data->csdata;
+		fields[1] = &data->sigdata;
+		fields[2] = &data->upgradecsdata;
+		datalen = 3 * sizeof(u_int32_t);
+		for (i = 0; i < 3; ++i) {
+			if (abuf_length(*fields[i]) > SFSDATA_MAX_FIELD_LENGTH)
+				return -EINVAL;
+			datalen += abuf_length(*fields[i]);
+		}
+	}
+	reclen = SFS_STORE_ALIGN(sizeof(*rec) + keylen + datalen);
+	buf = calloc(1, reclen);
+	if (buf == NULL)
+		return -ENOMEM;
+	rec = (struct sfs_store_rec *)buf;
+	rec->magic = SFS_STORE_RECMAGIC;
+	rec->type = type;
+	rec->keylen = keylen;
+	rec->datalen = datalen;
+	off = sizeof(*rec);
+	memcpy(buf + off, key, keylen);
+	off += keylen;
+	if (data) {
+		lens = (u_int32_t *)(buf + off);
+		off += 3 * sizeof(u_int32_t);
+		for (i = 0; i < 3; ++i) {
+			lens[i] = abuf_length(*fields[i]);
+			if (lens[i])
+				abuf_copy_frombuf(buf + off, *fields[i],
+				    lens[i]);
+			off += lens[i];
+		}
+	}
+	rec->crc = sfs_store_reccrc(buf);
+	ret = sfs_store_write(store->logfd, buf, reclen);
+	free(buf);
+	if (ret < 0) {
+		if (ftruncate(store->logfd, store->logsize) < 0)
+			log_warn("%s: Cannot truncate", store->logpath);
+		return ret;
+	}
+	ret = sfs_store_apply(store, type, key, keylen, store->logsize,
+	    reclen);
+	store->logsize += reclen;
+	if (ret < 0)
+		return ret;
+	sfs_store_maintain(store);
+	return 0;
+}
+
+/**
+ * Open an indexed SFS store.
+ *
+ * @param dir The directory of the store. The writer creates the
+ *     directory if it does not exist.
+ * @param writable True if the store is opened for writing. Only one
+ *     process may open a store for writing. Readers see the modifications
+ *     of the writer.
+ * @param storep The store is returned here.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. A reader can open a store that does not exist yet,
+ *     it appears empty until the writer creates it.
+ */
+int
+sfs_store_open(const char *dir, int writable, struct sfs_store **storep)
+{
+	struct sfs_store	*store;
+	char			*tmp;
+	int			 i, ret;
+
+	store = calloc(1, sizeof(struct sfs_store));
+	if (store == NULL)
+		return -ENOMEM;
+	store->writable = writable;
+	store->logfd = -1;
+	for (i = 0; i < SFS_STORE_HASHSIZE; ++i)
+		LIST_INIT(&store->hash[i]);
+	store->dirpath = strdup(dir);
+	if (store->dirpath == NULL
+	    || asprintf(&store->logpath, "%s/%s", dir, SFS_STORE_LOG) < 0
+	    || asprintf(&store->idxpath, "%s/%s", dir, SFS_STORE_INDEX) < 0) {
+		sfs_store_close(store);
+		return -ENOMEM;
+	}
+	if (writable) {
+		if (mkdir(dir, 0750) == 0) {
+			if (chown(dir, -1, anoubisd_gid) < 0) {
+				ret = -errno;
+				sfs_store_close(store);
+				return ret;
+			}
+		} else if (errno != EEXIST) {
+			ret = -errno;
+			sfs_store_close(store);
+			return ret;
+		}
+		/* Remove leftovers of an interrupted checkpoint/compaction. */
+		if (asprintf(&tmp, "%s%s", store->logpath, SFS_STORE_TMP) >= 0) {
+			unlink(tmp);
+			free(tmp);
+		}
+		if (asprintf(&tmp, "%s%s", store->idxpath, SFS_STORE_TMP) >= 0) {
+			unlink(tmp);
+			free(tmp);
+		}
+	}
+	ret = sfs_store_load(store);
+	if (ret < 0 && (writable || ret != -ENOENT)) {
+		sfs_store_close(store);
+		return ret;
+	}
+	*storep = store;
+	return 0;
+}
+
+/**
+ * Close an indexed SFS store. The writer writes a final checkpoint.
+ *
+ * @param store The store.
+ */
+void
+sfs_store_close(struct sfs_store *store)
+{
+	if (store == NULL)
+		return;
+	if (store->writable && store->logfd >= 0 && store->noverlay)
+		sfs_store_checkpoint(store);
+	sfs_store_reset(store);
+	free(store->dirpath);
+	free(store->logpath);
+	free(store->idxpath);
+	free(store);
+}
+
+/**
+ * Return true if an indexed SFS store exists in the directory.
+ *
+ * @param dir The directory of the store.
+ * @return True if the log file of the store exists.
+ */
+int
+sfs_store_exists(const char *dir)
+{
+	struct stat	 statbuf;
+	char		*path;
+	int		 ret;
+
+	if (asprintf(&path, "%s/%s", dir, SFS_STORE_LOG) < 0)
+		return 0;
+	ret = (stat(path, &statbuf) == 0);
+	free(path);
+	return ret;
+}
+
+/**
+ * Read the entry for a path name and an ID.
+ *
+ * @param store The store.
+ * @param path The path name of the file.
+ * @param id The ID of the entry (user-ID or 'k' followed by the key ID).
+ * @param data The data is returned here. The contents are allocated
+ *     dynamically and must be freed with sfs_freesfsdata.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. -ENOENT means that the entry does not exist.
+ */
+int
+sfs_store_get(struct sfs_store *store, const char *path, const char *id,
+    struct sfs_data *data)
+{
+	struct sfs_store_rec	*rec;
+	struct abuf_buffer	*fields[3];
+	u_int32_t		*lens, reclen;
+	u_int64_t		 offset;
+	unsigned int		 keylen, off;
+	char			*key, *buf;
+	int			 i, ret;
+
+	data->csdata = data->sigdata = data->upgradecsdata = ABUF_EMPTY;
+	ret = sfs_store_refresh(store);
+	if (ret < 0)
+		return ret;
+	key = sfs_store_mkkey(path, id, &keylen);
+	if (key == NULL)
+		return -ENOMEM;
+	if (!sfs_store_lookup(store, key, keylen, &offset, &reclen)) {
+		free(key);
+		return -ENOENT;
+	}
+	ret = sfs_store_readrec(store, offset, reclen, &buf);
+	if (ret < 0) {
+		free(key);
+		return ret;
+	}
+	rec = (struct sfs_store_rec *)buf;
+	if (rec->type != SFS_STORE_PUT || rec->keylen != keylen
+	    || memcmp(buf + sizeof(*rec), key, keylen) != 0
+	    || rec->datalen < 3 * sizeof(u_int32_t)) {
+		free(key);
+		free(buf);
+		return -EIO;
+	}
+	free(key);
+	fields[0] = &data->csdata;
+	fields[1] = &data->sigdata;
+	fields[2] = &data->upgradecsdata;
+	off = sizeof(*rec) + keylen;
+	lens = (u_int32_t *)(buf + off);
+	off += 3 * sizeof(u_int32_t);
+	if (lens[0] + lens[1] + lens[2] + 3 * sizeof(u_int32_t)
+	    != rec->datalen) {
+		free(buf);
+		return -EIO;
+	}
+	for (i = 0; i < 3; ++i) {
+		if (lens[i] == 0)
+			continue;
+		*fields[i] = abuf_alloc(lens[i]);
+		if (abuf_empty(*fields[i])) {
+			sfs_freesfsdata(data);
+			free(buf);
+			return -ENOMEM;
+		}
+		abuf_copy_tobuf(*fields[i], buf + off, lens[i]);
+		off += lens[i];
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * Store the entry for a path name and an ID. An existing entry is
+ * replaced. Only the writer can do this.
+ *
+ * @param store The store.
+ * @param path The path name of the file.
+ * @param id The ID of the entry (user-ID or 'k' followed by the key ID).
+ * @param data The data of the entry.
+ * @return Zero in case of success, a negative error code in case of
+ *     an error.
+ */
+int
+sfs_store_put(struct sfs_store *store, const char *path, const char *id,
+    const struct sfs_data *data)
+{
+	unsigned int	 keylen;
+	char		*key;
+	int		 ret;
+
+	if (!store->writable)
+		return -EPERM;
+	key = sfs_store_mkkey(path, id, &keylen);
+	if (key == NULL)
+		return -ENOMEM;
+	ret = sfs_store_append(store, SFS_STORE_PUT, key, keylen, data);
+	free(key);
+	return ret;
+}
+
+/**
+ * Remove the entry for a path name and an ID. Only the writer can
+ * do this.
+ *
+ * @param store The store.
+ * @param path The path name of the file.
+ * @param id The ID of the entry (user-ID or 'k' followed by the key ID).
+ * @return Zero in case of success, a negative error code in case of
+ *     an error. -ENOENT means that the entry does not exist.
+ */
+int
+sfs_store_del(struct sfs_store *store, const char *path, const char *id)
+{
+	unsigned int	 keylen;
+	u_int64_t	 offset;
+	u_int32_t	 reclen;
+	char		*key;
+	int		 ret;
+
+	if (!store->writable)
+		return -EPERM;
+	key = sfs_store_mkkey(path, id, &keylen);
+	if (key == NULL)
+		return -ENOMEM;
+	if (!sfs_store_lookup(store, key, keylen, &offset, &reclen)) {
+		free(key);
+		return -ENOENT;
+	}
+	ret = sfs_store_append(store, SFS_STORE_DEL, key, keylen, NULL);
+	free(key);
+	return ret;
+}
+
+/**
+ * Call a function for entries of the store in the order of their path
+ * names. The entries are determined before the first call, i.e. the
+ * callback may access and modify the store.
+ *
+ * @param store The store.
+ * @param path If this is NULL, the function is called for all entries.
+ *     Otherwise it is called for the entries of this path name (subtree
+ *     is false) or for the entries of all files below the directory
+ *     with this name (subtree is true).
+ * @param subtree See path.
+ * @param callback The callback function. It is called with the path
+ *     name and the ID of an entry and the callback argument. A non-zero
+ *     return value stops the iteration.
+ * @param arg The callback argument.
+ * @return Zero in case of success, the non-zero return value of the
+ *     callback or a negative error code in case of an error.
+ */
+int
+sfs_store_foreach(struct sfs_store *store, const char *path, int subtree,
+    int (*callback)(const char *, const char *, void *), void *arg)
+{
+	struct sfs_store_item	*items;
+	char			*prefix = NULL, **keys;
+	unsigned int		 plen = 0;
+	int			 i, n, ret;
+
+	ret = sfs_store_refresh(store);
+	if (ret < 0)
+		return ret;
+	if (path) {
+		plen = strlen(path);
+		prefix = malloc(plen + 2);
+		if (prefix == NULL)
+			return -ENOMEM;
+		memcpy(prefix, path, plen);
+		if (!subtree)
+			prefix[plen++] = 0;
+		else if (plen == 0 || path[plen-1] != '/')
+			prefix[plen++] = '/';
+	}
+	n = sfs_store_collect(store, prefix ? prefix : "", plen, &items);
+	free(prefix);
+	if (n < 0)
+		return n;
+	keys = malloc((n + 1) * sizeof(char *));
+	if (keys == NULL) {
+		free(items);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; ++i) {
+		keys[i] = malloc(items[i].keylen);
+		if (keys[i] == NULL) {
+			while (i > 0)
+				free(keys[--i]);
+			free(keys);
+			free(items);
+			return -ENOMEM;
+		}
+		memcpy(keys[i], items[i].key, items[i].keylen);
+	}
+	free(items);
+	ret = 0;
+	for (i = 0; i < n; ++i) {
+		if (ret == 0)
+			ret = callback(keys[i], keys[i] + strlen(keys[i]) + 1,
+			    arg);
+		free(keys[i]);
+	}
+	free(keys);
+	return ret;
+}
@@ -34,6 +34,9 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <event.h>
@@ -60,6 +63,58 @@
 static void	dispatch_m2u(int, short, void *);
 static void	dispatch_u2m(int, short, void *);
 
+/**
+ * The maximum number of threads that calculate the checksums of the
+ * files in a chunk concurrently.
+ */
+#define UPGRADE_THREADS_MAX	8
+
+/**
+ * The maximum payload size of a single ANOUBISD_MSG_SFS_UPDATE_ALL
+ * message. The checksums of a chunk are split into several messages
+ * if necessary.
+ */
+#define UPGRADE_UPDATE_MAX	8000
+
+/**
+ * An upgraded file in the current chunk and its new checksum.
+ */
+struct upgrade_file {
+	/**
+	 * The path name of the file. This points into the chunk.
+	 */
+	const char	*path;
+
+	/**
+	 * The new checksum of the file. Only valid if error is zero.
+	 */
+	u_int8_t	 csum[ANOUBIS_CS_LEN];
+
+	/**
+	 * Zero if the checksum was calculated, a negative error code
+	 * otherwise. In case of an error, the file is skipped. The error
+	 * is logged by the main thread (see errmsg).
+	 */
+	int		 error;
+
+	/**
+	 * A description of the operation that failed or NULL if the
+	 * error need not be logged.
+	 */
+	const char	*errmsg;
+};
+
+/**
+ * The files of a chunk. Each thread takes the next unprocessed file
+ * until all files are done.
+ */
+struct upgrade_chunk {
+	pthread_mutex_t		 lock;
+	struct upgrade_file	*files;
+	int			 nfiles;
+	int			 next;
+};
+
 /**
  * The event queue for outgoing events to the master process.
  */
@@ -77,6 +132,17 @@ struct event		 ev_m2u;
  */
 struct event	*sigs[10];
 
+/**
+ * The file descriptor of the anoubis device. Opened on first use.
+ */
+static int	 devanoubis = -2;
+
+/**
+ * The number of threads (including the main thread) that calculate
+ * checksums.
+ */
+static int	 upgrade_nthreads = 1;
+
 
 /**
  * The signal handler for QUIT, TERM and INT signals. INT and TERM
@@ -178,6 +244,13 @@ upgrade_main(int pipes[], int loggers[])
 
 	msg_init(masterfd);
 
+	upgrade_nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* Checksums require I/O, use at least two threads. */
+	if (upgrade_nthreads < 2)
+		upgrade_nthreads = 2;
+	if (upgrade_nthreads > UPGRADE_THREADS_MAX)
+		upgrade_nthreads = UPGRADE_THREADS_MAX;
+
 	/* master process */
 	event_set(&ev_m2u, masterfd, EV_READ | EV_PERSIST, dispatch_m2u, NULL);
 	event_add(&ev_m2u, NULL);
@@ -221,88 +294,231 @@ send_upgrade_message(int type)
 }
 
 /**
- * Calculate the new checksum of an upgraded file and send it to the
- * master. The master will update checksums in the SFS tree with the
- * new value.
+ * Calculate the new checksum of an upgraded file. This function is
+ * called concurrently by several threads and must not log. Errors are
+ * stored in the file structure.
  *
- * @param path The path of the file. Only regular files and symlinks
- *     are handled. All other files are skipped.
+ * @param file The file. Only regular files and symlinks are handled.
+ *     All other files are skipped.
  */
 static void
-send_checksum(const char *path)
+upgrade_checksum(struct upgrade_file *file)
 {
-	static int			 devanoubis = -2;
-	struct anoubisd_msg		*msg;
-	struct anoubisd_sfs_update_all	*umsg;
 	struct anoubis_ioctl_csum	 cs;
-	int				 fd, len, plen;
 	struct stat			 statbuf;
+	int				 fd;
 
-	if (devanoubis == -2) {
-		devanoubis = open(_PATH_DEV "anoubis", O_RDONLY);
-		if (devanoubis < 0) {
-			log_warn("upgrade: Failed to open "_PATH_DEV"anoubis");
-			return;
-		}
-	}
-	if (devanoubis < 0)
-		return;
-	if (lstat(path, &statbuf) < 0) {
-		log_warnx("upgrade: Failed to stat file %s", path);
+	file->error = 0;
+	file->errmsg = NULL;
+	if (lstat(file->path, &statbuf) < 0) {
+		file->error = -errno;
+		file->errmsg = "Failed to stat file";
 		return;
 	}
 	if (S_ISLNK(statbuf.st_mode)) {
-		char		*buf = malloc(PATH_MAX);
+		char		 buf[PATH_MAX];
 		int		 len;
 		SHA256_CTX	 shaCtx;
 
-		if (!buf) {
-			log_warnx("upgrade: Out of memory");
-			return;
-		}
-		len = readlink(path, buf, PATH_MAX);
+		len = readlink(file->path, buf, sizeof(buf));
 		if (len < 0) {
-			free(buf);
-			log_warn("upgrade: Readlink failed");
+			file->error = -errno;
+			file->errmsg = "Readlink failed for";
 			return;
 		}
 		SHA256_Init(&shaCtx);
 		SHA256_Update(&shaCtx, buf, len);
-		SHA256_Final(cs.csum, &shaCtx);
-		free(buf);
+		SHA256_Final(file->csum, &shaCtx);
 	} else if (S_ISREG(statbuf.st_mode)) {
-		fd = open(path, O_RDONLY);
+		fd = open(file->path, O_RDONLY);
 		if (fd < 0) {
+			file->error = -errno;
 			if (errno != ENOENT)
-				log_warn("upgrade: Failed to open file %s",
-				    path);
+				file->errmsg = "Failed to open file";
 			return;
 		}
 		cs.fd = fd;
 		if (ioctl(devanoubis, ANOUBIS_GETCSUM, &cs) < 0) {
-			log_warn("upgrade: Kernel failed to supply checksum "
-			    "for %s", path);
+			file->error = -errno;
+			file->errmsg = "Kernel failed to supply checksum for";
+		} else {
+			memcpy(file->csum, cs.csum, ANOUBIS_CS_LEN);
 		}
 		close(fd);
 	} else {
-		log_warnx("upgrade: Upgraded file %s is not a regular file",
-		    path);
-		return;
+		file->error = -EINVAL;
+		file->errmsg = "Not a regular file or symlink:";
 	}
-	plen = strlen(path) + 1;
-	len = sizeof(struct anoubisd_sfs_update_all) + ANOUBIS_CS_LEN + plen;
-	msg = msg_factory(ANOUBISD_MSG_SFS_UPDATE_ALL, len);
-	if (msg == NULL) {
-		log_warnx("upgrade: Out of memory in send_checksum");
+}
+
+/**
+ * The main function of the checksum threads. Also called by the main
+ * thread.
+ *
+ * @param arg The chunk.
+ * @return Always NULL.
+ */
+static void *
+upgrade_worker(void *arg)
+{
+	struct upgrade_chunk	*chunk = arg;
+	int			 i;
+
+	while (1) {
+		pthread_mutex_lock(&chunk->lock);
+		i = chunk->next++;
+		pthread_mutex_unlock(&chunk->lock);
+		if (i >= chunk->nfiles)
+			break;
+		upgrade_checksum(&chunk->files[i]);
+	}
+	return NULL;
+}
+
+/**
+ * Calculate the checksums of all files in a chunk. The files are
+ * distributed over upgrade_nthreads threads. The threads only live
+ * until the chunk is complete. If threads cannot be created, the
+ * remaining work is done by the main thread.
+ *
+ * @param files The files.
+ * @param nfiles The number of files.
+ */
+static void
+upgrade_checksum_all(struct upgrade_file *files, int nfiles)
+{
+	struct upgrade_chunk	 chunk;
+	pthread_t		 threads[UPGRADE_THREADS_MAX];
+	sigset_t		 all, old;
+	int			 i, cnt = 0;
+
+	chunk.files = files;
+	chunk.nfiles = nfiles;
+	chunk.next = 0;
+	pthread_mutex_init(&chunk.lock, NULL);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 1; i < upgrade_nthreads && i < nfiles; ++i) {
+		if (pthread_create(&threads[cnt], NULL, &upgrade_worker,
+		    &chunk) != 0)
+			break;
+		cnt++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	upgrade_worker(&chunk);
+	for (i = 0; i < cnt; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&chunk.lock);
+}
+
+/**
+ * Send the new checksums of upgraded files to the master. The master
+ * will update checksums in the SFS tree with the new value. The
+ * checksums of several files are sent in a single message. Files
+ * without a checksum are skipped.
+ *
+ * @param files The files.
+ * @param nfiles The number of files.
+ */
+static void
+send_checksums(const struct upgrade_file *files, int nfiles)
+{
+	struct anoubisd_msg		*msg;
+	struct anoubisd_sfs_update_all	*umsg;
+	int				 i, j, len, plen, off;
+
+	for (i = 0; i < nfiles; ) {
+		len = 0;
+		for (j = i; j < nfiles; ++j) {
+			if (files[j].error)
+				continue;
+			plen = ANOUBIS_CS_LEN + strlen(files[j].path) + 1;
+			if (len && len + plen > UPGRADE_UPDATE_MAX)
+				break;
+			len += plen;
+		}
+		if (len == 0)
+			break;
+		msg = msg_factory(ANOUBISD_MSG_SFS_UPDATE_ALL,
+		    sizeof(struct anoubisd_sfs_update_all) + len);
+		if (msg == NULL) {
+			log_warnx("upgrade: Out of memory in send_checksums");
+			return;
+		}
+		umsg = (struct anoubisd_sfs_update_all *)msg->msg;
+		umsg->cslen = ANOUBIS_CS_LEN;
+		umsg->nrec = 0;
+		for (off = 0; i < j; ++i) {
+			if (files[i].error)
+				continue;
+			plen = strlen(files[i].path) + 1;
+			memcpy(umsg->payload + off, files[i].csum,
+			    ANOUBIS_CS_LEN);
+			off += ANOUBIS_CS_LEN;
+			memcpy(umsg->payload + off, files[i].path, plen);
+			off += plen;
+			umsg->nrec++;
+		}
+		DEBUG(DBG_QUEUE, " Checksum upgrade message for %d files",
+		    umsg->nrec);
+		enqueue(&eventq_u2m, msg);
+	}
+}
+
+/**
+ * Compare two upgraded files by path name (qsort callback).
+ */
+static int
+upgrade_file_cmp(const void *a, const void *b)
+{
+	const struct upgrade_file	*f1 = a, *f2 = b;
+
+	return strcmp(f1->path, f2->path);
+}
+
+/**
+ * Calculate the new checksums of the files in a chunk and send them
+ * to the master. The files are sorted by path name, i.e. the master
+ * handles files in the same directory one after another.
+ *
+ * @param chunk The NUL-terminated path names of the files.
+ * @param chunksize The total size of the chunk.
+ */
+static void
+process_chunk(const char *chunk, size_t chunksize)
+{
+	struct upgrade_file	*files;
+	size_t			 pos;
+	int			 i, nfiles = 0;
+
+	if (devanoubis == -2) {
+		devanoubis = open(_PATH_DEV "anoubis", O_RDONLY);
+		if (devanoubis < 0)
+			log_warn("upgrade: Failed to open "_PATH_DEV"anoubis");
+	}
+	if (devanoubis < 0)
+		return;
+	for (pos = 0; pos < chunksize; pos += strlen(chunk + pos) + 1)
+		nfiles++;
+	files = calloc(nfiles, sizeof(struct upgrade_file));
+	if (files == NULL) {
+		log_warnx("upgrade: Out of memory");
 		return;
 	}
-	umsg = (struct anoubisd_sfs_update_all *)msg->msg;
-	umsg->cslen = ANOUBIS_CS_LEN;
-	// cppcheck-suppress bufferAccessOutOfBounds
-	memcpy(umsg->payload, &cs.csum, ANOUBIS_CS_LEN);
-	memcpy(umsg->payload + ANOUBIS_CS_LEN, path, plen);
-	DEBUG(DBG_QUEUE, " Checksum upgrade message for %s", path);
-	enqueue(&eventq_u2m, msg);
+	for (i = 0, pos = 0; i < nfiles; ++i) {
+		files[i].path = chunk + pos;
+		pos += strlen(chunk + pos) + 1;
+	}
+	qsort(files, nfiles, sizeof(struct upgrade_file), upgrade_file_cmp);
+	upgrade_checksum_all(files, nfiles);
+	for (i = 0; i < nfiles; ++i) {
+		if (files[i].errmsg == NULL)
+			continue;
+		errno = -files[i].error;
+		log_warn("upgrade: %s %s", files[i].errmsg, files[i].path);
+	}
+	send_checksums(files, nfiles);
+	free(files);
 }
 
 /**
@@ -319,7 +535,6 @@ static void
 dispatch_upgrade(struct anoubisd_msg *msg)
 {
 	struct anoubisd_msg_upgrade	*umsg;
-	size_t				 pos;
 
 	if (msg->size < (int)(sizeof(*msg) + sizeof(*umsg))) {
 		log_warnx("dispatch_upgrade: short message");
@@ -341,11 +556,7 @@ dispatch_upgrade(struct anoubisd_msg *msg)
 		}
 		/* Force NUL-termination of strings in umsg->chunk */
 		umsg->chunk[umsg->chunksize-1] = 0;
-		pos = 0;
-		while (pos < umsg->chunksize) {
-			send_checksum(umsg->chunk + pos);
-			pos += strlen(umsg->chunk + pos) + 1;
-		}
+		process_chunk(umsg->chunk, umsg->chunksize);
 		send_upgrade_message(ANOUBISD_UPGRADE_CHUNK_REQ);
 		break;
 	default:
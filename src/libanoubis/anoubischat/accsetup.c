@@ -148,6 +148,7 @@ acc_clear(struct achat_channel *acc)
 	acc_bufferclear(acc->sendbuffer);
 	acc_bufferclear(acc->recvbuffer);
 	acc->event = NULL;
+	acc->corked = 0;
 
 	return (ACHAT_RC_OK);
 }
@@ -26,6 +26,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <stdlib.h>
 #include <errno.h>
@@ -117,6 +118,54 @@ acc_write(int fd, void *buf, ssize_t nbyte)
 	return num;
 }
 
+/**
+ * Writes data from several buffers into a filedescriptor.
+ * Like acc_write() this retries on short writes until all data is
+ * written or the filedescriptor refuses to take more data. The
+ * iovec array is modified to describe the data that was not written.
+ *
+ * @param fd The destination filedescriptor
+ * @param iov The source buffers
+ * @param iovcnt The number of elements in <code>iov</code>.
+ * @return Number of bytes written into the filedescriptor. On error -1 is
+ *         returned.
+ */
+static ssize_t
+acc_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t num = 0;
+
+	while (iovcnt > 0) {
+		ssize_t		result;
+
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		result = writev(fd, iov, iovcnt);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			else
+				return (num == 0) ? -1 : num;
+		}
+		num += result;
+		while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+			result -= iov->iov_len;
+			iov->iov_len = 0;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + result;
+			iov->iov_len -= result;
+		}
+	}
+
+	return num;
+}
+
 /**
  * Flushes the content of the output-buffer.
  * The content of achat_channel::sendbuffer is written into achat_channel::fd.
@@ -170,7 +219,66 @@ acc_flush(struct achat_channel *chan)
 
 /**
  * Appends data to the output-buffer and flushes (at least a part of) it.
- * Data are appended at achat_channel::sendbuffer and acc_flush() is called.
+ * If the output-buffer is empty and the channel is not corked, the data
+ * is written directly from the caller's buffers with a single writev(2)
+ * and only the part that the filedescriptor did not accept is copied to
+ * the output-buffer.
+ *
+ * @param acc The channel
+ * @param iov The data to send. The array is modified.
+ * @param iovcnt The number of elements in <code>iov</code>.
+ * @return If all data are written achat_rc::ACHAT_RC_OK is returned. When
+ *         there are still some pending data left, achat_rc::ACHAT_RC_PENDING
+ *         is returned.
+ */
+static achat_rc
+acc_sendiov(struct achat_channel *acc, struct iovec *iov, int iovcnt)
+{
+	size_t		start;
+	achat_rc	rc;
+	int		i;
+
+	/* Can only send a message, if you have an open socket */
+	if (acc->fd < 0)
+		return (ACHAT_RC_ERROR);
+
+	if (!acc->corked && acc_bufferlen(acc->sendbuffer) == 0) {
+		ssize_t		bwritten;
+		size_t		total = 0;
+
+		for (i = 0; i < iovcnt; ++i)
+			total += iov[i].iov_len;
+		bwritten = acc_writev(acc->fd, iov, iovcnt);
+		if (bwritten < 0 && errno != EAGAIN)
+			return ACHAT_RC_ERROR;
+		if (bwritten == (ssize_t)total)
+			return ACHAT_RC_OK;
+		/* iov now describes the part that was not written. */
+	}
+
+	start = acc_bufferlen(acc->sendbuffer);
+	for (i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len == 0)
+			continue;
+		rc = acc_bufferappend(acc->sendbuffer, iov[i].iov_base,
+		    iov[i].iov_len);
+		if (rc != ACHAT_RC_OK) {
+			/* Remove partial data to keep the buffer consistent */
+			acc_buffertrunc(acc->sendbuffer,
+			    acc_bufferlen(acc->sendbuffer) - start);
+			return rc;
+		}
+	}
+	if (acc->corked)
+		return ACHAT_RC_OK;
+
+	/* Flush (at least a part of) the message */
+	return acc_flush(acc);
+}
+
+/**
+ * Sends a message.
+ * The message is preceeded by its size and sent with acc_sendiov().
  *
  * @param acc The channel
  * @param msg Data to be appended
@@ -183,31 +291,57 @@ achat_rc
 acc_sendmsg(struct achat_channel *acc, const char *msg, size_t size)
 {
 	uint32_t	pkgsize;
-	achat_rc	rc;
+	struct iovec	iov[2];
 
 	ACC_CHKPARAM(acc  != NULL);
 	ACC_CHKPARAM(msg  != NULL);
 	ACC_CHKPARAM(0 < size && size <= ACHAT_MAX_MSGSIZE);
 
-	/* Can only send a message, if you have an open socket */
-	if (acc->fd < 0)
-		return (ACHAT_RC_ERROR);
-
-	/* (1) Size of following message (in network byte order!) */
+	/* Size of following message (in network byte order!) */
 	pkgsize = htonl(sizeof(pkgsize) + size);
-	rc = acc_bufferappend(acc->sendbuffer, &pkgsize, sizeof(pkgsize));
-	if (rc != ACHAT_RC_OK)
-		return rc;
+	iov[0].iov_base = &pkgsize;
+	iov[0].iov_len = sizeof(pkgsize);
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = size;
 
-	/* (2) Append the message */
-	rc = acc_bufferappend(acc->sendbuffer, msg, size);
-	if (rc != ACHAT_RC_OK) {
-		/* Remove the size from the buffer to keep it consistent */
-		acc_buffertrunc(acc->sendbuffer, sizeof(pkgsize));
-		return rc;
-	}
+	return acc_sendiov(acc, iov, 2);
+}
 
-	/* Flush (at least a part of) the message */
+/**
+ * Corks the channel.
+ * Messages sent on a corked channel are only appended to the output-buffer.
+ * Use this while a burst of messages is produced. Calls can be nested.
+ *
+ * @param acc The channel
+ * @return achat_rc::ACHAT_RC_OK on success.
+ */
+achat_rc
+acc_cork(struct achat_channel *acc)
+{
+	ACC_CHKPARAM(acc != NULL);
+
+	acc->corked++;
+	return (ACHAT_RC_OK);
+}
+
+/**
+ * Uncorks the channel.
+ * If this removes the last cork, all messages queued in the output-buffer
+ * are flushed with acc_flush().
+ *
+ * @param acc The channel
+ * @return The result of acc_flush() or achat_rc::ACHAT_RC_OK if the channel
+ *         is still corked.
+ */
+achat_rc
+acc_uncork(struct achat_channel *acc)
+{
+	ACC_CHKPARAM(acc != NULL);
+
+	if (acc->corked > 0)
+		acc->corked--;
+	if (acc->corked)
+		return (ACHAT_RC_OK);
 	return acc_flush(acc);
 }
 
@@ -277,29 +411,21 @@ acc_fillrecvbuffer(struct achat_channel *acc, size_t size)
 }
 
 /**
- * Reads a complete message from the channel.
- *
- * The message starts with a two-byte-sequence, which contains the size of
- * the following datagram. Next, the message is read from the channel.
+ * Makes sure that a complete message is available in the input-buffer
+ * of the channel. The message starts at the beginning of the buffer
+ * including its four byte size.
  *
  * @param acc The channel
- * @param msg Additionally, the functions copies the message into this buffer.
- * @param size First, points to an integer, which contains the size of
- *        <code>msg</code>. Then, the function writes the number of bytes read
- *        into the integer.
- * @return If the complete message was read, achat_rc::ACHAT_RC_OK is returned.
- *        If you still read some more data to complete the message
- *        achat_rc::ACHAT_RC_PENDING is returned.
+ * @param pkgsize The size of the message including the size itself
+ *        is returned here.
+ * @return achat_rc::ACHAT_RC_OK if a complete message is available,
+ *        achat_rc::ACHAT_RC_PENDING if more data must be read and
+ *        some other value in case of an error.
  */
-achat_rc
-acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
+static achat_rc
+acc_bufferedmsg(struct achat_channel *acc, uint32_t *pkgsize)
 {
 	size_t		bsize;
-	uint32_t	pkgsize = 0;
-
-	ACC_CHKPARAM(acc  != NULL);
-	ACC_CHKPARAM(msg  != NULL);
-	ACC_CHKPARAM(0 < *size && *size <=  ACHAT_MAX_MSGSIZE);
 
 	/* Can only receive a message, if you have an open socket */
 	if (acc->fd < 0)
@@ -307,9 +433,9 @@ acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
 
 	bsize =  acc_bufferlen(acc->recvbuffer);
 
-	if (bsize < sizeof(pkgsize)) {
+	if (bsize < sizeof(*pkgsize)) {
 		/* Don't have enough data to receive size of message */
-		achat_rc rc = acc_fillrecvbuffer(acc, sizeof(pkgsize));
+		achat_rc rc = acc_fillrecvbuffer(acc, sizeof(*pkgsize));
 
 		if (rc != ACHAT_RC_OK) /* error, eof, pending */
 			return (rc);
@@ -317,17 +443,15 @@ acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
 
 	bsize = acc_bufferlen(acc->recvbuffer);
 
-	if (bsize >= sizeof(pkgsize)) {
+	if (bsize >= sizeof(*pkgsize)) {
 		/* Enough data received to build up package size */
-		memcpy(&pkgsize, acc_bufferptr(acc->recvbuffer),
-			sizeof(pkgsize));
-		pkgsize = ntohl(pkgsize); /* Convert to host byte order */
+		memcpy(pkgsize, acc_bufferptr(acc->recvbuffer),
+			sizeof(*pkgsize));
+		*pkgsize = ntohl(*pkgsize); /* Convert to host byte order */
 
-		if (pkgsize == sizeof(pkgsize)) { /* Empty body */
-			*size = 0;
+		if (*pkgsize == sizeof(*pkgsize)) /* Empty body */
 			return (ACHAT_RC_OK);
-		}
-		if (pkgsize < sizeof(pkgsize)) /* Corrupted buffer */
+		if (*pkgsize < sizeof(*pkgsize)) /* Corrupted buffer */
 			return (ACHAT_RC_ERROR);
 	}
 	else {
@@ -335,19 +459,54 @@ acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
 		return ACHAT_RC_PENDING;
 	}
 
-	if (bsize < pkgsize) {
+	if (bsize < *pkgsize) {
 		/* Complete message not buffered, re-read */
-		achat_rc rc = acc_fillrecvbuffer(acc, pkgsize);
+		achat_rc rc = acc_fillrecvbuffer(acc, *pkgsize);
 
 		if (rc != ACHAT_RC_OK) /* error, eof, pending */
 			return (rc);
 	}
 
 	bsize = acc_bufferlen(acc->recvbuffer);
-	if (bsize < pkgsize) {
+	if (bsize < *pkgsize) {
 		/* Don't have enough data to return complete message */
 		return ACHAT_RC_PENDING;
 	}
+	return (ACHAT_RC_OK);
+}
+
+/**
+ * Reads a complete message from the channel.
+ *
+ * The message starts with a two-byte-sequence, which contains the size of
+ * the following datagram. Next, the message is read from the channel.
+ *
+ * @param acc The channel
+ * @param msg Additionally, the functions copies the message into this buffer.
+ * @param size First, points to an integer, which contains the size of
+ *        <code>msg</code>. Then, the function writes the number of bytes read
+ *        into the integer.
+ * @return If the complete message was read, achat_rc::ACHAT_RC_OK is returned.
+ *        If you still read some more data to complete the message
+ *        achat_rc::ACHAT_RC_PENDING is returned.
+ */
+achat_rc
+acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
+{
+	uint32_t	pkgsize = 0;
+	achat_rc	rc;
+
+	ACC_CHKPARAM(acc  != NULL);
+	ACC_CHKPARAM(msg  != NULL);
+	ACC_CHKPARAM(0 < *size && *size <=  ACHAT_MAX_MSGSIZE);
+
+	rc = acc_bufferedmsg(acc, &pkgsize);
+	if (rc != ACHAT_RC_OK)
+		return rc;
+	if (pkgsize == sizeof(pkgsize)) { /* Empty body */
+		*size = 0;
+		return (ACHAT_RC_OK);
+	}
 
 	/* Complete message available */
 	if (*size >= pkgsize - sizeof(pkgsize)) {
@@ -361,3 +520,42 @@ acc_receivemsg(struct achat_channel *acc, char *msg, size_t *size)
 	else /* msg is not big enough to hold the complete message */
 		return ACHAT_RC_NOSPACE;
 }
+
+/**
+ * Reads a complete message from the channel without copying it.
+ *
+ * This works like acc_receivemsg() but instead of copying the message
+ * into a caller supplied buffer a pointer to the message in the
+ * input-buffer of the channel is returned. The message is removed from
+ * the input-buffer, i.e. the next call returns the next message.
+ *
+ * @param acc The channel
+ * @param msg A pointer to the message is returned here. The data is
+ *        only valid until the next receive operation on the channel.
+ * @param size The length of the message is returned here.
+ * @return If the complete message was read, achat_rc::ACHAT_RC_OK is returned.
+ *        If you still read some more data to complete the message
+ *        achat_rc::ACHAT_RC_PENDING is returned.
+ */
+achat_rc
+acc_receivemsg_view(struct achat_channel *acc, const char **msg, size_t *size)
+{
+	uint32_t	pkgsize = 0;
+	achat_rc	rc;
+
+	ACC_CHKPARAM(acc  != NULL);
+	ACC_CHKPARAM(msg  != NULL);
+	ACC_CHKPARAM(size != NULL);
+
+	rc = acc_bufferedmsg(acc, &pkgsize);
+	if (rc != ACHAT_RC_OK)
+		return rc;
+	*size = pkgsize - sizeof(pkgsize);
+	*msg = (char *)acc_bufferptr(acc->recvbuffer) + sizeof(pkgsize);
+
+	/*
+	 * Consuming only advances the start of the buffer. The data
+	 * stays in place until more data is appended to the buffer.
+	 */
+	return acc_bufferconsume(acc->recvbuffer, pkgsize);
+}
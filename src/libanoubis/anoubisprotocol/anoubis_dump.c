@@ -379,6 +379,7 @@ dump_listreply(Anoubis_ListMessage *m, size_t len __used)
 	Anoubis_PgInfoRecord	*pgrec = NULL;
 	Anoubis_PgFileRecord	*filerec = NULL;
 	Anoubis_ProcRecord	*procrec = NULL;
+	unsigned int		 statoff;
 
 	DUMP_NETU(m, error);
 	DUMP_NETU(m, nrec);
@@ -396,6 +397,19 @@ dump_listreply(Anoubis_ListMessage *m, size_t len __used)
 			DUMP_NETULL(pgrec, starttime);
 			DUMP_NETU(pgrec, nrprocs);
 			DUMP_NETU(pgrec, nrfiles);
+			statoff = sizeof(Anoubis_PgInfoRecord)
+			    + strlen(pgrec->path) + 1;
+			statoff = (statoff + 7UL) & ~7UL;
+			if (statoff + sizeof(Anoubis_PgStatsRecord)
+			    <= get_value(pgrec->reclen)) {
+				Anoubis_PgStatsRecord	*stats;
+
+				stats = (Anoubis_PgStatsRecord *)
+				    ((char *)pgrec + statoff);
+				DUMP_NETULL(stats, nrevents);
+				DUMP_NETU(stats, evrate);
+				DUMP_NETU(stats, nrnames);
+			}
 			break;
 		case ANOUBIS_REC_PGFILELIST:
 			filerec = (Anoubis_PgFileRecord *)(m->payload + off);
@@ -202,3 +202,21 @@ int anoubis_msg_send(struct achat_channel * chan, struct anoubis_msg * m)
 		return -EIO;
 	return 0;
 }
+
+/*
+ * Send a message whose checksum has already been set by the caller.
+ * This is used if the same message is sent to many channels.
+ * Does NOT free the message!
+ */
+int anoubis_msg_send_prepared(struct achat_channel * chan,
+    const struct anoubis_msg * m)
+{
+	achat_rc ret;
+
+	if (!VERIFY_LENGTH(m, sizeof(Anoubis_GeneralMessage)))
+		return -ERANGE;
+	ret = acc_sendmsg(chan, m->u.buf, m->length);
+	if (ret != ACHAT_RC_OK)
+		return -EIO;
+	return 0;
+}
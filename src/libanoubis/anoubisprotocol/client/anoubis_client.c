@@ -88,6 +88,8 @@ struct anoubis_client {
 	struct anoubis_msg * tail;
 	int auth_type;
 	anoubis_client_auth_callback_t	auth_callback;
+	int csmulti_window;
+	int csmulti_pending;
 };
 
 static void queue_notify(struct anoubis_client * client, struct anoubis_msg * m)
@@ -123,25 +125,23 @@ static struct anoubis_msg * anoubis_client_rcv(struct anoubis_client * client)
 {
 	struct anoubis_msg	*m = NULL;
 	achat_rc		 rc;
-	size_t			 alloclen = 4096;
+	const char		*buf;
+	size_t			 len;
 
-	m = anoubis_msg_new(alloclen);
+	/*
+	 * Verify the message in the receive buffer of the channel and
+	 * copy it exactly once into a message of the correct size.
+	 */
+	rc = acc_receivemsg_view(client->chan, &buf, &len);
+	if (rc != ACHAT_RC_OK || len < CSUM_LEN)
+		goto err;
+	if (!crc32_check((void *)buf, len))
+		goto err;
+	m = anoubis_msg_new(len - CSUM_LEN);
 	if (!m)
-		return NULL;
-	while (1) {
-		rc = acc_receivemsg(client->chan, m->u.buf, &alloclen);
-		if (rc != ACHAT_RC_NOSPACE)
-			break;
-		alloclen *= 2;
-		if (anoubis_msg_resize(m, alloclen) < 0) {
-			rc = ACHAT_RC_ERROR;
-			break;
-		}
-	}
-	if (rc != ACHAT_RC_OK)
 		goto err;
-	anoubis_msg_resize(m, alloclen);
-	if (!anoubis_msg_verify(m) || !crc32_check(m->u.buf, m->length))
+	memcpy(m->u.buf, buf, len);
+	if (!anoubis_msg_verify(m))
 		goto err;
 	anoubis_dump(m, "Client read");
 	if (get_value(m->u.general->type) == ANOUBIS_C_CLOSEREQ) {
@@ -202,6 +202,8 @@ struct anoubis_client * anoubis_client_create(struct achat_channel * chan,
 	ret->notify = ret->tail = NULL;
 	ret->auth_type = auth_type;
 	ret->auth_callback = auth_cb;
+	ret->csmulti_window = 1;
+	ret->csmulti_pending = 0;
 
 	return ret;
 }
@@ -1314,6 +1316,7 @@ anoubis_csmulti_create(unsigned int op, uid_t uid, void *keyid, int idlen)
 	}
 	ret->nreqs = 0;
 	ret->openreqs = 0;
+	ret->inflight = 0;
 	ret->reply_msg = NULL;
 	TAILQ_INIT(&ret->reqs);
 	return ret;
@@ -1446,27 +1449,53 @@ anoubis_csmulti_add_error(struct anoubis_csmulti_request *request,
 	return 0;
 }
 
+/**
+ * The callback data of a CSMULTI transaction. Several transactions
+ * for the same request can be in flight at the same time. Each of them
+ * knows the request records that were sent in its request message.
+ * These records have their error field set to EINPROGRESS until the
+ * daemon answers them.
+ */
+struct csmulti_chunk {
+	/** The request that this chunk belongs to. */
+	struct anoubis_csmulti_request	*request;
+	/** The number of records in this chunk that are not yet answered. */
+	unsigned int			 nrec;
+	/** The total number of records in this chunk. */
+	unsigned int			 cnt;
+	/** The records in this chunk. */
+	struct anoubis_csmulti_record	*recs[0];
+};
+
 /**
  * Callback handler for CSMULTI request. This handler gets called when
  * the ANOUBIS_T_DONE flag on a CSMULTI request is set. It takes over
- * responsibility for the reply message.
+ * responsibility for the reply messages. The request records point
+ * into these messages, i.e. they must be kept even if the transaction
+ * failed.
  *
- * @param t The transaction. The anoubis_csmulti_request associated with
+ * @param t The transaction. The csmulti_chunk associated with
  *     the transaction can be found in the callback data.
  * @return None.
  */
 static void
 anoubis_client_csmulti_finish(struct anoubis_transaction *t)
 {
-	struct anoubis_csmulti_request	*request = t->cbdata;
+	struct csmulti_chunk		*chunk = t->cbdata;
+	struct anoubis_csmulti_request	*request = chunk->request;
+	struct anoubis_msg		*m;
 
-	request->client = NULL;
-	if (t->result == 0) {
-		/* In case of success,  the request owns the message. */
-		t->msg->next = request->reply_msg;
+	if (t->msg) {
+		for (m = t->msg; m->next; m = m->next)
+			;
+		m->next = request->reply_msg;
 		request->reply_msg = t->msg;
 		t->msg = NULL;
 	}
+	if (request->inflight)
+		request->inflight--;
+	if (request->inflight == 0)
+		request->client = NULL;
 }
 
 /**
@@ -1520,6 +1549,10 @@ anoubis_csmulti_handle_get(struct anoubis_csmulti_record *record,
 /**
  * This method processes the reply of a CSMULTI request and stores the
  * data in the anoubis_csmulti_request associated with the transaction.
+ * The daemon may split the reply to a single request message into
+ * several reply messages. The transaction is complete once all records
+ * of its chunk are answered or if the daemon reports an error for the
+ * request as a whole.
  *
  * @param t The transaction.
  * @param m The reply message.
@@ -1528,14 +1561,16 @@ static void
 anoubis_client_csmulti_steps(struct anoubis_transaction *t,
     const struct anoubis_msg *m)
 {
-	struct anoubis_csmulti_request	*request = t->cbdata;
+	struct csmulti_chunk		*chunk = t->cbdata;
+	struct anoubis_csmulti_request	*request = chunk->request;
 	struct anoubis_client		*client = request->client;
 	unsigned int			 off = 0;
 	unsigned int			 type;
+	unsigned int			 i;
 	int				 ret;
 
 	ret = -EPROTO;
-	if (!request || !client)
+	if (!client)
 		goto out;
 	if (!VERIFY_FIELD(m, general, type))
 		goto out;
@@ -1601,11 +1636,13 @@ anoubis_client_csmulti_steps(struct anoubis_transaction *t,
 			goto out;
 		idx = get_value(r->index);
 		record = anoubis_csmulti_find(request, idx);
-		if (!record)
+		/* Only accept answers for records that are in flight. */
+		if (!record || record->error != EINPROGRESS)
 			continue;
-		if (record->error == EAGAIN)
-			request->openreqs--;
+		chunk->nrec--;
 		record->error = get_value(r->error);
+		if (record->error != EAGAIN)
+			request->openreqs--;
 		/* No payload data in case of an error. */
 		if (record->error)
 			continue;
@@ -1617,6 +1654,7 @@ anoubis_client_csmulti_steps(struct anoubis_transaction *t,
 		 * Iterate through the checksum data and process it.
 		 * The checksum data remains stored in the message and
 		 * the result record only points into the message!
+		 * The message is kept because of ANOUBIS_T_WANT_ALL.
 		 */
 		rlen -= sizeof(Anoubis_CSMultiReplyRecord);
 		ret = anoubis_csmulti_handle_get(record, r->payload, rlen);
@@ -1624,16 +1662,45 @@ anoubis_client_csmulti_steps(struct anoubis_transaction *t,
 			goto out;
 	}
 	ret = 0;
+	/* Wait for the remaining records of this chunk. */
+	if (chunk->nrec)
+		return;
 out:
-	/* Do not free the message because of ANOUBIS_T_WANTMESSAGE */
+	/*
+	 * Records that are still in flight will not be answered. They
+	 * must be sent again.
+	 */
+	for (i = 0; i < chunk->cnt; ++i) {
+		if (chunk->recs[i]->error == EINPROGRESS)
+			chunk->recs[i]->error = EAGAIN;
+	}
+	chunk->nrec = 0;
+	/* Do not free the messages because of ANOUBIS_T_WANT_ALL */
 	anoubis_transaction_done(t, -ret);
 	LIST_REMOVE(t, next);
-	if (client)
+	if (!client)
+		return;
+	if (client->csmulti_pending)
+		client->csmulti_pending--;
+	if (client->csmulti_pending == 0)
 		client->flags &= ~FLAG_POLICY_PENDING;
 }
 
+/**
+ * Create the next request message for a CSMULTI request. The message
+ * contains records that have not yet been asked for (error EAGAIN).
+ *
+ * @param request The request.
+ * @param compat True if the server does not support CSMULTI messages.
+ *     The message is a single checksum request in this case.
+ * @param split True if the server can split the reply into several
+ *     messages. Otherwise, the number of records in a GET request is
+ *     limited such that all checksums fit into a single reply.
+ * @return The message or NULL if no message could be created.
+ */
 static struct anoubis_msg *
-__anoubis_csmulti_msg(struct anoubis_csmulti_request *request, int compat)
+__anoubis_csmulti_msg(struct anoubis_csmulti_request *request, int compat,
+    int split)
 {
 	struct anoubis_msg		*m;
 	struct anoubis_csmulti_record	*record;
@@ -1685,10 +1752,11 @@ __anoubis_csmulti_msg(struct anoubis_csmulti_request *request, int compat)
 
 	/*
 	 * Limit GET requests to about 80. This means that the reply will
-	 * be able to hold all checksums.
+	 * be able to hold all checksums. This is not necessary if the
+	 * server splits the reply.
 	 */
-	if (request->op == ANOUBIS_CHECKSUM_OP_GET2
-	    || request->op == ANOUBIS_CHECKSUM_OP_GETSIG2)
+	if (!split && (request->op == ANOUBIS_CHECKSUM_OP_GET2
+	    || request->op == ANOUBIS_CHECKSUM_OP_GETSIG2))
 		limit = 80;
 
 	/* Step 1: Calculate the total length of the message */
@@ -1774,7 +1842,128 @@ __anoubis_csmulti_msg(struct anoubis_csmulti_request *request, int compat)
 struct anoubis_msg *
 anoubis_csmulti_msg(struct anoubis_csmulti_request *request)
 {
-	return __anoubis_csmulti_msg(request, 0);
+	return __anoubis_csmulti_msg(request, 0, 0);
+}
+
+/**
+ * Return the number of CSMULTI transactions that may be in flight
+ * at the same time on this client.
+ *
+ * @param client The client.
+ * @return The window size. This is one if the server does not support
+ *     pipelined CSMULTI requests.
+ */
+static int
+csmulti_window(struct anoubis_client *client)
+{
+	if (client->selected_version < 9)
+		return 1;
+	return client->csmulti_window;
+}
+
+int
+anoubis_client_csmulti_window(struct anoubis_client *client, int window)
+{
+	if (window < 1)
+		window = 1;
+	if (window > ANOUBIS_CSMULTI_MAXWINDOW)
+		window = ANOUBIS_CSMULTI_MAXWINDOW;
+	client->csmulti_window = window;
+	return window;
+}
+
+/**
+ * Return true if the request has records that have not yet been
+ * sent to the server.
+ *
+ * @param request The request.
+ * @return True if there are unsent records.
+ */
+static int
+csmulti_unsent(struct anoubis_csmulti_request *request)
+{
+	struct anoubis_csmulti_record	*record;
+
+	TAILQ_FOREACH(record, &request->reqs, next) {
+		if (record->error == EAGAIN)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Create the callback data for a CSMULTI transaction. All records
+ * that are part of the request message are marked as in flight.
+ *
+ * @param request The request.
+ * @param m The request message. For compat messages this is the
+ *     record request->last.
+ * @param compat True if this is a compat message.
+ * @return The callback data or NULL if no memory is available.
+ */
+static struct csmulti_chunk *
+csmulti_chunk_create(struct anoubis_csmulti_request *request,
+    const struct anoubis_msg *m, int compat)
+{
+	struct csmulti_chunk		*chunk;
+	struct anoubis_csmulti_record	*record;
+	Anoubis_CSMultiRequestRecord	*r;
+	unsigned int			 off, i, cnt = 0;
+
+	if (compat) {
+		chunk = malloc(sizeof(struct csmulti_chunk));
+		if (!chunk)
+			return NULL;
+		chunk->request = request;
+		chunk->nrec = chunk->cnt = 0;
+		return chunk;
+	}
+	off = get_value(m->u.csmultireq->recoff);
+	while (1) {
+		r = (Anoubis_CSMultiRequestRecord *)
+		    (m->u.csmultireq->payload + off);
+		if (get_value(r->length) == 0)
+			break;
+		off += get_value(r->length);
+		cnt++;
+	}
+	chunk = malloc(sizeof(struct csmulti_chunk)
+	    + cnt * sizeof(struct anoubis_csmulti_record *));
+	if (!chunk)
+		return NULL;
+	chunk->request = request;
+	chunk->nrec = chunk->cnt = 0;
+	off = get_value(m->u.csmultireq->recoff);
+	for (i = 0; i < cnt; ++i) {
+		r = (Anoubis_CSMultiRequestRecord *)
+		    (m->u.csmultireq->payload + off);
+		off += get_value(r->length);
+		record = anoubis_csmulti_find(request, get_value(r->index));
+		if (!record || record->error != EAGAIN)
+			continue;
+		record->error = EINPROGRESS;
+		chunk->recs[chunk->cnt++] = record;
+	}
+	chunk->nrec = chunk->cnt;
+	return chunk;
+}
+
+/**
+ * Mark the records of a chunk that are still in flight as unsent
+ * and free the chunk.
+ *
+ * @param chunk The chunk.
+ */
+static void
+csmulti_chunk_abort(struct csmulti_chunk *chunk)
+{
+	unsigned int	i;
+
+	for (i = 0; i < chunk->cnt; ++i) {
+		if (chunk->recs[i]->error == EINPROGRESS)
+			chunk->recs[i]->error = EAGAIN;
+	}
+	free(chunk);
 }
 
 struct anoubis_transaction *
@@ -1784,16 +1973,31 @@ anoubis_client_csmulti_start(struct anoubis_client *client,
 	static const u_int32_t ops[] = { ANOUBIS_P_CSMULTIREPLY, -1 };
 	static const u_int32_t compat_ops[] = { ANOUBIS_REPLY, -1 };
 	struct anoubis_msg		*m;
-	struct anoubis_transaction	*t = NULL;
+	struct anoubis_transaction	*t = NULL, *tmp, *last = NULL;
+	struct csmulti_chunk		*chunk;
 	int				 compat = 0;
 
 	if ((client->proto & ANOUBIS_PROTO_POLICY) == 0)
 		return NULL;
 	if (client->state != ANOUBIS_STATE_CONNECTED)
 		return NULL;
-	if (client->flags & FLAG_POLICY_PENDING)
+	/*
+	 * Other CSMULTI transactions may be in flight as long as the
+	 * window is not full. All other policy requests must wait.
+	 */
+	if (client->flags & FLAG_POLICY_PENDING) {
+		if (client->csmulti_pending == 0)
+			return NULL;
+		if (client->csmulti_pending >= csmulti_window(client))
+			return NULL;
+	}
+	if (request->client && request->client != client)
 		return NULL;
-	if (request->client)
+	/*
+	 * Records that are in flight must not be sent again. Without
+	 * this check __anoubis_csmulti_msg would reset openreqs.
+	 */
+	if (request->client && !csmulti_unsent(request))
 		return NULL;
 
 	if (client->selected_version < 5)
@@ -1802,30 +2006,52 @@ anoubis_client_csmulti_start(struct anoubis_client *client,
 	 * Do not use CSMULTI messages if the server does not support them
 	 * (selected_version < 5)
 	 */
-	m = __anoubis_csmulti_msg(request, compat);
+	m = __anoubis_csmulti_msg(request, compat,
+	    client->selected_version >= 9);
 	if (!m)
 		return NULL;
+	chunk = csmulti_chunk_create(request, m, compat);
+	if (!chunk) {
+		anoubis_msg_free(m);
+		return NULL;
+	}
 
-	request->client = client;
 	t = anoubis_transaction_create(0,
-	    ANOUBIS_T_INITSELF|ANOUBIS_T_DEQUEUE|ANOUBIS_T_WANTMESSAGE,
+	    ANOUBIS_T_INITSELF|ANOUBIS_T_DEQUEUE|ANOUBIS_T_WANT_ALL,
 	    &anoubis_client_csmulti_steps, &anoubis_client_csmulti_finish,
-	    request);
+	    chunk);
 	if (!t) {
-		request->client = NULL;
+		csmulti_chunk_abort(chunk);
 		anoubis_msg_free(m);
 		return NULL;
 	}
 	if (anoubis_client_send(client, m) < 0) {
-		request->client = NULL;
+		csmulti_chunk_abort(chunk);
 		anoubis_transaction_destroy(t);
 		return NULL;
 	}
+	t->flags |= ANOUBIS_T_FREECBDATA;
 	if (compat)
 		anoubis_transaction_setopcodes(t, compat_ops);
 	else
 		anoubis_transaction_setopcodes(t, ops);
-	LIST_INSERT_HEAD(&client->ops, t, next);
+	/*
+	 * Replies are matched by opcode, i.e. the first CSMULTI
+	 * transaction in the list gets the next reply. The server answers
+	 * pipelined requests in order, thus new transactions must be
+	 * queued behind those that are already in flight.
+	 */
+	LIST_FOREACH(tmp, &client->ops, next) {
+		if (tmp->process == &anoubis_client_csmulti_steps)
+			last = tmp;
+	}
+	if (last)
+		LIST_INSERT_AFTER(last, t, next);
+	else
+		LIST_INSERT_HEAD(&client->ops, t, next);
+	request->client = client;
+	request->inflight++;
+	client->csmulti_pending++;
 	client->flags |= FLAG_POLICY_PENDING;
 	return t;
 }
@@ -1948,6 +2174,45 @@ int anoubis_client_wait(struct anoubis_client * client)
 	return anoubis_client_process(client, m);
 }
 
+int
+anoubis_client_csmulti(struct anoubis_client *client,
+    struct anoubis_csmulti_request *request)
+{
+	struct anoubis_transaction	*ts[ANOUBIS_CSMULTI_MAXWINDOW];
+	struct anoubis_transaction	*t;
+	int				 head = 0, cnt = 0, ret = 0, window;
+
+	window = csmulti_window(client);
+	while (1) {
+		/* Fill the window unless an error occured. */
+		while (ret == 0 && cnt < window && csmulti_unsent(request)) {
+			t = anoubis_client_csmulti_start(client, request);
+			if (!t) {
+				ret = -EINVAL;
+				break;
+			}
+			ts[(head + cnt) % ANOUBIS_CSMULTI_MAXWINDOW] = t;
+			cnt++;
+		}
+		if (cnt == 0)
+			break;
+		/* The server answers in order. Wait for the oldest. */
+		t = ts[head];
+		while ((t->flags & ANOUBIS_T_DONE) == 0) {
+			int	err = anoubis_client_wait(client);
+
+			if (err < 0)
+				return err;
+		}
+		if (t->result && ret == 0)
+			ret = -t->result;
+		anoubis_transaction_destroy(t);
+		head = (head + 1) % ANOUBIS_CSMULTI_MAXWINDOW;
+		cnt--;
+	}
+	return ret;
+}
+
 static void
 anoubis_client_version_steps(struct anoubis_transaction *t,
     const struct anoubis_msg *m)
@@ -2172,3 +2437,40 @@ anoubis_client_parse_pgcommit_reply(struct anoubis_msg *m)
 	ret[cnt2] = NULL;
 	return ret;
 }
+
+char *
+anoubis_client_parse_pgcommit_latency(struct anoubis_msg *m)
+{
+	char		*ret;
+	uint8_t		*buf = m->u.ackpayload->payload;
+	int		 plen = PAYLOAD_LEN(m, ackpayload, payload);
+	int		 idx, taglen = strlen(ANOUBIS_PGCOMMIT_LATENCY);
+
+	/* The report follows the last NUL-terminated string. */
+	for (idx=plen; idx > 0; --idx) {
+		if (buf[idx-1] == 0)
+			break;
+	}
+	if (plen - idx < taglen
+	    || memcmp(buf + idx, ANOUBIS_PGCOMMIT_LATENCY, taglen) != 0)
+		return NULL;
+	idx += taglen;
+	ret = malloc(plen - idx + 1);
+	if (ret == NULL)
+		return NULL;
+	memcpy(ret, buf + idx, plen - idx);
+	ret[plen - idx] = 0;
+	return ret;
+}
+
+const Anoubis_PgStatsRecord *
+anoubis_client_pginfo_stats(const Anoubis_PgInfoRecord *rec)
+{
+	unsigned int	off;
+
+	off = sizeof(Anoubis_PgInfoRecord) + strlen(rec->path) + 1;
+	off = (off + 7UL) & ~7UL;
+	if (off + sizeof(Anoubis_PgStatsRecord) > get_value(rec->reclen))
+		return NULL;
+	return (const Anoubis_PgStatsRecord *)((const char *)rec + off);
+}
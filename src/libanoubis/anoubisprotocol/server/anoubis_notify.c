@@ -31,6 +31,8 @@
 #include <anoubis_msg.h>
 #include <anoubis_notify.h>
 #include <anoubis_errno.h>
+#include <anoubis_crc32.h>
+#include <anoubis_dump.h>
 
 #include <sys/queue.h>
 
@@ -43,14 +45,40 @@
 
 struct anoubis_notify_reg {
 	LIST_ENTRY(anoubis_notify_reg) next;
+	LIST_ENTRY(anoubis_notify_reg) subnext;	/* notify_subs slot */
+	struct anoubis_notify_group * grp;
 	u_int32_t ruleid;
 	uid_t uid;
 	u_int32_t subsystem;
 };
 
+/*
+ * All registrations of all groups indexed by subsystem. This allows
+ * anoubis_notify_all to find the interested groups without looking at
+ * groups that did not register for the subsystem of an event.
+ * Registrations for all subsystems (subsystem 0) are in slot 0.
+ */
+#define NOTIFY_SUBS_SLOTS	32
+#define NOTIFY_SUBS_SLOT(S)	((S) % NOTIFY_SUBS_SLOTS)
+static LIST_HEAD(, anoubis_notify_reg) notify_subs[NOTIFY_SUBS_SLOTS];
+
+/* Sequence number used to send each head at most once per group. */
+static unsigned long notify_seq;
+
 struct anoubis_notify_head {
 	LIST_HEAD(, anoubis_notify_event) events;
+	/*
+	 * The message is prepared (checksum set) once in
+	 * anoubis_notify_create_head and sent unmodified to all groups.
+	 * The values used for matching are decoded at the same time.
+	 */
 	struct anoubis_msg * m;
+	int opcode;
+	uid_t msguid;
+	u_int32_t ruleid;
+	u_int32_t subsystem;
+	anoubis_token_t token;
+	unsigned long seq;
 	int verdict;
 	int eventcount;
 	anoubis_notify_callback_t finish;
@@ -86,6 +114,7 @@ struct anoubis_notify_group {
 	/*@dependent@*/
 	struct achat_channel * chan;
 	LIST_HEAD(, anoubis_notify_event) pending;
+	unsigned long seq;	/* Sequence number of the last head sent. */
 };
 
 /*
@@ -108,6 +137,7 @@ struct anoubis_notify_group * anoubis_notify_create(struct achat_channel * chan,
 
 	ret->chan = chan;
 	ret->uid = uid;
+	ret->seq = 0;
 	LIST_INIT(&ret->regs);
 	LIST_INIT(&ret->pending);
 	return ret;
@@ -122,6 +152,7 @@ void anoubis_notify_destroy(struct anoubis_notify_group * ng)
 	while(!LIST_EMPTY(&ng->regs)) {
 		reg = LIST_FIRST(&ng->regs);
 		LIST_REMOVE(reg, next);
+		LIST_REMOVE(reg, subnext);
 		free(reg);
 	}
 	while(!LIST_EMPTY(&ng->pending)) {
@@ -188,7 +219,10 @@ int anoubis_notify_register(struct anoubis_notify_group * ng,
 	reg->uid = uid;
 	reg->ruleid = ruleid;
 	reg->subsystem = subsystem;
+	reg->grp = ng;
 	LIST_INSERT_HEAD(&ng->regs, reg, next);
+	LIST_INSERT_HEAD(&notify_subs[NOTIFY_SUBS_SLOT(subsystem)], reg,
+	    subnext);
 	return 0;
 }
 
@@ -244,6 +278,7 @@ int anoubis_notify_unregister(struct anoubis_notify_group * ng,
 	LIST_FOREACH(reg, &ng->regs, next) {
 		 if (reg_match(reg, uid, ruleid, subsystem)) {
 			LIST_REMOVE(reg, next);
+			LIST_REMOVE(reg, subnext);
 			free(reg);
 			return 0;
 		 }
@@ -290,6 +325,36 @@ anoubis_notify_create_head(struct anoubis_msg * m,
 		return NULL;
 	LIST_INIT(&head->events);
 	head->m = m;
+	head->opcode = opcode;
+	head->seq = 0;
+	switch(opcode) {
+	case ANOUBIS_N_POLICYCHANGE:
+		head->msguid = get_value(m->u.policychange->uid);
+		head->subsystem = ANOUBIS_SOURCE_STAT;
+		head->ruleid = 0;
+		head->token = 0;
+		break;
+	case ANOUBIS_N_PGCHANGE:
+		head->msguid = get_value(m->u.pgchange->uid);
+		head->subsystem = ANOUBIS_SOURCE_STAT;
+		head->ruleid = 0;
+		head->token = 0;
+		break;
+	case ANOUBIS_N_STATUSNOTIFY:
+		head->msguid = 0;
+		head->subsystem = ANOUBIS_SOURCE_STAT;
+		head->ruleid = 0;
+		head->token = 0;
+		break;
+	default:
+		head->msguid = get_value(m->u.notify->uid);
+		head->ruleid = get_value(m->u.notify->rule_id);
+		head->subsystem = get_value(m->u.notify->subsystem);
+		head->token = m->u.notify->token;
+	}
+	/* The message is not modified after this point. */
+	crc32_set(m->u.buf, m->length);
+	anoubis_dump(m, "anoubis_notify");
 	head->verdict = ANOUBIS_E_IO;
 	head->eventcount = 0;
 	head->finish = finish;
@@ -301,64 +366,40 @@ anoubis_notify_create_head(struct anoubis_msg * m,
 }
 
 /*
- * Returns:
- *  - negative errno on error.
- *  - zero if session is not registered for the message
- *  - positive if notify message was sent.
+ * Send the message of the head to a group that is known to be
+ * registered for it. Returns the same values as anoubis_notify.
  */
-
-int anoubis_notify(struct anoubis_notify_group * ng,
+static int notify_one(struct anoubis_notify_group * ng,
     struct anoubis_notify_head * head, unsigned int limit)
 {
 	struct anoubis_notify_event * nev;
 	struct anoubis_msg * m = head->m;
-	int ret, opcode;
-	u_int32_t uid, ruleid, subsystem;
-	anoubis_token_t token;
+	int ret, opcode = head->opcode;
 	unsigned int pendingcnt = 0;
 
-	opcode = get_value(m->u.general->type);
 	switch(opcode) {
 	case ANOUBIS_N_POLICYCHANGE:
-		uid = get_value(m->u.policychange->uid);
-		subsystem = ANOUBIS_SOURCE_STAT;
-		ruleid = 0;
-		token = 0;
 		/*
 		 * Only root receives policy change messages for other
 		 * users. XXX CEH: This check should be somewhere else!
 		 */
-		if (ng->uid != 0 && ng->uid != uid)
+		if (ng->uid != 0 && ng->uid != head->msguid)
 			return 0;
 		break;
 	case ANOUBIS_N_PGCHANGE:
-		uid = get_value(m->u.pgchange->uid);
-		subsystem = ANOUBIS_SOURCE_STAT;
-		ruleid = 0;
-		token = 0;
-		if (ng->uid != uid)
+		if (ng->uid != head->msguid)
 			return 0;
 		break;
 	case ANOUBIS_N_STATUSNOTIFY:
-		subsystem = ANOUBIS_SOURCE_STAT;
-		uid = 0;
-		ruleid = 0;
-		token = 0;
 		break;
 	default:
-		uid = get_value(m->u.notify->uid);
-		ruleid = get_value(m->u.notify->rule_id);
-		subsystem = get_value(m->u.notify->subsystem);
-		token = m->u.notify->token;
-		if (token == 0)
+		if (head->token == 0)
 			return -EINVAL;
 	}
 
-	if (!reg_match_all(ng, uid, ruleid, subsystem))
-		return 0;
 	LIST_FOREACH(nev, &ng->pending, next) {
 		pendingcnt++;
-		if (nev->token == token)
+		if (nev->token == head->token)
 			return -EEXIST;
 	}
 	/* In these cases there is no need to wait for a reply */
@@ -366,7 +407,7 @@ int anoubis_notify(struct anoubis_notify_group * ng,
 	    || opcode == ANOUBIS_N_POLICYCHANGE
 	    || opcode == ANOUBIS_N_PGCHANGE
 	    || opcode == ANOUBIS_N_STATUSNOTIFY) {
-		ret = anoubis_msg_send(ng->chan, m);
+		ret = anoubis_msg_send_prepared(ng->chan, m);
 		if (ret < 0)
 			return ret;
 		return 1;
@@ -376,11 +417,11 @@ int anoubis_notify(struct anoubis_notify_group * ng,
 	nev = malloc(sizeof(struct anoubis_notify_event));
 	if (!nev)
 		return -ENOMEM;
-	nev->token = token;
+	nev->token = head->token;
 	nev->flags = 0;
 	nev->head = head;
 	nev->grp = ng;
-	ret = anoubis_msg_send(ng->chan, m);
+	ret = anoubis_msg_send_prepared(ng->chan, m);
 	if (ret < 0) {
 		free(nev);
 		return ret;
@@ -391,6 +432,62 @@ int anoubis_notify(struct anoubis_notify_group * ng,
 	return 1;
 }
 
+/*
+ * Returns:
+ *  - negative errno on error.
+ *  - zero if session is not registered for the message
+ *  - positive if notify message was sent.
+ */
+
+int anoubis_notify(struct anoubis_notify_group * ng,
+    struct anoubis_notify_head * head, unsigned int limit)
+{
+	if (!reg_match_all(ng, head->msguid, head->ruleid, head->subsystem))
+		return 0;
+	return notify_one(ng, head, limit);
+}
+
+/*
+ * Send the message of the head to all groups that registered for it.
+ * Only the registrations for the subsystem of the message and those
+ * for all subsystems are examined. Each group receives the message
+ * at most once even if several of its registrations match.
+ *
+ * Returns the number of groups that the message was sent to. If
+ * errorp is not NULL, the number of groups where sending failed is
+ * stored there.
+ */
+int anoubis_notify_all(struct anoubis_notify_head * head, unsigned int limit,
+    int * errorp)
+{
+	struct anoubis_notify_reg * reg;
+	int slots[2], i, ret, sent = 0, errors = 0;
+
+	head->seq = ++notify_seq;
+	slots[0] = NOTIFY_SUBS_SLOT(head->subsystem);
+	slots[1] = NOTIFY_SUBS_SLOT(0);
+	for (i = 0; i < 2; ++i) {
+		if (i == 1 && slots[1] == slots[0])
+			break;
+		LIST_FOREACH(reg, &notify_subs[slots[i]], subnext) {
+			if (reg->grp->seq == head->seq)
+				continue;
+			if (!reg_match(reg, head->msguid, head->ruleid,
+			    head->subsystem))
+				continue;
+			reg->grp->seq = head->seq;
+			ret = notify_one(reg->grp, head, limit);
+			if (ret < 0)
+				errors++;
+			else if (ret > 0)
+				sent++;
+		}
+	}
+	if (errorp)
+		(*errorp) = errors;
+	return sent;
+}
+
 int anoubis_notify_sendreply(struct anoubis_notify_head * head,
     int verdict, void * you, uid_t uid)
 {
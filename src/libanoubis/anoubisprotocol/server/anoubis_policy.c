@@ -84,16 +84,31 @@ struct anoubis_policy_comm * anoubis_policy_comm_create(
 	return ret;
 }
 
-int anoubis_policy_comm_addrequest(struct anoubis_policy_comm *comm,
-    struct achat_channel *chan, int flags,
+/*
+ * Add a request to the list of pending requests or add data to the
+ * pending request of the channel. If pipeline is true, the request
+ * consists of a single message (flags must be POLICY_FLAG_START and
+ * POLICY_FLAG_END) and can be queued behind other complete requests
+ * of the same channel.
+ */
+static int anoubis_policy_comm_enqueue(struct anoubis_policy_comm *comm,
+    struct achat_channel *chan, int flags, int pipeline,
     anoubis_policy_reply_callback_t callback,
     anoubis_policy_comm_dispatcher_t dispatch, void *cbdata, u_int64_t *tokenp)
 {
 	struct policy_request	*req;
+	int			 pending = 0;
 
+	/*
+	 * Pipelined requests can only be queued behind other requests
+	 * whose request data is complete.
+	 */
 	LIST_FOREACH(req, &comm->req, link) {
-		if (req->chan == chan)
+		if (req->chan != chan)
+			continue;
+		if (!pipeline || (req->flags & REQUEST_DATAEND) == 0)
 			break;
+		pending++;
 	}
 	if (req) {
 		if (flags & POLICY_FLAG_START)
@@ -101,6 +116,8 @@ int anoubis_policy_comm_addrequest(struct anoubis_policy_comm *comm,
 		if (req->flags & REQUEST_DATAEND)
 			return -EINVAL;
 	} else {
+		if (pending >= ANOUBIS_CSMULTI_MAXWINDOW)
+			return -EBUSY;
 		req = malloc(sizeof(struct policy_request));
 		if (!req)
 			return -ENOMEM;
@@ -116,6 +133,24 @@ int anoubis_policy_comm_addrequest(struct anoubis_policy_comm *comm,
 	return 0;
 }
 
+int anoubis_policy_comm_addrequest(struct anoubis_policy_comm *comm,
+    struct achat_channel *chan, int flags,
+    anoubis_policy_reply_callback_t callback,
+    anoubis_policy_comm_dispatcher_t dispatch, void *cbdata, u_int64_t *tokenp)
+{
+	return anoubis_policy_comm_enqueue(comm, chan, flags, 0, callback,
+	    dispatch, cbdata, tokenp);
+}
+
+int anoubis_policy_comm_addpipelined(struct anoubis_policy_comm *comm,
+    struct achat_channel *chan, anoubis_policy_reply_callback_t callback,
+    anoubis_policy_comm_dispatcher_t dispatch, void *cbdata, u_int64_t *tokenp)
+{
+	return anoubis_policy_comm_enqueue(comm, chan,
+	    POLICY_FLAG_START | POLICY_FLAG_END, 1, callback, dispatch,
+	    cbdata, tokenp);
+}
+
 int anoubis_policy_comm_process(struct anoubis_policy_comm * comm,
     struct anoubis_msg * m, u_int32_t uid, struct achat_channel * chan)
 {
@@ -132,7 +167,9 @@ int anoubis_policy_comm_process(struct anoubis_policy_comm * comm,
 		anoubis_msg_free(m);
 		return -EINVAL;
 	}
+	/* Only the protocol flags are valid on the wire. */
 	flags = get_value(m->u.policyrequest->flags);
+	flags &= (POLICY_FLAG_START | POLICY_FLAG_END);
 	err = anoubis_policy_comm_addrequest(comm, chan, flags,
 	    anoubis_policy_request_callback, comm->dispatch, chan, &token);
 	if (err < 0) {
@@ -140,7 +177,7 @@ int anoubis_policy_comm_process(struct anoubis_policy_comm * comm,
 		return err;
 	}
 	ret = comm->dispatch(comm, token, uid, m->u.policyrequest->payload,
-	    datalen, comm->arg, get_value(m->u.policyrequest->flags));
+	    datalen, comm->arg, flags);
 	if (ret < 0)
 		anoubis_policy_comm_destroy(comm, chan);
 	anoubis_msg_free(m);
@@ -213,18 +250,20 @@ void
 anoubis_policy_comm_destroy(struct anoubis_policy_comm *comm,
     struct achat_channel *chan)
 {
-	struct policy_request	*req;
-	LIST_FOREACH(req, &comm->req, link) {
-		if (req->chan == chan) {
-			LIST_REMOVE(req, link);
-			if (req->dispatch) {
-				req->dispatch(comm, req->token, 0 /* uid */,
-				    NULL /* buffer */, 0 /*length */,
-				    comm->arg, 0 /* flags */);
-			}
-			free(req);
-			return;
+	struct policy_request	*req, *next;
+
+	/* There can be more than one request per channel (pipelining). */
+	for (req = LIST_FIRST(&comm->req); req; req = next) {
+		next = LIST_NEXT(req, link);
+		if (req->chan != chan)
+			continue;
+		LIST_REMOVE(req, link);
+		if (req->dispatch) {
+			req->dispatch(comm, req->token, 0 /* uid */,
+			    NULL /* buffer */, 0 /*length */,
+			    comm->arg, 0 /* flags */);
 		}
+		free(req);
 	}
 }
 
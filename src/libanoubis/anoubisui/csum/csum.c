@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <string.h>
 #include <paths.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -118,11 +119,39 @@ err:
 	return NULL;
 }
 
+/**
+ * The size of the buffer that is used to read files in
+ * anoubis_csum_calc_userspace. Large reads reduce the number of system
+ * calls, the buffer is still small enough to stay in the cache.
+ */
+#define CSUM_BUFSIZE	(128 * 1024)
+
+/**
+ * The maximum number of threads used by anoubis_csum_calc_batch.
+ */
+#define CSUM_MAXTHREADS	32
+
+/**
+ * Calculate the SHA256 checksum of a file in userspace. This is used if
+ * the kernel cannot calculate the checksum. The file is read sequentially
+ * in large chunks and the kernel is told about the access pattern to
+ * make read ahead more aggressive. This function is thread safe.
+ *
+ * The SHA256 implementation of OpenSSL chooses the best implementation
+ * for the CPU (e.g. SHA extensions or AVX2) at runtime.
+ *
+ * @param file The path name of the file.
+ * @param cs The checksum is stored here.
+ * @param cslen The length of the buffer cs. Must be at least
+ *     ANOUBIS_CS_LEN.
+ * @return Zero in case of success, a negative error code otherwise.
+ */
 int anoubis_csum_calc_userspace(const char *file, u_int8_t *cs, int *cslen)
 {
-	SHA256_CTX	shaCtx;
-	int		fd, nread;
-	unsigned char	buf[1024];
+	SHA256_CTX	 shaCtx;
+	int		 fd, ret = 0;
+	ssize_t		 nread;
+	unsigned char	*buf;
 
 	if ((file == NULL) || (cs == NULL) || (cslen == NULL) ||
 	    (*cslen < ANOUBIS_CS_LEN)) {
@@ -132,24 +161,37 @@ int anoubis_csum_calc_userspace(const char *file, u_int8_t *cs, int *cslen)
 	fd = open(file, O_RDONLY);
 	if (fd == -1)
 		return (-errno);
+	buf = malloc(CSUM_BUFSIZE);
+	if (buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
 	SHA256_Init(&shaCtx);
 
 	/* Read file chunk by chunk and put it into SHA256_CTX */
-	while ((nread = read(fd, buf, sizeof(buf))) > 0) {
-		SHA256_Update(&shaCtx, buf, nread);
+	while (1) {
+		nread = read(fd, buf, CSUM_BUFSIZE);
+		if (nread > 0) {
+			SHA256_Update(&shaCtx, buf, nread);
+			continue;
+		}
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread < 0)
+			ret = -errno;
+		break;
 	}
 
 	SHA256_Final(cs, &shaCtx);
 
+	free(buf);
 	close(fd);
 
-	if (nread == -1) {
-		/* read operation failed */
-		return (-errno);
-	}
-
-	return (0);
+	return ret;
 }
 
 int
@@ -206,8 +248,21 @@ userspace:
 	return anoubis_csum_calc_userspace(file, csbuf, cslen);
 }
 
-int
-anoubis_csum_link_calc(const char *link, u_int8_t * csbuf, int *cslen)
+/**
+ * Calculate the checksum of a file or symbolic link. The checksum of
+ * a symbolic link is the SHA256 checksum of the link target.
+ *
+ * @param link The path name of the file or link.
+ * @param csbuf The checksum is stored here.
+ * @param cslen The length of the buffer csbuf. Must be at least
+ *     ANOUBIS_CS_LEN. It is set to the length of the checksum.
+ * @param calc The function that calculates the checksum of a file that
+ *     is not a symbolic link.
+ * @return Zero in case of success, a negative error code otherwise.
+ */
+static int
+csum_link_calc(const char *link, u_int8_t *csbuf, int *cslen,
+    int (*calc)(const char *, u_int8_t *, int *))
 {
 	SHA256_CTX	shaCtx;
 	char		buf[PATH_MAX];
@@ -220,7 +275,7 @@ anoubis_csum_link_calc(const char *link, u_int8_t * csbuf, int *cslen)
 	if(lstat(link, &sb) < 0)
 		return -errno;
 	if (!S_ISLNK(sb.st_mode))
-		return anoubis_csum_calc(link, csbuf, cslen);
+		return calc(link, csbuf, cslen);
 
 	if ((ret = readlink(link, buf, PATH_MAX)) < 0) {
 		return -errno;
@@ -233,6 +288,130 @@ anoubis_csum_link_calc(const char *link, u_int8_t * csbuf, int *cslen)
 	return 0;
 }
 
+int
+anoubis_csum_link_calc(const char *link, u_int8_t * csbuf, int *cslen)
+{
+	return csum_link_calc(link, csbuf, cslen, &anoubis_csum_calc);
+}
+
+/**
+ * Shared state of the threads of a batch checksum calculation.
+ */
+struct csum_batch {
+	pthread_mutex_t			 lock;
+	struct anoubis_csum_request	*reqs;
+	int				 cnt;
+	int				 next;
+};
+
+/**
+ * Calculate the checksum of a single request of a batch.
+ *
+ * @param req The request.
+ * @param calc The function that calculates the checksum of a regular file.
+ */
+static void
+csum_batch_one(struct anoubis_csum_request *req,
+    int (*calc)(const char *, u_int8_t *, int *))
+{
+	int	len = req->cslen;
+
+	if (req->path == NULL || req->csum == NULL) {
+		req->error = -EINVAL;
+		return;
+	}
+	if (req->link)
+		req->error = csum_link_calc(req->path, req->csum, &len, calc);
+	else
+		req->error = calc(req->path, req->csum, &len);
+	if (req->error == 0)
+		req->cslen = len;
+}
+
+/**
+ * The main function of a thread in a batch checksum calculation. It
+ * takes the next unprocessed request until all requests are done.
+ * The kernel device is not used by these threads, all checksums are
+ * calculated in userspace.
+ *
+ * @param arg The batch (struct csum_batch).
+ * @return Always NULL.
+ */
+static void *
+csum_batch_thread(void *arg)
+{
+	struct csum_batch	*batch = arg;
+	int			 idx;
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		idx = batch->next;
+		if (idx < batch->cnt)
+			batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (idx >= batch->cnt)
+			break;
+		csum_batch_one(&batch->reqs[idx], &anoubis_csum_calc_userspace);
+	}
+	return NULL;
+}
+
+/**
+ * Calculate the checksums of many files. The files are processed by
+ * up to nthreads threads in parallel. The result of each file is
+ * reported in its request structure, the digests are the same as those
+ * calculated by anoubis_csum_calc and anoubis_csum_link_calc.
+ *
+ * If nthreads is one (or less), the requests are processed in the
+ * calling thread and the checksums are retrieved from the kernel if
+ * possible. Otherwise, checksums are calculated in userspace.
+ *
+ * @param reqs The requests. The path, link, csum and cslen fields
+ *     must be initialized by the caller.
+ * @param cnt The number of requests.
+ * @param nthreads The maximum number of threads to use.
+ * @return Zero if all requests were processed (the result of each
+ *     request is in its error field), a negative error code if the
+ *     requests could not be processed.
+ */
+int
+anoubis_csum_calc_batch(struct anoubis_csum_request *reqs, int cnt,
+    int nthreads)
+{
+	struct csum_batch	batch;
+	pthread_t		threads[CSUM_MAXTHREADS];
+	int			i, started = 0;
+
+	if (cnt < 0 || (cnt > 0 && reqs == NULL))
+		return -EINVAL;
+	if (nthreads > CSUM_MAXTHREADS)
+		nthreads = CSUM_MAXTHREADS;
+	if (nthreads > cnt)
+		nthreads = cnt;
+	if (nthreads <= 1) {
+		for (i = 0; i < cnt; ++i)
+			csum_batch_one(&reqs[i], &anoubis_csum_calc);
+		return 0;
+	}
+	if (pthread_mutex_init(&batch.lock, NULL) != 0)
+		return -ENOMEM;
+	batch.reqs = reqs;
+	batch.cnt = cnt;
+	batch.next = 0;
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, &csum_batch_thread,
+		    &batch) != 0)
+			break;
+		started++;
+	}
+	/* The calling thread helps, this also works if no thread started. */
+	csum_batch_thread(&batch);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+	return 0;
+}
+
 unsigned char **
 anoubis_keyid_list(struct anoubis_msg *m, int **idlen_list, int *list_cnt)
 {
@@ -0,0 +1,721 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file
+ * Binary serialization of parsed rule sets.
+ *
+ * A serialized rule set is a flat, self contained image of a struct
+ * apn_ruleset that can be turned back into a rule set without running
+ * the policy parser. The image starts with a header that records a
+ * magic number, the version of the image format, the version of the
+ * policy parser that produced the rules, the length of the payload
+ * and a CRC32 checksum of the payload. Integers are stored in host
+ * byte order, i.e. an image is only valid on the machine that wrote it.
+ * An image with a wrong byte order is rejected because its magic
+ * number does not match.
+ *
+ * Images are meant as a cache of the parsed policy. A caller must make
+ * sure that the image still corresponds to the policy source and fall
+ * back to the parser if unserialization fails for any reason.
+ */
+
+#include "config.h"
+
+#ifdef S_SPLINT_S
+#include "splint-includes.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apn.h"
+#include "apninternals.h"
+#include "anoubis_crc32.h"
+
+/**
+ * The magic number at the start of each serialized rule set ("APNC").
+ */
+#define APN_SER_MAGIC		0x41504e43U
+
+/**
+ * The version of the serialization format. Increase this if the
+ * format or any of the structures involved change.
+ */
+#define APN_SER_VERSION		1
+
+/**
+ * The value used instead of a string length for NULL strings.
+ */
+#define APN_SER_NULLSTR		0xffffffffU
+
+/**
+ * The header of a serialized rule set.
+ */
+struct apn_ser_header {
+	u_int32_t	magic;		/**< APN_SER_MAGIC */
+	u_int32_t	version;	/**< APN_SER_VERSION */
+	u_int32_t	parser;		/**< apn_parser_version() */
+	u_int32_t	len;		/**< Payload length in bytes. */
+	u_int32_t	crc;		/**< CRC32 of the payload. */
+};
+
+/**
+ * A growable output buffer. The first error is recorded in the
+ * error field and all further writes are ignored.
+ */
+struct apn_serbuf {
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+	int		 error;
+};
+
+/**
+ * A bounds checked input buffer. The first error is recorded in the
+ * error field. All further reads return zero.
+ */
+struct apn_unserbuf {
+	const char	*buf;
+	size_t		 len;
+	size_t		 off;
+	int		 error;
+};
+
+static void	 ser_rule(struct apn_serbuf *, struct apn_rule *);
+static struct apn_rule	*unser_rule(struct apn_unserbuf *, int);
+
+static void
+ser_put(struct apn_serbuf *sb, const void *data, size_t len)
+{
+	char	*nbuf;
+	size_t	 nsize;
+
+	if (sb->error)
+		return;
+	if (sb->len + len > sb->size) {
+		nsize = sb->size ? sb->size : 1024;
+		while (nsize < sb->len + len)
+			nsize *= 2;
+		nbuf = realloc(sb->buf, nsize);
+		if (nbuf == NULL) {
+			sb->error = -ENOMEM;
+			return;
+		}
+		sb->buf = nbuf;
+		sb->size = nsize;
+	}
+	memcpy(sb->buf + sb->len, data, len);
+	sb->len += len;
+}
+
+static void
+ser_put32(struct apn_serbuf *sb, u_int32_t val)
+{
+	ser_put(sb, &val, sizeof(val));
+}
+
+static void
+ser_put64(struct apn_serbuf *sb, u_int64_t val)
+{
+	ser_put(sb, &val, sizeof(val));
+}
+
+static void
+ser_putstr(struct apn_serbuf *sb, const char *str)
+{
+	u_int32_t	len;
+
+	if (str == NULL) {
+		ser_put32(sb, APN_SER_NULLSTR);
+		return;
+	}
+	len = strlen(str);
+	ser_put32(sb, len);
+	ser_put(sb, str, len);
+}
+
+static void
+ser_subject(struct apn_serbuf *sb, const struct apn_subject *subject)
+{
+	ser_put32(sb, subject->type);
+	switch (subject->type) {
+	case APN_CS_KEY:
+		ser_putstr(sb, subject->value.keyid);
+		break;
+	case APN_CS_UID:
+		ser_put32(sb, subject->value.uid);
+		break;
+	}
+}
+
+static void
+ser_apps(struct apn_serbuf *sb, struct apn_app *apps)
+{
+	struct apn_app	*app;
+	u_int32_t	 cnt = 0;
+
+	for (app = apps; app; app = app->next)
+		cnt++;
+	ser_put32(sb, cnt);
+	for (app = apps; app; app = app->next) {
+		ser_putstr(sb, app->name);
+		ser_subject(sb, &app->subject);
+	}
+}
+
+static void
+ser_hosts(struct apn_serbuf *sb, struct apn_host *hosts)
+{
+	struct apn_host	*host;
+	u_int32_t	 cnt = 0;
+
+	for (host = hosts; host; host = host->next)
+		cnt++;
+	ser_put32(sb, cnt);
+	for (host = hosts; host; host = host->next) {
+		ser_put32(sb, host->addr.af);
+		ser_put32(sb, host->addr.len);
+		ser_put(sb, host->addr.apa.addr8, sizeof(host->addr.apa));
+		ser_put32(sb, host->negate);
+	}
+}
+
+static void
+ser_ports(struct apn_serbuf *sb, struct apn_port *ports)
+{
+	struct apn_port	*port;
+	u_int32_t	 cnt = 0;
+
+	for (port = ports; port; port = port->next)
+		cnt++;
+	ser_put32(sb, cnt);
+	for (port = ports; port; port = port->next) {
+		ser_put32(sb, port->port);
+		ser_put32(sb, port->port2);
+	}
+}
+
+static void
+ser_default(struct apn_serbuf *sb, const struct apn_default *def)
+{
+	ser_put32(sb, def->action);
+	ser_put32(sb, def->log);
+}
+
+static void
+ser_chain(struct apn_serbuf *sb, struct apn_chain *chain)
+{
+	struct apn_rule	*rule;
+	u_int32_t	 cnt = 0;
+
+	TAILQ_FOREACH(rule, chain, entry)
+		cnt++;
+	ser_put32(sb, cnt);
+	TAILQ_FOREACH(rule, chain, entry)
+		ser_rule(sb, rule);
+}
+
+static void
+ser_rule(struct apn_serbuf *sb, struct apn_rule *rule)
+{
+	ser_put32(sb, rule->apn_type);
+	ser_put32(sb, rule->apn_id);
+	ser_put32(sb, rule->flags);
+	if (rule->scope) {
+		ser_put32(sb, 1);
+		ser_put64(sb, rule->scope->timeout);
+		ser_put64(sb, rule->scope->task);
+	} else {
+		ser_put32(sb, 0);
+	}
+	ser_apps(sb, rule->app);
+	switch (rule->apn_type) {
+	case APN_ALF:
+	case APN_SFS:
+	case APN_SB:
+	case APN_CTX:
+		ser_chain(sb, &rule->rule.chain);
+		break;
+	case APN_ALF_FILTER:
+		ser_put32(sb, rule->rule.afilt.action);
+		ser_put32(sb, rule->rule.afilt.filtspec.log);
+		ser_put32(sb, rule->rule.afilt.filtspec.proto);
+		ser_put32(sb, rule->rule.afilt.filtspec.netaccess);
+		ser_hosts(sb, rule->rule.afilt.filtspec.fromhost);
+		ser_ports(sb, rule->rule.afilt.filtspec.fromport);
+		ser_hosts(sb, rule->rule.afilt.filtspec.tohost);
+		ser_ports(sb, rule->rule.afilt.filtspec.toport);
+		break;
+	case APN_ALF_CAPABILITY:
+		ser_put32(sb, rule->rule.acap.action);
+		ser_put32(sb, rule->rule.acap.log);
+		ser_put32(sb, rule->rule.acap.capability);
+		break;
+	case APN_DEFAULT:
+		ser_default(sb, &rule->rule.apndefault);
+		break;
+	case APN_CTX_RULE:
+		ser_apps(sb, rule->rule.apncontext.application);
+		ser_put32(sb, rule->rule.apncontext.type);
+		break;
+	case APN_SFS_ACCESS:
+		ser_putstr(sb, rule->rule.sfsaccess.path);
+		ser_subject(sb, &rule->rule.sfsaccess.subject);
+		ser_default(sb, &rule->rule.sfsaccess.valid);
+		ser_default(sb, &rule->rule.sfsaccess.invalid);
+		ser_default(sb, &rule->rule.sfsaccess.unknown);
+		break;
+	case APN_SFS_DEFAULT:
+		ser_putstr(sb, rule->rule.sfsdefault.path);
+		ser_put32(sb, rule->rule.sfsdefault.log);
+		ser_put32(sb, rule->rule.sfsdefault.action);
+		break;
+	case APN_SB_ACCESS:
+		ser_putstr(sb, rule->rule.sbaccess.path);
+		ser_subject(sb, &rule->rule.sbaccess.cs);
+		ser_put32(sb, rule->rule.sbaccess.amask);
+		ser_put32(sb, rule->rule.sbaccess.log);
+		ser_put32(sb, rule->rule.sbaccess.action);
+		break;
+	default:
+		sb->error = -EINVAL;
+		break;
+	}
+}
+
+/**
+ * Serialize a rule set into a newly allocated memory buffer. The
+ * rule set itself is not modified. Error messages stored in the
+ * rule set are not part of the image.
+ *
+ * @param rs The rule set.
+ * @param bufp The address of the new buffer is stored here. The caller
+ *     must free the buffer.
+ * @param lenp The length of the buffer is stored here.
+ * @return Zero in case of success or a negative error code.
+ */
+int
+apn_serialize_ruleset(struct apn_ruleset *rs, void **bufp, size_t *lenp)
+{
+	struct apn_serbuf	 sb;
+	struct apn_ser_header	 hdr;
+
+	if (rs == NULL || bufp == NULL || lenp == NULL)
+		return -EINVAL;
+	sb.buf = NULL;
+	sb.len = sb.size = 0;
+	sb.error = 0;
+	/* Reserve space for the header. It is filled in below. */
+	memset(&hdr, 0, sizeof(hdr));
+	ser_put(&sb, &hdr, sizeof(hdr));
+	ser_put32(&sb, rs->flags);
+	ser_put32(&sb, rs->version);
+	ser_put32(&sb, rs->maxid);
+	ser_chain(&sb, &rs->alf_queue);
+	ser_chain(&sb, &rs->sfs_queue);
+	ser_chain(&sb, &rs->sb_queue);
+	ser_chain(&sb, &rs->ctx_queue);
+	if (sb.error == 0 && sb.len - sizeof(hdr) > 0xffffffffU)
+		sb.error = -EFBIG;
+	if (sb.error) {
+		free(sb.buf);
+		return sb.error;
+	}
+	hdr.magic = APN_SER_MAGIC;
+	hdr.version = APN_SER_VERSION;
+	hdr.parser = apn_parser_version();
+	hdr.len = sb.len - sizeof(hdr);
+	hdr.crc = anoubis_crc32_update(ANOUBIS_CRC32_INIT,
+	    sb.buf + sizeof(hdr), hdr.len);
+	memcpy(sb.buf, &hdr, sizeof(hdr));
+	(*bufp) = sb.buf;
+	(*lenp) = sb.len;
+	return 0;
+}
+
+static void
+unser_get(struct apn_unserbuf *ub, void *data, size_t len)
+{
+	if (ub->error == 0 && ub->len - ub->off < len)
+		ub->error = -EINVAL;
+	if (ub->error) {
+		memset(data, 0, len);
+		return;
+	}
+	memcpy(data, ub->buf + ub->off, len);
+	ub->off += len;
+}
+
+static u_int32_t
+unser_get32(struct apn_unserbuf *ub)
+{
+	u_int32_t	val;
+
+	unser_get(ub, &val, sizeof(val));
+	return val;
+}
+
+static u_int64_t
+unser_get64(struct apn_unserbuf *ub)
+{
+	u_int64_t	val;
+
+	unser_get(ub, &val, sizeof(val));
+	return val;
+}
+
+/*
+ * Return a newly allocated copy of the next string in the buffer.
+ * NULL is returned for a NULL string and in case of an error.
+ */
+static char *
+unser_getstr(struct apn_unserbuf *ub)
+{
+	u_int32_t	 len = unser_get32(ub);
+	char		*str;
+
+	if (ub->error || len == APN_SER_NULLSTR)
+		return NULL;
+	if (ub->len - ub->off < len) {
+		ub->error = -EINVAL;
+		return NULL;
+	}
+	if ((str = malloc(len + 1)) == NULL) {
+		ub->error = -ENOMEM;
+		return NULL;
+	}
+	memcpy(str, ub->buf + ub->off, len);
+	str[len] = 0;
+	ub->off += len;
+	return str;
+}
+
+static void
+unser_subject(struct apn_unserbuf *ub, struct apn_subject *subject)
+{
+	subject->type = unser_get32(ub);
+	switch (subject->type) {
+	case APN_CS_KEY:
+		subject->value.keyid = unser_getstr(ub);
+		break;
+	case APN_CS_UID:
+		subject->value.uid = unser_get32(ub);
+		break;
+	}
+}
+
+static struct apn_app *
+unser_apps(struct apn_unserbuf *ub)
+{
+	struct apn_app	*head = NULL, **tailp = &head, *app;
+	u_int32_t	 i, cnt = unser_get32(ub);
+
+	for (i = 0; i < cnt && ub->error == 0; ++i) {
+		if ((app = calloc(1, sizeof(struct apn_app))) == NULL) {
+			ub->error = -ENOMEM;
+			break;
+		}
+		(*tailp) = app;
+		tailp = &app->next;
+		app->name = unser_getstr(ub);
+		unser_subject(ub, &app->subject);
+	}
+	return head;
+}
+
+static struct apn_host *
+unser_hosts(struct apn_unserbuf *ub)
+{
+	struct apn_host	*head = NULL, **tailp = &head, *host;
+	u_int32_t	 i, cnt = unser_get32(ub);
+
+	for (i = 0; i < cnt && ub->error == 0; ++i) {
+		if ((host = calloc(1, sizeof(struct apn_host))) == NULL) {
+			ub->error = -ENOMEM;
+			break;
+		}
+		(*tailp) = host;
+		tailp = &host->next;
+		host->addr.af = unser_get32(ub);
+		host->addr.len = unser_get32(ub);
+		unser_get(ub, host->addr.apa.addr8, sizeof(host->addr.apa));
+		host->negate = unser_get32(ub);
+	}
+	return head;
+}
+
+static struct apn_port *
+unser_ports(struct apn_unserbuf *ub)
+{
+	struct apn_port	*head = NULL, **tailp = &head, *port;
+	u_int32_t	 i, cnt = unser_get32(ub);
+
+	for (i = 0; i < cnt && ub->error == 0; ++i) {
+		if ((port = calloc(1, sizeof(struct apn_port))) == NULL) {
+			ub->error = -ENOMEM;
+			break;
+		}
+		(*tailp) = port;
+		tailp = &port->next;
+		port->port = unser_get32(ub);
+		port->port2 = unser_get32(ub);
+	}
+	return head;
+}
+
+static void
+unser_default(struct apn_unserbuf *ub, struct apn_default *def)
+{
+	def->action = unser_get32(ub);
+	def->log = unser_get32(ub);
+}
+
+/*
+ * Read the rules of a chain. Only non-chain rules are allowed in
+ * a chain, i.e. there is no unbounded recursion.
+ */
+static void
+unser_chain(struct apn_unserbuf *ub, struct apn_chain *chain)
+{
+	struct apn_rule	*rule;
+	u_int32_t	 i, cnt = unser_get32(ub);
+
+	for (i = 0; i < cnt && ub->error == 0; ++i) {
+		if ((rule = unser_rule(ub, 0)) == NULL)
+			break;
+		TAILQ_INSERT_TAIL(chain, rule, entry);
+		rule->pchain = chain;
+	}
+}
+
+/*
+ * Read a single rule. Chain rules are only accepted if toplevel is
+ * true, all other rules only if toplevel is false. The rule is not
+ * linked into any chain or ID tree. Returns NULL in case of an error.
+ */
+static struct apn_rule *
+unser_rule(struct apn_unserbuf *ub, int toplevel)
+{
+	struct apn_rule	*rule;
+	u_int32_t	 type;
+
+	type = unser_get32(ub);
+	if (ub->error)
+		return NULL;
+	switch (type) {
+	case APN_ALF:
+	case APN_SFS:
+	case APN_SB:
+	case APN_CTX:
+		if (!toplevel)
+			goto invalid;
+		break;
+	case APN_ALF_FILTER:
+	case APN_ALF_CAPABILITY:
+	case APN_DEFAULT:
+	case APN_CTX_RULE:
+	case APN_SFS_ACCESS:
+	case APN_SFS_DEFAULT:
+	case APN_SB_ACCESS:
+		if (toplevel)
+			goto invalid;
+		break;
+	default:
+		goto invalid;
+	}
+	if ((rule = calloc(1, sizeof(struct apn_rule))) == NULL) {
+		ub->error = -ENOMEM;
+		return NULL;
+	}
+	rule->apn_type = type;
+	if (toplevel)
+		TAILQ_INIT(&rule->rule.chain);
+	rule->apn_id = unser_get32(ub);
+	rule->flags = unser_get32(ub);
+	if (unser_get32(ub)) {
+		rule->scope = calloc(1, sizeof(struct apn_scope));
+		if (rule->scope == NULL) {
+			ub->error = -ENOMEM;
+			goto err;
+		}
+		rule->scope->timeout = unser_get64(ub);
+		rule->scope->task = unser_get64(ub);
+	}
+	rule->app = unser_apps(ub);
+	switch (type) {
+	case APN_ALF:
+	case APN_SFS:
+	case APN_SB:
+	case APN_CTX:
+		unser_chain(ub, &rule->rule.chain);
+		break;
+	case APN_ALF_FILTER:
+		rule->rule.afilt.action = unser_get32(ub);
+		rule->rule.afilt.filtspec.log = unser_get32(ub);
+		rule->rule.afilt.filtspec.proto = unser_get32(ub);
+		rule->rule.afilt.filtspec.netaccess = unser_get32(ub);
+		rule->rule.afilt.filtspec.fromhost = unser_hosts(ub);
+		rule->rule.afilt.filtspec.fromport = unser_ports(ub);
+		rule->rule.afilt.filtspec.tohost = unser_hosts(ub);
+		rule->rule.afilt.filtspec.toport = unser_ports(ub);
+		break;
+	case APN_ALF_CAPABILITY:
+		rule->rule.acap.action = unser_get32(ub);
+		rule->rule.acap.log = unser_get32(ub);
+		rule->rule.acap.capability = unser_get32(ub);
+		break;
+	case APN_DEFAULT:
+		unser_default(ub, &rule->rule.apndefault);
+		break;
+	case APN_CTX_RULE:
+		rule->rule.apncontext.application = unser_apps(ub);
+		rule->rule.apncontext.type = unser_get32(ub);
+		break;
+	case APN_SFS_ACCESS:
+		rule->rule.sfsaccess.path = unser_getstr(ub);
+		unser_subject(ub, &rule->rule.sfsaccess.subject);
+		unser_default(ub, &rule->rule.sfsaccess.valid);
+		unser_default(ub, &rule->rule.sfsaccess.invalid);
+		unser_default(ub, &rule->rule.sfsaccess.unknown);
+		break;
+	case APN_SFS_DEFAULT:
+		rule->rule.sfsdefault.path = unser_getstr(ub);
+		rule->rule.sfsdefault.log = unser_get32(ub);
+		rule->rule.sfsdefault.action = unser_get32(ub);
+		break;
+	case APN_SB_ACCESS:
+		rule->rule.sbaccess.path = unser_getstr(ub);
+		unser_subject(ub, &rule->rule.sbaccess.cs);
+		rule->rule.sbaccess.amask = unser_get32(ub);
+		rule->rule.sbaccess.log = unser_get32(ub);
+		rule->rule.sbaccess.action = unser_get32(ub);
+		break;
+	}
+	if (ub->error == 0)
+		return rule;
+err:
+	apn_free_one_rule(rule, NULL);
+	return NULL;
+invalid:
+	ub->error = -EINVAL;
+	return NULL;
+}
+
+/*
+ * Read the blocks of one of the toplevel queues of a rule set and
+ * add them to the rule set. The rule IDs are entered into the ID tree
+ * of the rule set in the process.
+ */
+static void
+unser_queue(struct apn_unserbuf *ub, struct apn_ruleset *rs, int type,
+    int (*add)(struct apn_ruleset *, struct apn_rule *, const char *, int))
+{
+	struct apn_rule	*block;
+	u_int32_t	 i, cnt = unser_get32(ub);
+
+	for (i = 0; i < cnt && ub->error == 0; ++i) {
+		if ((block = unser_rule(ub, 1)) == NULL)
+			break;
+		if (block->apn_type != type || add(rs, block, NULL, 0) != 0) {
+			apn_free_one_rule(block, NULL);
+			ub->error = -EINVAL;
+		}
+	}
+}
+
+/**
+ * Create a rule set from a buffer that was filled by
+ * apn_serialize_ruleset. The buffer is verified before it is used, i.e.
+ * images from an older version of the library or the parser, truncated
+ * and otherwise corrupted images are rejected.
+ *
+ * @param buf The buffer.
+ * @param len The length of the buffer.
+ * @param rsp The new rule set is returned here. The caller must free it
+ *     with apn_free_ruleset. The destructor of the rule set is NULL.
+ * @return Zero in case of success or a negative error code. The
+ *     error code is -EINVAL if the buffer does not contain a valid image.
+ */
+int
+apn_unserialize_ruleset(const void *buf, size_t len,
+    struct apn_ruleset **rsp)
+{
+	struct apn_unserbuf	 ub;
+	struct apn_ser_header	 hdr;
+	struct apn_ruleset	*rs;
+	unsigned int		 maxid;
+
+	if (buf == NULL || rsp == NULL)
+		return -EINVAL;
+	(*rsp) = NULL;
+	if (len < sizeof(hdr))
+		return -EINVAL;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != APN_SER_MAGIC || hdr.version != APN_SER_VERSION
+	    || hdr.parser != (u_int32_t)apn_parser_version()
+	    || hdr.len != len - sizeof(hdr))
+		return -EINVAL;
+	ub.buf = (const char *)buf + sizeof(hdr);
+	ub.len = hdr.len;
+	ub.off = 0;
+	ub.error = 0;
+	if (anoubis_crc32_update(ANOUBIS_CRC32_INIT, ub.buf, ub.len) != hdr.crc)
+		return -EINVAL;
+
+	if ((rs = calloc(sizeof(struct apn_ruleset), 1)) == NULL)
+		return -ENOMEM;
+	TAILQ_INIT(&rs->alf_queue);
+	TAILQ_INIT(&rs->sfs_queue);
+	TAILQ_INIT(&rs->sb_queue);
+	TAILQ_INIT(&rs->ctx_queue);
+	TAILQ_INIT(&rs->err_queue);
+	rs->flags = unser_get32(&ub);
+	rs->version = unser_get32(&ub);
+	maxid = unser_get32(&ub);
+	rs->maxid = 1;
+	rs->idtree = NULL;
+	rs->destructor = NULL;
+	unser_queue(&ub, rs, APN_ALF, &apn_add_alfblock);
+	unser_queue(&ub, rs, APN_SFS, &apn_add_sfsblock);
+	unser_queue(&ub, rs, APN_SB, &apn_add_sbblock);
+	unser_queue(&ub, rs, APN_CTX, &apn_add_ctxblock);
+	if (ub.error == 0 && ub.off != ub.len)
+		ub.error = -EINVAL;
+	if (ub.error) {
+		apn_free_ruleset(rs);
+		return ub.error;
+	}
+	if (maxid > rs->maxid)
+		rs->maxid = maxid;
+	(*rsp) = rs;
+	return 0;
+}
@@ -165,6 +165,14 @@ struct achat_channel {
 	 * acc_flush() again.
 	 */
 	struct event		*event;
+
+	/**
+	 * Cork-count of the channel.
+	 * While this is non-zero, messages are only appended to the
+	 * output-buffer. The output-buffer is flushed with a single
+	 * write when the last acc_uncork() is called.
+	 */
+	int			corked;
 };
 
 __BEGIN_DECLS
@@ -189,7 +197,10 @@ achat_rc acc_getpeerids(struct achat_channel *);
 
 /* Subsystem Transmission */
 achat_rc acc_sendmsg(struct achat_channel *, const char *, size_t);
+achat_rc acc_cork(struct achat_channel *);
+achat_rc acc_uncork(struct achat_channel *);
 achat_rc acc_receivemsg(struct achat_channel *, char *, size_t *);
+achat_rc acc_receivemsg_view(struct achat_channel *, const char **, size_t *);
 achat_rc acc_flush(struct achat_channel *);
 
 __END_DECLS
@@ -64,6 +64,7 @@ struct anoubis_csmulti_request {
 	int						 idlen;
 	struct anoubis_msg				*reply_msg;
 	struct anoubis_client				*client;
+	unsigned int					 inflight;
 	struct anoubis_csmulti_record			*last;
 	TAILQ_HEAD(, anoubis_csmulti_record)		 reqs;
 };
@@ -202,6 +203,36 @@ struct anoubis_transaction *
 anoubis_client_csmulti_start(struct anoubis_client *client,
     struct anoubis_csmulti_request *request);
 
+/**
+ * Set the number of CSMULTI transactions that may be in flight at the
+ * same time (the default is one). A new transaction for the same or for
+ * a different request can be started before the previous transactions
+ * are complete as long as the window is not full. This only has an
+ * effect if the server supports pipelined CSMULTI requests (protocol
+ * version 9 or later).
+ *
+ * @param client The protocol client object.
+ * @param window The new window size. It is limited to the range from
+ *     one to ANOUBIS_CSMULTI_MAXWINDOW.
+ * @return The window size that is actually used.
+ */
+int anoubis_client_csmulti_window(struct anoubis_client *client, int window);
+
+/**
+ * Process a multi checksum request synchronously. The records of the
+ * request are sent in as many CSMULTI transactions as necessary. Up to
+ * window (see anoubis_client_csmulti_window) of these transactions
+ * are in flight at the same time.
+ *
+ * @param client The protocol client object for the request.
+ * @param request The anoubis_csmulti_request structure.
+ * @return Zero if all records were answered, a negative error code
+ *     if an error occured. Errors for individual records are stored
+ *     in the records.
+ */
+int anoubis_client_csmulti(struct anoubis_client *client,
+    struct anoubis_csmulti_request *request);
+
 /**
  * Request a list from the daemon. Possible lists are a list of all
  * playgrounds, a list of all files in a particular playground or a
@@ -259,6 +290,31 @@ struct anoubis_transaction *anoubis_client_pgunlink_start(
  */
 const char **anoubis_client_parse_pgcommit_reply(struct anoubis_msg *m);
 
+/**
+ * Extract the per scanner latency report from the reply message to
+ * a commit request. The report consists of one line per scanner that
+ * was configured for the commit. See ANOUBIS_PGCOMMIT_LATENCY for
+ * the format of the individual lines.
+ *
+ * @param m The (single) reply message.
+ * @return A malloced NUL-terminated copy of the report without the
+ *     leading ANOUBIS_PGCOMMIT_LATENCY tag. The caller must free the
+ *     string. NULL if the message does not contain a latency report
+ *     or if memory allocation failed.
+ */
+char *anoubis_client_parse_pgcommit_latency(struct anoubis_msg *m);
+
+/**
+ * Return the playground statistics that follow the path name in
+ * a playground list record.
+ *
+ * @param rec The playground list record. The record must be verified.
+ * @return A pointer to the statistics within the record or NULL if
+ *     the record does not contain statistics.
+ */
+const Anoubis_PgStatsRecord *anoubis_client_pginfo_stats(
+    const Anoubis_PgInfoRecord *rec);
+
 __END_DECLS
 
 #endif
@@ -29,12 +29,28 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/cdefs.h>
 
 static const uint32_t	POLY = 0x04C11DB7;
 
+/**
+ * The initial value of a CRC32 checksum.
+ */
+#define ANOUBIS_CRC32_INIT	0xFFFFFFFFU
+
+__BEGIN_DECLS
+uint32_t	anoubis_crc32_update(uint32_t crc, const void *buf, size_t len);
+__END_DECLS
+
+/*
+ * Bitwise reference implementation of the checksum. It is slow and
+ * only kept for the benefit of the unit tests, all other users should
+ * use the table driven implementation (anoubis_crc32_update).
+ */
+/*@unused@*/
 static inline uint32_t _crc32_do(unsigned char * buf, int len)
 {
-	uint32_t	sum = 0xFFFFFFFFUL;
+	uint32_t	sum = ANOUBIS_CRC32_INIT;
 	int i;
 
 	for (i=0; i<len; buf++,i++) {
@@ -54,20 +70,22 @@ static inline uint32_t _crc32_do(unsigned char * buf, int len)
 /*@unused@*/
 static inline uint32_t crc32_get(void * buf, int len)
 {
-	return _crc32_do(buf, len);
+	if (len <= 0)
+		return ANOUBIS_CRC32_INIT;
+	return anoubis_crc32_update(ANOUBIS_CRC32_INIT, buf, len);
 }
 
 /*@unused@*/
 static inline int crc32_check(void * buf, int len)
 {
-	return _crc32_do(buf, len) == 0;
+	return crc32_get(buf, len) == 0;
 }
 
 /*@unused@*/
 static inline void crc32_set(void * _buf, int len)
 {
 	unsigned char * buf = _buf;
-	unsigned long sum = _crc32_do(buf, len-4);
+	unsigned long sum = crc32_get(buf, len-4);
 	int i;
 	buf += len-4;
 	for (i=3; i>=0; i--) {
@@ -49,11 +49,43 @@ struct sfs_entry {
 	struct sfs_entry	*next;
 };
 
+/**
+ * A single file in a batch checksum calculation
+ * (see anoubis_csum_calc_batch).
+ */
+struct anoubis_csum_request {
+	/**
+	 * The path name of the file (input).
+	 */
+	const char		*path;
+
+	/**
+	 * True if symbolic links should be handled like
+	 * anoubis_csum_link_calc does (input).
+	 */
+	int			 link;
+
+	/**
+	 * The buffer for the checksum (input) and its length. The
+	 * length is updated with the length of the checksum (output).
+	 */
+	u_int8_t		*csum;
+	int			 cslen;
+
+	/**
+	 * Zero if the checksum was calculated, a negative error
+	 * code otherwise (output).
+	 */
+	int			 error;
+};
+
 __BEGIN_DECLS
 
 int	  anoubis_csum_calc(const char *file, u_int8_t *cs, int *cslen);
 int	  anoubis_csum_link_calc(const char *link, u_int8_t *csbuf,
     int *cslen);
+int	  anoubis_csum_calc_batch(struct anoubis_csum_request *reqs,
+    int cnt, int nthreads);
 char	**anoubis_csum_list(struct anoubis_msg *m, int *listcnt);
 int	  anoubis_print_checksum(FILE *fd, unsigned char *checksum, int len);
 int	  anoubis_print_keyid(FILE *fd, unsigned char *key, int len);
@@ -168,6 +168,8 @@ int anoubis_extract_sig_type(const struct anoubis_msg *m, int type,
     const void **data);
 
 int anoubis_msg_send(struct achat_channel * chan, struct anoubis_msg * m);
+int anoubis_msg_send_prepared(struct achat_channel * chan,
+    const struct anoubis_msg * m);
 __END_DECLS
 
 #endif
@@ -53,6 +53,16 @@ int anoubis_policy_comm_addrequest(struct anoubis_policy_comm *comm,
     anoubis_policy_reply_callback_t callback,
     anoubis_policy_comm_dispatcher_t dispatch, void *cbdata, u_int64_t *tokenp);
 
+/**
+ * Add a pipelined request. The request consists of a single message
+ * and can be added even if other requests of the same channel are
+ * still waiting for their reply. At most ANOUBIS_CSMULTI_MAXWINDOW
+ * requests can be pending per channel.
+ */
+int anoubis_policy_comm_addpipelined(struct anoubis_policy_comm *comm,
+    struct achat_channel *chan, anoubis_policy_reply_callback_t callback,
+    anoubis_policy_comm_dispatcher_t dispatch, void *cbdata, u_int64_t *tokenp);
+
 int anoubis_policy_comm_answer(struct anoubis_policy_comm * comm,
     u_int64_t token, int error, const void * data, int len, int end);
 
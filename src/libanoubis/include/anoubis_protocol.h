@@ -47,9 +47,10 @@
  *     Version 6: Add Playground and file browser messages
  *     Version 7: Add Playground-unlink message
  *     Version 8: Add cmd to Anoubis_PgChange message
+ *     Version 9: Pipelined CSMULTI requests, multi-message CSMULTI replies
  */
-#define ANOUBIS_PROTO_VERSION		8
-#define ANOUBIS_PROTO_MINVERSION	8
+#define ANOUBIS_PROTO_VERSION		9
+#define ANOUBIS_PROTO_MINVERSION	9
 
 #define ANOUBIS_PROTO_CONNECT		0
 #define ANOUBIS_PROTO_POLICY		1
@@ -218,6 +219,37 @@ static inline u_int64_t __ntohll(u_int64_t arg)
 #define ANOUBIS_STATUS_UPGRADE		0x1000UL
 		/* Upgrade end. Value: Number of upgraded files */
 
+/*
+ * Statistics that the daemon appends to the statistics of the kernel
+ * (ANOUBIS_SOURCE_STAT messages). The subsystem of these values is
+ * ANOUBIS_STAT_SUBSYS_SFSCACHE or ANOUBIS_STAT_SUBSYS_MASTER. Clients
+ * should ignore keys that they do not understand.
+ */
+#define ANOUBIS_STAT_SUBSYS_SFSCACHE	0x1000UL
+#define ANOUBIS_STAT_SFSCACHE_HITS	1	/* Cache hits */
+#define ANOUBIS_STAT_SFSCACHE_MISSES	2	/* On-disk lookups */
+#define ANOUBIS_STAT_SFSCACHE_EVICTIONS	3	/* Entries evicted */
+#define ANOUBIS_STAT_SFSCACHE_ENTRIES	4	/* Current entries */
+#define ANOUBIS_STAT_SFSCACHE_BYTES	5	/* Current memory usage */
+#define ANOUBIS_STAT_SFSCACHE_LIMIT	6	/* Memory limit */
+#define ANOUBIS_STAT_SFSCACHE_FILTERED	7	/* Negative lookup filter */
+
+/*
+ * Event and message transfer statistics of the master process. The
+ * histogram keys are followed by one key per bucket: Bucket i counts
+ * batches with 2^i up to 2^(i+1)-1 entries.
+ */
+#define ANOUBIS_STAT_SUBSYS_MASTER	0x1001UL
+#define ANOUBIS_STAT_MASTER_EVREADS	1	/* Event device reads */
+#define ANOUBIS_STAT_MASTER_EVENTS	2	/* Events read */
+#define ANOUBIS_STAT_MASTER_REPLYWRITES	3	/* Event device writes */
+#define ANOUBIS_STAT_MASTER_REPLIES	4	/* Replies written */
+#define ANOUBIS_STAT_MASTER_MSGWRITES	5	/* Writes to daemon pipes */
+#define ANOUBIS_STAT_MASTER_MSGS	6	/* Messages written to pipes */
+#define ANOUBIS_STAT_MASTER_EVBATCH	0x100	/* Events per wakeup */
+#define ANOUBIS_STAT_MASTER_REPLYBATCH	0x200	/* Replies per write */
+#define ANOUBIS_STAT_MASTER_MSGBATCH	0x300	/* Messages per write */
+
 /*
  * Playground operations for the pgop filed in AnoubisPgChange messages.
  * Clients should ignore message types that they do not understand.
@@ -520,12 +552,24 @@ typedef	struct {
 	 */
 } __attribute__((packed)) Anoubis_CSMultiRequestRecord;
 
+/**
+ * The maximum number of CSMulti requests that a client can send before
+ * it received the complete reply to the first of them. The daemon
+ * answers CSMulti requests of a connection in the order in which they
+ * were received.
+ */
+#define ANOUBIS_CSMULTI_MAXWINDOW	8
+
 /**
  * A reply to a CSMulti request. This message contains the answer to
- * one or more requests from the daemon. The daemon can answer a request
- * with EAGAIN. In this case the client must retry the request. This
- * can happen if the resulting message would otherwise be larger than
- * the limit imposed by the daemon.
+ * one or more requests from the daemon. The daemon answers each request
+ * record exactly once. If all the answers do not fit into a single
+ * message, the daemon sends several reply messages. The reply is
+ * complete if all request records are answered or if a reply message
+ * reports an error for the whole request.
+ *
+ * The daemon can answer a request record with EAGAIN. In this case
+ * the client must retry the request.
  *
  * - type  ANOUBIS_P_CSMULTI_REPLY
  * - operation  Repeats the operation from the request.
@@ -562,9 +606,7 @@ struct anoubis_csentry {
  * length  The total length of the record.
  * index  The index copied from the request record. This reply record
  *    answers the request in the corresponding request record. The daemon
- *    will answer replies in the order given by the client but the it
- *    is possible that not all request are answered. The client must
- *    resend those request.
+ *    will answer replies in the order given by the client.
  * error  An error code for this request. If the error code is non-zero
  *    the payload is empty.
  * payload  Is empty if error is non-zero or if the operation in the reply
@@ -694,6 +736,18 @@ typedef struct {
 	char	    payload[0];
 } __attribute__((packed)) Anoubis_PgCommitMessage;
 
+/**
+ * The reply to an ANOUBIS_P_PGCOMMIT request is an Anoubis_AckPayloadMessage.
+ * Its payload starts with pairs of NUL-terminated strings (scanner
+ * description and scanner output) for each scanner that rejected the file.
+ * The pairs are optionally followed by a latency report that starts with
+ * ANOUBIS_PGCOMMIT_LATENCY and is _not_ NUL-terminated. This keeps the
+ * report invisible to clients that only look for NUL-terminated strings.
+ * The report has one line per scanner of the form
+ *     <milliseconds> <ok|failed|aborted|cached> <description>\n
+ */
+#define ANOUBIS_PGCOMMIT_LATENCY	"latency:\n"
+
 /**
  * This message is send by the client to ask the daemon to unlink a file.
  * This operation does not really removes the file. It removes
@@ -749,6 +803,26 @@ typedef struct {
 	char			path[0];
 } __attribute__((packed)) Anoubis_PgInfoRecord;
 
+/**
+ * Statistics about a single playground. The daemon appends this
+ * structure to each Anoubis_PgInfoRecord. It starts at the first
+ * offset after the NUL byte that terminates the path that is a multiple
+ * of 8 (relative to the start of the record). Older daemons do not
+ * send the statistics, use anoubis_client_pginfo_stats to access them.
+ * Fields:
+ *
+ * nrevents The total number of playground file events (instantiate,
+ *     rename and delete) that the daemon has seen for this playground
+ *     since it was started.
+ * evrate The number of playground file events in the last full second.
+ * nrnames The total number of path names of all files in this playground.
+ */
+typedef struct {
+	u64n			nrevents;
+	u32n			evrate;
+	u32n			nrnames;
+} __attribute__((packed)) Anoubis_PgStatsRecord;
+
 /**
  * This structure contains information about a single file in the playground.
  * It is used in Anobuis_ListMessage replies. Fields:
@@ -396,6 +396,12 @@ int	apn_escalation_rule_sb(struct apn_chain *, struct apn_rule *,
 int	apn_escalation_rule_sfs(struct apn_chain *, struct apn_rule *,
 	    struct apn_default *, const char *, int);
 
+/*
+ * Binary images of parsed rule sets.
+ */
+int	apn_serialize_ruleset(struct apn_ruleset *, void **, size_t *);
+int	apn_unserialize_ruleset(const void *, size_t, struct apn_ruleset **);
+
 __END_DECLS
 
 #endif /* _APN_H_ */
@@ -115,6 +115,13 @@
  */
 #define PGCLI_OUTLEN_FILES 5
 
+/**
+ * Field width for the number of playground file events and the event
+ * rate (verbose output only).
+ */
+#define PGCLI_OUTLEN_EVENTS 8
+#define PGCLI_OUTLEN_RATE 5
+
 /**
  * Field width for time.
  */
@@ -819,6 +826,10 @@ pgcli_list_print_msg(struct anoubis_msg *message)
 	printf("%*s ", PGCLI_OUTLEN_USER, "USER");
 	printf("%*s ", PGCLI_OUTLEN_STAT, "STATUS");
 	printf("%*s ", PGCLI_OUTLEN_FILES, "FILES");
+	if (opts & PGCLI_OPT_VERBOSE) {
+		printf("%*s ", PGCLI_OUTLEN_EVENTS, "EVENTS");
+		printf("%*s ", PGCLI_OUTLEN_RATE, "EV/S");
+	}
 	printf("%*s ", PGCLI_OUTLEN_TIME, "TIME");
 	printf("%-*s\n", PGCLI_OUTLEN_COMMAND, "COMMAND");
 
@@ -853,6 +864,20 @@ pgcli_list_print_record(Anoubis_PgInfoRecord *record)
 	}
 
 	printf("%*d ", PGCLI_OUTLEN_FILES, get_value(record->nrfiles));
+	if (opts & PGCLI_OPT_VERBOSE) {
+		const Anoubis_PgStatsRecord	*stats;
+
+		stats = anoubis_client_pginfo_stats(record);
+		if (stats) {
+			printf("%*" PRIu64 " ", PGCLI_OUTLEN_EVENTS,
+			    get_value(stats->nrevents));
+			printf("%*u ", PGCLI_OUTLEN_RATE,
+			    get_value(stats->evrate));
+		} else {
+			printf("%*s ", PGCLI_OUTLEN_EVENTS, "-");
+			printf("%*s ", PGCLI_OUTLEN_RATE, "-");
+		}
+	}
 
 	/* Print time of creation. */
 	time = get_value(record->starttime);
@@ -1513,6 +1538,41 @@ pgcli_commit_show_scanresult(const char *file, struct anoubis_msg *m, int rc)
 	return 1;
 }
 
+/**
+ * Print the time that each playground scanner needed for the file
+ * to stderr. Nothing is printed if the daemon did not report any
+ * latencies.
+ *
+ * @param file The file we are trying to commit (for messages)
+ * @param m The result message of the commit transaction.
+ * @return None.
+ */
+static void
+pgcli_commit_show_latency(const char *file, struct anoubis_msg *m)
+{
+	char		*report, *line, *next, *status, *desc;
+
+	if (m == NULL)
+		return;
+	report = anoubis_client_parse_pgcommit_latency(m);
+	if (report == NULL)
+		return;
+	next = report;
+	while ((line = strsep(&next, "\n")) != NULL) {
+		status = strchr(line, ' ');
+		if (status == NULL)
+			continue;
+		*(status++) = 0;
+		desc = strchr(status, ' ');
+		if (desc == NULL)
+			continue;
+		*(desc++) = 0;
+		fprintf(stderr, "File %s: '%s' %s after %s ms\n", file, desc,
+		    status, line);
+	}
+	free(report);
+}
+
 /**
  * Commit one file, expects verified parameters.
  * This method will do the actual work to commit one file. It expects verified
@@ -1692,6 +1752,8 @@ pgcli_commit_file(struct anoubis_client *client, uint64_t pgid, uint64_t dev,
 	    (opts & PGCLI_OPT_IGNRECOMM));
 	free(abspath);
 	rc = anoubis_transaction_complete(client, transaction, &results);
+	if (opts & PGCLI_OPT_VERBOSE)
+		pgcli_commit_show_latency(errpath, results);
 	if (rc < 0) {
 		if (rc == -EAGAIN || rc == -EPERM)
 			rc = pgcli_commit_show_scanresult(errpath, results, rc);
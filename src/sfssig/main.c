@@ -52,6 +52,9 @@ static int	 sfs_export(char *, uid_t);
 static int	 sfs_import(char *, uid_t);
 static int	 sfs_tree(char *, int op, uid_t);
 static int	 sfs_add_tree(char *, int op, uid_t);
+static int	 sfs_add_queue(const char *, uid_t);
+static int	 sfs_add_flush(void);
+static void	 sfs_add_report(int);
 
 /* These are helper functions for the sfs commandos */
 static int	 _export(char *, FILE *, int, uid_t);
@@ -95,6 +98,32 @@ static char			*sfs_key = NULL;
 static struct sfs_request_tree	*req_tree = NULL;
 static int			 request_error = 0;
 
+/**
+ * The number of threads that calculate checksums for add operations
+ * (option -j). If this is zero, each checksum is calculated when the
+ * file is added. Otherwise files are queued and the checksums of all
+ * queued files are calculated in parallel once the queue is full.
+ */
+static int				 sfs_jobs = 0;
+
+/**
+ * The files that are queued for an add operation, their checksums
+ * and the number of queued files. All queued files use the same uid.
+ */
+static struct anoubis_csum_request	*sfs_addq = NULL;
+static u_int8_t				*sfs_addq_csum = NULL;
+static int				 sfs_addq_cnt = 0;
+static uid_t				 sfs_addq_uid = 0;
+
+/**
+ * Progress of the queued add operations: The number of files that
+ * were added, the number of files that were skipped due to errors and
+ * the start time of the first checksum calculation.
+ */
+static unsigned long			 sfs_addq_done = 0;
+static unsigned long			 sfs_addq_failed = 0;
+static struct timeval			 sfs_addq_start;
+
 struct sfs_request_tree	*filter_tree = NULL;
 unsigned int		 opts = 0;
 extern char		*__progname;
@@ -110,6 +139,7 @@ usage(void)
 	 */
 	fprintf(stderr, "usage: %s [-dvi]\n", __progname);
 	fprintf(stderr, "   [-r | --recursive]\n");
+	fprintf(stderr, "   [-j | --jobs <n>]\n");
 	fprintf(stderr, "   [-l | --link]\n");
 	fprintf(stderr, "   [-f <listfile> ]\n");
 	fprintf(stderr, "   [-o <exportfile>]\n");
@@ -212,6 +242,7 @@ main(int argc, char *argv[])
 	char		*sfs_command = NULL;
 	char		*sfs_cmdarg = NULL;
 	char		*linkfile = NULL;
+	const char	*errstr = NULL;
 	char		 linkpath[PATH_MAX];
 	char		 realarg[PATH_MAX];
 	char		**tmp_argv = NULL;
@@ -242,10 +273,11 @@ main(int argc, char *argv[])
 		{ "cert", required_argument, NULL, 'c' },
 		{ "key", required_argument, NULL, 'k' },
 		{ "uid", required_argument, NULL, 'u' },
+		{ "jobs", required_argument, NULL, 'j' },
 		{ 0, 0, 0, 0 }
 	};
 
-	while ((ch = getopt_long(argc, argv, "+A:URLCSf:c:k:u:o:nlidvr",
+	while ((ch = getopt_long(argc, argv, "+A:URLCSf:c:k:u:o:j:nlidvr",
 	    options, NULL)) != -1) {
 		/* No more options are allowed after a syssig option. */
 		if (syssigmode > 0)
@@ -295,6 +327,17 @@ main(int argc, char *argv[])
 				usage();
 			sfs_infile = optarg;
 			break;
+		case 'j':
+			assert(optarg);
+			if (sfs_jobs)
+				usage();
+			sfs_jobs = strtonum(optarg, 1, JOBS_MAX, &errstr);
+			if (errstr) {
+				fprintf(stderr, "Number of jobs is %s: %s\n",
+				    errstr, optarg);
+				return 1;
+			}
+			break;
 		case 'u':
 			assert(optarg);
 			if (got_uid)
@@ -578,6 +621,11 @@ main(int argc, char *argv[])
 				ret = error;
 		}
 	}
+	if (sfs_jobs) {
+		if (sfs_add_flush() != 0)
+			ret = 1;
+		sfs_add_report(1);
+	}
 
 	while((node = sfs_first_request(req_tree)) != NULL) {
 		if (process_a_request(node))
@@ -607,6 +655,11 @@ finish:
 	if (out_fd)
 		fclose(out_fd);
 
+	if (sfs_addq)
+		free(sfs_addq);
+	if (sfs_addq_csum)
+		free(sfs_addq_csum);
+
 	if (done == 0)
 		usage();
 
@@ -1157,27 +1210,25 @@ sfs_sigop_allkeys(const char *file, int operation, sumop_callback_t callback)
 }
 
 /**
- * Common function to perform add, del, get and validate operations.
+ * Queue a checksum operation for a file whose checksum (if any) is
+ * already known. This signs the checksum if required.
  *
  * @param file The target file.
  * @param operation The operation that should be performed.
  * @param sfs_uid The target user-ID for a single uid checksum operation.
  * @param callback The callback function that handles the result of a
  *     successful get operation.
- * @return Zero in case of success, one in case of an error. ENOENT errors
- *     for GET and GETSIG operations are suppressed.
- *     XXX CEH: Returning 1 for an error and zero for success is bogus.
- *     XXX CEH: Calling conventions should be fixed.
+ * @param csp The checksum of the file for add operations, NULL otherwise.
+ * @param len The length of the checksum.
+ * @return See sfs_generic_op.
  */
 static int
-sfs_generic_op(const char *file, int operation, uid_t sfs_uid,
-    sumop_callback_t callback)
+sfs_generic_op_csum(const char *file, int operation, uid_t sfs_uid,
+    sumop_callback_t callback, u_int8_t *csp, int len)
 {
-	u_int8_t	 csum[ANOUBIS_CS_LEN];
 	unsigned int	 siglen = 0;
-	int		 len = 0, ret;
+	int		 ret;
 	u_int8_t	*sig = NULL;
-	void		*csp = NULL;
 
 	if (operation == ANOUBIS_CHECKSUM_OP_ADDSIG
 	    && (opts & SFSSIG_OPT_ALLCERT)) {
@@ -1187,20 +1238,8 @@ sfs_generic_op(const char *file, int operation, uid_t sfs_uid,
 	}
 	if (operation == ANOUBIS_CHECKSUM_OP_ADDSUM
 	    || operation == ANOUBIS_CHECKSUM_OP_ADDSIG) {
-		len = ANOUBIS_CS_LEN;
-		csp = csum;
-		if (opts & SFSSIG_OPT_LN) {
-			ret = anoubis_csum_link_calc(file, csum, &len);
-		} else {
-			ret = anoubis_csum_calc(file, csum, &len);
-		}
-		if (ret < 0) {
-			fprintf(stderr, "Checksum calculation for "
-			    "%s failed: %s\n", file, anoubis_strerror(-ret));
-			return 1;
-		}
 		if (opts & SFSSIG_OPT_SIG) {
-			sig = anoubis_sign_csum(as, csum, &siglen);
+			sig = anoubis_sign_csum(as, csp, &siglen);
 			if (!sig) {
 				fprintf(stderr,
 				    "Error in anoubis_sign_csum\n");
@@ -1243,6 +1282,46 @@ sfs_generic_op(const char *file, int operation, uid_t sfs_uid,
 	return 0;
 }
 
+/**
+ * Common function to perform add, del, get and validate operations.
+ *
+ * @param file The target file.
+ * @param operation The operation that should be performed.
+ * @param sfs_uid The target user-ID for a single uid checksum operation.
+ * @param callback The callback function that handles the result of a
+ *     successful get operation.
+ * @return Zero in case of success, one in case of an error. ENOENT errors
+ *     for GET and GETSIG operations are suppressed.
+ *     XXX CEH: Returning 1 for an error and zero for success is bogus.
+ *     XXX CEH: Calling conventions should be fixed.
+ */
+static int
+sfs_generic_op(const char *file, int operation, uid_t sfs_uid,
+    sumop_callback_t callback)
+{
+	u_int8_t	 csum[ANOUBIS_CS_LEN];
+	int		 len = 0, ret;
+	u_int8_t	*csp = NULL;
+
+	if (operation == ANOUBIS_CHECKSUM_OP_ADDSUM
+	    || operation == ANOUBIS_CHECKSUM_OP_ADDSIG) {
+		len = ANOUBIS_CS_LEN;
+		csp = csum;
+		if (opts & SFSSIG_OPT_LN) {
+			ret = anoubis_csum_link_calc(file, csum, &len);
+		} else {
+			ret = anoubis_csum_calc(file, csum, &len);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "Checksum calculation for "
+			    "%s failed: %s\n", file, anoubis_strerror(-ret));
+			return 1;
+		}
+	}
+	return sfs_generic_op_csum(file, operation, sfs_uid, callback,
+	    csp, len);
+}
+
 /**
  * Perfrom an sfs add operation on a file.
  * @param file The target file.
@@ -1253,11 +1332,142 @@ static int
 sfs_add(char *file, uid_t sfs_uid) {
 	int	op = ANOUBIS_CHECKSUM_OP_ADDSUM;
 
+	if (sfs_jobs)
+		return sfs_add_queue(file, sfs_uid);
 	if (opts & SFSSIG_OPT_SIG)
 		op = ANOUBIS_CHECKSUM_OP_ADDSIG;
 	return sfs_generic_op(file, op, sfs_uid, sfs_add_del_callback);
 }
 
+/**
+ * Queue a file for an add operation (option -j). The checksums of
+ * the queued files are calculated in parallel by sfs_add_flush once
+ * REQUESTS_MAX files are queued.
+ *
+ * @param file The target file. The queue keeps a copy of the name.
+ * @param sfs_uid The sfs User-ID that should be used.
+ * @return See sfs_generic_op. An error can also be the result of
+ *     previously queued files.
+ */
+static int
+sfs_add_queue(const char *file, uid_t sfs_uid)
+{
+	struct anoubis_csum_request	*req;
+	int				 ret;
+
+	if (sfs_addq == NULL) {
+		sfs_addq = calloc(REQUESTS_MAX, sizeof(*sfs_addq));
+		sfs_addq_csum = calloc(REQUESTS_MAX, ANOUBIS_CS_LEN);
+		if (sfs_addq == NULL || sfs_addq_csum == NULL) {
+			fprintf(stderr, "%s\n", anoubis_strerror(ENOMEM));
+			free(sfs_addq);
+			free(sfs_addq_csum);
+			sfs_addq = NULL;
+			sfs_addq_csum = NULL;
+			return 1;
+		}
+		gettimeofday(&sfs_addq_start, NULL);
+	}
+	if (sfs_addq_cnt == REQUESTS_MAX || (sfs_addq_cnt
+	    && sfs_addq_uid != sfs_uid)) {
+		ret = sfs_add_flush();
+		if (ret != 0)
+			return ret;
+	}
+	req = &sfs_addq[sfs_addq_cnt];
+	req->path = strdup(file);
+	if (req->path == NULL) {
+		fprintf(stderr, "%s\n", anoubis_strerror(ENOMEM));
+		return 1;
+	}
+	req->link = (opts & SFSSIG_OPT_LN) != 0;
+	req->csum = sfs_addq_csum + sfs_addq_cnt * ANOUBIS_CS_LEN;
+	req->cslen = ANOUBIS_CS_LEN;
+	req->error = 0;
+	sfs_addq_uid = sfs_uid;
+	sfs_addq_cnt++;
+	return 0;
+}
+
+/**
+ * Calculate the checksums of all queued files with sfs_jobs threads
+ * and add them in the order in which the files were queued. The add
+ * requests are sent to the daemon in CSMULTI batches by sfs_csumop.
+ * Processing stops at the first error just like it does without -j.
+ *
+ * @return Zero in case of success, one in case of an error.
+ */
+static int
+sfs_add_flush(void)
+{
+	int	op = ANOUBIS_CHECKSUM_OP_ADDSUM;
+	int	i, ret = 0;
+
+	if (sfs_addq_cnt == 0)
+		return 0;
+	if (opts & SFSSIG_OPT_SIG)
+		op = ANOUBIS_CHECKSUM_OP_ADDSIG;
+	ret = anoubis_csum_calc_batch(sfs_addq, sfs_addq_cnt, sfs_jobs);
+	if (ret < 0) {
+		fprintf(stderr, "Checksum calculation failed: %s\n",
+		    anoubis_strerror(-ret));
+		ret = 1;
+		i = 0;
+	} else {
+		for (i = 0; i < sfs_addq_cnt; ++i) {
+			struct anoubis_csum_request	*req = &sfs_addq[i];
+
+			if (req->error < 0) {
+				fprintf(stderr, "Checksum calculation for "
+				    "%s failed: %s\n", req->path,
+				    anoubis_strerror(-req->error));
+				ret = 1;
+			} else {
+				ret = sfs_generic_op_csum(req->path, op,
+				    sfs_addq_uid, sfs_add_del_callback,
+				    req->csum, req->cslen);
+			}
+			if (ret != 0)
+				break;
+			sfs_addq_done++;
+		}
+	}
+	sfs_addq_failed += sfs_addq_cnt - i;
+	for (i = 0; i < sfs_addq_cnt; ++i)
+		free((void *)sfs_addq[i].path);
+	sfs_addq_cnt = 0;
+	sfs_add_report(0);
+	return ret;
+}
+
+/**
+ * Report the progress of queued add operations in verbose mode.
+ *
+ * @param final True for the summary after the last file was added.
+ */
+static void
+sfs_add_report(int final)
+{
+	struct timeval	now;
+	double		secs, rate = 0.0;
+
+	if ((opts & SFSSIG_OPT_VERBOSE) == 0 || sfs_addq == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - sfs_addq_start.tv_sec)
+	    + (now.tv_usec - sfs_addq_start.tv_usec) / 1000000.0;
+	if (secs > 0)
+		rate = sfs_addq_done / secs;
+	if (final) {
+		fprintf(stderr, "%lu files added, %lu skipped in %.1f "
+		    "seconds (%.0f files/s, %d jobs)\n", sfs_addq_done,
+		    sfs_addq_failed, secs, rate, sfs_jobs);
+	} else {
+		fprintf(stderr, "%lu files added (%.0f files/s)\n",
+		    sfs_addq_done, rate);
+	}
+}
+
 /**
  * Perform an sfs delete operation on a file.
  *
@@ -2029,42 +2239,20 @@ get_entry(char *file, unsigned char *keyid_p, int idlen_p, uid_t sfs_uid)
 static int
 process_a_request(struct sfs_request_node *n)
 {
-	struct anoubis_transaction *t = NULL;
 	struct anoubis_csmulti_record   *rec;
 	int ret, result = 0;
 
 	if (opts & SFSSIG_OPT_DEBUG)
 		fprintf(stderr, ">process_a_request\n");
 
-req_again:
-	t = anoubis_client_csmulti_start(client, n->req);
-	if (t == NULL) {
-		fprintf(stderr, "Error while starting transaction\n");
-		sfs_delete_request(req_tree, n);
-		return 1;
-	}
-	while ((t->flags & ANOUBIS_T_DONE) == 0) {
-		ret = anoubis_client_wait(client);
-		if (ret < 0) {
-			fprintf(stderr, "Error while waiting for "
-			    "request %s\n",
-			    anoubis_strerror(-ret));
-			sfs_delete_request(req_tree, n);
-			return 1;
-		}
-	}
-	ret = t->result;
-	anoubis_transaction_destroy(t);
-	if (ret) {
+	ret = anoubis_client_csmulti(client, n->req);
+	if (ret < 0) {
 		fprintf(stderr, "Transaction error (%d): %s\n",
-		    ret, anoubis_strerror(ret));
+		    -ret, anoubis_strerror(-ret));
 		sfs_delete_request(req_tree, n);
 		return 1;
 	}
 
-	if (n->req->openreqs)
-		goto req_again;
-
 	TAILQ_FOREACH(rec, &n->req->reqs, next) {
 		if (n->sumop_callback) {
 			ret = (* n->sumop_callback)(n->req, rec);
@@ -2091,41 +2279,19 @@ req_again:
 static int
 process_filter_request(struct sfs_request_node *n)
 {
-	struct anoubis_transaction *t = NULL;
 	int ret;
 
 	if (opts & SFSSIG_OPT_DEBUG)
 		fprintf(stderr, ">process_filter_request\n");
 
-req_again:
-	t = anoubis_client_csmulti_start(client, n->req);
-	if (t == NULL) {
-		fprintf(stderr, "Error while starting transaction\n");
-		sfs_delete_request(filter_tree, n);
-		return 1;
-	}
-	while ((t->flags & ANOUBIS_T_DONE) == 0) {
-		ret = anoubis_client_wait(client);
-		if (ret < 0) {
-			fprintf(stderr, "Error while waiting for "
-			    "request %s\n",
-			    anoubis_strerror(-ret));
-			sfs_delete_request(filter_tree, n);
-			return 1;
-		}
-	}
-	ret = t->result;
-	anoubis_transaction_destroy(t);
-	if (ret) {
+	ret = anoubis_client_csmulti(client, n->req);
+	if (ret < 0) {
 		fprintf(stderr, "Transaction error (%d): %s\n",
-		    ret, anoubis_strerror(ret));
+		    -ret, anoubis_strerror(-ret));
 		sfs_delete_request(filter_tree, n);
 		return 1;
 	}
 
-	if (n->req->openreqs)
-		goto req_again;
-
 	if (opts & SFSSIG_OPT_DEBUG)
 		fprintf(stderr, "<process_filter_request\n");
 	return 0;
@@ -2444,6 +2610,8 @@ create_channel(void)
 		error = 5;
 		goto err;
 	}
+	/* Pipeline checksum requests if the daemon supports it. */
+	anoubis_client_csmulti_window(client, ANOUBIS_CSMULTI_MAXWINDOW);
 
 err:
 	if (opts & SFSSIG_OPT_DEBUG)
@@ -52,6 +52,7 @@
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #include <anoubis_protocol.h>
@@ -111,6 +112,7 @@
 #define SKIPSUMNAME "security.anoubis_skipsum"
 
 #define REQUESTS_MAX			1000
+#define JOBS_MAX			32
 
 typedef int (*sumop_callback_t) (struct anoubis_csmulti_request *,
     struct anoubis_csmulti_record *);
@@ -33,6 +33,7 @@
 
 #include <sys/un.h>
 #include <signal.h>
+#include <string.h>
 
 #include <poll.h>
 
@@ -386,7 +387,8 @@ ComThread::Entry(void)
 bool
 ComThread::readMessage(void)
 {
-	size_t			 size = 4096;
+	size_t			 size = 0;
+	const char		*buf = NULL;
 	struct anoubis_msg	*msg;
 	char			*str = NULL;
 	wxString		 message;
@@ -397,26 +399,17 @@ ComThread::readMessage(void)
 		return (false);
 	}
 
-	if ((msg = anoubis_msg_new(size)) == 0) {
+	/* Copy the message from the channel buffer exactly once. */
+	rc = acc_receivemsg_view(channel_, &buf, &size);
+	if (rc != ACHAT_RC_OK || size < CSUM_LEN) {
 		sendComEvent(JobCtrl::ERR_RW);
 		return (false);
 	}
-	while(1) {
-		rc = acc_receivemsg(channel_, (char*)(msg->u.buf), &size);
-		if (rc != ACHAT_RC_NOSPACE)
-			break;
-		size *= 2;
-		if (anoubis_msg_resize(msg, size) < 0)
-			rc = ACHAT_RC_ERROR;
-	}
-	if (rc != ACHAT_RC_OK) {
-		anoubis_msg_free(msg);
+	if ((msg = anoubis_msg_new(size - CSUM_LEN)) == 0) {
 		sendComEvent(JobCtrl::ERR_RW);
-
 		return (false);
 	}
-
-	anoubis_msg_resize(msg, size);
+	memcpy(msg->u.buf, buf, size);
 
 	if (Debug::checkLevel(Debug::CHAT)) {
 		anoubis_dump_str(msg, NULL, &str);
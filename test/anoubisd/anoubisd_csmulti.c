@@ -34,6 +34,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 
 #include <err.h>
@@ -70,9 +71,15 @@ struct csfile {
 	unsigned char	 csdata[ANOUBIS_CS_LEN];
 };
 
-#define NFILES	1024
+/*
+ * The default number of files. The files are distributed over several
+ * directories with FILESPERDIR files each.
+ */
+#define NFILES		1024
+#define FILESPERDIR	100
 
-static struct csfile	 csfiles[NFILES];
+static struct csfile	*csfiles;
+static int		 nfiles = NFILES;
 
 
 static void
@@ -80,8 +87,14 @@ init_files(void)
 {
 	int		i;
 
-	for (i=0; i<NFILES; ++i) {
-		if (asprintf(&csfiles[i].path, "/virtual/file%d", i) < 0) {
+	csfiles = calloc(nfiles, sizeof(struct csfile));
+	if (csfiles == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i=0; i<nfiles; ++i) {
+		if (asprintf(&csfiles[i].path, "/virtual/dir%d/file%d",
+		    i / FILESPERDIR, i) < 0) {
 			perror("asprintf");
 			exit(1);
 		}
@@ -89,11 +102,17 @@ init_files(void)
 	}
 }
 
+/*
+ * Send the request until all records are answered and report the
+ * time that this took.
+ */
 static int
 process_request(struct anoubis_csmulti_request *req)
 {
+	struct timeval	start, end;
 	int		ret;
 
+	gettimeofday(&start, NULL);
 	while (1) {
 		struct anoubis_csmulti_record	*r;
 		struct anoubis_transaction	*t;
@@ -122,6 +141,10 @@ process_request(struct anoubis_csmulti_request *req)
 			return ret;
 		}
 	}
+	gettimeofday(&end, NULL);
+	printf("op %d: %d records in %ld ms\n", req->op, req->nreqs,
+	    (end.tv_sec - start.tv_sec) * 1000L
+	    + (end.tv_usec - start.tv_usec) / 1000);
 	return 0;
 }
 
@@ -146,7 +169,7 @@ create_request(int op)
 	}
 	if (!req)
 		return NULL;
-	for (i=0; i<NFILES; ++i) {
+	for (i=0; i<nfiles; ++i) {
 		if (op == ANOUBIS_CHECKSUM_OP_ADDSUM
 		    || op == ANOUBIS_CHECKSUM_OP_ADDSIG) {
 			if (!sign) {
@@ -272,8 +295,11 @@ int main(int argc, char **argv)
 	unsigned int				 maxversion = -1;
 
 	if (argc > 1) {
-		assert(argc == 2);
+		assert(argc <= 3);
 		maxversion = atoi(argv[1]);
+		if (argc > 2)
+			nfiles = atoi(argv[2]);
+		assert(nfiles > 0);
 	}
 	init_files();
 	sigs = create_sig();
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef LINUX
+#include <linux/anoubis_alf.h>
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <sys/anoubis_alf.h>
+#include <dev/anoubis.h>
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP	132
+#endif
+#endif
+
+#include "anoubisd.h"
+#include "pe.h"
+#include <anoubisd_unit.h>
+
+#define NEVENTS		5000
+#define COOKIE		4711
+
+/*
+ * Number of recent events that are repeated after each new event.
+ * This is a bit more than the size of the decision cache, i.e. some
+ * of the repeated events are cache hits and others are not.
+ */
+#define NREPEAT		10
+
+/* Policy database hooks of the test stubs (see test_peunit.c). */
+extern struct apn_ruleset	*(*pe_user_get_ruleset_p)(uid_t, unsigned int);
+extern unsigned long		 pe_user_generation_val;
+
+/*
+ * The rules cover host lists, negation, network prefixes, port ranges,
+ * both address families, all directions and capability rules.
+ */
+static const char *policy =
+    "apnversion 1.0\n"
+    "alf {\n"
+    "any {\n"
+    "allow connect tcp from any to 10.0.0.0/8 port 20 - 25\n"
+    "deny connect tcp from any to { 10.1.0.0/16, 192.168.1.1 } "
+	"port { 80, 443 }\n"
+    "allow connect tcp from any to ! 10.2.0.0/16 port { 80, 8000 - 8100 }\n"
+    "allow connect tcp from 192.168.0.0/24 port 1024 - 65535 "
+	"to fd00:db8::/32 port 80\n"
+    "allow accept tcp from 10.0.0.0/8 to any port 22\n"
+    "deny accept tcp from ! fd00:db8::/32 to any port 22\n"
+    "allow accept tcp from any to ::1 port 22\n"
+    "allow receive udp from any port 53 to any\n"
+    "allow both udp from 192.168.0.0/24 to 192.168.0.0/24 port 5353\n"
+    "deny connect sctp from any to 10.0.0.0/8\n"
+    "allow connect sctp all\n"
+    "allow raw\n"
+    "default deny\n"
+    "}\n"
+    "}\n";
+
+static const char *v4addrs[] = {
+	"0.0.0.0", "9.255.255.255", "10.0.0.0", "10.0.0.1", "10.1.2.3",
+	"10.2.0.1", "10.255.255.255", "11.0.0.0", "192.168.0.7",
+	"192.168.1.1", "255.255.255.255",
+};
+static const char *v6addrs[] = {
+	"::", "::1", "fd00:db7:ffff:ffff:ffff:ffff:ffff:ffff", "fd00:db8::",
+	"fd00:db8::1", "fd00:db8:ffff:ffff:ffff:ffff:ffff:ffff", "fd00:db9::",
+	"::ffff:10.0.0.1", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff",
+};
+static const int ports[] = {
+	0, 19, 20, 22, 25, 26, 53, 80, 443, 1023, 1024, 5353, 7999, 8000,
+	8100, 8101, 65535,
+};
+static const int protocols[] = {
+	IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP, IPPROTO_ICMP, 0,
+};
+static const int types[] = {
+	SOCK_STREAM, SOCK_DGRAM, SOCK_RAW, SOCK_SEQPACKET,
+};
+static const int ops[] = {
+	ALF_CONNECT, ALF_ACCEPT, ALF_SENDMSG, ALF_RECVMSG,
+};
+
+#define NELEM(X)	(sizeof(X)/sizeof((X)[0]))
+#define PICK(X)		((X)[random() % NELEM(X)])
+
+static struct apn_ruleset	*rs;
+static struct eventdev_hdr	*events[NEVENTS];
+
+static struct apn_ruleset *
+get_ruleset(uid_t uid __used, unsigned int prio)
+{
+	if (prio == PE_PRIO_ADMIN)
+		return rs;
+	return NULL;
+}
+
+static void
+setup_ruleset(void)
+{
+	struct iovec	 iov;
+
+	iov.iov_base = (void *)policy;
+	iov.iov_len = strlen(policy);
+	fail_if(apn_parse_iovec("<alf>", &iov, 1, &rs, 0) != 0,
+	    "Cannot parse policy");
+	rs->destructor = &pe_userdata_destroy;
+	pe_user_get_ruleset_p = &get_ruleset;
+}
+
+static void
+set_addr(struct alf_event *ev, int local, int family, const char *addr,
+    int port)
+{
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+
+	if (family == AF_INET) {
+		sin = local ? &ev->local.in_addr : &ev->peer.in_addr;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		fail_if(inet_pton(AF_INET, addr, &sin->sin_addr) != 1,
+		    "Bad address %s", addr);
+	} else {
+		sin6 = local ? &ev->local.in6_addr : &ev->peer.in6_addr;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		fail_if(inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1,
+		    "Bad address %s", addr);
+	}
+}
+
+static struct eventdev_hdr *
+make_event(int family, const char *laddr, int lport, const char *paddr,
+    int pport, int protocol, int type, int op)
+{
+	struct eventdev_hdr	*hdr;
+	struct alf_event	*ev;
+	int			 size;
+
+	size = sizeof(struct eventdev_hdr) + sizeof(struct alf_event);
+	hdr = calloc(1, size);
+	fail_if(hdr == NULL, "Out of memory");
+	hdr->msg_size = size;
+	hdr->msg_source = ANOUBIS_SOURCE_ALF;
+	hdr->msg_uid = 0;
+	hdr->msg_pid = 100;
+	ev = (struct alf_event *)(hdr + 1);
+	ev->common.task_cookie = COOKIE;
+	ev->family = family;
+	ev->protocol = protocol;
+	ev->type = type;
+	ev->op = op;
+	set_addr(ev, 1, family, laddr, lport);
+	set_addr(ev, 0, family, paddr, pport);
+	return hdr;
+}
+
+/*
+ * Events are drawn from a small set of addresses and ports close to
+ * the boundaries of the networks and port ranges in the policy.
+ */
+static void
+setup_events(void)
+{
+	int	i, family;
+
+	srandom(4711);
+	for (i = 0; i < NEVENTS; ++i) {
+		family = (random() % 2) ? AF_INET : AF_INET6;
+		if (family == AF_INET)
+			events[i] = make_event(family, PICK(v4addrs),
+			    PICK(ports), PICK(v4addrs), PICK(ports),
+			    PICK(protocols), PICK(types), PICK(ops));
+		else
+			events[i] = make_event(family, PICK(v6addrs),
+			    PICK(ports), PICK(v6addrs), PICK(ports),
+			    PICK(protocols), PICK(types), PICK(ops));
+	}
+}
+
+static void
+teardown(void)
+{
+	int	i;
+
+	for (i = 0; i < NEVENTS; ++i) {
+		free(events[i]);
+		events[i] = NULL;
+	}
+	pe_user_get_ruleset_p = NULL;
+	apn_free_ruleset(rs);
+	rs = NULL;
+}
+
+/*
+ * Evaluate an event with the plain rule walk or with the compiled
+ * rule block.
+ */
+static int
+evaluate(struct eventdev_hdr *hdr, int compiled, int *log,
+    u_int32_t *rule_id)
+{
+	*log = APN_LOG_NONE;
+	*rule_id = 0;
+	return test_pe_alf_evaluate(TAILQ_FIRST(&rs->alf_queue),
+	    (struct alf_event *)(hdr + 1), compiled, log, rule_id);
+}
+
+/*
+ * Evaluate an event via pe_decide_alf, i.e. with the decision cache
+ * of the process' context, and compare the reply to the result of
+ * the plain rule walk.
+ */
+static void
+check_decide(struct pe_proc *proc, struct eventdev_hdr *hdr, int idx)
+{
+	struct anoubisd_reply	*reply;
+	u_int32_t		 rule_id;
+	int			 decision, log;
+
+	decision = evaluate(hdr, 0, &log, &rule_id);
+	fail_if(decision == -1, "No decision for event %d", idx);
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL, "No reply for event %d", idx);
+	fail_if(reply->reply != (decision == APN_ACTION_DENY ? EPERM : 0),
+	    "Event %d: reply %d but decision %d", idx, reply->reply,
+	    decision);
+	fail_if(reply->rule_id != rule_id, "Event %d: rule %u instead of %u",
+	    idx, reply->rule_id, rule_id);
+	fail_if(reply->log != log, "Event %d: log %d instead of %d",
+	    idx, reply->log, log);
+	fail_if(reply->prio != PE_PRIO_ADMIN, "Event %d: prio %d", idx,
+	    reply->prio);
+	free(reply);
+}
+
+/*
+ * The compiled rule block must make the same decisions as the plain
+ * rule walk.
+ */
+START_TEST(tc_alf_compiled)
+{
+	u_int32_t	id1, id2;
+	int		i, d1, d2, log1, log2;
+	int		allow = 0, deny = 0;
+
+	setup_ruleset();
+	setup_events();
+	for (i = 0; i < NEVENTS; ++i) {
+		d1 = evaluate(events[i], 0, &log1, &id1);
+		d2 = evaluate(events[i], 1, &log2, &id2);
+		fail_if(d2 == -ENOMEM, "Cannot compile rule block");
+		fail_if(d1 != d2, "Event %d: decision %d instead of %d",
+		    i, d2, d1);
+		fail_if(id1 != id2, "Event %d: rule %u instead of %u",
+		    i, id2, id1);
+		fail_if(log1 != log2, "Event %d: log %d instead of %d",
+		    i, log2, log1);
+		if (d1 == APN_ACTION_ALLOW && id1)
+			allow++;
+		else if (d1 == APN_ACTION_DENY)
+			deny++;
+	}
+	/* Make sure that the events actually exercise the rules. */
+	fail_if(allow < NEVENTS / 20, "Only %d events allowed by a rule",
+	    allow);
+	fail_if(deny < NEVENTS / 20, "Only %d events denied", deny);
+	teardown();
+}
+END_TEST
+
+/*
+ * Repeat each event and some of its predecessors. The decisions
+ * must be the same whether they come from the decision cache or not.
+ */
+START_TEST(tc_alf_cache)
+{
+	struct pe_proc	*proc;
+	int		 i, j;
+
+	setup_ruleset();
+	setup_events();
+	pe_init();
+	pe_proc_fork(0, COOKIE, 0, 0);
+	proc = pe_proc_get(COOKIE);
+	fail_if(proc == NULL, "Process %d not tracked", COOKIE);
+
+	for (i = 0; i < NEVENTS; ++i) {
+		j = (i < NREPEAT) ? 0 : i - NREPEAT;
+		for (; j <= i; ++j)
+			check_decide(proc, events[j], j);
+		check_decide(proc, events[i], i);
+	}
+
+	pe_proc_put(proc);
+	pe_proc_exit(COOKIE);
+	pe_shutdown();
+	teardown();
+}
+END_TEST
+
+/*
+ * A cached decision is used until the policy database changes.
+ * Changing a rule in place is only visible to the cache after
+ * the invalidation that goes along with a new database generation.
+ */
+START_TEST(tc_alf_cache_invalidate)
+{
+	struct eventdev_hdr	*hdr;
+	struct anoubisd_reply	*reply;
+	struct pe_proc		*proc;
+	struct apn_rule		*rule;
+	u_int32_t		 rule_id;
+	int			 log;
+
+	setup_ruleset();
+	setup_events();
+	pe_init();
+	pe_proc_fork(0, COOKIE, 0, 0);
+	proc = pe_proc_get(COOKIE);
+	fail_if(proc == NULL, "Process %d not tracked", COOKIE);
+
+	/* Matches the first filter rule. */
+	hdr = make_event(AF_INET, "192.168.0.7", 40000, "10.0.0.1", 22,
+	    IPPROTO_TCP, SOCK_STREAM, ALF_CONNECT);
+	rule = TAILQ_FIRST(&TAILQ_FIRST(&rs->alf_queue)->rule.chain);
+	fail_if(rule == NULL || rule->apn_type != APN_ALF_FILTER,
+	    "First rule is not a filter rule");
+
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL || reply->reply != 0, "Event not allowed");
+	fail_if(reply->rule_id != rule->apn_id, "Wrong rule %u",
+	    reply->rule_id);
+	free(reply);
+
+	rule->rule.afilt.action = APN_ACTION_DENY;
+	fail_if(evaluate(hdr, 1, &log, &rule_id) != APN_ACTION_DENY,
+	    "Modified rule does not deny");
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL || reply->reply != 0,
+	    "Cached decision not used");
+	free(reply);
+
+	/* This is what pe_user does when it switches to a new database. */
+	pe_user_generation_val++;
+	pe_alf_invalidate();
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL || reply->reply != EPERM,
+	    "Stale decision after invalidation");
+	fail_if(reply->rule_id != rule->apn_id, "Wrong rule %u",
+	    reply->rule_id);
+	free(reply);
+
+	/* The new decision is cached, too. */
+	rule->rule.afilt.action = APN_ACTION_ALLOW;
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL || reply->reply != EPERM,
+	    "New decision not cached");
+	free(reply);
+	pe_user_generation_val++;
+	pe_alf_invalidate();
+	reply = pe_decide_alf(proc, hdr);
+	fail_if(reply == NULL || reply->reply != 0,
+	    "Stale decision after second invalidation");
+	free(reply);
+
+	free(hdr);
+	pe_proc_put(proc);
+	pe_proc_exit(COOKIE);
+	pe_shutdown();
+	teardown();
+}
+END_TEST
+
+/*
+ * Testcases
+ */
+TCase *
+anoubisd_testcase_pe_alf(void)
+{
+	TCase *tc = tcase_create("ALFCompiled");
+
+	tcase_set_timeout(tc, 120);
+	tcase_add_test(tc, tc_alf_compiled);
+	tcase_add_test(tc, tc_alf_cache);
+	tcase_add_test(tc, tc_alf_cache_invalidate);
+
+	return (tc);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <dev/anoubis.h>
+#endif
+
+#include "anoubisd.h"
+#include "pe.h"
+#include <anoubisd_unit.h>
+
+static char	 journal[] = "/tmp/pgfiles.XXXXXX";
+
+static void
+setup(void)
+{
+	int	fd = mkstemp(journal);
+
+	fail_if(fd < 0, "Cannot create %s", journal);
+	close(fd);
+}
+
+static void
+teardown(void)
+{
+	fail_if(unlink(journal) < 0, "Cannot remove %s", journal);
+	strlcpy(journal, "/tmp/pgfiles.XXXXXX", sizeof(journal));
+}
+
+/* Open the journal file and replay it into a new database. */
+static struct pe_pgfiles *
+openjournal(void)
+{
+	struct pe_pgfiles	*db = pe_pgfiles_create();
+	int			 fd;
+
+	fail_if(db == NULL, "Cannot create file database");
+	fd = open(journal, O_RDWR|O_APPEND);
+	fail_if(fd < 0, "Cannot open %s", journal);
+	fail_if(pe_pgfiles_load(db, fd) != 0, "Cannot load journal");
+	return db;
+}
+
+/* Collects all names of the file with device 1 and the given inode. */
+struct names {
+	uint64_t	ino;
+	int		cnt;
+	char		buf[1024];
+};
+
+static int
+collect(uint64_t dev, uint64_t ino, const char *path, void *arg)
+{
+	struct names	*names = arg;
+
+	if (dev == 1 && ino == names->ino) {
+		names->cnt++;
+		strlcat(names->buf, path, sizeof(names->buf));
+		strlcat(names->buf, ";", sizeof(names->buf));
+	}
+	return 0;
+}
+
+static char *
+getnames(struct pe_pgfiles *db, uint64_t ino)
+{
+	static struct names	names;
+
+	names.ino = ino;
+	names.cnt = 0;
+	names.buf[0] = 0;
+	fail_if(pe_pgfiles_foreach(db, collect, &names) != 0);
+	return names.buf;
+}
+
+START_TEST(tc_pgfiles_basic)
+{
+	struct pe_pgfiles	*db = openjournal();
+	int			 i;
+
+	fail_if(pe_pgfiles_add(db, 1, 10, "/home/a/x") != 1, "New file");
+	fail_if(pe_pgfiles_add(db, 1, 10, "/home/a/x") != 0, "Duplicate");
+	fail_if(pe_pgfiles_add(db, 1, 10, "/home/a/y") != 0, "Second name");
+	fail_if(pe_pgfiles_add(db, 1, 11, "rel") != 1, "Relative name");
+	fail_if(pe_pgfiles_add(db, 1, 12, "") != -EINVAL, "Empty name");
+	fail_if(pe_pgfiles_count(db) != 2, "Wrong file count");
+	fail_if(strcmp(getnames(db, 10), "/home/a/x;/home/a/y;") != 0,
+	    "Wrong names: %s", getnames(db, 10));
+	fail_if(strcmp(getnames(db, 11), "rel;") != 0);
+
+	/* Many files force the hash tables to grow. */
+	for (i = 0; i < 5000; ++i) {
+		char	path[64];
+
+		snprintf(path, sizeof(path), "/tmp/d%d/f%d", i % 100, i);
+		fail_if(pe_pgfiles_add(db, 2, i, path) != 1,
+		    "Cannot add %s", path);
+	}
+	fail_if(pe_pgfiles_count(db) != 5002, "Wrong file count");
+	for (i = 0; i < 5000; ++i)
+		fail_if(pe_pgfiles_remove(db, 2, i) != 1, "Cannot remove");
+	fail_if(pe_pgfiles_remove(db, 2, 0) != 0, "Removed twice");
+	fail_if(pe_pgfiles_count(db) != 2, "Wrong file count");
+	fail_if(!pe_pgfiles_needcompact(db), "Journal needs compaction");
+	pe_pgfiles_destroy(db);
+
+	/* The journal restores the same state. */
+	db = openjournal();
+	fail_if(pe_pgfiles_count(db) != 2, "Wrong file count after replay");
+	fail_if(strcmp(getnames(db, 10), "/home/a/x;/home/a/y;") != 0,
+	    "Wrong names after replay: %s", getnames(db, 10));
+	pe_pgfiles_destroy(db);
+}
+END_TEST
+
+START_TEST(tc_pgfiles_rename)
+{
+	struct pe_pgfiles	*db = openjournal();
+
+	fail_if(pe_pgfiles_add(db, 1, 2, "/src/dir") != 1);
+	fail_if(pe_pgfiles_add(db, 1, 3, "/src/dir/a") != 1);
+	fail_if(pe_pgfiles_add(db, 1, 4, "/src/dir/sub/b") != 1);
+	fail_if(pe_pgfiles_add(db, 1, 5, "/src/dirx/c") != 1);
+	fail_if(pe_pgfiles_add(db, 7, 6, "/src/dir/d") != 1);
+
+	/* Only files on the same device and below the directory. */
+	fail_if(pe_pgfiles_add(db, 1, 2, "/dst/dir") != 0);
+	fail_if(pe_pgfiles_rename_dir(db, 1, 2, "/dst/dir", "/src/dir") != 2,
+	    "Wrong number of renamed files");
+	fail_if(strcmp(getnames(db, 2), "/src/dir;/dst/dir;") != 0);
+	fail_if(strcmp(getnames(db, 3), "/src/dir/a;/dst/dir/a;") != 0);
+	fail_if(strcmp(getnames(db, 4), "/src/dir/sub/b;/dst/dir/sub/b;")
+	    != 0, "Wrong names: %s", getnames(db, 4));
+	fail_if(strcmp(getnames(db, 5), "/src/dirx/c;") != 0);
+	fail_if(pe_pgfiles_rename_dir(db, 1, 2, "/dst/dir", "/src/dir") != 0,
+	    "Repeated rename added names");
+	fail_if(pe_pgfiles_rename_dir(db, 1, 2, "/x", "/nonexistent") != 0);
+	pe_pgfiles_destroy(db);
+
+	db = openjournal();
+	fail_if(strcmp(getnames(db, 4), "/src/dir/sub/b;/dst/dir/sub/b;")
+	    != 0, "Wrong names after replay: %s", getnames(db, 4));
+	pe_pgfiles_destroy(db);
+}
+END_TEST
+
+START_TEST(tc_pgfiles_journal)
+{
+	struct pe_pgfiles	*db = openjournal();
+	struct stat		 statbuf;
+	char			 tmpfile[] = "/tmp/pgfiles.XXXXXX";
+	int			 fd, i;
+	off_t			 size;
+
+	for (i = 0; i < 100; ++i) {
+		char	path[64];
+
+		snprintf(path, sizeof(path), "/tmp/f%d", i);
+		fail_if(pe_pgfiles_add(db, 1, i, path) != 1);
+		fail_if(pe_pgfiles_add(db, 1, i, "/tmp/other") != 0);
+	}
+	for (i = 0; i < 50; ++i)
+		fail_if(pe_pgfiles_remove(db, 1, i) != 1);
+
+	/* Write a compacted journal and use it from now on. */
+	fd = mkstemp(tmpfile);
+	fail_if(fd < 0);
+	fail_if(pe_pgfiles_save(db, fd) != 0, "Cannot save journal");
+	fail_if(rename(tmpfile, journal) < 0);
+	fail_if(fcntl(fd, F_SETFL, O_APPEND) < 0);
+	pe_pgfiles_setjournal(db, fd);
+	fail_if(pe_pgfiles_needcompact(db), "Compacted journal is stale");
+	fail_if(pe_pgfiles_add(db, 1, 1000, "/tmp/new") != 1);
+	pe_pgfiles_destroy(db);
+
+	db = openjournal();
+	fail_if(pe_pgfiles_count(db) != 51, "Wrong file count after replay");
+	fail_if(strcmp(getnames(db, 99), "/tmp/f99;/tmp/other;") != 0);
+	fail_if(strcmp(getnames(db, 1000), "/tmp/new;") != 0);
+	pe_pgfiles_destroy(db);
+
+	/* A truncated record at the end of the journal is discarded. */
+	fail_if(stat(journal, &statbuf) < 0);
+	size = statbuf.st_size;
+	fail_if(truncate(journal, size - 3) < 0);
+	db = openjournal();
+	fail_if(pe_pgfiles_count(db) != 50, "Damaged record was replayed");
+	fail_if(pe_pgfiles_add(db, 1, 1000, "/tmp/new") != 1);
+	pe_pgfiles_destroy(db);
+	db = openjournal();
+	fail_if(pe_pgfiles_count(db) != 51, "Record after repair was lost");
+	pe_pgfiles_destroy(db);
+}
+END_TEST
+
+TCase *
+anoubisd_testcase_pe_pgfiles(void)
+{
+	TCase *tc = tcase_create("Playground Files");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, tc_pgfiles_basic);
+	tcase_add_test(tc, tc_pgfiles_rename);
+	tcase_add_test(tc, tc_pgfiles_journal);
+
+	return (tc);
+}
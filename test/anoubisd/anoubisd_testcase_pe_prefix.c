@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "anoubisd.h"
+#include "pe.h"
+#include <anoubisd_unit.h>
+
+/*
+ * A synthetic sandbox rule block that resembles real world policies:
+ * A default rule, a rule for "/" and many rules for directories at
+ * different depths below a few common top level directories.
+ */
+#define NUSERS		20
+#define NAPPS		10
+#define NPATHS		5000
+#define NLOOKUPS	20
+#define MAXRULES	(2 + 3 * NUSERS * NAPPS + 64)
+
+static struct apn_rule	 block;
+static struct apn_rule	 rules[MAXRULES];
+static char		*prefixes[MAXRULES];
+static int		 nrules;
+static char		*paths[NPATHS];
+
+static void
+add_rule(const char *prefix)
+{
+	struct apn_rule	*rule;
+
+	fail_if(nrules >= MAXRULES, "Too many rules");
+	rule = &rules[nrules];
+	memset(rule, 0, sizeof(*rule));
+	if (prefix) {
+		rule->apn_type = APN_SB_ACCESS;
+		prefixes[nrules] = strdup(prefix);
+		fail_if(prefixes[nrules] == NULL, "Out of memory");
+		rule->rule.sbaccess.path = prefixes[nrules];
+	} else {
+		rule->apn_type = APN_DEFAULT;
+		prefixes[nrules] = NULL;
+	}
+	rule->apn_id = nrules + 1;
+	TAILQ_INSERT_TAIL(&block.rule.chain, rule, entry);
+	nrules++;
+}
+
+static void
+setup_rules(void)
+{
+	char	buf[256];
+	int	u, a;
+
+	memset(&block, 0, sizeof(block));
+	TAILQ_INIT(&block.rule.chain);
+	nrules = 0;
+	add_rule("/");
+	for (u = 0; u < NUSERS; ++u) {
+		for (a = 0; a < NAPPS; ++a) {
+			sprintf(buf, "/home/user%d/.config/app%d", u, a);
+			add_rule(buf);
+			sprintf(buf, "/home/user%d/.local/share/app%d/data",
+			    u, a);
+			add_rule(buf);
+			sprintf(buf, "/usr/lib/app%d/plugins/p%d", a, u);
+			add_rule(buf);
+		}
+	}
+	for (u = 0; u < 16; ++u) {
+		sprintf(buf, "/var/lib/service%d", u);
+		add_rule(buf);
+		sprintf(buf, "/home/user%d", u);
+		add_rule(buf);
+		sprintf(buf, "/etc/service%d/conf.d", u);
+		add_rule(buf);
+		sprintf(buf, "/usr/lib/app%d", u);
+		add_rule(buf);
+	}
+	add_rule(NULL);
+}
+
+static void
+setup_paths(void)
+{
+	char	buf[512];
+	int	i;
+
+	srandom(4711);
+	for (i = 0; i < NPATHS; ++i) {
+		int	u = random() % (NUSERS + 4);
+		int	a = random() % (NAPPS + 2);
+
+		switch (i % 5) {
+		case 0:
+			sprintf(buf, "/home/user%d/.config/app%d/cache/"
+			    "thumbnails/large/%d/%d/image%d.png", u, a,
+			    (int)(random() % 16), (int)(random() % 16), i);
+			break;
+		case 1:
+			sprintf(buf, "/home/user%d/.local/share/app%d/data/"
+			    "db/index/shard%d/segment%d", u, a,
+			    (int)(random() % 8), i);
+			break;
+		case 2:
+			sprintf(buf, "/usr/lib/app%d/plugins/p%d/lib/modules/"
+			    "x86_64/generic/mod%d.so", a, u, i);
+			break;
+		case 3:
+			sprintf(buf, "/var/lib/service%d/spool/queue/%d/%d/msg%d",
+			    u, (int)(random() % 100), (int)(random() % 100), i);
+			break;
+		default:
+			sprintf(buf, "/home/user%d/src/project%d/src/main/java/"
+			    "org/example/pkg%d/File%d.java", u, a,
+			    (int)(random() % 10), i);
+			break;
+		}
+		paths[i] = strdup(buf);
+		fail_if(paths[i] == NULL, "Out of memory");
+	}
+}
+
+static void
+teardown(void)
+{
+	int	i;
+
+	for (i = 0; i < nrules; ++i)
+		free(prefixes[i]);
+	for (i = 0; i < NPATHS; ++i)
+		free(paths[i]);
+	nrules = 0;
+}
+
+/*
+ * Return true if the prefix of the rule with index idx is a path
+ * prefix of path.
+ */
+static int
+prefix_matches(int idx, const char *path)
+{
+	const char	*prefix = prefixes[idx];
+	int		 len;
+
+	if (prefix == NULL || strcmp(prefix, "/") == 0)
+		return 1;
+	len = strlen(prefix);
+	if (strncmp(prefix, path, len) != 0)
+		return 0;
+	return path[len] == 0 || path[len] == '/';
+}
+
+/*
+ * Verify a candidate list: All rules must be in rule order, all rules
+ * with a matching prefix must be present. If exact is true no other
+ * rules may be present.
+ */
+static void
+check_candidates(struct apnarr_array arr, const char *path, int exact)
+{
+	size_t	i = 0;
+	int	idx, cnt = 0;
+
+	for (idx = 0; idx < nrules; ++idx) {
+		int	match = prefix_matches(idx, path);
+
+		if (i < apnarr_size(arr) && apnarr_access(arr, i)
+		    == &rules[idx]) {
+			fail_if(exact && !match,
+			    "Unexpected rule %d for %s", idx, path);
+			i++;
+			continue;
+		}
+		fail_if(match, "Rule %d missing for %s", idx, path);
+	}
+	fail_if(i != apnarr_size(arr), "Candidates for %s out of order",
+	    path);
+	for (idx = 0; idx < nrules; ++idx)
+		cnt += prefix_matches(idx, path);
+	fail_if(exact && cnt != (int)apnarr_size(arr),
+	    "Wrong number of candidates for %s", path);
+}
+
+/*
+ * Look up all paths NLOOKUPS times using the given backend and
+ * return the elapsed time in microseconds.
+ */
+static long
+run_lookups(int backend)
+{
+	struct timeval	 start, end;
+	int		 i, j;
+
+	pe_set_prefix_backend(backend);
+	fail_if(pe_build_prefixhash(&block) < 0, "Cannot build index");
+	for (i = 0; i < NPATHS; ++i) {
+		struct apnarr_array	arr;
+
+		fail_if(pe_prefix_getrules(&block, paths[i], &arr) < 0,
+		    "Lookup failed for %s", paths[i]);
+		check_candidates(arr, paths[i], backend == PE_PREFIX_TRIE);
+		pe_prefix_putrules(&block, arr);
+	}
+	gettimeofday(&start, NULL);
+	for (j = 0; j < NLOOKUPS; ++j) {
+		for (i = 0; i < NPATHS; ++i) {
+			struct apnarr_array	arr;
+
+			pe_prefix_getrules(&block, paths[i], &arr);
+			pe_prefix_putrules(&block, arr);
+		}
+	}
+	gettimeofday(&end, NULL);
+	pe_userdata_destroy(block.userdata);
+	block.userdata = NULL;
+	return (end.tv_sec - start.tv_sec) * 1000000L
+	    + (end.tv_usec - start.tv_usec);
+}
+
+/*
+ * Both backends must return correct candidate lists for deep paths.
+ * The timings are reported for comparison.
+ */
+START_TEST(tc_prefix_bench)
+{
+	long	thash, ttrie;
+
+	setup_rules();
+	setup_paths();
+	thash = run_lookups(PE_PREFIX_HASH);
+	ttrie = run_lookups(PE_PREFIX_TRIE);
+	printf("prefix index: %d rules, %d lookups: hash %ld us, "
+	    "trie %ld us\n", nrules, NPATHS * NLOOKUPS, thash, ttrie);
+	pe_set_prefix_backend(PE_PREFIX_TRIE);
+	teardown();
+}
+END_TEST
+
+/*
+ * Special cases: No path, relative paths and paths that are only
+ * prefixes of rule paths on a byte level.
+ */
+START_TEST(tc_prefix_special)
+{
+	int	backend;
+
+	for (backend = PE_PREFIX_HASH; backend <= PE_PREFIX_TRIE; ++backend) {
+		struct apnarr_array	arr;
+		int			exact = (backend == PE_PREFIX_TRIE);
+
+		setup_rules();
+		pe_set_prefix_backend(backend);
+		fail_if(pe_build_prefixhash(&block) < 0, "Cannot build index");
+
+		fail_if(pe_prefix_getrules(&block, NULL, &arr) < 0);
+		fail_if(apnarr_size(arr) < 1);
+		fail_if(apnarr_access(arr, apnarr_size(arr)-1)
+		    != &rules[nrules-1], "Default rule missing");
+		pe_prefix_putrules(&block, arr);
+
+		fail_if(pe_prefix_getrules(&block, "relative/path",
+		    &arr) != -EINVAL);
+
+		fail_if(pe_prefix_getrules(&block, "/", &arr) < 0);
+		check_candidates(arr, "/", exact);
+		pe_prefix_putrules(&block, arr);
+
+		fail_if(pe_prefix_getrules(&block, "/home/user1x/a",
+		    &arr) < 0);
+		check_candidates(arr, "/home/user1x/a", exact);
+		pe_prefix_putrules(&block, arr);
+
+		fail_if(pe_prefix_getrules(&block, "/home/user1",
+		    &arr) < 0);
+		check_candidates(arr, "/home/user1", exact);
+		pe_prefix_putrules(&block, arr);
+
+		pe_userdata_destroy(block.userdata);
+		block.userdata = NULL;
+		teardown();
+	}
+	pe_set_prefix_backend(PE_PREFIX_TRIE);
+}
+END_TEST
+
+/*
+ * Testcases
+ */
+TCase *
+anoubisd_testcase_pe_prefix(void)
+{
+	TCase *tc = tcase_create("PrefixIndex");
+
+	tcase_set_timeout(tc, 120);
+	tcase_add_test(tc, tc_prefix_special);
+	tcase_add_test(tc, tc_prefix_bench);
+
+	return (tc);
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "anoubisd.h"
+#include "pe.h"
+#include <anoubisd_unit.h>
+
+#ifdef LINUX
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <dev/anoubis.h>
+#endif
+
+/*
+ * Number of processes that are alive at the same time. This is more
+ * than the number of slots in the process hash, i.e. there are collisions.
+ */
+#define NPROC		20000
+#define NROUNDS		8
+#define INIT_COOKIE	1
+
+/*
+ * Cookie of the i-th process in a given round. The second half of
+ * each round is the first half of the next round, i.e. these processes
+ * survive one round of forks and exits.
+ */
+#define COOKIE(ROUND, I)	(1000 + (ROUND) * (NPROC/2) + (I))
+
+/* Policy database hooks of the test stubs (see test_peunit.c). */
+extern struct apn_ruleset	*(*pe_user_get_ruleset_p)(uid_t, unsigned int);
+extern unsigned long		 pe_user_generation_val;
+extern int			 pe_user_retired_dbs_val;
+
+/* The admin ruleset returned by the ruleset hook. */
+static struct apn_ruleset	*cur_rs;
+
+static int
+tracked(anoubis_cookie_t cookie)
+{
+	struct pe_proc	*proc = pe_proc_get(cookie);
+
+	if (proc == NULL)
+		return 0;
+	fail_if(pe_proc_task_cookie(proc) != cookie,
+	    "pe_proc_get(%lld) returned process with cookie %lld",
+	    (long long)cookie, (long long)pe_proc_task_cookie(proc));
+	pe_proc_put(proc);
+	return 1;
+}
+
+static struct apn_ruleset *
+get_ruleset(uid_t uid __used, unsigned int prio)
+{
+	if (prio == PE_PRIO_ADMIN)
+		return cur_rs;
+	return NULL;
+}
+
+static struct apn_ruleset *
+parse_ruleset(const char *text)
+{
+	struct apn_ruleset	*rs;
+	struct iovec		 iov;
+
+	iov.iov_base = (void *)text;
+	iov.iov_len = strlen(text);
+	fail_if(apn_parse_iovec("<proc>", &iov, 1, &rs, 0) != 0,
+	    "Cannot parse policy");
+	rs->destructor = &pe_userdata_destroy;
+	return rs;
+}
+
+/*
+ * Return true if the admin context of the process uses the ALF rules
+ * from the given ruleset.
+ */
+static int
+uses_ruleset(anoubis_cookie_t cookie, struct apn_ruleset *rs)
+{
+	struct pe_proc	*proc = pe_proc_get(cookie);
+	struct apn_rule	*rule;
+
+	fail_if(proc == NULL, "Process %lld not tracked", (long long)cookie);
+	rule = pe_context_get_alfrule(pe_proc_get_context(proc,
+	    PE_PRIO_ADMIN));
+	pe_proc_put(proc);
+	return rule != NULL && rule == TAILQ_FIRST(&rs->alf_queue);
+}
+
+/*
+ * Fork and exit a large number of processes and verify that each lookup
+ * finds exactly the right process.
+ */
+START_TEST(tc_proc_churn)
+{
+	int		round, i;
+
+	pe_init();
+	pe_proc_fork(0, INIT_COOKIE, 0, 0);
+
+	for (round = 0; round < NROUNDS; ++round) {
+		for (i = 0; i < NPROC; ++i) {
+			/* Second half of the previous round is still alive. */
+			if (round && i < NPROC/2)
+				continue;
+			pe_proc_fork(0, COOKIE(round, i), INIT_COOKIE, 0);
+		}
+		for (i = 0; i < NPROC; ++i) {
+			fail_unless(tracked(COOKIE(round, i)),
+			    "Process %d missing in round %d",
+			    COOKIE(round, i), round);
+			pe_proc_add_thread(COOKIE(round, i));
+			fail_unless(pe_proc_is_running(COOKIE(round, i)),
+			    "Process %d not running", COOKIE(round, i));
+		}
+		/* Exit the first half in reverse order. */
+		for (i = NPROC/2 - 1; i >= 0; --i) {
+			pe_proc_remove_thread(COOKIE(round, i));
+#ifdef ANOUBIS_PROCESS_OP_CREATE
+			fail_if(pe_proc_is_running(COOKIE(round, i)),
+			    "Process %d without threads is running",
+			    COOKIE(round, i));
+#endif
+			pe_proc_exit(COOKIE(round, i));
+			fail_if(tracked(COOKIE(round, i)),
+			    "Process %d still tracked after exit",
+			    COOKIE(round, i));
+		}
+		for (i = NPROC/2; i < NPROC; ++i) {
+			fail_unless(tracked(COOKIE(round, i)),
+			    "Process %d lost in round %d",
+			    COOKIE(round, i), round);
+			pe_proc_remove_thread(COOKIE(round, i));
+		}
+	}
+	/* Exit the remaining processes. */
+	for (i = NPROC/2; i < NPROC; ++i) {
+		pe_proc_exit(COOKIE(NROUNDS-1, i));
+		fail_if(tracked(COOKIE(NROUNDS-1, i)),
+		    "Process %d still tracked after exit",
+		    COOKIE(NROUNDS-1, i));
+	}
+	for (i = 0; i < COOKIE(NROUNDS, 0); ++i) {
+		if (i == INIT_COOKIE)
+			continue;
+		fail_if(tracked(i), "Unexpected process %d", i);
+	}
+	fail_unless(tracked(INIT_COOKIE), "Init process lost");
+	pe_proc_exit(INIT_COOKIE);
+	fail_if(tracked(INIT_COOKIE), "Init process still tracked");
+
+	pe_shutdown();
+}
+END_TEST
+
+/*
+ * Additional instances keep a process alive until the last instance
+ * exits.
+ */
+START_TEST(tc_proc_instances)
+{
+	pe_init();
+
+	pe_proc_fork(0, 17, 0, 0);
+	pe_proc_addinstance(17);
+	pe_proc_exit(17);
+	fail_unless(tracked(17), "Process 17 gone with instance left");
+	pe_proc_exit(17);
+	fail_if(tracked(17), "Process 17 still tracked");
+	pe_proc_exit(17);
+	fail_if(tracked(17), "Process 17 reappeared");
+
+	/* Reuse of the same cookie. */
+	pe_proc_fork(0, 17, 0, 0);
+	fail_unless(tracked(17), "Process 17 not tracked after reuse");
+	pe_proc_exit(17);
+	fail_if(tracked(17), "Process 17 still tracked");
+
+	pe_shutdown();
+}
+END_TEST
+
+/*
+ * A new policy database is picked up by each process with its next
+ * event. Idle processes are refreshed by pe_proc_refresh_stale in
+ * batches.
+ */
+START_TEST(tc_proc_refresh)
+{
+	struct apn_ruleset	*rs1, *rs2;
+	int			 i, cnt;
+
+	rs1 = parse_ruleset("apnversion 1.0\nalf {\nany {\n"
+	    "default allow\n}\n}\n");
+	rs2 = parse_ruleset("apnversion 1.0\nalf {\nany {\n"
+	    "default deny\n}\n}\n");
+	cur_rs = rs1;
+	pe_user_get_ruleset_p = &get_ruleset;
+
+	pe_init();
+	pe_proc_fork(0, INIT_COOKIE, 0, 0);
+	for (i = 0; i < NPROC; ++i)
+		pe_proc_fork(0, COOKIE(0, i), INIT_COOKIE, 0);
+	fail_unless(uses_ruleset(INIT_COOKIE, rs1), "Wrong initial context");
+	fail_unless(uses_ruleset(COOKIE(0, 0), rs1), "Context not inherited");
+
+	/* Reload: No process is touched until it is used. */
+	cur_rs = rs2;
+	pe_user_generation_val++;
+	pe_user_retired_dbs_val = 1;
+	fail_unless(uses_ruleset(COOKIE(0, 0), rs2),
+	    "Context not refreshed by pe_proc_get");
+	pe_proc_fork(0, COOKIE(1, 0), COOKIE(0, 1), 0);
+	fail_unless(uses_ruleset(COOKIE(1, 0), rs2),
+	    "Child inherited stale context");
+
+	cnt = pe_proc_refresh_stale(100);
+	fail_if(cnt != 100, "Refreshed %d instead of 100 processes", cnt);
+	/*
+	 * Init and COOKIE(0, 2) to COOKIE(0, 100) are refreshed. The next
+	 * batch starts at COOKIE(0, 101), it must cope with an exit.
+	 */
+	pe_proc_exit(COOKIE(0, 101));
+	/* The children minus COOKIE(0, 0) to COOKIE(0, 101). */
+	cnt = pe_proc_refresh_stale(2 * NPROC);
+	fail_if(cnt != NPROC - 102, "Refreshed %d instead of %d processes",
+	    cnt, NPROC - 102);
+	cnt = pe_proc_refresh_stale(2 * NPROC);
+	fail_if(cnt != 0, "%d processes still stale", cnt);
+	for (i = 0; i < NPROC; ++i) {
+		if (i == 101)
+			continue;
+		fail_unless(uses_ruleset(COOKIE(0, i), rs2),
+		    "Process %d not refreshed", COOKIE(0, i));
+	}
+
+	/* Nothing to do if no old database is alive. */
+	pe_user_generation_val++;
+	pe_user_retired_dbs_val = 0;
+	fail_if(pe_proc_refresh_stale(2 * NPROC) != 0,
+	    "Refresh without retired database");
+
+	for (i = 0; i < NPROC; ++i)
+		pe_proc_exit(COOKIE(0, i));
+	pe_proc_exit(COOKIE(1, 0));
+	pe_proc_exit(INIT_COOKIE);
+	pe_shutdown();
+
+	pe_user_get_ruleset_p = NULL;
+	cur_rs = NULL;
+	apn_free_ruleset(rs1);
+	apn_free_ruleset(rs2);
+}
+END_TEST
+
+/*
+ * Testcases
+ */
+TCase *
+anoubisd_testcase_pe_proc(void)
+{
+	TCase *tc = tcase_create("ProcTracker");
+
+	tcase_set_timeout(tc, 120);
+	tcase_add_test(tc, tc_proc_churn);
+	tcase_add_test(tc, tc_proc_instances);
+	tcase_add_test(tc, tc_proc_refresh);
+
+	return (tc);
+}
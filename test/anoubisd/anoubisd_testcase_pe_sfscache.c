@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <anoubis_protocol.h>
+#include "anoubisd.h"
+#include "sfs.h"
+#include <anoubisd_unit.h>
+
+#define NPATHS		20000
+
+/* Checksum backend hooks of the test stubs (see test_peunit.c). */
+extern int	(*sfs_checksumop_chroot_p)(const struct sfs_checksumop *,
+		    struct sfs_data *);
+extern int	(*sfs_foreach_file_chroot_p)(void (*)(const char *, void *),
+		    void *);
+
+/* Number of times the checksum backend was asked for a checksum. */
+static int	nreads;
+
+/*
+ * Derive a checksum from the request parameters. This allows us to verify
+ * the data returned from the cache.
+ */
+static void
+fill_csum(u_int8_t *buf, const char *path, uid_t uid, unsigned char key)
+{
+	int	i, len = strlen(path);
+
+	for (i=0; i<ANOUBIS_CS_LEN; ++i)
+		buf[i] = path[i % len] + i + uid + key;
+}
+
+/*
+ * Fake checksum backend: Paths that contain "missing" have no checksum,
+ * all other paths have an unsigned checksum and a signature with
+ * additional data.
+ */
+static int
+fake_checksumop(const struct sfs_checksumop *csop, struct sfs_data *data)
+{
+	struct abuf_buffer	buf;
+	unsigned char		key = 0;
+
+	nreads++;
+	if (strstr(csop->path, "missing"))
+		return -ENOENT;
+	if (csop->op == ANOUBIS_CHECKSUM_OP_GETSIG2) {
+		fail_if(abuf_length(csop->keyid) != 2, "Bad key length");
+		abuf_copy_frombuf(&key, csop->keyid, 1);
+		fail_if(key != 0xab, "Bad key-ID %x", key);
+		buf = abuf_alloc(ANOUBIS_CS_LEN + 64);
+	} else {
+		fail_if(csop->op != ANOUBIS_CHECKSUM_OP_GET2);
+		buf = abuf_alloc(ANOUBIS_CS_LEN);
+	}
+	fail_if(abuf_empty(buf), "Out of memory");
+	fill_csum(abuf_toptr(buf, 0, ANOUBIS_CS_LEN), csop->path,
+	    csop->uid, key);
+	if (csop->op == ANOUBIS_CHECKSUM_OP_GETSIG2)
+		data->sigdata = buf;
+	else
+		data->csdata = buf;
+	return 0;
+}
+
+static void
+check_csum(struct abuf_buffer csum, const char *path, uid_t uid,
+    unsigned char key)
+{
+	u_int8_t	expect[ANOUBIS_CS_LEN];
+
+	fill_csum(expect, path, uid, key);
+	fail_if(abuf_length(csum) != ANOUBIS_CS_LEN, "Bad checksum length");
+	fail_if(memcmp(abuf_toptr(csum, 0, ANOUBIS_CS_LEN), expect,
+	    ANOUBIS_CS_LEN) != 0, "Bad checksum for %s", path);
+}
+
+static void
+setup(void)
+{
+	sfs_checksumop_chroot_p = fake_checksumop;
+	sfshash_init();
+	sfshash_set_limit(ANOUBISD_SFSCACHE_SIZE);
+	nreads = 0;
+}
+
+static void
+teardown(void)
+{
+	sfshash_flush();
+	sfs_checksumop_chroot_p = NULL;
+	sfs_foreach_file_chroot_p = NULL;
+	sfshash_load_filter();
+}
+
+/*
+ * Fake SFS tree scan: Only files in /bin have checksums.
+ */
+static int
+fake_foreach(void (*callback)(const char *, void *), void *arg)
+{
+	char	path[64];
+	int	i;
+
+	for (i=0; i<1000; ++i) {
+		sprintf(path, "/bin/file%d", i);
+		callback(path, arg);
+	}
+	callback("/bin/ls", arg);
+	return 0;
+}
+
+static int
+fake_foreach_fail(void (*callback)(const char *, void *), void *arg)
+{
+	callback("/bin/ls", arg);
+	return -EACCES;
+}
+
+/*
+ * Lookups, negative entries and invalidation.
+ */
+START_TEST(tc_sfscache_basic)
+{
+	struct abuf_buffer	csum;
+	struct sfshash_stats	s1, s2;
+	u_int8_t		key[2] = { 0xab, 0x01 };
+
+	setup();
+	sfshash_getstats(&s1);
+
+	fail_if(sfshash_get_uid("/bin/ls", 1000, &csum) < 0);
+	check_csum(csum, "/bin/ls", 1000, 0);
+	abuf_free(csum);
+	fail_if(sfshash_get_uid("/bin/ls", 1000, &csum) < 0);
+	check_csum(csum, "/bin/ls", 1000, 0);
+	abuf_free(csum);
+	fail_if(nreads != 1, "Checksum not cached");
+
+	/* Different user, same path. */
+	fail_if(sfshash_get_uid("/bin/ls", 1001, &csum) < 0);
+	check_csum(csum, "/bin/ls", 1001, 0);
+	abuf_free(csum);
+	fail_if(nreads != 2);
+
+	/* Negative entries. */
+	fail_if(sfshash_get_uid("/bin/missing", 1000, &csum) != -ENOENT);
+	fail_if(sfshash_get_uid("/bin/missing", 1000, &csum) != -ENOENT);
+	fail_if(nreads != 3, "Negative entry not cached");
+
+	/* Signatures: Only the checksum part is returned. */
+	fail_if(sfshash_get_key("/bin/ls", "aB01", &csum) < 0);
+	check_csum(csum, "/bin/ls", 0, 0xab);
+	abuf_free(csum);
+	fail_if(sfshash_get_key("/bin/ls", "Ab01", &csum) < 0);
+	check_csum(csum, "/bin/ls", 0, 0xab);
+	abuf_free(csum);
+	fail_if(nreads != 4, "Signature not cached");
+	fail_if(sfshash_get_key("/bin/ls", "xyz", &csum) != -ENOENT);
+	fail_if(sfshash_get_keyid("/bin/ls", abuf_open_frommem(key, 2),
+	    &csum) < 0);
+	check_csum(csum, "/bin/ls", 0, 0xab);
+	abuf_free(csum);
+	fail_if(nreads != 4, "Binary and hex key-IDs differ");
+
+	/* Invalidation only affects the given path/uid pair. */
+	sfshash_invalidate_uid("/bin/ls", 1000);
+	fail_if(sfshash_get_uid("/bin/ls", 1001, &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 4);
+	fail_if(sfshash_get_uid("/bin/ls", 1000, &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 5, "Entry not invalidated");
+	sfshash_invalidate_keyid("/bin/ls", abuf_open_frommem(key, 2));
+	fail_if(sfshash_get_key("/bin/ls", "ab01", &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 6, "Signature not invalidated");
+
+	sfshash_getstats(&s2);
+	fail_if(s2.misses - s1.misses != 6, "Bad miss count");
+	fail_if(s2.hits - s1.hits != 5, "Bad hit count");
+	fail_if(s2.entries != 4, "Bad entry count %lld",
+	    (long long)s2.entries);
+	fail_if(s2.bytes == 0 || s2.bytes > s2.limit);
+
+	teardown();
+}
+END_TEST
+
+/*
+ * Memory limit, LRU eviction and growth of the hash tables.
+ */
+START_TEST(tc_sfscache_limit)
+{
+	struct abuf_buffer	 csum;
+	struct sfshash_stats	 s;
+	char			 path[64];
+	int			 i, round;
+
+	setup();
+
+	/* Everything fits: All lookups in the second round are hits. */
+	for (round = 0; round < 2; ++round) {
+		for (i=0; i<NPATHS; ++i) {
+			sprintf(path, "/usr/lib/file%d", i);
+			fail_if(sfshash_get_uid(path, 0, &csum) < 0);
+			check_csum(csum, path, 0, 0);
+			abuf_free(csum);
+		}
+	}
+	fail_if(nreads != NPATHS, "%d reads for %d paths", nreads, NPATHS);
+	sfshash_getstats(&s);
+	fail_if(s.entries != NPATHS);
+	fail_if(s.evictions != 0);
+
+	/* Shrinking the limit evicts entries immediately. */
+	sfshash_set_limit(s.bytes / 4);
+	sfshash_getstats(&s);
+	fail_if(s.bytes > s.limit, "Cache exceeds limit");
+	fail_if(s.evictions == 0 || s.entries >= NPATHS);
+
+	/*
+	 * A small working set that is used repeatedly must stay in the
+	 * cache even if many other paths are looked up in between.
+	 */
+	nreads = 0;
+	for (i=0; i<NPATHS; ++i) {
+		sprintf(path, "/hot/file%d", i % 16);
+		fail_if(sfshash_get_uid(path, 0, &csum) < 0);
+		abuf_free(csum);
+		sprintf(path, "/cold/file%d", i);
+		fail_if(sfshash_get_uid(path, 0, &csum) < 0);
+		abuf_free(csum);
+	}
+	fail_if(nreads != NPATHS + 16, "Hot entries evicted");
+	sfshash_getstats(&s);
+	fail_if(s.bytes > s.limit, "Cache exceeds limit");
+
+	/* A limit of zero disables the cache. */
+	sfshash_set_limit(0);
+	sfshash_getstats(&s);
+	fail_if(s.entries != 0 || s.bytes != 0);
+	nreads = 0;
+	fail_if(sfshash_get_uid("/bin/ls", 0, &csum) < 0);
+	abuf_free(csum);
+	fail_if(sfshash_get_uid("/bin/ls", 0, &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 2);
+	sfshash_getstats(&s);
+	fail_if(s.entries != 0);
+
+	teardown();
+}
+END_TEST
+
+/*
+ * Negative lookup filter: Paths without a checksum in the SFS tree
+ * must not cause any lookups in the tree.
+ */
+START_TEST(tc_sfscache_filter)
+{
+	struct abuf_buffer	 csum;
+	struct sfshash_stats	 s1, s2;
+	char			 path[64];
+	int			 i;
+
+	setup();
+	sfs_foreach_file_chroot_p = fake_foreach;
+	sfshash_load_filter();
+	sfshash_getstats(&s1);
+
+	for (i=0; i<1000; ++i) {
+		sprintf(path, "/usr/bin/file%d", i);
+		fail_if(sfshash_get_uid(path, 0, &csum) != -ENOENT);
+	}
+	sfshash_getstats(&s2);
+	/* Allow for some false positives. */
+	fail_if(nreads > 20, "%d tree lookups for unknown files", nreads);
+	fail_if(s2.filtered - s1.filtered + nreads != 1000);
+	fail_if(s2.entries != (unsigned)nreads);
+
+	/* No false negatives. */
+	nreads = 0;
+	for (i=0; i<1000; ++i) {
+		sprintf(path, "/bin/file%d", i);
+		fail_if(sfshash_get_uid(path, 0, &csum) < 0);
+		check_csum(csum, path, 0, 0);
+		abuf_free(csum);
+	}
+	fail_if(nreads != 1000);
+
+	/* Checksums added later are reported by an invalidate message. */
+	nreads = 0;
+	sfshash_invalidate_uid("/sbin/new", 0);
+	fail_if(sfshash_get_uid("/sbin/new", 0, &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 1, "New checksum filtered");
+
+	/* A flush (reload or upgrade) keeps the filter including updates. */
+	sfshash_flush();
+	nreads = 0;
+	fail_if(sfshash_get_uid("/sbin/new", 0, &csum) < 0);
+	abuf_free(csum);
+	fail_if(nreads != 1, "New checksum filtered after flush");
+	sfshash_getstats(&s1);
+	for (i=0; i<100; ++i) {
+		sprintf(path, "/usr/bin/file%d", i);
+		fail_if(sfshash_get_uid(path, 0, &csum) != -ENOENT);
+	}
+	sfshash_getstats(&s2);
+	fail_if(s2.filtered - s1.filtered < 80, "Filter lost after flush");
+
+	/* The filter is disabled if the tree cannot be scanned. */
+	sfs_foreach_file_chroot_p = fake_foreach_fail;
+	sfshash_load_filter();
+	nreads = 0;
+	fail_if(sfshash_get_uid("/etc/missing", 0, &csum) != -ENOENT);
+	fail_if(nreads != 1, "Incomplete filter used");
+
+	teardown();
+}
+END_TEST
+
+TCase *
+anoubisd_testcase_pe_sfscache(void)
+{
+	TCase *tc = tcase_create("SfsCache");
+
+	tcase_set_timeout(tc, 120);
+	tcase_add_test(tc, tc_sfscache_basic);
+	tcase_add_test(tc, tc_sfscache_limit);
+	tcase_add_test(tc, tc_sfscache_filter);
+
+	return (tc);
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef LINUX
+#include <linux/anoubis_alf.h>
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <sys/anoubis_alf.h>
+#include <dev/anoubis.h>
+#endif
+
+#include "anoubisd.h"
+#include "pe.h"
+#include <anoubisd_unit.h>
+
+/*
+ * An admin policy with a single ALF block for all applications. It
+ * consists of NRULES filter rules for distinct networks and a default
+ * deny rule. Events that do not match any filter rule must be checked
+ * against all rules.
+ */
+#define NRULES		2000
+#define NEVENTS		20000
+
+/* Ruleset hook of the test stubs (see test_peunit.c). */
+extern struct apn_ruleset	*(*pe_user_get_ruleset_p)(uid_t, unsigned int);
+
+static struct apn_ruleset	*rs;
+static struct anoubisd_msg	*events[NEVENTS];
+static int			 expected[NEVENTS];
+static int			 results[NEVENTS];
+
+static struct apn_ruleset *
+get_ruleset(uid_t uid __used, unsigned int prio)
+{
+	if (prio == PE_PRIO_ADMIN)
+		return rs;
+	return NULL;
+}
+
+static void
+setup_ruleset(void)
+{
+	struct iovec	 iov;
+	char		*buf;
+	int		 i, off, len = 100 + NRULES * 80;
+
+	buf = malloc(len);
+	fail_if(buf == NULL, "Out of memory");
+	off = snprintf(buf, len, "apnversion 1.0\nalf {\nany {\n");
+	for (i = 0; i < NRULES; ++i) {
+		off += snprintf(buf + off, len - off, "allow connect tcp "
+		    "from any to 10.%d.%d.0/24 port %d\n", i / 250, i % 250,
+		    1000 + i % 100);
+	}
+	off += snprintf(buf + off, len - off, "default deny\n}\n}\n");
+	fail_if(off >= len, "Policy buffer too small");
+	iov.iov_base = buf;
+	iov.iov_len = off;
+	fail_if(apn_parse_iovec("<workers>", &iov, 1, &rs, 0) != 0,
+	    "Cannot parse policy");
+	rs->destructor = &pe_userdata_destroy;
+	free(buf);
+	pe_user_get_ruleset_p = &get_ruleset;
+}
+
+/*
+ * Roughly half of the events match a filter rule, the others are
+ * denied by the default rule.
+ */
+static void
+setup_events(void)
+{
+	struct anoubisd_msg	*msg;
+	struct eventdev_hdr	*hdr;
+	struct alf_event	*ev;
+	int			 i, r, size;
+
+	srandom(4711);
+	size = sizeof(struct eventdev_hdr) + sizeof(struct alf_event);
+	for (i = 0; i < NEVENTS; ++i) {
+		msg = calloc(1, sizeof(struct anoubisd_msg) + size);
+		fail_if(msg == NULL, "Out of memory");
+		msg->mtype = ANOUBISD_MSG_EVENTDEV;
+		msg->size = sizeof(struct anoubisd_msg) + size;
+		hdr = (struct eventdev_hdr *)msg->msg;
+		hdr->msg_size = size;
+		hdr->msg_source = ANOUBIS_SOURCE_ALF;
+		hdr->msg_token = i;
+		hdr->msg_uid = 0;
+		hdr->msg_pid = 100 + i;
+		ev = (struct alf_event *)(hdr + 1);
+		ev->common.task_cookie = 1000 + i;
+		ev->family = AF_INET;
+		ev->type = SOCK_STREAM;
+		ev->protocol = IPPROTO_TCP;
+		ev->op = ALF_CONNECT;
+		r = random() % NRULES;
+		ev->local.in_addr.sin_family = AF_INET;
+		ev->local.in_addr.sin_addr.s_addr = htonl(0xc0a80001);
+		ev->local.in_addr.sin_port = htons(40000 + i % 1000);
+		ev->peer.in_addr.sin_family = AF_INET;
+		ev->peer.in_addr.sin_addr.s_addr = htonl(0x0a000001
+		    | ((r / 250) << 16) | ((r % 250) << 8));
+		if (random() % 2)
+			ev->peer.in_addr.sin_port = htons(1000 + r % 100);
+		else
+			ev->peer.in_addr.sin_port = htons(2000 + r % 100);
+		events[i] = msg;
+	}
+}
+
+static void
+teardown(void)
+{
+	int	i;
+
+	for (i = 0; i < NEVENTS; ++i) {
+		free(events[i]);
+		events[i] = NULL;
+	}
+	pe_user_get_ruleset_p = NULL;
+	apn_free_ruleset(rs);
+	rs = NULL;
+}
+
+static void
+reply_cb(struct anoubisd_msg *msg, struct anoubisd_reply *reply)
+{
+	struct eventdev_hdr	*hdr = (struct eventdev_hdr *)msg->msg;
+
+	fail_if(reply == NULL, "No reply for event %d", hdr->msg_token);
+	fail_if(results[hdr->msg_token] != -1, "Duplicate reply for event %d",
+	    hdr->msg_token);
+	results[hdr->msg_token] = reply->reply;
+	free(reply);
+}
+
+static long
+elapsed(struct timeval *start)
+{
+	struct timeval	end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000000L
+	    + (end.tv_usec - start->tv_usec);
+}
+
+/*
+ * Evaluate all events with the given number of worker threads and
+ * return the number of events per second.
+ */
+static long
+run_events(int nworkers)
+{
+	struct timeval	start;
+	long		usec;
+	int		i;
+
+	fail_if(pe_workers_start(nworkers) != 0, "Cannot start workers");
+	fail_if(pe_workers_active() != nworkers, "Wrong number of workers");
+	for (i = 0; i < NEVENTS; ++i)
+		results[i] = -1;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NEVENTS; ++i) {
+		fail_unless(policy_engine_async(events[i], &reply_cb),
+		    "Event %d not processed asynchronously", i);
+		if (i % 1000 == 0)
+			pe_workers_complete();
+	}
+	pe_workers_drain();
+	usec = elapsed(&start);
+	pe_workers_stop();
+	for (i = 0; i < NEVENTS; ++i)
+		fail_if(results[i] != expected[i], "Event %d: reply %d with "
+		    "%d workers, expected %d", i, results[i], nworkers,
+		    expected[i]);
+	return (long)NEVENTS * 1000000L / (usec ? usec : 1);
+}
+
+/*
+ * Decisions made by the worker threads must be identical to the
+ * decisions of the main thread. The throughput is reported for
+ * comparison.
+ */
+START_TEST(tc_workers_stress)
+{
+	struct anoubisd_reply	*reply;
+	struct timeval		 start;
+	long			 sync, w1, w4, w16;
+	int			 i, allowed = 0;
+
+	pe_init();
+	setup_ruleset();
+	setup_events();
+
+	fail_if(policy_engine_async(events[0], &reply_cb),
+	    "Asynchronous processing without workers");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NEVENTS; ++i) {
+		reply = policy_engine(events[i]);
+		fail_if(reply == NULL, "No reply for event %d", i);
+		expected[i] = reply->reply;
+		if (reply->reply == 0)
+			allowed++;
+		free(reply);
+	}
+	sync = (long)NEVENTS * 1000000L / (elapsed(&start) ? : 1);
+	fail_if(allowed == 0 || allowed == NEVENTS,
+	    "Bad test data: %d of %d events allowed", allowed, NEVENTS);
+
+	w1 = run_events(1);
+	w4 = run_events(4);
+	w16 = run_events(16);
+	printf("policy workers: %d rules, %d events: main thread %ld/s, "
+	    "1 worker %ld/s, 4 workers %ld/s, 16 workers %ld/s\n",
+	    NRULES, NEVENTS, sync, w1, w4, w16);
+
+	teardown();
+	pe_shutdown();
+}
+END_TEST
+
+/*
+ * Jobs that are in flight must be completed before the workers stop
+ * and before the policy changes.
+ */
+START_TEST(tc_workers_drain)
+{
+	int	i, cnt;
+
+	pe_init();
+	setup_ruleset();
+	setup_events();
+
+	for (i = 0; i < NEVENTS; ++i)
+		results[i] = -1;
+	fail_if(pe_workers_start(4) != 0, "Cannot start workers");
+	fail_if(pe_workers_fd() < 0, "No notification pipe");
+	for (i = 0; i < 100; ++i)
+		fail_unless(policy_engine_async(events[i], &reply_cb));
+	pe_workers_drain();
+	for (i = 0; i < 100; ++i)
+		fail_if(results[i] == -1, "Event %d not complete", i);
+	for (i = 100; i < 200; ++i)
+		fail_unless(policy_engine_async(events[i], &reply_cb));
+	pe_workers_stop();
+	fail_if(pe_workers_active() != 0, "Workers still active");
+	fail_if(pe_workers_fd() >= 0, "Notification pipe still open");
+	cnt = 0;
+	for (i = 100; i < 200; ++i)
+		cnt += (results[i] != -1);
+	fail_if(cnt != 100, "Only %d of 100 events complete", cnt);
+	fail_if(policy_engine_async(events[0], &reply_cb),
+	    "Asynchronous processing after stop");
+
+	teardown();
+	pe_shutdown();
+}
+END_TEST
+
+/*
+ * Testcases
+ */
+TCase *
+anoubisd_testcase_pe_workers(void)
+{
+	TCase *tc = tcase_create("PolicyWorkers");
+
+	tcase_set_timeout(tc, 300);
+	tcase_add_test(tc, tc_workers_drain);
+	tcase_add_test(tc, tc_workers_stress);
+
+	return (tc);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <dev/anoubis.h>
+#endif
+
+#include "anoubisd.h"
+#include <anoubisd_unit.h>
+
+static char	 cachefile[] = "/tmp/scancache.XXXXXX";
+
+static void
+setup(void)
+{
+	int	fd = mkstemp(cachefile);
+
+	fail_if(fd < 0, "Cannot create %s", cachefile);
+	close(fd);
+}
+
+static void
+teardown(void)
+{
+	fail_if(unlink(cachefile) < 0, "Cannot remove %s", cachefile);
+	strlcpy(cachefile, "/tmp/scancache.XXXXXX", sizeof(cachefile));
+}
+
+/* Create a key that is derived from val. */
+static void
+mkkey(u_int8_t *key, int val)
+{
+	int	i;
+
+	for (i = 0; i < SCANCACHE_KEYLEN; ++i)
+		key[i] = (val >> (8 * (i % 4))) & 0xff;
+}
+
+START_TEST(tc_scancache_basic)
+{
+	struct scancache	*cache, *cache2;
+	u_int8_t		 key[SCANCACHE_KEYLEN];
+	time_t			 now = time(NULL);
+
+	fail_if(scancache_open(cachefile, 4, &cache) != -EINVAL,
+	    "Cache with less slots than the probe window");
+	fail_if(scancache_open(cachefile, 64, &cache) != 0,
+	    "Cannot open cache");
+	mkkey(key, 1);
+	fail_if(scancache_lookup(cache, key, now, 60) != 0,
+	    "Entry in empty cache");
+	fail_if(scancache_store(cache, key, now) != 0, "Cannot store entry");
+	fail_if(scancache_lookup(cache, key, now, 60) != 1, "Entry not found");
+	fail_if(scancache_lookup(cache, key, now + 59, 60) != 1,
+	    "Entry expired too early");
+	fail_if(scancache_lookup(cache, key, now + 60, 60) != 0,
+	    "Entry did not expire");
+	fail_if(scancache_lookup(cache, key, now - 1, 60) != 0,
+	    "Entry from the future is valid");
+	mkkey(key, 2);
+	fail_if(scancache_lookup(cache, key, now, 60) != 0, "Bad entry found");
+
+	/* A second user of the same file sees the entry. */
+	fail_if(scancache_open(cachefile, 64, &cache2) != 0,
+	    "Cannot open cache twice");
+	mkkey(key, 1);
+	fail_if(scancache_lookup(cache2, key, now, 60) != 1,
+	    "Entry not found in second cache");
+	scancache_close(cache2);
+	scancache_close(cache);
+
+	/* A different size re-initializes the cache. */
+	fail_if(scancache_open(cachefile, 128, &cache) != 0,
+	    "Cannot resize cache");
+	fail_if(scancache_lookup(cache, key, now, 60) != 0,
+	    "Entry survived resize");
+	scancache_close(cache);
+}
+END_TEST
+
+START_TEST(tc_scancache_replace)
+{
+	struct scancache	*cache;
+	u_int8_t		 key[SCANCACHE_KEYLEN];
+	struct stat		 statbuf;
+	time_t			 now = time(NULL);
+	int			 i, found;
+
+	fail_if(scancache_open(cachefile, 16, &cache) != 0,
+	    "Cannot open cache");
+	/* Each key is stored with a newer timestamp than the previous one. */
+	for (i = 0; i < 1000; ++i) {
+		mkkey(key, i);
+		fail_if(scancache_store(cache, key, now - 1000 + i) != 0,
+		    "Cannot store entry %d", i);
+	}
+	found = 0;
+	for (i = 0; i < 1000; ++i) {
+		mkkey(key, i);
+		found += scancache_lookup(cache, key, now, 2000);
+	}
+	fail_if(found == 0 || found > 16, "Found %d entries", found);
+	/* The newest entry is never replaced. */
+	mkkey(key, 999);
+	fail_if(scancache_lookup(cache, key, now, 2000) != 1,
+	    "Newest entry was replaced");
+	/* Refreshing an entry does not create a duplicate. */
+	fail_if(scancache_store(cache, key, now) != 0);
+	fail_if(scancache_lookup(cache, key, now, 1) != 1,
+	    "Refreshed entry not found");
+	scancache_close(cache);
+	fail_if(stat(cachefile, &statbuf) < 0);
+	fail_if(statbuf.st_size > 16 + 16 * 40, "Cache grew: %lld",
+	    (long long)statbuf.st_size);
+}
+END_TEST
+
+TCase *
+anoubisd_testcase_scancache(void)
+{
+	TCase *tc = tcase_create("ScanCache");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, tc_scancache_basic);
+	tcase_add_test(tc, tc_scancache_replace);
+
+	return (tc);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <linux/anoubis.h>
+#include <bsdcompat.h>
+#endif
+#ifdef OPENBSD
+#include <dev/anoubis.h>
+#endif
+
+#include "anoubisd.h"
+#include "sfs.h"
+#include <anoubisd_unit.h>
+
+static char	 dir[] = "/tmp/sfsstore.XXXXXX";
+static char	 logfile[sizeof(dir) + 16];
+static char	 idxfile[sizeof(dir) + 16];
+
+static void
+setup(void)
+{
+	fail_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+	snprintf(logfile, sizeof(logfile), "%s/sfs.log", dir);
+	snprintf(idxfile, sizeof(idxfile), "%s/sfs.idx", dir);
+}
+
+static void
+teardown(void)
+{
+	unlink(logfile);
+	unlink(idxfile);
+	fail_if(rmdir(dir) < 0, "Cannot remove %s", dir);
+	strlcpy(dir, "/tmp/sfsstore.XXXXXX", sizeof(dir));
+}
+
+/* Store an unsigned checksum that is derived from val. */
+static void
+put(struct sfs_store *store, const char *path, const char *id, int val)
+{
+	struct sfs_data	data;
+	char		cs[ANOUBIS_CS_LEN];
+
+	memset(cs, val, sizeof(cs));
+	data.csdata = abuf_alloc(sizeof(cs));
+	data.sigdata = data.upgradecsdata = ABUF_EMPTY;
+	abuf_copy_tobuf(data.csdata, cs, sizeof(cs));
+	fail_if(sfs_store_put(store, path, id, &data) != 0,
+	    "Cannot store %s/%s", path, id);
+	sfs_freesfsdata(&data);
+}
+
+/* Return the value of the checksum or a negative error code. */
+static int
+get(struct sfs_store *store, const char *path, const char *id)
+{
+	struct sfs_data	data;
+	char		cs[ANOUBIS_CS_LEN];
+	int		ret;
+
+	ret = sfs_store_get(store, path, id, &data);
+	if (ret < 0)
+		return ret;
+	fail_if(abuf_length(data.csdata) != ANOUBIS_CS_LEN,
+	    "Bad checksum length for %s/%s", path, id);
+	fail_if(!abuf_empty(data.sigdata) || !abuf_empty(data.upgradecsdata),
+	    "Unexpected data for %s/%s", path, id);
+	abuf_copy_frombuf(cs, data.csdata, sizeof(cs));
+	sfs_freesfsdata(&data);
+	return (unsigned char)cs[0];
+}
+
+static int
+collect(const char *path, const char *id, void *arg)
+{
+	char	*buf = arg;
+
+	strlcat(buf, path, 1024);
+	strlcat(buf, ":", 1024);
+	strlcat(buf, id, 1024);
+	strlcat(buf, " ", 1024);
+	return 0;
+}
+
+START_TEST(tc_sfsstore_basic)
+{
+	struct sfs_store	*store, *reader;
+	struct sfs_data		 data;
+
+	fail_if(sfs_store_exists(dir), "Store exists before creation");
+	fail_if(sfs_store_open(dir, 0, &reader) != 0,
+	    "Readers must accept a missing store");
+	fail_if(get(reader, "/bin/ls", "0") != -ENOENT, "Entry in empty store");
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot create store");
+	fail_if(!sfs_store_exists(dir), "Store does not exist");
+
+	put(store, "/bin/ls", "0", 1);
+	put(store, "/bin/ls", "1000", 2);
+	put(store, "/bin/ls", "0", 3);
+	fail_if(get(store, "/bin/ls", "0") != 3, "Wrong value for uid 0");
+	fail_if(get(store, "/bin/ls", "1000") != 2, "Wrong value for uid 1000");
+	fail_if(get(store, "/bin/l", "0") != -ENOENT, "Entry for prefix");
+	fail_if(get(store, "/bin/ls", "100") != -ENOENT, "Entry for bad uid");
+
+	/* The reader sees the modifications of the writer. */
+	fail_if(get(reader, "/bin/ls", "0") != 3, "Reader: wrong value");
+	fail_if(sfs_store_del(store, "/bin/ls", "0") != 0, "Cannot delete");
+	fail_if(sfs_store_del(store, "/bin/ls", "0") != -ENOENT,
+	    "Deleted twice");
+	fail_if(get(store, "/bin/ls", "0") != -ENOENT, "Entry not deleted");
+	fail_if(get(reader, "/bin/ls", "0") != -ENOENT, "Reader: not deleted");
+	fail_if(get(reader, "/bin/ls", "1000") != 2, "Reader: lost entry");
+
+	/* Readers cannot modify the store. */
+	memset(&data, 0, sizeof(data));
+	fail_if(sfs_store_put(reader, "/bin/ls", "0", &data) != -EPERM,
+	    "Reader can write");
+	fail_if(sfs_store_del(reader, "/bin/ls", "1000") != -EPERM,
+	    "Reader can delete");
+
+	sfs_store_close(reader);
+	sfs_store_close(store);
+
+	/* Everything survives a reopen. */
+	fail_if(sfs_store_open(dir, 0, &reader) != 0, "Cannot reopen");
+	fail_if(get(reader, "/bin/ls", "0") != -ENOENT, "Entry not deleted");
+	fail_if(get(reader, "/bin/ls", "1000") != 2, "Lost entry");
+	sfs_store_close(reader);
+}
+END_TEST
+
+START_TEST(tc_sfsstore_foreach)
+{
+	struct sfs_store	*store;
+	char			 buf[1024];
+
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot create store");
+	put(store, "/usr/bin/vi", "0", 1);
+	put(store, "/usr/bin/vi", "kabcd", 1);
+	put(store, "/usr/bin", "0", 1);
+	put(store, "/usr/bin.old/vi", "0", 1);
+	put(store, "/usr/bin/a/b", "1000", 1);
+	put(store, "/usr/binx", "0", 1);
+	put(store, "/etc/passwd", "0", 1);
+
+	buf[0] = 0;
+	fail_if(sfs_store_foreach(store, "/usr/bin", 0, collect, buf) != 0);
+	fail_if(strcmp(buf, "/usr/bin:0 ") != 0, "Entries of file: %s", buf);
+	buf[0] = 0;
+	fail_if(sfs_store_foreach(store, "/usr/bin", 1, collect, buf) != 0);
+	fail_if(strcmp(buf, "/usr/bin/a/b:1000 /usr/bin/vi:0 "
+	    "/usr/bin/vi:kabcd ") != 0, "Entries of directory: %s", buf);
+	buf[0] = 0;
+	fail_if(sfs_store_foreach(store, "/", 1, collect, buf) != 0);
+	fail_if(strcmp(buf, "/etc/passwd:0 /usr/bin:0 /usr/bin.old/vi:0 "
+	    "/usr/bin/a/b:1000 /usr/bin/vi:0 /usr/bin/vi:kabcd "
+	    "/usr/binx:0 ") != 0, "All entries: %s", buf);
+
+	/* The same after a checkpoint (reopen) with deleted entries. */
+	sfs_store_close(store);
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot reopen store");
+	fail_if(sfs_store_del(store, "/usr/bin/vi", "0") != 0);
+	put(store, "/usr/bin/c", "0", 1);
+	buf[0] = 0;
+	fail_if(sfs_store_foreach(store, NULL, 0, collect, buf) != 0);
+	fail_if(strcmp(buf, "/etc/passwd:0 /usr/bin:0 /usr/bin.old/vi:0 "
+	    "/usr/bin/a/b:1000 /usr/bin/c:0 /usr/bin/vi:kabcd "
+	    "/usr/binx:0 ") != 0, "All entries after reopen: %s", buf);
+	sfs_store_close(store);
+}
+END_TEST
+
+/*
+ * A torn write at the end of the log is discarded and a missing or
+ * stale index is rebuilt from the log.
+ */
+START_TEST(tc_sfsstore_recovery)
+{
+	struct sfs_store	*store;
+	struct stat		 statbuf;
+	char			 path[64];
+	off_t			 size;
+	int			 i, fd;
+
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot create store");
+	for (i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/file%d", i);
+		put(store, path, "0", i);
+	}
+	sfs_store_close(store);
+
+	/* Simulate a crash during a write. */
+	fail_if(stat(logfile, &statbuf) < 0);
+	size = statbuf.st_size;
+	fd = open(logfile, O_WRONLY|O_APPEND);
+	fail_if(fd < 0);
+	fail_if(write(fd, "SFSR\0\0\0\0\1\0\0\0\40\0", 14) != 14);
+	close(fd);
+	fail_if(unlink(idxfile) < 0);
+
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot reopen store");
+	fail_if(stat(logfile, &statbuf) < 0);
+	fail_if(statbuf.st_size != size, "Torn record not removed");
+	fail_if(stat(idxfile, &statbuf) < 0, "Index not rebuilt");
+	for (i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/file%d", i);
+		fail_if(get(store, path, "0") != i, "Lost entry %s", path);
+	}
+	put(store, "/file0", "0", 200);
+	sfs_store_close(store);
+
+	/* Damaged data in the middle of the log ends the log. */
+	fd = open(logfile, O_WRONLY);
+	fail_if(fd < 0);
+	fail_if(pwrite(fd, "XXXX", 4, size) != 4);
+	close(fd);
+	fail_if(unlink(idxfile) < 0);
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot reopen store");
+	fail_if(get(store, "/file0", "0") != 0, "Damaged record used");
+	sfs_store_close(store);
+}
+END_TEST
+
+/*
+ * Overwrite entries until the store checkpoints and compacts. A reader
+ * must see the same data before and after the log is replaced.
+ */
+START_TEST(tc_sfsstore_compact)
+{
+	struct sfs_store	*store, *reader;
+	struct stat		 statbuf;
+	char			 path[64];
+	ino_t			 ino;
+	int			 i, k;
+
+	fail_if(sfs_store_open(dir, 1, &store) != 0, "Cannot create store");
+	fail_if(sfs_store_open(dir, 0, &reader) != 0, "Cannot open reader");
+	fail_if(stat(logfile, &statbuf) < 0);
+	ino = statbuf.st_ino;
+	for (k = 0; k < 20; ++k) {
+		for (i = 0; i < 2000; ++i) {
+			snprintf(path, sizeof(path), "/dir%d/file%d", i % 10, i);
+			put(store, path, "1000", (i + k) % 256);
+		}
+		for (i = 0; i < 2000; i += 97) {
+			snprintf(path, sizeof(path), "/dir%d/file%d", i % 10, i);
+			fail_if(get(reader, path, "1000") != (i + k) % 256,
+			    "Reader: wrong value for %s in round %d", path, k);
+		}
+	}
+	fail_if(stat(logfile, &statbuf) < 0);
+	fail_if(statbuf.st_ino == ino, "Log was not compacted");
+
+	fail_if(sfs_store_compact(store) != 0, "Cannot compact");
+	fail_if(stat(logfile, &statbuf) < 0);
+	fail_if(statbuf.st_size > 2000 * 128, "Log too large: %lld",
+	    (long long)statbuf.st_size);
+	for (i = 0; i < 2000; ++i) {
+		snprintf(path, sizeof(path), "/dir%d/file%d", i % 10, i);
+		fail_if(get(store, path, "1000") != (i + 19) % 256,
+		    "Wrong value for %s", path);
+		fail_if(get(reader, path, "1000") != (i + 19) % 256,
+		    "Reader: wrong value for %s", path);
+	}
+	fail_if(sfs_store_compact(reader) != -EPERM, "Reader can compact");
+	sfs_store_close(reader);
+	sfs_store_close(store);
+}
+END_TEST
+
+TCase *
+anoubisd_testcase_sfsstore(void)
+{
+	TCase *tc = tcase_create("SfsStore");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, tc_sfsstore_basic);
+	tcase_add_test(tc, tc_sfsstore_foreach);
+	tcase_add_test(tc, tc_sfsstore_recovery);
+	tcase_add_test(tc, tc_sfsstore_compact);
+
+	return (tc);
+}
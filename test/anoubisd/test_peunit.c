@@ -25,6 +25,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <check.h>
 #include <anoubischeck.h>
@@ -144,16 +145,34 @@ cert_reconfigure(int chroot __used)
 {
 }
 
+int (*sfs_checksumop_chroot_p)(const struct sfs_checksumop *csop,
+    struct sfs_data *data) = NULL;
 int
-sfs_checksumop_chroot(const struct sfs_checksumop *csop __used,
-    struct sfs_data *data __used)
+sfs_checksumop_chroot(const struct sfs_checksumop *csop,
+    struct sfs_data *data)
 {
+	data->sigdata = data->csdata = data->upgradecsdata = ABUF_EMPTY;
+	if (sfs_checksumop_chroot_p)
+		return sfs_checksumop_chroot_p(csop, data);
 	return 0;
 }
 
 void
-sfs_freesfsdata(struct sfs_data *data __used)
+sfs_freesfsdata(struct sfs_data *data)
 {
+	abuf_free(data->sigdata);
+	abuf_free(data->csdata);
+	abuf_free(data->upgradecsdata);
+}
+
+int (*sfs_foreach_file_chroot_p)(void (*)(const char *, void *),
+    void *) = NULL;
+int
+sfs_foreach_file_chroot(void (*callback)(const char *, void *), void *arg)
+{
+	if (sfs_foreach_file_chroot_p)
+		return sfs_foreach_file_chroot_p(callback, arg);
+	return -ENOSYS;
 }
 
 int (*sfs_haschecksum_chroot_p)(const char *path) = NULL;
@@ -165,10 +184,13 @@ sfs_haschecksum_chroot(const char *path)
 	return 0;
 }
 
+struct apn_ruleset *(*pe_user_get_ruleset_p)(uid_t, unsigned int) = NULL;
 struct apn_ruleset *
-pe_user_get_ruleset(uid_t uid __used, unsigned int prio __used,
+pe_user_get_ruleset(uid_t uid, unsigned int prio,
     struct pe_policy_db *p __used)
 {
+	if (pe_user_get_ruleset_p)
+		return pe_user_get_ruleset_p(uid, prio);
 	return NULL;
 }
 
@@ -187,6 +209,31 @@ pe_user_flush_db(struct pe_policy_db *ppdb __used)
 {
 }
 
+unsigned long pe_user_generation_val = 1;
+unsigned long
+pe_user_generation(void)
+{
+	return pe_user_generation_val;
+}
+
+int pe_user_retired_dbs_val = 0;
+int
+pe_user_retired_dbs(void)
+{
+	return pe_user_retired_dbs_val;
+}
+
+struct pe_policy_db *
+pe_user_db_get(void)
+{
+	return NULL;
+}
+
+void
+pe_user_db_put(struct pe_policy_db *p __used)
+{
+}
+
 void
 pe_user_init(void)
 {
@@ -217,10 +264,19 @@ unsigned int debug_flags = 0;
 unsigned long version = ANOUBISCORE_VERSION;
 enum anoubisd_process_type anoubisd_process = 0;
 struct anoubisd_config anoubisd_config;
+gid_t anoubisd_gid = (gid_t)-1;
 
 extern TCase	*anoubisd_testcase_pe(void);
+extern TCase	*anoubisd_testcase_pe_alf(void);
 extern TCase	*anoubisd_testcase_pe_filetree(void);
+extern TCase	*anoubisd_testcase_pe_pgfiles(void);
 extern TCase	*anoubisd_testcase_pe_upgrade(void);
+extern TCase	*anoubisd_testcase_pe_proc(void);
+extern TCase	*anoubisd_testcase_pe_prefix(void);
+extern TCase	*anoubisd_testcase_pe_sfscache(void);
+extern TCase	*anoubisd_testcase_pe_workers(void);
+extern TCase	*anoubisd_testcase_sfsstore(void);
+extern TCase	*anoubisd_testcase_scancache(void);
 
 Suite*
 peunit_testsuite(void)
@@ -228,8 +284,16 @@ peunit_testsuite(void)
 	Suite	*s = suite_create("PEUnit");
 
 	suite_add_tcase(s, anoubisd_testcase_pe_filetree());
+	suite_add_tcase(s, anoubisd_testcase_pe_pgfiles());
 	suite_add_tcase(s, anoubisd_testcase_pe());
 	suite_add_tcase(s, anoubisd_testcase_pe_upgrade());
+	suite_add_tcase(s, anoubisd_testcase_pe_proc());
+	suite_add_tcase(s, anoubisd_testcase_pe_alf());
+	suite_add_tcase(s, anoubisd_testcase_pe_prefix());
+	suite_add_tcase(s, anoubisd_testcase_pe_sfscache());
+	suite_add_tcase(s, anoubisd_testcase_pe_workers());
+	suite_add_tcase(s, anoubisd_testcase_sfsstore());
+	suite_add_tcase(s, anoubisd_testcase_scancache());
 
 	return s;
 }
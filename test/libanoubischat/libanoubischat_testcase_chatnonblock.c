@@ -41,6 +41,7 @@
 
 #include <anoubis_errno.h>
 #include <anoubis_chat.h>
+#include <accbuffer.h>
 
 char raw_msg[] = {
 	0x0, 0x0, 0x0, 0xE,
@@ -412,6 +413,101 @@ START_TEST(tc_chatnb_complete_message)
 }
 END_TEST
 
+START_TEST(tc_chatnb_view_message)
+{
+	int	pfd[2];
+	pid_t	cpid;
+
+	if (pipe(pfd) == -1)
+		fail("Failed to create pipe: %s", anoubis_strerror(errno));
+
+	cpid = check_fork();
+	fail_if(cpid == -1, "Failed to fork sub-process: %s",
+		anoubis_strerror(errno));
+
+	if (cpid == 0) { /* Child process */
+		int result = tc_chatnb_child(pfd[0]);
+		close(pfd[0]);
+		close(pfd[1]);
+
+		exit(result);
+	}
+	else { /* Father process */
+		struct achat_channel	*sc, *cc;
+		int			port = 0;
+		const char		*msg;
+		size_t			smsg;
+		achat_rc		rc;
+		fd_set			rfds;
+		struct timeval		tv;
+
+		sc = tc_chatnb_channel_init(&port);
+		fail_if(sc == NULL, "Failed to initialize channel: %s",
+			anoubis_strerror(errno));
+
+		/* Ask child to establish connection */
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_START);
+		tc_chatnb_write_arg(pfd[1], &port, sizeof(port));
+
+		/* Wait for client-connection */
+		cc = acc_opendup(sc);
+		fail_if(cc == NULL, "Failed to connect to client: %s",
+			anoubis_strerror(errno));
+
+		/* Watch client-channel to see when it has input */
+		FD_ZERO(&rfds);
+		FD_SET(cc->fd, &rfds);
+
+		/* Wait up to one second */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		/* Receive a message */
+		rc = acc_receivemsg_view(cc, &msg, &smsg);
+		fail_if(rc != ACHAT_RC_PENDING,
+			"Unexpected receive-result %i", rc);
+
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_WRITE);
+		tc_chatnb_write_arg(pfd[1], raw_msg, sizeof(raw_msg));
+
+		while (1) {
+			int retval = select(cc->fd + 1, &rfds, NULL, NULL, &tv);
+			fail_if(retval < 0, "Select failed: %s",
+				anoubis_strerror(errno));
+
+			rc = acc_receivemsg_view(cc, &msg, &smsg);
+
+			if (rc == ACHAT_RC_OK) {
+				fail_if (smsg != strlen("Hallo Welt") ||
+					memcmp(msg, "Hallo Welt", smsg) != 0,
+					"Unexpected message received");
+				break;
+			}
+			else if (rc != ACHAT_RC_PENDING) {
+				fail("Unexpected recv-result: %i [%s]",
+					rc, anoubis_strerror(errno));
+			}
+		}
+
+		/* Receive a message */
+		rc = acc_receivemsg_view(cc, &msg, &smsg);
+		fail_if(rc != ACHAT_RC_PENDING,
+			"Unexpected receive-result %i", rc);
+
+		/* Ask child to close connection */
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_QUIT);
+		tc_chatnb_channel_destroy(sc);
+		tc_chatnb_channel_destroy(cc);
+
+		close(pfd[0]); close(pfd[1]);
+
+		/* Wait for child */
+		check_waitpid_and_exit(cpid);
+		exit(0);
+	}
+}
+END_TEST
+
 START_TEST(tc_chatnb_part_message)
 {
 	int	pfd[2];
@@ -688,6 +784,84 @@ START_TEST(tc_chatnb_write)
 }
 END_TEST
 
+START_TEST(tc_chatnb_cork)
+{
+	int	pfd[2];
+	pid_t	cpid;
+
+	if (pipe(pfd) == -1)
+		fail("Failed to create pipe: %s", anoubis_strerror(errno));
+
+	cpid = check_fork();
+	fail_if(cpid == -1, "Failed to fork sub-process: %s",
+		anoubis_strerror(errno));
+
+	if (cpid == 0) { /* Child process */
+		int result = tc_chatnb_child(pfd[0]);
+		close(pfd[0]);
+		close(pfd[1]);
+
+		exit(result);
+	}
+	else { /* Father process */
+		struct achat_channel	*sc, *cc;
+		int			port = 0;
+		achat_rc		rc;
+		char			expmsg[2 * sizeof(raw_msg)];
+
+		sc = tc_chatnb_channel_init(&port);
+		fail_if(sc == NULL, "Failed to initialize channel: %s",
+			anoubis_strerror(errno));
+
+		/* Ask child to establish connection */
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_START);
+		tc_chatnb_write_arg(pfd[1], &port, sizeof(port));
+
+		/* Wait for client-connection */
+		cc = acc_opendup(sc);
+		fail_if(cc == NULL, "Failed to connect to client: %s",
+			anoubis_strerror(errno));
+
+		/* Two messages are expected */
+		memcpy(expmsg, raw_msg, sizeof(raw_msg));
+		memcpy(expmsg + sizeof(raw_msg), raw_msg, sizeof(raw_msg));
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_READ);
+		tc_chatnb_write_arg(pfd[1], expmsg, sizeof(expmsg));
+
+		/* Nothing is written while the channel is corked */
+		rc = acc_cork(cc);
+		fail_if(rc != ACHAT_RC_OK, "Failed to cork channel");
+		rc = acc_sendmsg(cc, raw_msg + 4, sizeof(raw_msg) - 4);
+		fail_if(rc != ACHAT_RC_OK, "Failed to queue first message");
+		rc = acc_sendmsg(cc, raw_msg + 4, sizeof(raw_msg) - 4);
+		fail_if(rc != ACHAT_RC_OK, "Failed to queue second message");
+		fail_if(acc_bufferlen(cc->sendbuffer) != sizeof(expmsg),
+			"Corked messages not queued");
+
+		rc = acc_uncork(cc);
+		fail_if(rc != ACHAT_RC_OK && rc != ACHAT_RC_PENDING,
+			"Failed to send message");
+
+		while (rc != ACHAT_RC_OK) {
+			rc = acc_flush(cc);
+			fail_if(rc != ACHAT_RC_OK && rc != ACHAT_RC_PENDING,
+				"Failed to flush channel");
+		}
+
+		/* Ask child to close connection */
+		tc_chatnb_write_cmd(pfd[1], TC_CHATNB_CMD_QUIT);
+		tc_chatnb_channel_destroy(sc);
+		tc_chatnb_channel_destroy(cc);
+
+		close(pfd[0]); close(pfd[1]);
+
+		/* Wait for child */
+		check_waitpid_and_exit(cpid);
+		exit(0);
+	}
+}
+END_TEST
+
 START_TEST(tc_chatnb_write_only)
 {
 	int	pfd[2];
@@ -837,9 +1011,11 @@ libanoubischat_testcase_chatnonblock(void)
 
 	tcase_add_test(tc_chat, tc_chatnb_nomessage);
 	tcase_add_test(tc_chat, tc_chatnb_complete_message);
+	tcase_add_test(tc_chat, tc_chatnb_view_message);
 	tcase_add_test(tc_chat, tc_chatnb_part_message);
 	tcase_add_test(tc_chat, tc_chatnb_cutheader_message);
 	tcase_add_test(tc_chat, tc_chatnb_write);
+	tcase_add_test(tc_chat, tc_chatnb_cork);
 	tcase_add_test(tc_chat, tc_chatnb_write_only);
 	tcase_add_test(tc_chat, tc_chatnb_eof);
 
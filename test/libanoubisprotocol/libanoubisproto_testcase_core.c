@@ -390,6 +390,157 @@ START_TEST(tp_core_comm)
 }
 END_TEST
 
+static int	pipeline_aborts;
+static int	pipeline_replies;
+static int	pipeline_flags;
+
+static int
+pipeline_dispatch(struct anoubis_policy_comm *comm __used,
+    u_int64_t token __used, u_int32_t uid __used, const void *buf,
+    size_t len __used, void *arg __used, int flags __used)
+{
+	/* This is only called for aborted requests. */
+	fail_if(buf != NULL);
+	pipeline_aborts++;
+	return 0;
+}
+
+static int
+pipeline_reply(void *cbdata __used, int error __used,
+    const void *data __used, int len __used, int flags)
+{
+	pipeline_replies++;
+	pipeline_flags = flags;
+	return 0;
+}
+
+/* Pipelined policy requests on the server side. */
+START_TEST(tp_policy_pipeline)
+{
+	struct anoubis_policy_comm	*comm;
+	struct achat_channel		*chan1, *chan2;
+	u_int64_t			 tokens[ANOUBIS_CSMULTI_MAXWINDOW];
+	u_int64_t			 token, token2;
+	int				 i, j, ret;
+
+	comm = anoubis_policy_comm_create(&pipeline_dispatch, NULL);
+	fail_if(comm == NULL);
+	chan1 = acc_create();
+	chan2 = acc_create();
+	fail_if(chan1 == NULL || chan2 == NULL);
+
+	/* Fill the window of the first channel. */
+	for (i = 0; i < ANOUBIS_CSMULTI_MAXWINDOW; ++i) {
+		ret = anoubis_policy_comm_addpipelined(comm, chan1,
+		    &pipeline_reply, &pipeline_dispatch, NULL, &tokens[i]);
+		fail_if(ret != 0, "Pipelined request %d failed: %d", i, ret);
+		for (j = 0; j < i; ++j)
+			fail_if(tokens[i] == tokens[j], "Duplicate token");
+	}
+	ret = anoubis_policy_comm_addpipelined(comm, chan1,
+	    &pipeline_reply, &pipeline_dispatch, NULL, &token);
+	fail_if(ret != -EBUSY, "Request window not enforced");
+	ret = anoubis_policy_comm_addrequest(comm, chan1,
+	    POLICY_FLAG_START | POLICY_FLAG_END, &pipeline_reply,
+	    &pipeline_dispatch, NULL, &token);
+	fail_if(ret != -EBUSY, "Non pipelined request accepted");
+
+	/* The window is per channel. */
+	ret = anoubis_policy_comm_addpipelined(comm, chan2,
+	    &pipeline_reply, &pipeline_dispatch, NULL, &token2);
+	fail_if(ret != 0, "Request on second channel failed: %d", ret);
+
+	/* A reply can consist of several messages. */
+	ret = anoubis_policy_comm_answer(comm, tokens[1], 0, NULL, 0, 0);
+	fail_if(ret != 0 || pipeline_replies != 1);
+	fail_if(pipeline_flags != POLICY_FLAG_START);
+	ret = anoubis_policy_comm_answer(comm, tokens[1], 0, NULL, 0, 1);
+	fail_if(ret != 0 || pipeline_replies != 2);
+	fail_if(pipeline_flags != POLICY_FLAG_END);
+	ret = anoubis_policy_comm_answer(comm, tokens[1], 0, NULL, 0, 1);
+	fail_if(ret != -ESRCH, "Answer for completed request accepted");
+
+	/* The completed request frees a slot in the window. */
+	ret = anoubis_policy_comm_addpipelined(comm, chan1,
+	    &pipeline_reply, &pipeline_dispatch, NULL, &tokens[1]);
+	fail_if(ret != 0, "Request after completion failed: %d", ret);
+
+	/* Destroying a channel aborts all of its requests. */
+	anoubis_policy_comm_destroy(comm, chan1);
+	fail_if(pipeline_aborts != ANOUBIS_CSMULTI_MAXWINDOW,
+	    "%d of %d requests aborted", pipeline_aborts,
+	    ANOUBIS_CSMULTI_MAXWINDOW);
+	for (i = 0; i < ANOUBIS_CSMULTI_MAXWINDOW; ++i) {
+		ret = anoubis_policy_comm_answer(comm, tokens[i], 0, NULL,
+		    0, 1);
+		fail_if(ret != -ESRCH, "Request %d not aborted", i);
+	}
+	ret = anoubis_policy_comm_answer(comm, token2, 0, NULL, 0, 1);
+	fail_if(ret != 0, "Request of second channel lost");
+	fail_if(pipeline_replies != 3);
+
+	acc_destroy(chan1);
+	acc_destroy(chan2);
+}
+END_TEST
+
+static int	wire_requests;
+static int	wire_flags;
+
+static int
+wire_dispatch(struct anoubis_policy_comm *comm __used,
+    u_int64_t token __used, u_int32_t uid __used, const void *buf __used,
+    size_t len __used, void *arg __used, int flags)
+{
+	wire_requests++;
+	wire_flags = flags;
+	return 0;
+}
+
+static struct anoubis_msg *
+wire_request(int flags)
+{
+	struct anoubis_msg	*m;
+
+	m = anoubis_msg_new(sizeof(Anoubis_PolicyRequestMessage) + 4);
+	fail_if(m == NULL);
+	set_value(m->u.policyrequest->type, ANOUBIS_P_REQUEST);
+	set_value(m->u.policyrequest->flags, flags);
+	memset(m->u.policyrequest->payload, 0, 4);
+	return m;
+}
+
+/* Clients cannot use flags other than POLICY_FLAG_START/END. */
+START_TEST(tp_policy_wireflags)
+{
+	struct anoubis_policy_comm	*comm;
+	struct achat_channel		*chan;
+	int				 ret;
+
+	comm = anoubis_policy_comm_create(&wire_dispatch, NULL);
+	fail_if(comm == NULL);
+	chan = acc_create();
+	fail_if(chan == NULL);
+
+	ret = anoubis_policy_comm_process(comm, wire_request(POLICY_FLAG_START
+	    | POLICY_FLAG_END | 0x1000), 0, chan);
+	fail_if(ret != 0, "Policy request failed: %d", ret);
+	fail_if(wire_requests != 1);
+	fail_if(wire_flags != (POLICY_FLAG_START | POLICY_FLAG_END),
+	    "Unknown flags passed to dispatcher: 0x%x", wire_flags);
+
+	/* The request is not pipelined. */
+	ret = anoubis_policy_comm_process(comm, wire_request(POLICY_FLAG_START
+	    | POLICY_FLAG_END | 0x1000), 0, chan);
+	fail_if(ret != -EBUSY, "Second request accepted: %d", ret);
+	fail_if(wire_requests != 1);
+
+	anoubis_policy_comm_destroy(comm, chan);
+	acc_destroy(chan);
+	free(comm);
+}
+END_TEST
+
 static inline void
 fixup_crc(struct anoubis_msg *m)
 {
@@ -680,6 +831,8 @@ libanoubisproto_testcase_core(void)
 	tcase_add_test(tp_core, tp_csmulti_del);
 	tcase_add_test(tp_core, tp_csmulti_delsig);
 	tcase_add_test(tp_core, tp_core_comm);
+	tcase_add_test(tp_core, tp_policy_pipeline);
+	tcase_add_test(tp_core, tp_policy_wireflags);
 	tcase_set_timeout(tp_core, 30);
 
 	return (tp_core);
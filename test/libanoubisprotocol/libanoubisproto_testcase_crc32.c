@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <check.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <anoubis_crc32.h>
+
+/*
+ * The table driven checksum must produce the same results as the
+ * bitwise reference implementation for all lengths and alignments.
+ */
+START_TEST(tp_crc32_reference)
+{
+	unsigned char	*buf;
+	int		 i, off, len;
+	uint32_t	 crc;
+
+	buf = malloc(4096 + 8);
+	fail_if(buf == NULL, "Out of memory");
+	srandom(4711);
+	for (i = 0; i < 4096 + 8; ++i)
+		buf[i] = random();
+	for (off = 0; off < 8; ++off) {
+		for (len = 0; len <= 300; ++len) {
+			fail_if(crc32_get(buf + off, len)
+			    != _crc32_do(buf + off, len),
+			    "Checksum mismatch (offset %d, length %d)",
+			    off, len);
+		}
+	}
+	for (i = 0; i < 1000; ++i) {
+		off = random() % 8;
+		len = random() % 4096;
+		fail_if(crc32_get(buf + off, len) != _crc32_do(buf + off, len),
+		    "Checksum mismatch (offset %d, length %d)", off, len);
+	}
+	/* Incremental updates must not depend on the chunk size. */
+	for (i = 0; i < 1000; ++i) {
+		len = random() % 4096;
+		off = random() % (len + 1);
+		crc = anoubis_crc32_update(ANOUBIS_CRC32_INIT, buf, off);
+		crc = anoubis_crc32_update(crc, buf + off, len - off);
+		fail_if(crc != _crc32_do(buf, len),
+		    "Incremental checksum mismatch (split %d, length %d)",
+		    off, len);
+	}
+	/* Known value: CRC-32/MPEG-2 of "123456789". */
+	crc = anoubis_crc32_update(ANOUBIS_CRC32_INIT, "123456789", 9);
+	fail_if(crc != 0x0376e6e7, "Wrong checksum of test vector: 0x%08x",
+	    crc);
+	free(buf);
+}
+END_TEST
+
+/*
+ * A message with a checksum set by crc32_set must pass crc32_check
+ * and any single bit error must be detected.
+ */
+START_TEST(tp_crc32_setcheck)
+{
+	unsigned char	buf[256];
+	int		i, len, bit;
+
+	srandom(4712);
+	for (len = 4; len <= (int)sizeof(buf); ++len) {
+		for (i = 0; i < len; ++i)
+			buf[i] = random();
+		crc32_set(buf, len);
+		fail_unless(crc32_check(buf, len),
+		    "Checksum not valid (length %d)", len);
+		bit = random() % (len * 8);
+		buf[bit / 8] ^= (1 << (bit % 8));
+		fail_if(crc32_check(buf, len),
+		    "Bit error not detected (length %d, bit %d)", len, bit);
+	}
+}
+END_TEST
+
+static double
+crc32_rate(uint32_t (*fn)(unsigned char *, int), unsigned char *buf,
+    int len, int rounds)
+{
+	struct timeval	start, end;
+	double		usec;
+	uint32_t	sum = 0;
+	int		i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < rounds; ++i)
+		sum += fn(buf, len);
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1e6
+	    + (end.tv_usec - start.tv_usec);
+	/* Make sure that the loop is not optimized away. */
+	if (sum == 0x12345678)
+		printf(" ");
+	return (double)len * rounds / (usec ? usec : 1);
+}
+
+static uint32_t
+crc32_fast(unsigned char *buf, int len)
+{
+	return crc32_get(buf, len);
+}
+
+/*
+ * Report the throughput of the table driven checksum and the reference
+ * implementation for typical message sizes. This does not fail if the
+ * table driven code is slower, timing depends too much on the host.
+ */
+START_TEST(tp_crc32_bench)
+{
+	static const int	 sizes[] = { 64, 1024, 8000 };
+	unsigned char		*buf;
+	double			 ref, fast;
+	unsigned int		 i;
+	int			 len;
+
+	buf = malloc(8000);
+	fail_if(buf == NULL, "Out of memory");
+	memset(buf, 0x5a, 8000);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		len = sizes[i];
+		ref = crc32_rate(&_crc32_do, buf, len, 4000000 / len);
+		fast = crc32_rate(&crc32_fast, buf, len, 40000000 / len);
+		printf("crc32 %5d bytes: reference %.1f MB/s, "
+		    "table %.1f MB/s\n", len, ref, fast);
+	}
+	free(buf);
+}
+END_TEST
+
+TCase *
+libanoubisproto_testcase_crc32(void)
+{
+	TCase	*tc = tcase_create("CRC32");
+
+	tcase_add_test(tc, tp_crc32_reference);
+	tcase_add_test(tc, tp_crc32_setcheck);
+	tcase_add_test(tc, tp_crc32_bench);
+	tcase_set_timeout(tc, 60);
+
+	return (tc);
+}
@@ -28,6 +28,7 @@
 #include <check.h>
 
 extern TCase *libanoubisproto_testcase_core(void);
+extern TCase *libanoubisproto_testcase_crc32(void);
 
 Suite *
 protocol_testsuite(void)
@@ -38,5 +39,8 @@ protocol_testsuite(void)
 	TCase *tc_core = libanoubisproto_testcase_core();
 	suite_add_tcase(s, tc_core);
 
+	/* Checksum test case */
+	suite_add_tcase(s, libanoubisproto_testcase_crc32());
+
 	return (s);
 }
@@ -150,6 +150,101 @@ START_TEST(tp_notify_reg)
 }
 END_TEST
 
+START_TEST(tp_notify_all)
+{
+	struct achat_channel * chan[NRCLIENT];
+	struct anoubis_notify_group * ng[NRCLIENT];
+	struct anoubis_msg * m;
+	char buf[4096];
+	int token = 0x123000;
+	int i, ret;
+	int total = 0, real = 0;
+
+	for (i=0; i<NRCLIENT; ++i) {
+		chan[i] = acc_create();
+		fail_if(chan[i] == NULL, "failed to create channel");
+		ng[i] = anoubis_notify_create(chan[i], UID + i%2);
+		fail_if(ng[i] == NULL);
+		ret = anoubis_notify_register(ng[i], UID + i%2,
+		    (i&4)?RULE:0, (i&8)?SUBSYS:0);
+		fail_if(ret != 0, "Register failed with %d", ret);
+		if (i&16) {
+			ret = anoubis_notify_register(ng[i], UID + i%2,
+			    (i&4)?RULE+1:0, (i&8)?SUBSYS+1:0);
+			fail_if(ret != 0, "Register failed with %d", ret);
+		}
+	}
+	for (i=0; i<81; ++i) {
+		struct anoubis_notify_head * head;
+		int off[4], j, k;
+		k=i;
+		for(j=0; j<4; ++j) {
+			off[j] = -1+k%3;
+			k/=3;
+		}
+		m = anoubis_msg_new(sizeof(Anoubis_NotifyMessage));
+		fail_if(m == NULL, "Cannot allocate message");
+		if (i%2) {
+			set_value(m->u.notify->type, ANOUBIS_N_NOTIFY);
+		} else {
+			set_value(m->u.notify->type, ANOUBIS_N_LOGNOTIFY);
+			set_value(m->u.notify->error, 0);
+			set_value(m->u.notify->loglevel, 0);
+		}
+		set_value(m->u.notify->uid, UID+off[UIDX]);
+		set_value(m->u.notify->subsystem, SUBSYS+off[SIDX]);
+		set_value(m->u.notify->rule_id, RULE+off[RIDX]);
+		set_value(m->u.notify->csumoff, 0);
+		set_value(m->u.notify->csumlen, 0);
+		set_value(m->u.notify->pathoff, 0);
+		set_value(m->u.notify->pathlen, 0);
+		set_value(m->u.notify->ctxcsumoff, 0);
+		set_value(m->u.notify->ctxcsumlen, 0);
+		set_value(m->u.notify->ctxpathoff, 0);
+		set_value(m->u.notify->ctxpathlen, 0);
+		set_value(m->u.notify->evoff, 0);
+		set_value(m->u.notify->evlen, 0);
+		m->u.notify->token = ++token;
+		head = anoubis_notify_create_head(m, NULL, NULL);
+		fail_if(head == NULL, "Cannot create head");
+		ret = anoubis_notify_all(head, 0, &j);
+		fail_if(j != 0, "notify failed for %d groups", j);
+		total += ret;
+		anoubis_notify_destroy_head(head);
+	}
+	for (i=0; i<NRCLIENT; ++i) {
+		int expect = 1, cnt = 0;
+		if ((i&16) && (i&12))
+			expect++;
+		expect *= 3;
+		if ((i&4) == 0)
+			expect *= 3;
+		if ((i&8) == 0)
+			expect *= 3;
+		while(1) {
+			int ret;
+			size_t len;
+			len = 4096;
+			ret = acc_receivemsg_operator(chan[i], buf, &len);
+			if (ret == ACHAT_RC_EOF)
+				break;
+			fail_if(ret != ACHAT_RC_OK,
+			    "receivemsg failed with %d", ret);
+			cnt++;
+		}
+		fail_if(cnt != expect, "Wrong number of messages for %d "
+		    "real = %d expected = %d", i, cnt, expect);
+		real += cnt;
+	}
+	fail_if(real != total, "Sent %d messages but received %d",
+	    total, real);
+	for (i=0; i<NRCLIENT; ++i) {
+		anoubis_notify_destroy(ng[i]);
+		acc_destroy(chan[i]);
+	}
+}
+END_TEST
+
 #undef NRCLIENT
 #define NRCLIENT 4
 #define TOKENOFF 0x234000
@@ -311,6 +406,7 @@ libanoubisproto_testcase_notify(void)
 
 	tcase_add_test(tp_notify, tp_notify_reg);
 	tcase_add_test(tp_notify, tp_ask);
+	tcase_add_test(tp_notify, tp_notify_all);
 	tcase_set_timeout(tp_notify, 30);
 
 	return (tp_notify);
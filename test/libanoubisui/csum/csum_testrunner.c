@@ -51,6 +51,8 @@
 #include <anoubis_msg.h>
 #endif
 
+#include <openssl/sha.h>
+
 #include <anoubischeck.h>
 #include <anoubis_csum.h>
 #include <anoubis_errno.h>
@@ -134,6 +136,111 @@ START_TEST(csum_calc_userspace_enoent)
 }
 END_TEST
 
+/*
+ * Create a temporary file with size bytes of pseudo random data and
+ * return the expected checksum in sha256.
+ */
+static char *
+csum_mkfile(int size, unsigned char *sha256)
+{
+	SHA256_CTX	 ctx;
+	unsigned char	 buf[4096];
+	char		*path;
+	int		 fd, i, n;
+
+	path = strdup("/tmp/csum_tc_XXXXXX");
+	fail_if(path == NULL, "Out of memory");
+	fd = mkstemp(path);
+	fail_if(fd == -1, "Failed to create %s: %s",
+	    path, anoubis_strerror(errno));
+	SHA256_Init(&ctx);
+	while (size > 0) {
+		n = size > (int)sizeof(buf) ? (int)sizeof(buf) : size;
+		for (i = 0; i < n; ++i)
+			buf[i] = random();
+		fail_unless(write(fd, buf, n) == n,
+		    "Failed to prepare input-file: %s",
+		    anoubis_strerror(errno));
+		SHA256_Update(&ctx, buf, n);
+		size -= n;
+	}
+	SHA256_Final(sha256, &ctx);
+	close(fd);
+	return path;
+}
+
+/*
+ * Sizes around the internal buffer size of the userspace checksum
+ * and some larger files. The last request is a file that does not exist.
+ */
+#define BATCH_CNT	12
+static const int batch_sizes[BATCH_CNT - 1] = {
+	0, 1, 1023, 1024, 1025, 131071, 131072, 131073, 1000000, 4194304,
+	4194305
+};
+
+START_TEST(csum_calc_batch)
+{
+	struct anoubis_csum_request	 reqs[BATCH_CNT];
+	unsigned char			 expect[BATCH_CNT][ANOUBIS_CS_LEN];
+	unsigned char			 csum[BATCH_CNT][ANOUBIS_CS_LEN];
+	char				*paths[BATCH_CNT];
+	int				 i, nthreads, len, result;
+
+	srandom(4711);
+	for (i = 0; i < BATCH_CNT - 1; ++i)
+		paths[i] = csum_mkfile(batch_sizes[i], expect[i]);
+	paths[BATCH_CNT - 1] = strdup("/tmp/csum_tc_does_not_exist");
+	fail_if(paths[BATCH_CNT - 1] == NULL, "Out of memory");
+
+	for (i = 0; i < BATCH_CNT - 1; ++i) {
+		len = ANOUBIS_CS_LEN;
+		result = anoubis_csum_calc_userspace(paths[i], csum[i], &len);
+		fail_unless(result == 0, "Checksum failed for %d bytes: %s",
+		    batch_sizes[i], anoubis_strerror(-result));
+		fail_unless(memcmp(csum[i], expect[i], ANOUBIS_CS_LEN) == 0,
+		    "Wrong checksum for %d bytes", batch_sizes[i]);
+	}
+
+	for (nthreads = 1; nthreads <= 16; nthreads *= 4) {
+		memset(csum, 0, sizeof(csum));
+		for (i = 0; i < BATCH_CNT; ++i) {
+			reqs[i].path = paths[i];
+			reqs[i].link = (i % 2);
+			reqs[i].csum = csum[i];
+			reqs[i].cslen = ANOUBIS_CS_LEN;
+			reqs[i].error = 1;
+		}
+		result = anoubis_csum_calc_batch(reqs, BATCH_CNT, nthreads);
+		fail_unless(result == 0, "Batch failed with %d threads: %s",
+		    nthreads, anoubis_strerror(-result));
+		for (i = 0; i < BATCH_CNT - 1; ++i) {
+			fail_unless(reqs[i].error == 0, "Batch checksum failed "
+			    "for %d bytes: %s", batch_sizes[i],
+			    anoubis_strerror(-reqs[i].error));
+			fail_unless(reqs[i].cslen == ANOUBIS_CS_LEN,
+			    "Bad checksum length %d", reqs[i].cslen);
+			fail_unless(memcmp(csum[i], expect[i],
+			    ANOUBIS_CS_LEN) == 0, "Wrong batch checksum for "
+			    "%d bytes with %d threads", batch_sizes[i],
+			    nthreads);
+		}
+		fail_unless(reqs[BATCH_CNT - 1].error == -ENOENT,
+		    "Unexpected result for missing file: %d",
+		    reqs[BATCH_CNT - 1].error);
+	}
+	fail_unless(anoubis_csum_calc_batch(NULL, 1, 4) == -EINVAL,
+	    "Batch without requests should fail");
+	fail_unless(anoubis_csum_calc_batch(reqs, 0, 4) == 0,
+	    "Empty batch failed");
+
+	for (i = 0; i < BATCH_CNT; ++i) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+}
+END_TEST
+
 START_TEST(csum_utils)
 {
 	int cnt = 0;
@@ -308,6 +415,7 @@ csum_tcase(void)
 	tcase_add_test(tc, csum_calc_userspace);
 	tcase_add_test(tc, csum_calc_userspace_einval);
 	tcase_add_test(tc, csum_calc_userspace_enoent);
+	tcase_add_test(tc, csum_calc_batch);
 	tcase_add_test(tc, csum_utils);
 #ifndef GCOV
 	tcase_add_test(tc, csum_list);
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2010 GeNUA mbH <info@genua.de>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef OPENBSD
+#include <sys/uio.h>
+#endif
+
+#include <netinet/in.h>
+
+#include <apn.h>
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef NEEDBSDCOMPAT
+#include <bsdcompat.h>
+#endif
+
+/* Implemented in libapn_testcase_iov.c */
+extern void dump_rules(struct apn_ruleset *, char **, int *);
+
+static const char *serialize_policy =
+"apnversion 1.1\n"
+"alf {\n"
+"/bin/sh {\n"
+"allow connect tcp from any to 1.2.3.4 task 20 until 30\n"
+"allow accept tcp from 1.2.3.0/24 port www to any\n"
+"allow connect tcp from ::1 to any port 1000 - 2000\n"
+"allow raw\n"
+"default deny\n"
+"}\n"
+"{ /usr/bin/ssh uid 10, /usr/bin/scp self } {\n"
+"allow send log udp all\n"
+"default deny\n"
+"}\n"
+"any {\n"
+"default deny\n"
+"}\n"
+"}\n"
+"sfs {\n"
+"path /tmp/blah uid 0 valid allow invalid alert deny unknown log continue\n"
+"path /usr key \"0123456789abcdef\" valid allow invalid deny\n"
+"default path /etc log deny\n"
+"}\n"
+"sandbox {\n"
+"/bin/sh {\n"
+"allow path /etc r\n"
+"deny log path /tmp uid 20 w\n"
+"default allow\n"
+"}\n"
+"}\n"
+"context {\n"
+"/usr/bin/dings {\n"
+"context new any\n"
+"}\n"
+"{ /bin/bu, /bin/ms } nosfs {\n"
+"context open { /bin/a, /bin/b }\n"
+"}\n"
+"}\n";
+
+static struct apn_ruleset *
+serialize_parse(void)
+{
+	struct apn_ruleset	*rs = NULL;
+	struct iovec		 iov;
+
+	iov.iov_base = (void *)serialize_policy;
+	iov.iov_len = strlen(serialize_policy);
+	if (apn_parse_iovec("<iov>", &iov, 1, &rs, 0) != 0) {
+		apn_print_errors(rs, stderr);
+		fail("Could not parse ruleset");
+	}
+	return rs;
+}
+
+START_TEST(tc_serialize_roundtrip)
+{
+	struct apn_ruleset	*rs, *nrs;
+	struct apn_rule		*block, *rule;
+	char			*ref, *buf;
+	int			 reflen, len, ret;
+	void			*image;
+	size_t			 imagelen;
+
+	rs = serialize_parse();
+	dump_rules(rs, &ref, &reflen);
+	ret = apn_serialize_ruleset(rs, &image, &imagelen);
+	fail_if(ret != 0, "apn_serialize_ruleset failed with %d", ret);
+	ret = apn_unserialize_ruleset(image, imagelen, &nrs);
+	fail_if(ret != 0, "apn_unserialize_ruleset failed with %d", ret);
+	fail_if(nrs == NULL, "No ruleset returned");
+
+	dump_rules(nrs, &buf, &len);
+	fail_if(len != reflen, "Ruleset length differs after round trip");
+	fail_if(memcmp(buf, ref, len) != 0,
+	    "Ruleset differs after round trip");
+	fail_if(nrs->maxid != rs->maxid, "maxid differs after round trip");
+	free(buf);
+
+	/* All rule IDs must be present in the ID tree of the new ruleset. */
+	TAILQ_FOREACH(block, &rs->alf_queue, entry) {
+		struct apn_rule	*nblock, *nrule;
+
+		nblock = apn_find_rule(nrs, block->apn_id);
+		fail_if(nblock == NULL, "Block %lu not found", block->apn_id);
+		fail_if(nblock->pchain != &nrs->alf_queue,
+		    "Bad parent chain for block %lu", block->apn_id);
+		TAILQ_FOREACH(rule, &block->rule.chain, entry) {
+			nrule = apn_find_rule(nrs, rule->apn_id);
+			fail_if(nrule == NULL, "Rule %lu not found",
+			    rule->apn_id);
+			fail_if(nrule->pchain != &nblock->rule.chain,
+			    "Bad parent chain for rule %lu", rule->apn_id);
+		}
+	}
+
+	/* The new ruleset must be editable like a parsed one. */
+	block = TAILQ_FIRST(&nrs->alf_queue);
+	ret = apn_remove(nrs, TAILQ_FIRST(&block->rule.chain)->apn_id);
+	fail_if(ret != 0, "apn_remove failed on unserialized ruleset");
+
+	apn_free_ruleset(nrs);
+	apn_free_ruleset(rs);
+	free(image);
+	free(ref);
+}
+END_TEST
+
+START_TEST(tc_serialize_corrupt)
+{
+	struct apn_ruleset	*rs, *nrs;
+	unsigned char		*image;
+	size_t			 imagelen, i;
+	int			 ret;
+
+	rs = serialize_parse();
+	ret = apn_serialize_ruleset(rs, (void **)&image, &imagelen);
+	fail_if(ret != 0, "apn_serialize_ruleset failed with %d", ret);
+	apn_free_ruleset(rs);
+
+	/* Truncated images must be rejected. */
+	for (i=0; i<imagelen; ++i) {
+		nrs = (void *)0x1;
+		ret = apn_unserialize_ruleset(image, i, &nrs);
+		fail_if(ret != -EINVAL, "Truncated image (%d bytes) accepted",
+		    (int)i);
+		fail_if(nrs != NULL, "Ruleset returned on error");
+	}
+	/* So must images with a single flipped bit. */
+	for (i=0; i<imagelen; ++i) {
+		image[i] ^= 0x10;
+		ret = apn_unserialize_ruleset(image, imagelen, &nrs);
+		fail_if(ret != -EINVAL, "Corrupted image (byte %d) accepted",
+		    (int)i);
+		image[i] ^= 0x10;
+	}
+	ret = apn_unserialize_ruleset(image, imagelen, &nrs);
+	fail_if(ret != 0, "apn_unserialize_ruleset failed with %d", ret);
+	apn_free_ruleset(nrs);
+	free(image);
+}
+END_TEST
+
+TCase *
+libapn_testcase_serialize(void)
+{
+	TCase *testcase_serialize = tcase_create("serialize testcase");
+
+	tcase_add_test(testcase_serialize, tc_serialize_roundtrip);
+	tcase_add_test(testcase_serialize, tc_serialize_corrupt);
+
+	return (testcase_serialize);
+}
@@ -34,6 +34,7 @@ extern TCase *libapn_testcase_crash_parse_files(void);
 extern TCase *libapn_testcase_crash_print_errors(void);
 extern TCase *libapn_testcase_iovec(void);
 extern TCase *libapn_testcase_firstinsert(void);
+extern TCase *libapn_testcase_serialize(void);
 
 Suite *
 libapn_testsuite(void)
@@ -50,6 +51,7 @@ libapn_testsuite(void)
 	TCase *tc_iovec = libapn_testcase_iovec();
 	tcase_set_timeout(tc_iovec, 60);
 	TCase *tc_firstinsert = libapn_testcase_firstinsert();
+	TCase *tc_serialize = libapn_testcase_serialize();
 
 	suite_add_tcase(s, tc_errorcodes);
 	suite_add_tcase(s, tc_invalidparams);
@@ -58,6 +60,7 @@ libapn_testsuite(void)
 	suite_add_tcase(s, tc_crash_print_error);
 	suite_add_tcase(s, tc_iovec);
 	suite_add_tcase(s, tc_firstinsert);
+	suite_add_tcase(s, tc_serialize);
 
 	return (s);
 }